@@ -1,7 +1,10 @@
 #include "maintests.h"
 #include "testhelpers.h"
 #include "conffiletemp.h"
+#include "flashmqtestclient.h"
 #include "exceptions.h"
+#include "utils.h"
+#include "filecloser.h"
 
 void MainTests::test_loading_second_value()
 {
@@ -170,3 +173,167 @@ void MainTests::testConfigSuggestion()
         }
     }
 }
+
+void MainTests::testHandshakeThreads()
+{
+    {
+        ConfFileTemp config;
+        config.writeLine("handshake_thread_count -1");
+        config.closeFile();
+
+        ConfigFileParser parser(config.getFilePath());
+        try
+        {
+            parser.loadFile(false);
+            FMQ_FAIL("The parser was too liberal");
+        }
+        catch (ConfigFileException&)
+        {
+            /* Good! This is where we want to end up in */
+        }
+    }
+
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("handshake_thread_count 2");
+    confFile.closeFile();
+
+    {
+        ConfigFileParser parser(confFile.getFilePath());
+        parser.loadFile(false);
+        Settings settings = parser.getSettings();
+        FMQ_COMPARE(settings.handshakeThreadCount, 2);
+    }
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    // Plain listeners don't use the handshake threads, but the threads must be there, and reporting.
+    FlashMQTestClient receiver;
+    receiver.start();
+    receiver.connectClient(ProtocolVersion::Mqtt5);
+    receiver.subscribe("$SYS/broker/handshakes/pending", 0);
+
+    receiver.waitForMessageCount(1);
+
+    {
+        auto ro = receiver.receivedObjects.lock();
+        MqttPacket &msg = ro->receivedPublishes.front();
+        FMQ_COMPARE(msg.getPayloadCopy(), "0");
+        QVERIFY(msg.getRetain());
+    }
+
+    FlashMQTestClient sender;
+    sender.start();
+    sender.connectClient(ProtocolVersion::Mqtt5);
+    receiver.subscribe("a/b", 0);
+    Publish pub("a/b", "hello", 0);
+    sender.publish(pub);
+    receiver.waitForMessageCount(1);
+
+    {
+        auto ro = receiver.receivedObjects.lock();
+        MqttPacket &msg = ro->receivedPublishes.front();
+        FMQ_COMPARE(msg.getPayloadCopy(), "hello");
+    }
+}
+
+void MainTests::testHandshakeThreadHaProxyHealthCheck()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("handshake_thread_count 1");
+    confFile.writeLine("listen {");
+    confFile.writeLine("  port 21883");
+    confFile.writeLine("  haproxy true");
+    confFile.writeLine("}");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    int fd = check<std::runtime_error>(socket(AF_INET, SOCK_STREAM, 0));
+    FileCloser fd_closer(fd);
+
+    struct timeval timeout;
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    check<std::runtime_error>(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+
+    BindAddr bindAddr = getBindAddr(AF_INET, "127.0.0.1", 21883);
+    check<std::runtime_error>(connect(fd, bindAddr.p.get(), bindAddr.len));
+
+    // A PROXY protocol v2 header with the LOCAL command and no address block, as sent by HAProxy health checks.
+    const unsigned char header[] = {0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A, 0x20, 0x00, 0x00, 0x00};
+    check<std::runtime_error>(write(fd, header, sizeof(header)));
+
+    // The handshake thread must close it, instead of handing it over to a worker where it would linger.
+    char buf[16];
+    const ssize_t n = read(fd, buf, sizeof(buf));
+    FMQ_COMPARE(n, 0);
+}
+
+void MainTests::testKtlsRequiresTls()
+{
+    {
+        ConfFileTemp config;
+        config.writeLine("listen {");
+        config.writeLine("  port 2883");
+        config.writeLine("  ktls true");
+        config.writeLine("}");
+        config.closeFile();
+
+        ConfigFileParser parser(config.getFilePath());
+        try
+        {
+            parser.loadFile(false);
+            FMQ_FAIL("kTLS on a non-TLS listener should not be accepted");
+        }
+        catch (ConfigFileException&)
+        {
+            /* Good! This is where we want to end up in */
+        }
+    }
+
+    {
+        ConfFileTemp config;
+        config.writeLine("bridge {");
+        config.writeLine("  address localhost");
+        config.writeLine("  publish send/this 1");
+        config.writeLine("  ktls true");
+        config.writeLine("}");
+        config.closeFile();
+
+        ConfigFileParser parser(config.getFilePath());
+        try
+        {
+            parser.loadFile(false);
+            FMQ_FAIL("kTLS on a non-TLS bridge should not be accepted");
+        }
+        catch (ConfigFileException&)
+        {
+            /* Good! This is where we want to end up in */
+        }
+    }
+
+    {
+        ConfFileTemp config;
+        config.writeLine("bridge {");
+        config.writeLine("  address localhost");
+        config.writeLine("  publish send/this 1");
+        config.writeLine("  tls on");
+        config.writeLine("  ktls true");
+        config.writeLine("}");
+        config.closeFile();
+
+        ConfigFileParser parser(config.getFilePath());
+        parser.loadFile(false);
+        Settings settings = parser.getSettings();
+        std::shared_ptr<BridgeConfig> bridge = settings.stealBridges().front();
+        QVERIFY(bridge->ktls);
+    }
+}
@@ -7,6 +7,8 @@ void printHelp(const std::string &arg0)
 {
     std::cout << std::endl;
     std::cout << "Usage: " << arg0 << " [ --skip-tests-with-internet ] [ --skip-server-tests ] " << " <tests> " << std::endl;
+    std::cout << std::endl;
+    std::cout << "Benchmarks, like testTopicScanKernelsBenchmark, only run when given as test name." << std::endl;
 }
 
 int main(int argc, char *argv[])
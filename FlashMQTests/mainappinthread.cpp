@@ -83,3 +83,8 @@ std::shared_ptr<SubscriptionStore> MainAppInThread::getStore()
 {
     return appInstance->getSubscriptionStore();
 }
+
+std::vector<std::shared_ptr<ThreadData>> MainAppInThread::getThreads()
+{
+    return appInstance->threads;
+}
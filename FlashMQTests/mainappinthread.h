@@ -18,6 +18,7 @@ public:
     void stopApp();
     void waitForStarted();
     std::shared_ptr<SubscriptionStore> getStore();
+    std::vector<std::shared_ptr<ThreadData>> getThreads();
 };
 
 #endif // MAINAPPINTHREAD_H
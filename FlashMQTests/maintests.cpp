@@ -139,12 +139,14 @@ void MainTests::cleanupAfterEachTest()
     this->mainApp.reset();
 }
 
-void MainTests::registerFunction(const std::string &name, std::function<void ()> f, bool requiresServer, bool requiresInternet)
+void MainTests::registerFunction(const std::string &name, std::function<void ()> f, bool requiresServer, bool requiresInternet,
+                                 bool explicitOnly)
 {
     TestFunction &tf = testFunctions[name];
     tf.f = f;
     tf.requiresServer = requiresServer;
     tf.requiresInternet = requiresInternet;
+    tf.explicitOnly = explicitOnly;
 }
 
 void MainTests::testDummy()
@@ -187,6 +189,18 @@ MainTests::MainTests()
     REGISTER_FUNCTION3(test_circbuf_wrapped_doubling);
     REGISTER_FUNCTION3(test_circbuf_full_wrapped_buffer_doubling);
     REGISTER_FUNCTION3(test_cirbuf_vector_methods);
+    REGISTER_FUNCTION3(test_cirbuf_release_and_lazy_allocate);
+    REGISTER_FUNCTION3(testReadScratchBufferPartialPackets);
+    REGISTER_FUNCTION3(testReadBudget);
+    REGISTER_FUNCTION3(testControlPacketPriority);
+    REGISTER_FUNCTION3(testConflationWhenBacklogged);
+    REGISTER_FUNCTION3(testConflatingQosQueue);
+    REGISTER_FUNCTION3(testPublisherBackpressure);
+    REGISTER_FUNCTION(testPublisherBackpressureHoldsAck);
+    REGISTER_FUNCTION3(testMemoryAccounting);
+    REGISTER_FUNCTION3(testMemoryPressureShedding);
+    REGISTER_FUNCTION3(testMemoryPressureReadBuffer);
+    REGISTER_FUNCTION3(testAdmissionController);
     REGISTER_FUNCTION3(test_validSubscribePath);
     REGISTER_FUNCTION(test_retained);
     REGISTER_FUNCTION(test_retained_double_set);
@@ -224,6 +238,25 @@ MainTests::MainTests()
     REGISTER_FUNCTION3(test_utf8_compare_implementation);
 #endif
 
+    REGISTER_FUNCTION3(testTopicScanKernels);
+    REGISTER_FUNCTION3(testConnectStorm);
+    REGISTER_FUNCTION3(testSessionSubscriptionIndex);
+    REGISTER_FUNCTION3(testBatchedSubscribe);
+    REGISTER_FUNCTION3(testSubscriptionFilterCovers);
+    REGISTER_FUNCTION3(testDerivableCounter);
+    REGISTER_FUNCTION3(testLatencyHistogram);
+    REGISTER_FUNCTION3(testPublishLatencySampling);
+    REGISTER_FUNCTION3(testOpenMetricsBuilder);
+    REGISTER_FUNCTION(testMetricsListener);
+    REGISTER_FUNCTION3(testLoopPhaseProfiler);
+    REGISTER_FUNCTION3(testSlowTaskDetection);
+    REGISTER_FUNCTION3(testTaskQueue);
+    REGISTER_FUNCTION3(testLoggerRepeatedMessages);
+    REGISTER_FUNCTION3(testLoggerOrderAcrossThreads);
+    REGISTER_FUNCTION3(testClientRebalancer);
+    REGISTER_FUNCTION(testClientMigration);
+    REGISTER_FUNCTION(testClientMigrationWithQueuedRemoval);
+
     REGISTER_FUNCTION3(testPacketInt16Parse);
     REGISTER_FUNCTION3(testRetainedMessageDB);
     REGISTER_FUNCTION3(testRetainedMessageDBNotPresent);
@@ -231,6 +264,7 @@ MainTests::MainTests()
     REGISTER_FUNCTION3(testSavingSessions);
     REGISTER_FUNCTION3(testParsePacket);
     REGISTER_FUNCTION3(testbufferToMqttPacketsFuzz);
+    REGISTER_FUNCTION3(testPacketBytesRecycling);
     REGISTER_FUNCTION(testDowngradeQoSOnSubscribeQos2to2);
     REGISTER_FUNCTION(testDowngradeQoSOnSubscribeQos2to1);
     REGISTER_FUNCTION(testDowngradeQoSOnSubscribeQos2to0);
@@ -255,6 +289,9 @@ MainTests::MainTests()
     REGISTER_FUNCTION(testMqtt5DelayedWillsDisabled);
     REGISTER_FUNCTION3(testStringDistances);
     REGISTER_FUNCTION3(testConfigSuggestion);
+    REGISTER_FUNCTION(testHandshakeThreads);
+    REGISTER_FUNCTION(testHandshakeThreadHaProxyHealthCheck);
+    REGISTER_FUNCTION3(testKtlsRequiresTls);
     REGISTER_FUNCTION(testIncomingTopicAlias);
     REGISTER_FUNCTION(testOutgoingTopicAlias);
     REGISTER_FUNCTION(testOutgoingTopicAliasBeyondMax);
@@ -280,6 +317,9 @@ MainTests::MainTests()
     REGISTER_FUNCTION(testUnsubscribedSharedSubscribers);
     REGISTER_FUNCTION(testSharedSubscribersSurviveRestart);
     REGISTER_FUNCTION(testSharedSubscriberDoesntGetRetainedMessages);
+    REGISTER_FUNCTION3(testSharedSubscribersLeastLoaded);
+    REGISTER_FUNCTION3(testSharedSubscribersThreadLocal);
+    REGISTER_FUNCTION3(testSharedSubscribersTopicHash);
     REGISTER_FUNCTION(testExtendedAuthOneStepSucceed);
     REGISTER_FUNCTION(testExtendedAuthOneStepDeny);
     REGISTER_FUNCTION(testExtendedAuthOneStepBadAuthMethod);
@@ -321,6 +361,7 @@ MainTests::MainTests()
     REGISTER_FUNCTION(testWebsocketHugePing);
     REGISTER_FUNCTION(testWebsocketManyBigPingFrames);
     REGISTER_FUNCTION(testWebsocketClose);
+    REGISTER_FUNCTION(testWebsocketMaskedFramesAndWriteCoalescing);
     REGISTER_FUNCTION3(testStartsWith);
     REGISTER_FUNCTION3(testStringValuesParsing);
     REGISTER_FUNCTION3(testStringValuesParsingEscaping);
@@ -328,6 +369,7 @@ MainTests::MainTests()
     REGISTER_FUNCTION3(testStringValuesInvalid);
     REGISTER_FUNCTION2(testPreviouslyValidConfigFile, false, false);
     REGISTER_FUNCTION3(testNoCopy);
+    REGISTER_FUNCTION3(testUnmaskWebsocketBytes);
     REGISTER_FUNCTION(testSessionTakeoverOtherUsername);
     REGISTER_FUNCTION(testCorrelationData);
     REGISTER_FUNCTION(testSubscriptionIdOnlineClient);
@@ -336,6 +378,9 @@ MainTests::MainTests()
     REGISTER_FUNCTION(testSubscriptionIdSharedSubscriptions);
     REGISTER_FUNCTION(testSubscriptionIdChange);
     REGISTER_FUNCTION(testSubscriptionIdOverlappingSubscriptions);
+
+    // Benchmarks only print numbers, so they only run when asked for by name.
+    REGISTER_BENCHMARK(testTopicScanKernelsBenchmark);
 }
 
 bool MainTests::test(bool skip_tests_with_internet, bool skip_server_tests, const std::vector<std::string> &tests)
@@ -378,6 +423,9 @@ bool MainTests::test(bool skip_tests_with_internet, bool skip_server_tests, cons
         if (skip_server_tests && tf.requiresServer)
             continue;
 
+        if (subset.empty() && tf.explicitOnly)
+            continue;
+
         testCount++;
 
         try
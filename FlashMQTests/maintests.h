@@ -10,12 +10,14 @@
 #define REGISTER_FUNCTION(name) registerFunction(#name, std::bind(&MainTests::name, this))
 #define REGISTER_FUNCTION2(name, server, internet) registerFunction(#name, std::bind(&MainTests::name, this), server, internet)
 #define REGISTER_FUNCTION3(name) registerFunction(#name, std::bind(&MainTests::name, this), false, false)
+#define REGISTER_BENCHMARK(name) registerFunction(#name, std::bind(&MainTests::name, this), false, false, true)
 
 struct TestFunction
 {
     std::function<void()> f;
     bool requiresServer = true;
     bool requiresInternet = false;
+    bool explicitOnly = false;
 };
 
 class MainTests
@@ -33,7 +35,8 @@ class MainTests
     void initBeforeEachTest(const std::vector<std::string> &args, bool startServer=true);
     void initBeforeEachTest(bool startServer=true);
     void cleanupAfterEachTest();
-    void registerFunction(const std::string &name, std::function<void ()> f, bool requiresServer=true, bool requiresInternet=false);
+    void registerFunction(const std::string &name, std::function<void ()> f, bool requiresServer=true, bool requiresInternet=false,
+                          bool explicitOnly=false);
 
     // Compatability for porting the tests away from Qt. The function names are too vague so want to phase them out.
     void init(const std::vector<std::string> &args) { initBeforeEachTest(args);}
@@ -50,6 +53,18 @@ class MainTests
     void test_circbuf_wrapped_doubling();
     void test_circbuf_full_wrapped_buffer_doubling();
     void test_cirbuf_vector_methods();
+    void test_cirbuf_release_and_lazy_allocate();
+    void testReadScratchBufferPartialPackets();
+    void testReadBudget();
+    void testControlPacketPriority();
+    void testConflationWhenBacklogged();
+    void testConflatingQosQueue();
+    void testPublisherBackpressure();
+    void testPublisherBackpressureHoldsAck();
+    void testMemoryAccounting();
+    void testMemoryPressureShedding();
+    void testMemoryPressureReadBuffer();
+    void testAdmissionController();
 
     void test_validSubscribePath();
 
@@ -95,6 +110,26 @@ class MainTests
     void test_utf8_compare_implementation();
 #endif
 
+    void testTopicScanKernels();
+    void testTopicScanKernelsBenchmark();
+    void testConnectStorm();
+    void testSessionSubscriptionIndex();
+    void testBatchedSubscribe();
+    void testSubscriptionFilterCovers();
+    void testDerivableCounter();
+    void testLatencyHistogram();
+    void testPublishLatencySampling();
+    void testOpenMetricsBuilder();
+    void testMetricsListener();
+    void testLoopPhaseProfiler();
+    void testSlowTaskDetection();
+    void testTaskQueue();
+    void testLoggerRepeatedMessages();
+    void testLoggerOrderAcrossThreads();
+    void testClientRebalancer();
+    void testClientMigration();
+    void testClientMigrationWithQueuedRemoval();
+
     void testPacketInt16Parse();
 
     void testRetainedMessageDB();
@@ -105,6 +140,7 @@ class MainTests
 
     void testParsePacket();
     void testbufferToMqttPacketsFuzz();
+    void testPacketBytesRecycling();
 
     void testDowngradeQoSOnSubscribeQos2to2();
     void testDowngradeQoSOnSubscribeQos2to1();
@@ -138,6 +174,9 @@ class MainTests
     void testMqtt5DelayedWillsDisabled();
     void testStringDistances();
     void testConfigSuggestion();
+    void testHandshakeThreads();
+    void testHandshakeThreadHaProxyHealthCheck();
+    void testKtlsRequiresTls();
 
 
     void testIncomingTopicAlias();
@@ -177,6 +216,9 @@ class MainTests
     void testUnsubscribedSharedSubscribers();
     void testSharedSubscribersSurviveRestart();
     void testSharedSubscriberDoesntGetRetainedMessages();
+    void testSharedSubscribersLeastLoaded();
+    void testSharedSubscribersThreadLocal();
+    void testSharedSubscribersTopicHash();
 
     /**
      * Plugin tests
@@ -226,6 +268,7 @@ class MainTests
     void testWebsocketHugePing();
     void testWebsocketManyBigPingFrames();
     void testWebsocketClose();
+    void testWebsocketMaskedFramesAndWriteCoalescing();
 
     void testStartsWith();
 
@@ -240,6 +283,7 @@ class MainTests
     void forkingTestSaveAndLoadDelayedWill();
 
     void testNoCopy();
+    void testUnmaskWebsocketBytes();
     void testSessionTakeoverOtherUsername();
     void testCorrelationData();
     void testSubscriptionIdOnlineClient();
@@ -316,3 +316,268 @@ void MainTests::testSharedSubscriberDoesntGetRetainedMessages()
 
     MYCASTCOMPARE(ro->receivedPublishes.size(), 0);
 }
+
+void MainTests::testSharedSubscribersLeastLoaded()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+
+    Authentication auth(settings);
+    ThreadGlobals::assign(&auth);
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
+
+    std::vector<std::shared_ptr<Client>> clients;
+    std::vector<std::shared_ptr<Session>> sessions;
+    SharedSubscribers s;
+
+    for (int i = 0; i < 3; i++)
+    {
+        std::shared_ptr<Client> c(new Client(0, t, nullptr, false, false, nullptr, settings, false));
+        c->setClientProperties(ProtocolVersion::Mqtt5, formatString("clientid%d", i), "user", true, 60);
+
+        std::shared_ptr<Session> ses = std::make_shared<Session>(c->getClientId(), c->getUsername());
+        ses->assignActiveConnection(c);
+        s[ses->getClientId()].session = ses;
+
+        // Like a client with a receive maximum of 100.
+        {
+            auto qos_locked = ses->qos.lock();
+            qos_locked->flowControlCealing = 100;
+            qos_locked->flowControlQuota = 100;
+            qos_locked->updateFreeCapacityEstimate();
+        }
+
+        clients.push_back(c);
+        sessions.push_back(ses);
+    }
+
+    auto fillWriteBuf = [&](int i, size_t n) {
+        auto write_buf_locked = clients.at(i)->writebuf.lock();
+        write_buf_locked->buf.reset();
+        write_buf_locked->buf.ensureFreeSpace(n, settings.clientMaxWriteBufferSize);
+        std::vector<char> data(n, 'x');
+        write_buf_locked->buf.write(data.data(), data.size());
+        clients.at(i)->updateWriteBufFreeEstimate(*write_buf_locked);
+    };
+
+    auto setQuota = [&](int i, int quota) {
+        auto qos_locked = sessions.at(i)->qos.lock();
+        qos_locked->flowControlQuota = quota;
+        qos_locked->updateFreeCapacityEstimate();
+    };
+
+    // One saturated, one with a half full buffer, and one with only a quarter of its quota left.
+    fillWriteBuf(0, settings.clientMaxWriteBufferSize);
+    fillWriteBuf(1, settings.clientMaxWriteBufferSize / 2);
+    setQuota(2, 25);
+
+    QVERIFY(sessions.at(0)->getFreeCapacity() == 0.0);
+    QVERIFY(sessions.at(1)->getFreeCapacity() > 0.49 && sessions.at(1)->getFreeCapacity() < 0.51);
+    QVERIFY(sessions.at(2)->getFreeCapacity() == 0.25);
+
+    for (int i = 0; i < 10; i++)
+    {
+        QCOMPARE(*s.getLeastLoaded(), s[sessions.at(1)->getClientId()]);
+    }
+
+    // An idle member wins.
+    setQuota(2, 100);
+    QVERIFY(sessions.at(2)->getFreeCapacity() == 1.0);
+
+    for (int i = 0; i < 10; i++)
+    {
+        QCOMPARE(*s.getLeastLoaded(), s[sessions.at(2)->getClientId()]);
+    }
+
+    // Off-line members are skipped.
+    clients.at(2).reset();
+    QVERIFY(sessions.at(2)->getFreeCapacity() == 0.0);
+    QCOMPARE(*s.getLeastLoaded(), s[sessions.at(1)->getClientId()]);
+
+    // When all are saturated, it's round robin.
+    fillWriteBuf(1, settings.clientMaxWriteBufferSize);
+
+    std::set<std::string> selected;
+    for (int i = 0; i < 10; i++)
+    {
+        const Subscription *sub = s.getLeastLoaded();
+        QVERIFY(sub);
+        selected.insert(sub->session.lock()->getClientId());
+    }
+
+    MYCASTCOMPARE(selected.size(), 3);
+}
+
+void MainTests::testSharedSubscribersThreadLocal()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t1(new ThreadData(0, settings, pluginLoader));
+    std::shared_ptr<ThreadData> t2(new ThreadData(1, settings, pluginLoader));
+    std::shared_ptr<ThreadData> t3(new ThreadData(2, settings, pluginLoader));
+
+    Authentication auth(settings);
+    ThreadGlobals::assign(&auth);
+    ThreadGlobals::assignThreadData(t1.get());
+    ThreadGlobals::assignSettings(&settings);
+
+    std::vector<std::shared_ptr<Client>> clients;
+    std::vector<std::shared_ptr<Session>> sessions;
+    SharedSubscribers s;
+
+    const std::vector<std::shared_ptr<ThreadData>> homes {t2, t1, t2, t2};
+
+    for (size_t i = 0; i < homes.size(); i++)
+    {
+        std::shared_ptr<Client> c(new Client(0, homes.at(i), nullptr, false, false, nullptr, settings, false));
+        c->setClientProperties(ProtocolVersion::Mqtt5, formatString("clientid%d", static_cast<int>(i)), "user", true, 60);
+
+        std::shared_ptr<Session> ses = std::make_shared<Session>(c->getClientId(), c->getUsername());
+        ses->assignActiveConnection(c);
+        s[ses->getClientId()].session = ses;
+
+        clients.push_back(c);
+        sessions.push_back(ses);
+    }
+
+    QVERIFY(sessions.at(1)->isOnThread(t1.get()));
+    QVERIFY(!sessions.at(1)->isOnThread(t2.get()));
+
+    for (int i = 0; i < 5; i++)
+    {
+        QCOMPARE(*s.getThreadLocal(t1.get()), s[sessions.at(1)->getClientId()]);
+    }
+
+    // The members on the thread take turns.
+    std::vector<std::string> selected;
+    for (int i = 0; i < 6; i++)
+    {
+        selected.push_back(s.getThreadLocal(t2.get())->session.lock()->getClientId());
+    }
+
+    MYCASTCOMPARE(std::count(selected.begin(), selected.end(), "clientid0"), 2);
+    MYCASTCOMPARE(std::count(selected.begin(), selected.end(), "clientid2"), 2);
+    MYCASTCOMPARE(std::count(selected.begin(), selected.end(), "clientid3"), 2);
+
+    // Without local members, it's round robin.
+    std::set<std::string> selected_elsewhere;
+    for (int i = 0; i < 8; i++)
+    {
+        selected_elsewhere.insert(s.getThreadLocal(t3.get())->session.lock()->getClientId());
+    }
+
+    MYCASTCOMPARE(selected_elsewhere.size(), 4);
+
+    // Off-line members don't count as local.
+    clients.at(1).reset();
+    QVERIFY(!sessions.at(1)->isOnThread(t1.get()));
+}
+
+void MainTests::testSharedSubscribersTopicHash()
+{
+    Settings settings;
+    settings.sharedSubscriptionTargeting = SharedSubscriptionTargeting::TopicHash;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+
+    Authentication auth(settings);
+    ThreadGlobals::assign(&auth);
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
+
+    std::vector<std::shared_ptr<Session>> sessions;
+    SharedSubscribers s;
+
+    QVERIFY(s.getByTopicHash(1234) == nullptr);
+
+    auto addMember = [&](int i) {
+        std::shared_ptr<Session> ses = std::make_shared<Session>(formatString("clientid%d", i), "user");
+        s[ses->getClientId()].session = ses;
+        sessions.push_back(ses);
+    };
+
+    for (int i = 0; i < 10; i++)
+    {
+        addMember(i);
+    }
+
+    std::vector<size_t> hashes;
+    for (int i = 0; i < 10000; i++)
+    {
+        hashes.push_back(std::hash<std::string>()(formatString("devices/%d/temperature", i)));
+    }
+
+    auto getMapping = [&]() {
+        std::vector<std::string> result;
+        for (size_t h : hashes)
+        {
+            const Subscription *sub = s.getByTopicHash(h);
+            result.push_back(sub ? sub->session.lock()->getClientId() : "");
+        }
+        return result;
+    };
+
+    const std::vector<std::string> mapping1 = getMapping();
+
+    // Stable, and reasonably balanced.
+    QVERIFY(getMapping() == mapping1);
+
+    for (int i = 0; i < 10; i++)
+    {
+        const int count = std::count(mapping1.begin(), mapping1.end(), formatString("clientid%d", i));
+        QVERIFY2(count > 400 && count < 1600, formatString("Member %d has %d topics", i, count).c_str());
+    }
+
+    // Removing a member only moves the topics of that member.
+    const std::string removed = sessions.at(3)->getClientId();
+    s.erase(removed);
+    sessions.at(3).reset();
+
+    const std::vector<std::string> mapping2 = getMapping();
+    for (size_t i = 0; i < hashes.size(); i++)
+    {
+        if (mapping1.at(i) == removed)
+            QVERIFY(mapping2.at(i) != removed && !mapping2.at(i).empty());
+        else
+            QVERIFY(mapping2.at(i) == mapping1.at(i));
+    }
+
+    // Cleaning up the empty spot doesn't change anything.
+    s.purgeAndReIndex();
+    MYCASTCOMPARE(s.members.size(), 9);
+    QVERIFY(getMapping() == mapping2);
+
+    // Adding a member only moves topics to that member, about 1/N of them.
+    addMember(10);
+    const std::vector<std::string> mapping3 = getMapping();
+    int moved = 0;
+    for (size_t i = 0; i < hashes.size(); i++)
+    {
+        if (mapping3.at(i) == mapping2.at(i))
+            continue;
+
+        QVERIFY(mapping3.at(i) == "clientid10");
+        moved++;
+    }
+
+    QVERIFY2(moved > 400 && moved < 2000, formatString("%d topics moved", moved).c_str());
+
+    // A purge with nothing to purge leaves it alone.
+    s.purgeAndReIndex();
+    QVERIFY(getMapping() == mapping3);
+
+    // Other targeting doesn't maintain the ring, but a purge makes it after switching to topic hash on a reload.
+    settings.sharedSubscriptionTargeting = SharedSubscriptionTargeting::RoundRobin;
+    SharedSubscribers other;
+    std::shared_ptr<Session> otherSession = std::make_shared<Session>("other", "user");
+    other[otherSession->getClientId()].session = otherSession;
+    QVERIFY(other.hashRing.empty());
+    QVERIFY(other.getByTopicHash(1234) == &other[otherSession->getClientId()]);
+
+    settings.sharedSubscriptionTargeting = SharedSubscriptionTargeting::TopicHash;
+    other.purgeAndReIndex();
+    MYCASTCOMPARE(other.hashRing.size(), SharedSubscribers::hashRingVirtualNodes);
+    QVERIFY(other.getByTopicHash(1234) == &other[otherSession->getClientId()]);
+}
@@ -10,6 +10,7 @@ See LICENSE for license details.
 
 #include <list>
 #include <unordered_map>
+#include <unordered_set>
 #include <sys/sysinfo.h>
 #include <fstream>
 #include <random>
@@ -22,10 +23,22 @@ See LICENSE for license details.
 
 #include "threadglobals.h"
 #include "threadlocalutils.h"
+#include "topicscanner.h"
+#include "memoryaccounting.h"
+#include "admissioncontroller.h"
+#include "derivablecounter.h"
+#include "latencyhistogram.h"
+#include "metricsexporter.h"
+#include "loopprofiler.h"
+#include "queuedtasks.h"
+#include "taskqueue.h"
+#include "clientrebalancer.h"
+#include "retainedmessage.h"
 #include "retainedmessagesdb.h"
 #include "utils.h"
 #include "exceptions.h"
 #include "flashmqtempdir.h"
+#include "filecloser.h"
 
 void MainTests::test_circbuf()
 {
@@ -262,561 +275,2665 @@ void MainTests::test_cirbuf_vector_methods()
     }
 }
 
+void MainTests::test_cirbuf_release_and_lazy_allocate()
+{
+    const int64_t allocatedBefore = CirBuf::getTotalAllocatedBytes();
+
+    {
+        CirBuf buf(1024);
+        FMQ_COMPARE(CirBuf::getTotalAllocatedBytes() - allocatedBefore, static_cast<int64_t>(1024));
+
+        buf.resetSize(0);
+        QVERIFY(buf.buf == nullptr);
+        FMQ_COMPARE(buf.getSize(), static_cast<uint32_t>(0));
+        FMQ_COMPARE(buf.freeSpace(), static_cast<uint32_t>(0));
+        FMQ_COMPARE(buf.maxWriteSize(), static_cast<uint32_t>(0));
+        FMQ_COMPARE(buf.usedBytes(), static_cast<uint32_t>(0));
+        FMQ_COMPARE(CirBuf::getTotalAllocatedBytes(), allocatedBefore);
+
+        const std::string data(100, 'a');
+        buf.writerange(data.begin(), data.end());
+        FMQ_COMPARE(buf.getSize(), static_cast<uint32_t>(128));
+        FMQ_COMPARE(buf.usedBytes(), static_cast<uint32_t>(100));
+        FMQ_COMPARE(CirBuf::getTotalAllocatedBytes() - allocatedBefore, static_cast<int64_t>(128));
+
+        std::vector<char> reread = buf.readAllToVector();
+        FMQ_COMPARE(std::string(reread.begin(), reread.end()), data);
+
+        buf.ensureFreeSpace(500);
+        FMQ_COMPARE(buf.getSize(), static_cast<uint32_t>(512));
+        FMQ_COMPARE(CirBuf::getTotalAllocatedBytes() - allocatedBefore, static_cast<int64_t>(512));
+    }
+
+    FMQ_COMPARE(CirBuf::getTotalAllocatedBytes(), allocatedBefore);
+}
+
+/**
+ * @brief MainTests::testReadScratchBufferPartialPackets tests that reading happens in the thread's buffer, and that clients only
+ * get their own read buffer for leftover partial packets.
+ */
+void MainTests::testReadScratchBufferPartialPackets()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+    ThreadGlobals::assignThreadData(t.get());
+
+    int fds[2];
+    check<std::runtime_error>(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    FileCloser peerCloser(fds[1]);
+
+    std::shared_ptr<Client> client(new Client(fds[0], t, nullptr, false, false, nullptr, settings, false));
+
+    FMQ_COMPARE(client->readbuf.getSize(), static_cast<uint32_t>(0));
+    FMQ_COMPARE(client->writebuf.lock()->buf.getSize(), static_cast<uint32_t>(0));
+
+    // QoS 0 publish on topic 'a' with payload 'hello'.
+    const std::vector<char> publish {0x30, 8, 0, 1, 'a', 'h', 'e', 'l', 'l', 'o'};
+
+    std::vector<char> data(publish);
+    data.insert(data.end(), publish.begin(), publish.begin() + 4);
+
+    std::vector<MqttPacket> packets;
+
+    QVERIFY(write(fds[1], data.data(), data.size()) == static_cast<ssize_t>(data.size()));
+    client->readFdIntoBuffer();
+    client->bufferToMqttPackets(packets, client);
+
+    FMQ_COMPARE(packets.size(), static_cast<size_t>(1));
+    FMQ_COMPARE(client->readbuf.usedBytes(), static_cast<uint32_t>(4));
+    FMQ_COMPARE(t->readScratchBuf.usedBytes(), static_cast<uint32_t>(0));
+
+    QVERIFY(write(fds[1], publish.data() + 4, publish.size() - 4) == static_cast<ssize_t>(publish.size() - 4));
+    client->readFdIntoBuffer();
+    client->bufferToMqttPackets(packets, client);
+
+    FMQ_COMPARE(packets.size(), static_cast<size_t>(2));
+    FMQ_COMPARE(client->readbuf.usedBytes(), static_cast<uint32_t>(0));
+
+    // Reading twice before parsing must not lose the bytes in the scratch buffer.
+    QVERIFY(write(fds[1], publish.data(), 3) == 3);
+    client->readFdIntoBuffer();
+    QVERIFY(write(fds[1], publish.data() + 3, publish.size() - 3) == static_cast<ssize_t>(publish.size() - 3));
+    client->readFdIntoBuffer();
+    client->bufferToMqttPackets(packets, client);
+
+    FMQ_COMPARE(packets.size(), static_cast<size_t>(3));
+    FMQ_COMPARE(client->readbuf.usedBytes(), static_cast<uint32_t>(0));
+
+    for (MqttPacket &packet : packets)
+    {
+        FMQ_COMPARE(packet.getBites(), publish);
+    }
+}
+
+/**
+ * @brief MainTests::testReadBudget tests that packets beyond the budget stay in the client's buffer for the next turn.
+ */
+void MainTests::testReadBudget()
+{
+    Settings settings;
+    settings.clientReadBudgetPackets = 4;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
+
+    int fds[2];
+    check<std::runtime_error>(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    FileCloser peerCloser(fds[1]);
+
+    std::shared_ptr<Client> client(new Client(fds[0], t, nullptr, false, false, nullptr, settings, false));
+
+    // QoS 0 publish on topic 'a' with payload 'hello'.
+    const std::vector<char> publish {0x30, 8, 0, 1, 'a', 'h', 'e', 'l', 'l', 'o'};
+
+    std::vector<char> data;
+    for (int i = 0; i < 10; i++)
+        data.insert(data.end(), publish.begin(), publish.end());
+
+    QVERIFY(write(fds[1], data.data(), data.size()) == static_cast<ssize_t>(data.size()));
+
+    std::vector<MqttPacket> packets;
+
+    client->readFdIntoBuffer();
+    QVERIFY(!client->getReadBudgetExhausted());
+    client->bufferToMqttPackets(packets, client);
+
+    FMQ_COMPARE(packets.size(), static_cast<size_t>(4));
+    QVERIFY(client->getReadBudgetExhausted());
+    FMQ_COMPARE(client->readbuf.usedBytes(), static_cast<uint32_t>(6 * publish.size()));
+    FMQ_COMPARE(t->readPacketBudgetExhausted.get(), static_cast<uint64_t>(1));
+
+    client->readFdIntoBuffer();
+    client->bufferToMqttPackets(packets, client);
+
+    FMQ_COMPARE(packets.size(), static_cast<size_t>(8));
+    QVERIFY(client->getReadBudgetExhausted());
+
+    client->readFdIntoBuffer();
+    client->bufferToMqttPackets(packets, client);
+
+    FMQ_COMPARE(packets.size(), static_cast<size_t>(10));
+    QVERIFY(!client->getReadBudgetExhausted());
+    FMQ_COMPARE(client->readbuf.usedBytes(), static_cast<uint32_t>(0));
+    FMQ_COMPARE(t->readPacketBudgetExhausted.get(), static_cast<uint64_t>(2));
+
+    for (MqttPacket &packet : packets)
+    {
+        FMQ_COMPARE(packet.getBites(), publish);
+    }
+
+    // The byte budget stops reading from the socket.
+    settings.clientReadBudgetPackets = 0;
+    settings.clientReadBudgetBytes = 1;
+    packets.clear();
+
+    QVERIFY(write(fds[1], publish.data(), publish.size()) == static_cast<ssize_t>(publish.size()));
+    client->readFdIntoBuffer();
+    QVERIFY(client->getReadBudgetExhausted());
+    FMQ_COMPARE(t->readByteBudgetExhausted.get(), static_cast<uint64_t>(1));
+    client->bufferToMqttPackets(packets, client);
+    FMQ_COMPARE(packets.size(), static_cast<size_t>(1));
+
+    QVERIFY(client->claimReadTurn(1));
+    QVERIFY(!client->claimReadTurn(1));
+    QVERIFY(client->claimReadTurn(2));
+}
+
+/**
+ * @brief MainTests::testControlPacketPriority tests that control packets overtake a backlog of publishes, at a packet boundary.
+ */
+void MainTests::testControlPacketPriority()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+    ThreadGlobals::assignThreadData(t.get());
+
+    int fds[2];
+    check<std::runtime_error>(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+    FileCloser peerCloser(fds[1]);
+
+    std::shared_ptr<Client> c1(new Client(fds[0], t, nullptr, false, false, nullptr, settings, false));
+    std::shared_ptr<Client> client = c1;
+    t->giveClient(std::move(c1));
+
+    const int publishCount = 500;
+    const Publish pub("bulk/data", std::string(1000, 'x'), 0);
+    const MqttPacket pubPacket(ProtocolVersion::Mqtt311, pub);
+    const size_t pubPacketSize = pubPacket.getSizeIncludingNonPresentHeader();
+
+    for (int i = 0; i < publishCount; i++)
+    {
+        FMQ_COMPARE(client->writeMqttPacket(pubPacket), PacketDropReason::Success);
+    }
+
+    // The socket takes part of it.
+    client->writeBufIntoFd();
+    QVERIFY(client->writebuf.lock()->buf.usedBytes() > 0);
+
+    client->writePingResp();
+    PubResponse pubAck(ProtocolVersion::Mqtt311, PacketType::PUBACK, ReasonCodes::Success, 42);
+    MqttPacket pubAckPacket(pubAck);
+    FMQ_COMPARE(client->writeMqttPacket(pubAckPacket), PacketDropReason::Success);
+
+    // Bulk drops don't affect control packets.
+    int extraPublishes = 0;
+    bool dropped = false;
+    for (int i = 0; i < 5000 && !dropped; i++)
+    {
+        const PacketDropReason r = client->writeMqttPacket(pubPacket);
+        dropped = r == PacketDropReason::BufferFull;
+        extraPublishes += r == PacketDropReason::Success;
+    }
+    QVERIFY(dropped);
+    QVERIFY(client->writebuf.lock()->controlBuf.usedBytes() > 0);
+
+    std::vector<char> received;
+
+    for (int i = 0; i < 10000; i++)
+    {
+        char buf[65536];
+        ssize_t n = 0;
+        while ((n = read(fds[1], buf, sizeof(buf))) > 0)
+        {
+            received.insert(received.end(), buf, buf + n);
+        }
+
+        if (client->writebuf.lock()->usedBytes() == 0)
+            break;
+
+        client->writeBufIntoFd();
+    }
+
+    std::vector<PacketType> types;
+    size_t pos = 0;
+    while (pos < received.size())
+    {
+        const uint8_t first_byte = received.at(pos);
+        size_t remaining_length = 0;
+        size_t multiplier = 1;
+        size_t i = pos + 1;
+        uint8_t encodedByte = 0;
+        do
+        {
+            encodedByte = received.at(i++);
+            remaining_length += (encodedByte & 127) * multiplier;
+            multiplier *= 128;
+        }
+        while ((encodedByte & 128) != 0);
+
+        const size_t packet_length = remaining_length + (i - pos);
+        const PacketType type = static_cast<PacketType>(first_byte >> 4);
+
+        if (type == PacketType::PUBLISH)
+        {
+            FMQ_COMPARE(packet_length, pubPacketSize);
+        }
+
+        types.push_back(type);
+        pos += packet_length;
+    }
+
+    FMQ_COMPARE(pos, received.size());
+    FMQ_COMPARE(types.size(), static_cast<size_t>(publishCount + extraPublishes + 2));
+
+    const auto pingresp_pos = std::find(types.begin(), types.end(), PacketType::PINGRESP);
+    QVERIFY(pingresp_pos != types.end());
+    QVERIFY(pingresp_pos + 1 != types.end());
+    FMQ_COMPARE(*(pingresp_pos + 1), PacketType::PUBACK);
+
+    // There must be publishes after the control packets.
+    QVERIFY(std::distance(types.begin(), pingresp_pos) < publishCount - 10);
+}
+
+/**
+ * @brief MainTests::testConflationWhenBacklogged tests that a backlogged client with conflation gets the last value of each topic, instead
+ * of having the newest messages dropped.
+ */
+void MainTests::testConflationWhenBacklogged()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
+
+    int fds[2];
+    check<std::runtime_error>(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+    FileCloser peerCloser(fds[1]);
+
+    std::shared_ptr<Client> c1(new Client(fds[0], t, nullptr, false, false, nullptr, settings, false));
+    std::shared_ptr<Client> client = c1;
+    t->giveClient(std::move(c1));
+    client->protocolVersion = ProtocolVersion::Mqtt311;
+    client->setConflateWhenBacklogged(true);
+
+    const Publish bulk("bulk/data", std::string(1000, 'x'), 0);
+    const MqttPacket bulkPacket(ProtocolVersion::Mqtt311, bulk);
+
+    bool backlogged = false;
+    int bulkCount = 0;
+    for (int i = 0; i < 10000 && !backlogged; i++)
+    {
+        const PacketDropReason r = client->writeMqttPacket(bulkPacket);
+        backlogged = r == PacketDropReason::BufferFull;
+        bulkCount += r == PacketDropReason::Success;
+    }
+    QVERIFY(backlogged);
+
+    const int updates = 100;
+    for (int i = 0; i < updates; i++)
+    {
+        for (const std::string topic : {"state/a", "state/b"})
+        {
+            Publish pub(topic, topic.substr(6) + std::to_string(i), 0);
+            PublishCopyFactory factory(&pub);
+            FMQ_COMPARE(client->writeMqttPacketAndBlameThisClient(factory, 0, 0, false, 0, {}), PacketDropReason::Success);
+        }
+    }
+
+    // Small publishes can still fit in the buffer before it's fully backlogged.
+    FMQ_COMPARE(client->writebuf.lock()->conflated.size(), static_cast<size_t>(2));
+    QVERIFY(t->conflatedPublishes.get() > 0);
+
+    std::vector<char> received;
+
+    for (int i = 0; i < 10000; i++)
+    {
+        char buf[65536];
+        ssize_t n = 0;
+        while ((n = read(fds[1], buf, sizeof(buf))) > 0)
+        {
+            received.insert(received.end(), buf, buf + n);
+        }
+
+        {
+            auto wb = client->writebuf.lock();
+            if (wb->usedBytes() == 0 && wb->conflated.empty())
+                break;
+        }
+
+        client->writeBufIntoFd();
+    }
+
+    std::vector<std::pair<std::string, std::string>> publishes;
+    size_t pos = 0;
+    while (pos < received.size())
+    {
+        size_t remaining_length = 0;
+        size_t multiplier = 1;
+        size_t i = pos + 1;
+        uint8_t encodedByte = 0;
+        do
+        {
+            encodedByte = received.at(i++);
+            remaining_length += (encodedByte & 127) * multiplier;
+            multiplier *= 128;
+        }
+        while ((encodedByte & 128) != 0);
+
+        const size_t topic_length = (static_cast<uint8_t>(received.at(i)) << 8) | static_cast<uint8_t>(received.at(i + 1));
+        const size_t end = i + remaining_length;
+        const std::string topic(&received.at(i + 2), topic_length);
+        const std::string payload(received.begin() + i + 2 + topic_length, received.begin() + end);
+        publishes.emplace_back(topic, payload);
+        pos = end;
+    }
+
+    FMQ_COMPARE(pos, received.size());
+
+    // Every update was either sent or replaced by a newer one.
+    const size_t stateCount = publishes.size() - bulkCount;
+    FMQ_COMPARE(stateCount + t->conflatedPublishes.get(), static_cast<size_t>(updates * 2));
+    QVERIFY(stateCount >= 2);
+
+    // The conflated ones are sent in the order the topics were first conflated, which depends on which fit.
+    std::vector<std::pair<std::string, std::string>> last(publishes.end() - 2, publishes.end());
+    std::sort(last.begin(), last.end());
+    FMQ_COMPARE(last.at(0).first, "state/a");
+    FMQ_COMPARE(last.at(0).second, "a99");
+    FMQ_COMPARE(last.at(1).first, "state/b");
+    FMQ_COMPARE(last.at(1).second, "b99");
+}
+
+void MainTests::testConflatingQosQueue()
+{
+    QoSPublishQueue q;
+    q.setConflate(true);
+
+    q.queuePublish(Publish("state/a", "a1", 1), 1, {});
+    q.queuePublish(Publish("state/b", "b1", 1), 2, {});
+
+    QVERIFY(q.eraseByTopic("state/a"));
+    QVERIFY(!q.eraseByTopic("state/a"));
+    q.queuePublish(Publish("state/a", "a2", 1), 3, {});
+
+    // The topic override is what the client sees, so that's what is conflated on.
+    q.queuePublish(Publish("state/c", "c1", 1), 4, std::string("remote/state/c"));
+    QVERIFY(!q.eraseByTopic("state/c"));
+    QVERIFY(q.eraseByTopic("remote/state/c"));
+
+    FMQ_COMPARE(q.size(), static_cast<size_t>(2));
+    FMQ_COMPARE(q.popNext()->getPublish().payload, "b1");
+    FMQ_COMPARE(q.popNext()->getPublish().payload, "a2");
+    QVERIFY(!q.eraseByTopic("state/b"));
+    QVERIFY(!q.popNext());
+
+    QoSPublishQueue q2;
+    q2.queuePublish(Publish("state/a", "a1", 1), 1, {});
+    QVERIFY(!q2.eraseByTopic("state/a"));
+    q2.setConflate(true);
+    QVERIFY(q2.eraseByTopic("state/a"));
+}
+
+/**
+ * @brief MainTests::testPublisherBackpressure tests that a paused publisher is resumed once the subscribers it waits for have drained, or
+ * when the maximum pause is over.
+ */
+void MainTests::testPublisherBackpressure()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
+
+    int pubFds[2];
+    check<std::runtime_error>(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pubFds));
+    FileCloser pubPeerCloser(pubFds[1]);
+
+    int subFds[2];
+    check<std::runtime_error>(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, subFds));
+    FileCloser subPeerCloser(subFds[1]);
+
+    std::shared_ptr<Client> c1(new Client(pubFds[0], t, nullptr, false, false, nullptr, settings, false));
+    std::shared_ptr<Client> publisher = c1;
+    t->giveClient(std::move(c1));
+
+    std::shared_ptr<Client> c2(new Client(subFds[0], t, nullptr, false, false, nullptr, settings, false));
+    std::shared_ptr<Client> subscriber = c2;
+    t->giveClient(std::move(c2));
+
+    std::shared_ptr<Session> session = std::make_shared<Session>("subscriber", "");
+    session->assignActiveConnection(subscriber);
+
+    QVERIFY(!session->isBacklogged());
+
+    const Publish pub("bulk/data", std::string(1000, 'x'), 0);
+    const MqttPacket pubPacket(ProtocolVersion::Mqtt311, pub);
+
+    bool dropped = false;
+    for (int i = 0; i < 10000 && !dropped; i++)
+    {
+        dropped = subscriber->writeMqttPacket(pubPacket) == PacketDropReason::BufferFull;
+    }
+    QVERIFY(dropped);
+    QVERIFY(session->isBacklogged());
+
+    t->pauseClientForBackpressure(publisher, {session});
+    QVERIFY(publisher->isPausedForBackpressure());
+    QVERIFY(!publisher->readyForReading);
+    FMQ_COMPARE(t->publisherBackpressurePauses.get(), static_cast<size_t>(1));
+
+    // Reading (again) is not possible while paused.
+    publisher->setReadyForReading(true);
+    QVERIFY(!publisher->readyForReading);
+
+    t->resumeClientsAfterBackpressure();
+    QVERIFY(publisher->isPausedForBackpressure());
+
+    for (int i = 0; i < 10000 && session->isBacklogged(); i++)
+    {
+        char buf[65536];
+        while (read(subFds[1], buf, sizeof(buf)) > 0) {}
+        subscriber->writeBufIntoFd();
+    }
+    QVERIFY(!session->isBacklogged());
+
+    t->resumeClientsAfterBackpressure();
+    QVERIFY(!publisher->isPausedForBackpressure());
+    QVERIFY(publisher->readyForReading);
+    QVERIFY(t->clientsPausedForBackpressure.empty());
+
+    // A subscriber that doesn't catch up doesn't stop the publisher forever.
+    dropped = false;
+    for (int i = 0; i < 10000 && !dropped; i++)
+    {
+        dropped = subscriber->writeMqttPacket(pubPacket) == PacketDropReason::BufferFull;
+    }
+    QVERIFY(dropped);
+
+    t->pauseClientForBackpressure(publisher, {session});
+    QVERIFY(!publisher->resumeReadingIfTargetsDrained(std::chrono::steady_clock::now(), std::chrono::milliseconds(1000)));
+    QVERIFY(publisher->resumeReadingIfTargetsDrained(std::chrono::steady_clock::now() + std::chrono::milliseconds(1000), std::chrono::milliseconds(1000)));
+    QVERIFY(publisher->readyForReading);
+}
+
+/**
+ * @brief MainTests::testPublisherBackpressureHoldsAck tests that the publisher doesn't get its PUBACK while it's paused, and does when the
+ * subscriber has room again.
+ */
+void MainTests::testPublisherBackpressureHoldsAck()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("publisher_backpressure_threshold 1");
+    confFile.writeLine("publisher_backpressure_max_pause_ms 60000");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    FlashMQTestClient receiver;
+    receiver.start();
+    receiver.connectClient(ProtocolVersion::Mqtt5);
+    receiver.subscribe("a/b", 1);
+
+    std::shared_ptr<Session> session = mainApp->getStore()->lockSession(receiver.getClientId());
+    QVERIFY(session);
+
+    // Make the subscriber look like it has too much in flight, so it's backlogged.
+    int quota = 0;
+    {
+        auto qos_locked = session->qos.lock();
+        quota = qos_locked->flowControlQuota;
+        qos_locked->flowControlQuota = 0;
+    }
+
+    FlashMQTestClient sender;
+    sender.start();
+    sender.connectClient(ProtocolVersion::Mqtt5);
+
+    try
+    {
+        sender.publish("a/b", "held", 1);
+        FMQ_FAIL("The publish was acked while the subscriber was backlogged.");
+    }
+    catch (std::runtime_error &ex)
+    {
+        FMQ_COMPARE(std::string(ex.what()), "Wait condition failed.");
+    }
+
+    {
+        auto ro = sender.receivedObjects.lock();
+        QVERIFY(ro->receivedPackets.empty());
+    }
+
+    session->qos.lock()->flowControlQuota = quota;
+
+    sender.waitForPacketCount(1);
+
+    {
+        auto ro = sender.receivedObjects.lock();
+        MqttPacket &pubAck = ro->receivedPackets.front();
+        FMQ_COMPARE(pubAck.packetType, PacketType::PUBACK);
+        pubAck.parsePubAckData();
+        FMQ_COMPARE(pubAck.getPacketId(), 77);
+    }
+
+    // The publish that caused the pause was dropped for the backlogged subscriber, but the next one is delivered.
+    sender.publish("a/b", "delivered", 1);
+    receiver.waitForMessageCount(1);
+
+    {
+        auto ro = receiver.receivedObjects.lock();
+        FMQ_COMPARE(ro->receivedPublishes.front().getPayloadCopy(), "delivered");
+    }
+}
+
+void MainTests::testMemoryAccounting()
+{
+    Settings settings;
+    ThreadGlobals::assignSettings(&settings);
+
+    std::atomic<int64_t> counter = 0;
+
+    {
+        AccountedMemory a(counter, 100);
+        FMQ_COMPARE(counter.load(), 100);
+
+        AccountedMemory b(a);
+        FMQ_COMPARE(counter.load(), 200);
+
+        AccountedMemory c(std::move(b));
+        FMQ_COMPARE(counter.load(), 200);
+
+        c = AccountedMemory(counter, 10);
+        FMQ_COMPARE(counter.load(), 110);
+
+        a = c;
+        FMQ_COMPARE(counter.load(), 20);
+    }
+
+    FMQ_COMPARE(counter.load(), 0);
+
+    const int64_t qosStart = MemoryAccounting::getQosQueueBytes();
+
+    {
+        QoSPublishQueue q;
+        q.queuePublish(Publish("one/two", std::string(1000, 'x'), 1), 1, {});
+        q.queuePublish(Publish("one/three", std::string(500, 'x'), 1), 2, {});
+        FMQ_COMPARE(MemoryAccounting::getQosQueueBytes() - qosStart, 1000 + 7 + 500 + 9);
+
+        q.popNext();
+        FMQ_COMPARE(MemoryAccounting::getQosQueueBytes() - qosStart, 500 + 9);
+    }
+
+    FMQ_COMPARE(MemoryAccounting::getQosQueueBytes(), qosStart);
+
+    const int64_t retainedStart = MemoryAccounting::getRetainedMessageBytes();
+
+    {
+        std::vector<RetainedMessage> messages;
+        messages.emplace_back(Publish("one/two", "payload", 0));
+        messages.emplace_back(Publish("one/three", "payload", 0));
+        messages.push_back(messages.front());
+        FMQ_COMPARE(MemoryAccounting::getRetainedMessageBytes() - retainedStart, 2 * messages.at(0).getSize() + messages.at(1).getSize());
+    }
+
+    FMQ_COMPARE(MemoryAccounting::getRetainedMessageBytes(), retainedStart);
+
+    const uint64_t total = MemoryAccounting::getTotalBytes();
+    QVERIFY(total > 0);
+    FMQ_COMPARE(MemoryAccounting::determinePressure(0), MemoryPressure::None);
+    FMQ_COMPARE(MemoryAccounting::determinePressure(total * 10), MemoryPressure::None);
+    FMQ_COMPARE(MemoryAccounting::determinePressure(total + total / 20), MemoryPressure::High);
+    FMQ_COMPARE(MemoryAccounting::determinePressure(total / 2), MemoryPressure::Critical);
+}
+
+/**
+ * @brief MainTests::testMemoryPressureShedding tests that buffers don't grow near the memory budget, and QoS 0 is shed over it.
+ */
+void MainTests::testMemoryPressureShedding()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
+    ThreadGlobals::assign(&t->authentication);
+
+    int fds[2];
+    check<std::runtime_error>(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+    FileCloser peerCloser(fds[1]);
+
+    std::shared_ptr<Client> c1(new Client(fds[0], t, nullptr, false, false, nullptr, settings, false));
+    std::shared_ptr<Client> client = c1;
+    t->giveClient(std::move(c1));
+
+    const Publish pub("bulk/data", std::string(100, 'x'), 0);
+    const MqttPacket pubPacket(ProtocolVersion::Mqtt311, pub);
+
+    // Make sure the memory pressure doesn't leak into other tests.
+    struct PressureResetter
+    {
+        ~PressureResetter() { MemoryAccounting::setPressure(MemoryPressure::None); }
+    } pressureResetter;
+
+    MemoryAccounting::setPressure(MemoryPressure::High);
+
+    bool dropped = false;
+    for (int i = 0; i < 10000 && !dropped; i++)
+    {
+        dropped = client->writeMqttPacket(pubPacket) == PacketDropReason::BufferFull;
+    }
+    QVERIFY(dropped);
+    QVERIFY(client->writebuf.lock()->buf.getSize() <= static_cast<uint32_t>(settings.clientInitialBufferSize));
+    QVERIFY(t->memoryPressureDrops.get() > 0);
+
+    // Control packets still go.
+    client->writePingResp();
+    QVERIFY(client->writebuf.lock()->controlBuf.usedBytes() > 0);
+
+    client->writebuf.lock()->buf.reset();
+    MemoryAccounting::setPressure(MemoryPressure::Critical);
+
+    FMQ_COMPARE(client->writeMqttPacket(pubPacket), PacketDropReason::Success);
+    FMQ_COMPARE(client->writeMqttPacket(pubPacket), PacketDropReason::BufferFull);
+
+    // Running into the normal buffer limit is not a memory pressure drop.
+    MemoryAccounting::setPressure(MemoryPressure::None);
+    const uint64_t pressureDropsBefore = t->memoryPressureDrops.get();
+    dropped = false;
+    for (int i = 0; i < 1000000 && !dropped; i++)
+    {
+        dropped = client->writeMqttPacket(pubPacket) == PacketDropReason::BufferFull;
+    }
+    QVERIFY(dropped);
+    FMQ_COMPARE(t->memoryPressureDrops.get(), pressureDropsBefore);
+    MemoryAccounting::setPressure(MemoryPressure::Critical);
+
+    // Offline clients don't get QoS messages queued.
+    std::shared_ptr<Session> session = std::make_shared<Session>("offline", "");
+    Publish qosPub("bulk/data", "payload", 1);
+    PublishCopyFactory factory(&qosPub);
+    FMQ_COMPARE(session->writePacket(factory, 1, false, 0), PacketDropReason::QoSTODOSomethingSomething);
+
+    MemoryAccounting::setPressure(MemoryPressure::None);
+    FMQ_COMPARE(session->writePacket(factory, 1, false, 0), PacketDropReason::ClientOffline);
+
+    // A conflating off-line client keeps the value it has when the new one is shed.
+    session->qos.lock()->qosPacketQueue.setConflate(true);
+    MemoryAccounting::setPressure(MemoryPressure::Critical);
+    Publish newerQosPub("bulk/data", "newer payload", 1);
+    PublishCopyFactory newerFactory(&newerQosPub);
+    FMQ_COMPARE(session->writePacket(newerFactory, 1, false, 0), PacketDropReason::QoSTODOSomethingSomething);
+
+    {
+        auto qos_locked = session->qos.lock();
+        FMQ_COMPARE(qos_locked->qosPacketQueue.size(), static_cast<size_t>(1));
+        FMQ_COMPARE(qos_locked->qosPacketQueue.popNext()->getPublish().payload, "payload");
+    }
+}
+
+/**
+ * @brief MainTests::testMemoryPressureReadBuffer tests that read buffers don't grow near the memory budget, and that reading continues when
+ * the pressure is gone.
+ */
+void MainTests::testMemoryPressureReadBuffer()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
+    ThreadGlobals::assign(&t->authentication);
+
+    int fds[2];
+    check<std::runtime_error>(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+    FileCloser peerCloser(fds[1]);
+
+    std::shared_ptr<Client> c1(new Client(fds[0], t, nullptr, false, false, nullptr, settings, false));
+    std::shared_ptr<Client> client = c1;
+    t->giveClient(std::move(c1));
+
+    struct PressureResetter
+    {
+        ~PressureResetter() { MemoryAccounting::setPressure(MemoryPressure::None); }
+    } pressureResetter;
+
+    MemoryAccounting::setPressure(MemoryPressure::High);
+
+    const Publish pub("bulk/data", std::string(3 * settings.clientInitialBufferSize, 'x'), 0);
+    const MqttPacket pubPacket(ProtocolVersion::Mqtt311, pub);
+    CirBuf packetBuf(8192);
+    pubPacket.readIntoBuf(packetBuf);
+    const std::vector<char> bytes = packetBuf.peekAllToVector();
+
+    QVERIFY(write(fds[1], bytes.data(), bytes.size()) == static_cast<ssize_t>(bytes.size()));
+
+    std::vector<MqttPacket> packets;
+
+    for (int i = 0; i < 10 && !client->isPausedForMemoryPressure(); i++)
+    {
+        client->readFdIntoBuffer();
+        client->bufferToMqttPackets(packets, client);
+    }
+
+    QVERIFY(client->isPausedForMemoryPressure());
+    QVERIFY(packets.empty());
+    const uint32_t sizeUnderPressure = client->readbuf.getSize();
+    QVERIFY(sizeUnderPressure < bytes.size());
+    FMQ_COMPARE(client->readbuf.freeSpace(), static_cast<uint32_t>(0));
+
+    // Still under pressure, so nothing changes.
+    t->resumeClientsAfterMemoryPressure();
+    QVERIFY(client->isPausedForMemoryPressure());
+    FMQ_COMPARE(client->readbuf.getSize(), sizeUnderPressure);
+
+    MemoryAccounting::setPressure(MemoryPressure::None);
+    t->resumeClientsAfterMemoryPressure();
+    QVERIFY(!client->isPausedForMemoryPressure());
+    QVERIFY(client->readbuf.getSize() > sizeUnderPressure);
+
+    for (int i = 0; i < 10 && packets.empty(); i++)
+    {
+        client->readFdIntoBuffer();
+        client->bufferToMqttPackets(packets, client);
+    }
+
+    FMQ_COMPARE(packets.size(), static_cast<size_t>(1));
+    FMQ_COMPARE(packets.front().getBites(), bytes);
+}
+
+void MainTests::testAdmissionController()
+{
+    AdmissionController disabled;
+    QVERIFY(!disabled.enabled());
+    QVERIFY(disabled.tryAdmit(std::chrono::steady_clock::now()));
+
+    AdmissionController admission;
+    admission.setMaxRate(100);
+    QVERIFY(admission.enabled());
+
+    const auto start = std::chrono::steady_clock::now();
+
+    // The burst is one second worth.
+    int admitted = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        if (admission.tryAdmit(start))
+            admitted++;
+    }
+    QVERIFY(admitted >= 100 && admitted <= 101);
+    QVERIFY(!admission.tryAdmit(start));
+    QVERIFY(admission.getTimeTillNextToken() > std::chrono::milliseconds(0));
+    QVERIFY(admission.getTimeTillNextToken() <= std::chrono::milliseconds(10));
+
+    // Half a second later, there's room for about half.
+    admitted = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        if (admission.tryAdmit(start + std::chrono::milliseconds(500)))
+            admitted++;
+    }
+    QVERIFY(admitted >= 49 && admitted <= 51);
+
+    admission.adapt(true);
+    FMQ_COMPARE(admission.getRate(), 50.0);
+    admission.adapt(true);
+    FMQ_COMPARE(admission.getRate(), 25.0);
+
+    for (int i = 0; i < 10; i++)
+        admission.adapt(true);
+
+    FMQ_COMPARE(admission.getRate(), 5.0);
+
+    admission.adapt(false);
+    FMQ_COMPARE(admission.getRate(), 15.0);
+
+    for (int i = 0; i < 20; i++)
+        admission.adapt(false);
+
+    FMQ_COMPARE(admission.getRate(), 100.0);
+
+    FMQ_COMPARE(admission.takeRejectionCount(), static_cast<uint64_t>(0));
+    admission.countRejection();
+    admission.countRejection();
+    FMQ_COMPARE(admission.takeRejectionCount(), static_cast<uint64_t>(2));
+    FMQ_COMPARE(admission.takeRejectionCount(), static_cast<uint64_t>(0));
+}
+
 void MainTests::test_validSubscribePath()
 {
-    QVERIFY(isValidSubscribePath("one/two/three"));
-    QVERIFY(isValidSubscribePath("one//three"));
-    QVERIFY(isValidSubscribePath("one/+/three"));
-    QVERIFY(isValidSubscribePath("one/+/#"));
-    QVERIFY(isValidSubscribePath("#"));
-    QVERIFY(isValidSubscribePath("///"));
-    QVERIFY(isValidSubscribePath("//#"));
-    QVERIFY(isValidSubscribePath("+"));
-    QVERIFY(isValidSubscribePath(""));
-    QVERIFY(isValidSubscribePath("hello"));
+    QVERIFY(isValidSubscribePath("one/two/three"));
+    QVERIFY(isValidSubscribePath("one//three"));
+    QVERIFY(isValidSubscribePath("one/+/three"));
+    QVERIFY(isValidSubscribePath("one/+/#"));
+    QVERIFY(isValidSubscribePath("#"));
+    QVERIFY(isValidSubscribePath("///"));
+    QVERIFY(isValidSubscribePath("//#"));
+    QVERIFY(isValidSubscribePath("+"));
+    QVERIFY(isValidSubscribePath(""));
+    QVERIFY(isValidSubscribePath("hello"));
+
+    QVERIFY(isValidSubscribePath("$SYS/hello"));
+    QVERIFY(isValidSubscribePath("hello/$SYS")); // Hmm, is this valid?
+
+    QVERIFY(!isValidSubscribePath("one/tw+o/three"));
+    QVERIFY(!isValidSubscribePath("one/+o/three"));
+    QVERIFY(!isValidSubscribePath("one/a+/three"));
+    QVERIFY(!isValidSubscribePath("#//three"));
+    QVERIFY(!isValidSubscribePath("#//+"));
+    QVERIFY(!isValidSubscribePath("one/#/+"));
+
+    QVERIFY(!isValidSubscribePath("one/two#"));
+    QVERIFY(!isValidSubscribePath("one/two#/three"));
+    QVERIFY(!isValidSubscribePath("one/asdf+/+"));
+    QVERIFY(!isValidSubscribePath("+one/asdf+/+"));
+}
+
+void MainTests::test_various_packet_sizes()
+{
+    std::vector<ProtocolVersion> protocols {ProtocolVersion::Mqtt311, ProtocolVersion::Mqtt5};
+    std::list<std::string> payloads {std::string(8000,3), std::string(10*1024*1024, 5)};
+
+    for (const ProtocolVersion senderVersion : protocols)
+    {
+        for (const ProtocolVersion receiverVersion : protocols)
+        {
+            for (const std::string &payload : payloads)
+            {
+                FlashMQTestClient sender;
+                FlashMQTestClient receiver;
+
+                std::string topic = "hugepacket";
+
+                sender.start();
+                sender.connectClient(senderVersion);
+
+                receiver.start();
+                receiver.connectClient(receiverVersion);
+                receiver.subscribe(topic, 0);
+
+                sender.publish(topic, payload, 0);
+                receiver.waitForMessageCount(1, 2);
+
+                auto ro = receiver.receivedObjects.lock();
+
+                MYCASTCOMPARE(ro->receivedPublishes.size(), 1);
+
+                MqttPacket &msg = ro->receivedPublishes.front();
+                QCOMPARE(msg.getPayloadCopy(), payload);
+                QVERIFY(!msg.getRetain());
+            }
+        }
+    }
+}
+
+void MainTests::test_acl_tree()
+{
+    AclTree aclTree;
+
+    aclTree.addTopic("one/two/#", AclGrant::ReadWrite, AclTopicType::Strings);
+    aclTree.addTopic("one/two/three", AclGrant::Deny, AclTopicType::Strings);
+    aclTree.addTopic("a/+/c", AclGrant::Read, AclTopicType::Strings);
+    aclTree.addTopic("1/+/3", AclGrant::ReadWrite, AclTopicType::Strings);
+    aclTree.addTopic("1/blocked/3", AclGrant::Deny, AclTopicType::Strings);
+    aclTree.addTopic("cat/+/dog", AclGrant::Write, AclTopicType::Strings);
+    aclTree.addTopic("cat/blocked/dog", AclGrant::Deny, AclTopicType::Strings);
+    aclTree.addTopic("cat/blocked/dog/bla/bla/#", AclGrant::Deny, AclTopicType::Strings);
+    aclTree.addTopic("cat/turtle/dog/%u/bla/#", AclGrant::ReadWrite, AclTopicType::Strings);
+    aclTree.addTopic("fish/turtle/dog/%u/bla/#", AclGrant::ReadWrite, AclTopicType::Strings, "john");
+    aclTree.addTopic("fish/turtle/dog/%u/bla/#", AclGrant::ReadWrite, AclTopicType::Strings, "AAA");
+
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four/five/six", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four/five/six", '/'), AclGrant::Write, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two/three", '/'), AclGrant::Read, "", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("asdf", '/'), AclGrant::Read, "", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/b/c", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/b/c", '/'), AclGrant::Write, "", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/wildcardmatch/c", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("1/2/3", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("1/2/3", '/'), AclGrant::Write, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("1/wildcardmatch/3", '/'), AclGrant::Write, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("1/wildcardmatch/3", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("cat/2/dog", '/'), AclGrant::Write, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("cat/2/dog", '/'), AclGrant::Read, "", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("cat/blocked/dog", '/'), AclGrant::Write, "", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("cat/blocked/dog", '/'), AclGrant::Read, "", "clientid"), AuthResult::acl_denied);
+
+    // Test that wildcards aren't replaced here
+    QCOMPARE(aclTree.findPermission(splitToVector("cat/turtle/dog/%u/bla/sdf", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("fish/turtle/dog/%u/bla/sdf", '/'), AclGrant::Read, "john", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("fish/turtle/dog/john/bla/sdf", '/'), AclGrant::Read, "john", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("fish/turtle/dog/AAA/bla/sdf", '/'), AclGrant::Read, "AAA", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("fish/turtle/dog/john/bla/sdf", '/'), AclGrant::Read, "john", "clientid"), AuthResult::acl_denied);
+
+}
+
+void MainTests::test_acl_tree2()
+{
+    AclTree aclTree;
+
+    aclTree.addTopic("one/two/#", AclGrant::ReadWrite, AclTopicType::Strings);
+    aclTree.addTopic("one/two/three", AclGrant::Deny, AclTopicType::Strings);
+    aclTree.addTopic("one/two/three", AclGrant::ReadWrite, AclTopicType::Strings, "Metusalem");
+    aclTree.addTopic("a/+/c", AclGrant::Read, AclTopicType::Strings);
+    aclTree.addTopic("1/+/3", AclGrant::ReadWrite, AclTopicType::Strings);
+    aclTree.addTopic("1/blocked/3", AclGrant::Deny, AclTopicType::Strings);
+    aclTree.addTopic("cat/+/dog", AclGrant::Write, AclTopicType::Strings);
+    aclTree.addTopic("cat/blocked/dog", AclGrant::Deny, AclTopicType::Strings);
+    aclTree.addTopic("cat/blocked/dog/bla/bla/#", AclGrant::Deny, AclTopicType::Strings);
+
+    // Test all these with a user, which should be denied.
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four/five/six", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four/five/six", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two/three", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("asdf", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/b/c", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/b/c", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/wildcardmatch/c", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("1/2/3", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("1/2/3", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("1/wildcardmatch/3", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("1/wildcardmatch/3", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("cat/2/dog", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("cat/2/dog", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("cat/blocked/dog", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("cat/blocked/dog", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("one/two/three", '/'), AclGrant::Read, "Metusalem", "clientid"), AuthResult::success);
+}
+
+void MainTests::test_acl_patterns_username()
+{
+    AclTree aclTree;
+
+    aclTree.addTopic("one/%u/three", AclGrant::ReadWrite, AclTopicType::Patterns);
+    aclTree.addTopic("a/%u/c", AclGrant::Read, AclTopicType::Patterns);
+    aclTree.addTopic("d/%u/f/#", AclGrant::Read, AclTopicType::Patterns);
+    aclTree.addTopic("one/Jheronimus/three", AclGrant::Deny, AclTopicType::Strings);
+    aclTree.addTopic("one/santaclause/three", AclGrant::Deny, AclTopicType::Strings, "santaclause");
+    aclTree.addTopic("%u/#", AclGrant::ReadWrite, AclTopicType::Patterns);
+
+    // Succeeds, because the anonymous deny should have no effect on the authenticated ACL check, so it checks the pattern based.
+    QCOMPARE(aclTree.findPermission(splitToVector("one/Jheronimus/three", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
+
+    // The fixed-strings deny for 'santaclause' should override the pattern based ReadWrite.
+    QCOMPARE(aclTree.findPermission(splitToVector("one/santaclause/three", '/'), AclGrant::Read, "santaclause", "clientid"), AuthResult::acl_denied);
+
+    aclTree.addTopic("some/thing", AclGrant::ReadWrite, AclTopicType::Strings, "Rembrandt");
+    aclTree.addTopic("some/thing", AclGrant::ReadWrite, AclTopicType::Patterns);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("one/Jheronimus/three", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/Theo/three", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::acl_denied);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("a/Jheronimus/c", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/NotJheronimus/c", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/Jheronimus/c", '/'), AclGrant::Write, "Jheronimus", "clientid"), AuthResult::acl_denied);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("d/Jheronimus/f", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("d/Jheronimus/f/A", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("d/Jheronimus/f/A/B", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
+
+    // Repeat the test, but now with a user for which there is also an unrelated user specific ACL.
+
+    QCOMPARE(aclTree.findPermission(splitToVector("one/Rembrandt/three", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/Theo/three", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::acl_denied);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("a/Rembrandt/c", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/NotRembrandt/c", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/Rembrandt/c", '/'), AclGrant::Write, "Rembrandt", "clientid"), AuthResult::acl_denied);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("d/Rembrandt/f", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("d/Rembrandt/f/A", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("d/Rembrandt/f/A/B", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("Rembrandt", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("Rembrandt", '/'), AclGrant::Write, "Rembrandt", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("Rembrandt/wer", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("Rembrandt/eee", '/'), AclGrant::Write, "Rembrandt", "clientid"), AuthResult::success);
+
+}
+
+void MainTests::test_acl_patterns_clientid()
+{
+    AclTree aclTree;
+
+    aclTree.addTopic("one/%c/three", AclGrant::ReadWrite, AclTopicType::Patterns);
+    aclTree.addTopic("a/%c/c", AclGrant::Read, AclTopicType::Patterns);
+    aclTree.addTopic("d/%c/f/#", AclGrant::Read, AclTopicType::Patterns);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("one/clientid_one/three", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("one/clientid_two/three", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::acl_denied);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("a/clientid_one/c", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/not_clientidone/c", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("a/clientid_one/c", '/'), AclGrant::Write, "foo", "clientid_one"), AuthResult::acl_denied);
+
+    QCOMPARE(aclTree.findPermission(splitToVector("d/clientid_one/f", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("d/clientid_one/f/A", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("d/clientid_one/f/A/B", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
+}
+
+/**
+ * @brief MainTests::test_loading_acl_file was created because assertions in it failed when publishing $SYS topics were passed through the ACL
+ * layer. That's why it seemingly doesn't do anything.
+ */
+void MainTests::test_loading_acl_file()
+{
+    ConfFileTemp aclFile;
+    aclFile.writeLine("topic readwrite one/two");
+    aclFile.closeFile();
+
+    ConfFileTemp confFile;
+    confFile.writeLine("mosquitto_acl_file " + aclFile.getFilePath());
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    usleep(1000000);
+
+    QVERIFY(true);
+}
+
+#ifndef FMQ_NO_SSE
+void MainTests::test_sse_split()
+{
+    SimdUtils data;
+
+    std::list<std::string> topics;
+    topics.push_back("one/two/threeabcasdfasdf/koe");
+    topics.push_back("/two/threeabcasdfasdf/koe"); // Test empty component.
+    topics.push_back("//two/threeabcasdfasdf/koe"); // Test two empty components.
+    topics.push_back("//1234567890abcde/bla/koe"); // Test two empty components, 15 char topic (one byte short of 16 alignment).
+    topics.push_back("//1234567890abcdef/bla/koe"); // Test two empty components, 16 char topic
+    topics.push_back("//1234567890abcdefg/bla/koe"); // Test two empty components, 17 char topic
+    topics.push_back("//1234567890abcdefg/1234567890abcdefg/koe"); // Test two empty components, two 17 char topics
+    topics.push_back("//1234567890abcdef/1234567890abcdefg/koe"); // Test two empty components, 16 and 17 char
+    topics.push_back("//1234567890abcdef/1234567890abcdefg/koe/");
+    topics.push_back("//1234567890abcdef/1234567890abcdefg/koe//");
+    topics.push_back("//1234567890abcdef/1234567890abcdef/");
+    topics.push_back("/");
+    topics.push_back("");
+
+    for (const std::string &t : topics)
+    {
+        std::vector<std::string> output = data.splitTopic(t);
+        QCOMPARE(output, splitToVector(t, '/'));
+    }
+}
+#endif
+
+void MainTests::test_validUtf8Generic()
+{
+    char m[16];
+
+    QVERIFY(isValidUtf8Generic(""));
+    QVERIFY(isValidUtf8Generic("ƀ"));
+    QVERIFY(isValidUtf8Generic("Hello"));
+
+    std::memset(m, 0, 16);
+    QVERIFY(!isValidUtf8Generic(std::string(m, 16)));
+
+    QVERIFY(isValidUtf8Generic("Straƀe")); // two byte chars
+    QVERIFY(isValidUtf8Generic("StraƀeHelloHelloHelloHelloHelloHello")); // two byte chars
+    QVERIFY(isValidUtf8Generic("HelloHelloHelloHelloHelloHelloHelloHelloStraƀeHelloHelloHelloHelloHelloHello")); // two byte chars
+
+    std::memset(m, 0, 16);
+    m[0] = 'a';
+    m[1] = 13; // is \r
+    QVERIFY(!isValidUtf8Generic(std::string(m, 16)));
+
+    const std::string unicode_ballet_shoes("🩰");
+    QVERIFY(unicode_ballet_shoes.length() == 4);
+    QVERIFY(isValidUtf8Generic(unicode_ballet_shoes));
+
+    const std::string unicode_ballot_box("☐");
+    QVERIFY(unicode_ballot_box.length() == 3);
+    QVERIFY(isValidUtf8Generic(unicode_ballot_box));
+
+    std::memset(m, 0, 16);
+    m[0] = 0b11000001; // Start 2 byte char
+    m[1] = 0b00000001; // Next byte doesn't start with 1, which is wrong
+    std::string a(m, 2);
+    QVERIFY(!isValidUtf8Generic(a));
+
+    std::memset(m, 0, 16);
+    m[0] = 0b11100001; // Start 3 byte char
+    m[1] = 0b10100001;
+    m[2] = 0b00000001; // Next byte doesn't start with 1, which is wrong
+    std::string b(m, 3);
+    QVERIFY(!isValidUtf8Generic(b));
+
+    std::memset(m, 0, 16);
+    m[0] = 0b11110001; // Start 4 byte char
+    m[1] = 0b10100001;
+    m[2] = 0b10100001;
+    m[3] = 0b00000001; // Next byte doesn't start with 1, which is wrong
+    std::string c(m, 4);
+    QVERIFY(!isValidUtf8Generic(c));
+
+    std::memset(m, 0, 16);
+    m[0] = 0b11110001; // Start 4 byte char
+    m[1] = 0b10100001;
+    m[2] = 0b00100001; // Doesn't start with 1: invalid.
+    m[3] = 0b10000001;
+    std::string d(m, 4);
+    QVERIFY(!isValidUtf8Generic(d));
+
+    // Upper ASCII, invalid
+    std::memset(m, 0, 16);
+    m[0] = 127;
+    std::string e(m, 1);
+    QVERIFY(!isValidUtf8Generic(e));
+}
+
+#ifndef FMQ_NO_SSE
+void MainTests::test_validUtf8Sse()
+{
+    SimdUtils data;
+
+    char m[16];
+
+    QVERIFY(data.isValidUtf8(""));
+    QVERIFY(data.isValidUtf8("ƀ"));
+    QVERIFY(data.isValidUtf8("Hello"));
+
+    std::memset(m, 0, 16);
+    QVERIFY(!data.isValidUtf8(std::string(m, 16)));
+
+    QVERIFY(data.isValidUtf8("Straƀe")); // two byte chars
+    QVERIFY(data.isValidUtf8("StraƀeHelloHelloHelloHelloHelloHello")); // two byte chars
+    QVERIFY(data.isValidUtf8("HelloHelloHelloHelloHelloHelloHelloHelloStraƀeHelloHelloHelloHelloHelloHello")); // two byte chars
+
+    QVERIFY(!data.isValidUtf8("Straƀe#", true));
+    QVERIFY(!data.isValidUtf8("ƀ#", true));
+    QVERIFY(!data.isValidUtf8("#ƀ", true));
+    QVERIFY(!data.isValidUtf8("+", true));
+    QVERIFY(!data.isValidUtf8("🩰+asdfasdfasdf", true));
+    QVERIFY(!data.isValidUtf8("+asdfasdfasdf", true));
+
+    std::memset(m, 0, 16);
+    m[0] = 'a';
+    m[1] = 13; // is \r
+    QVERIFY(!data.isValidUtf8(std::string(m, 16)));
+
+    const std::string unicode_ballet_shoes("🩰");
+    QVERIFY(unicode_ballet_shoes.length() == 4);
+    QVERIFY(data.isValidUtf8(unicode_ballet_shoes));
+
+    const std::string unicode_ballot_box("☐");
+    QVERIFY(unicode_ballot_box.length() == 3);
+    QVERIFY(data.isValidUtf8(unicode_ballot_box));
+
+    std::memset(m, 0, 16);
+    m[0] = 0b11000001; // Start 2 byte char
+    m[1] = 0b00000001; // Next byte doesn't start with 1, which is wrong
+    std::string a(m, 2);
+    QVERIFY(!data.isValidUtf8(a));
+
+    std::memset(m, 0, 16);
+    m[0] = 0b11100001; // Start 3 byte char
+    m[1] = 0b10100001;
+    m[2] = 0b00000001; // Next byte doesn't start with 1, which is wrong
+    std::string b(m, 3);
+    QVERIFY(!data.isValidUtf8(b));
+
+    std::memset(m, 0, 16);
+    m[0] = 0b11110001; // Start 4 byte char
+    m[1] = 0b10100001;
+    m[2] = 0b10100001;
+    m[3] = 0b00000001; // Next byte doesn't start with 1, which is wrong
+    std::string c(m, 4);
+    QVERIFY(!data.isValidUtf8(c));
+
+    std::memset(m, 0, 16);
+    m[0] = 0b11110001; // Start 4 byte char
+    m[1] = 0b10100001;
+    m[2] = 0b00100001; // Doesn't start with 1: invalid.
+    m[3] = 0b10000001;
+    std::string d(m, 4);
+    QVERIFY(!data.isValidUtf8(d));
+
+    // Upper ASCII, invalid
+    std::memset(m, 0, 16);
+    m[0] = 127;
+    std::string e(m, 1);
+    QVERIFY(!data.isValidUtf8(e));
+}
+
+/**
+ * @brief MainTests::test_utf8_nonchars tests the 66 non-chars in unicode, and a bit around them.
+ */
+void MainTests::test_utf8_nonchars()
+{
+    SimdUtils simd_utils;
+
+    for (int i = 0x80; i < 0x90; i++)
+    {
+        std::string c;
+        c.push_back(0xEF);
+        c.push_back(0xB7);
+        c.push_back(i);
+
+        QVERIFY(isValidUtf8Generic(c));
+        QVERIFY(simd_utils.isValidUtf8(c));
+    }
+
+    // The invalid ones
+    for (int i = 0x90; i <= 0xAF; i++)
+    {
+        std::string c;
+        c.push_back(0xEF);
+        c.push_back(0xB7);
+        c.push_back(i);
+
+        QVERIFY(!isValidUtf8Generic(c));
+        QVERIFY(!simd_utils.isValidUtf8(c));
+    }
+
+    for (int i = 0xB0; i < 0xB5; i++)
+    {
+        std::string c;
+        c.push_back(0xEF);
+        c.push_back(0xB7);
+        c.push_back(i);
+
+        QVERIFY(isValidUtf8Generic(c));
+        QVERIFY(simd_utils.isValidUtf8(c));
+    }
+
+    // Now the last two code points of the multilingual planes
+
+    {
+        std::string s;
+        s.clear(); s.push_back(0xEF); s.push_back(0xBF); s.push_back(0xBE);
+        QVERIFY(!isValidUtf8Generic(s));
+        QVERIFY(!simd_utils.isValidUtf8(s));
+
+        s.clear(); s.push_back(0xEF); s.push_back(0xBF); s.push_back(0xBF);
+        QVERIFY(!isValidUtf8Generic(s));
+        QVERIFY(!simd_utils.isValidUtf8(s));
+
+        // Adjacent one that is valid.
+        s.clear(); s.push_back(0xEF); s.push_back(0xBF); s.push_back(0xBD);
+        QVERIFY(isValidUtf8Generic(s));
+        QVERIFY(simd_utils.isValidUtf8(s));
+    }
+
+    {
+        std::string s;
+        s.clear(); s.push_back(0xF0); s.push_back(0x9F); s.push_back(0xBF); s.push_back(0xBE);
+        QVERIFY(!isValidUtf8Generic(s));
+        QVERIFY(!simd_utils.isValidUtf8(s));
+
+        s.clear(); s.push_back(0xF0); s.push_back(0x9F); s.push_back(0xBF); s.push_back(0xBF);
+        QVERIFY(!isValidUtf8Generic(s));
+        QVERIFY(!simd_utils.isValidUtf8(s));
+
+        // Adjacent one that is valid.
+        s.clear(); s.push_back(0xF0); s.push_back(0x9F); s.push_back(0xBF); s.push_back(0xBD);
+        QVERIFY(isValidUtf8Generic(s));
+        QVERIFY(simd_utils.isValidUtf8(s));
+    }
+
+    // TODO: there are more planes to check, but programming that out means encoding in UTF8.
+}
+
+/**
+ * @brief MainTests::test_utf8_overlong tests multiple representations of '/' (ASCII 0xAF).
+ *
+ * U+002F = c0 af
+ * U+002F = e0 80 af
+ * U+002F = f0 80 80 af
+ */
+void MainTests::test_utf8_overlong()
+{
+    SimdUtils simd_utils;
+
+    {
+        std::string two;
+        two.push_back(0xc0);
+        two.push_back(0xaf);
+        QVERIFY(!isValidUtf8Generic(two));
+        QVERIFY(!simd_utils.isValidUtf8(two));
+    }
+
+    {
+        std::string three;
+        three.push_back(0xe0);
+        three.push_back(0x80);
+        three.push_back(0xaf);
+        QVERIFY(!isValidUtf8Generic(three));
+        QVERIFY(!simd_utils.isValidUtf8(three));
+    }
+
+    {
+        std::string four;
+        four.push_back(0xf0);
+        four.push_back(0x80);
+        four.push_back(0x80);
+        four.push_back(0xaf);
+        QVERIFY(!isValidUtf8Generic(four));
+        QVERIFY(!simd_utils.isValidUtf8(four));
+    }
+}
+
+void MainTests::test_utf8_compare_implementation()
+{
+    SimdUtils simd_utils;
 
-    QVERIFY(isValidSubscribePath("$SYS/hello"));
-    QVERIFY(isValidSubscribePath("hello/$SYS")); // Hmm, is this valid?
+    // Just something to look at. It prefixes lines with a red cross when the checker returns false. Note that this means you
+    // don't see the difference between invalid UTF8 and valid but invalid for MQTT.
+    FlashMQTempDir tmpdir;
+    std::ofstream outfile(tmpdir.getPath() / "flashmq_utf8_test_result.txt", std::ios::binary);
 
-    QVERIFY(!isValidSubscribePath("one/tw+o/three"));
-    QVERIFY(!isValidSubscribePath("one/+o/three"));
-    QVERIFY(!isValidSubscribePath("one/a+/three"));
-    QVERIFY(!isValidSubscribePath("#//three"));
-    QVERIFY(!isValidSubscribePath("#//+"));
-    QVERIFY(!isValidSubscribePath("one/#/+"));
+    int line_count = 0;
+    std::ifstream infile("UTF-8-test.txt", std::ios::binary);
+    for(std::string line; getline(infile, line ); )
+    {
+        const bool a = isValidUtf8Generic(line);
+        const bool b = simd_utils.isValidUtf8(line);
 
-    QVERIFY(!isValidSubscribePath("one/two#"));
-    QVERIFY(!isValidSubscribePath("one/two#/three"));
-    QVERIFY(!isValidSubscribePath("one/asdf+/+"));
-    QVERIFY(!isValidSubscribePath("+one/asdf+/+"));
+        QVERIFY(a == b);
+
+        if (a)
+            outfile << "\u2705 ";
+        else
+            outfile << "\u274C ";
+
+        outfile << line << std::endl;
+
+        line_count++;
+    }
+
+    QVERIFY(line_count > 40);
 }
+#endif
 
-void MainTests::test_various_packet_sizes()
+/**
+ * @brief MainTests::testTopicScanKernels compares all kernels this CPU supports with isValidUtf8Generic() and splitToVector().
+ */
+void MainTests::testTopicScanKernels()
 {
-    std::vector<ProtocolVersion> protocols {ProtocolVersion::Mqtt311, ProtocolVersion::Mqtt5};
-    std::list<std::string> payloads {std::string(8000,3), std::string(10*1024*1024, 5)};
+    std::vector<TopicScanKernel> kernels {TopicScanKernel::None, TopicScanKernel::Avx2, TopicScanKernel::Avx512bw};
+
+    std::vector<std::string> inputs;
 
-    for (const ProtocolVersion senderVersion : protocols)
     {
-        for (const ProtocolVersion receiverVersion : protocols)
+        std::ifstream infile("UTF-8-test.txt", std::ios::binary);
+        for(std::string line; getline(infile, line ); )
         {
-            for (const std::string &payload : payloads)
+            inputs.push_back(line);
+        }
+    }
+
+    inputs.push_back("");
+    inputs.push_back("/");
+    inputs.push_back("//");
+    inputs.push_back("one/two/three");
+    inputs.push_back("one/two/three/");
+    inputs.push_back("Straƀe/🩰/☐/Hello");
+    inputs.push_back("a/+/b");
+    inputs.push_back("a/b/#");
+    inputs.push_back(std::string(31, 'a') + "/" + std::string(64, 'b') + "/" + std::string(63, 'c') + "/");
+    inputs.push_back(std::string(62, 'a') + "ƀ/ƀ");
+    inputs.push_back(std::string(31, 'a') + "🩰" + std::string(31, 'a') + "/x");
+    inputs.push_back(std::string(63, 'a') + "\xC2");
+    inputs.push_back(std::string(40, 'a') + '\x7F');
+    inputs.push_back(std::string(65, 'a') + '\r');
+
+    // Multi-byte characters, separators and wildcards straddling each position around the 32 and 64 byte block boundaries.
+    for (size_t pos = 28; pos < 132; pos++)
+    {
+        for (const std::string &insert : {std::string("\xE2\x98\x90"), std::string("\xF0\x9F\xA9\xB0"), std::string("/"), std::string("+"),
+                                          std::string("\xC2")})
+        {
+            std::string s(pos, 'a');
+            s.append(insert);
+            s.append(pos % 7, 'b');
+            inputs.push_back(s);
+        }
+    }
+
+    std::minstd_rand rnd(42);
+    const std::string alphabet("abc/+#\x01\x7F\xC2\x80\xC3\xBF\xE2\x98\x90\xF0\x9F\xA9\xB0\xEF\xBF\xBE");
+
+    for (int i = 0; i < 20000; i++)
+    {
+        std::string s;
+        const size_t len = rnd() % 200;
+        const bool mostly_ascii = i % 2 == 0;
+
+        while (s.size() < len)
+        {
+            if (mostly_ascii && rnd() % 10 != 0)
+                s.push_back("abcdefgh/"[rnd() % 9]);
+            else
+                s.push_back(alphabet.at(rnd() % alphabet.size()));
+        }
+
+        inputs.push_back(s);
+    }
+
+    int valid_count = 0;
+    int kernel_count = 0;
+
+    for (TopicScanKernel kernel : kernels)
+    {
+        if (!topicScanKernelSupported(kernel))
+        {
+            std::cout << "Topic scan kernel " << topicScanKernelToString(kernel) << " not supported on this CPU." << std::endl;
+            continue;
+        }
+
+        kernel_count++;
+
+        for (const std::string &s : inputs)
+        {
+            for (const bool alsoCheckInvalidPublishChars : {false, true})
             {
-                FlashMQTestClient sender;
-                FlashMQTestClient receiver;
+                const bool expected = isValidUtf8Generic(s, alsoCheckInvalidPublishChars);
 
-                std::string topic = "hugepacket";
+                std::vector<std::string> subtopics;
+                const bool valid = scanTopic(kernel, s.data(), s.size(), true, alsoCheckInvalidPublishChars, &subtopics);
 
-                sender.start();
-                sender.connectClient(senderVersion);
+                FMQ_COMPARE(valid, expected);
+                FMQ_COMPARE(scanTopic(kernel, s.data(), s.size(), true, alsoCheckInvalidPublishChars, nullptr), expected);
 
-                receiver.start();
-                receiver.connectClient(receiverVersion);
-                receiver.subscribe(topic, 0);
+                if (valid)
+                {
+                    FMQ_COMPARE(subtopics, splitToVector(s, '/'));
+                    valid_count++;
+                }
+            }
 
-                sender.publish(topic, payload, 0);
-                receiver.waitForMessageCount(1, 2);
+            std::vector<std::string> subtopics;
+            QVERIFY(scanTopic(kernel, s.data(), s.size(), false, false, &subtopics));
+            FMQ_COMPARE(subtopics, splitToVector(s, '/'));
 
-                auto ro = receiver.receivedObjects.lock();
+            if (kernel == TopicScanKernel::None)
+                continue;
 
-                MYCASTCOMPARE(ro->receivedPublishes.size(), 1);
+            // And directly against the scalar kernel, to catch disagreements the generic functions happen to share with it.
+            for (const bool alsoCheckInvalidPublishChars : {false, true})
+            {
+                std::vector<std::string> reference_subtopics;
+                const bool reference_valid = scanTopic(TopicScanKernel::None, s.data(), s.size(), true, alsoCheckInvalidPublishChars,
+                                                       &reference_subtopics);
 
-                MqttPacket &msg = ro->receivedPublishes.front();
-                QCOMPARE(msg.getPayloadCopy(), payload);
-                QVERIFY(!msg.getRetain());
+                std::vector<std::string> kernel_subtopics;
+                const bool kernel_valid = scanTopic(kernel, s.data(), s.size(), true, alsoCheckInvalidPublishChars, &kernel_subtopics);
+
+                FMQ_COMPARE(kernel_valid, reference_valid);
+
+                if (reference_valid)
+                    FMQ_COMPARE(kernel_subtopics, reference_subtopics);
             }
         }
     }
+
+    QVERIFY(kernel_count >= 1);
+    QVERIFY(valid_count > 1000);
 }
 
-void MainTests::test_acl_tree()
+/**
+ * @brief MainTests::testTopicScanKernelsBenchmark is a micro benchmark. The numbers are printed, and not asserted on. It's not part
+ * of the normal run; give its name as argument to run it.
+ */
+void MainTests::testTopicScanKernelsBenchmark()
 {
-    AclTree aclTree;
+    const std::string shortTopic("sensors/building1/floor3/room12/temperature");
+    std::string longTopic;
+    while (longTopic.size() < 65000)
+        longTopic.append("abcdefghijklmnopqrstuvwxyz0123/");
+    std::string payload;
+    while (payload.size() < 65536)
+        payload.append("{\"temperature\": 21.5, \"unit\": \"°C\", \"location\": \"Straße\"} ");
+
+    struct BenchCase
+    {
+        std::string name;
+        const std::string *data;
+        bool split = false;
+        int iterations = 0;
+    };
 
-    aclTree.addTopic("one/two/#", AclGrant::ReadWrite, AclTopicType::Strings);
-    aclTree.addTopic("one/two/three", AclGrant::Deny, AclTopicType::Strings);
-    aclTree.addTopic("a/+/c", AclGrant::Read, AclTopicType::Strings);
-    aclTree.addTopic("1/+/3", AclGrant::ReadWrite, AclTopicType::Strings);
-    aclTree.addTopic("1/blocked/3", AclGrant::Deny, AclTopicType::Strings);
-    aclTree.addTopic("cat/+/dog", AclGrant::Write, AclTopicType::Strings);
-    aclTree.addTopic("cat/blocked/dog", AclGrant::Deny, AclTopicType::Strings);
-    aclTree.addTopic("cat/blocked/dog/bla/bla/#", AclGrant::Deny, AclTopicType::Strings);
-    aclTree.addTopic("cat/turtle/dog/%u/bla/#", AclGrant::ReadWrite, AclTopicType::Strings);
-    aclTree.addTopic("fish/turtle/dog/%u/bla/#", AclGrant::ReadWrite, AclTopicType::Strings, "john");
-    aclTree.addTopic("fish/turtle/dog/%u/bla/#", AclGrant::ReadWrite, AclTopicType::Strings, "AAA");
+    const std::vector<BenchCase> cases {
+        {"short topic", &shortTopic, true, 500000},
+        {"64 KB topic", &longTopic, true, 500},
+        {"64 KB PFI payload", &payload, false, 500}
+    };
 
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four/five/six", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four/five/six", '/'), AclGrant::Write, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two/three", '/'), AclGrant::Read, "", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("asdf", '/'), AclGrant::Read, "", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/b/c", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/b/c", '/'), AclGrant::Write, "", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/wildcardmatch/c", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("1/2/3", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("1/2/3", '/'), AclGrant::Write, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("1/wildcardmatch/3", '/'), AclGrant::Write, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("1/wildcardmatch/3", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("cat/2/dog", '/'), AclGrant::Write, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("cat/2/dog", '/'), AclGrant::Read, "", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("cat/blocked/dog", '/'), AclGrant::Write, "", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("cat/blocked/dog", '/'), AclGrant::Read, "", "clientid"), AuthResult::acl_denied);
+    for (TopicScanKernel kernel : {TopicScanKernel::None, TopicScanKernel::Avx2, TopicScanKernel::Avx512bw})
+    {
+        if (!topicScanKernelSupported(kernel))
+            continue;
 
-    // Test that wildcards aren't replaced here
-    QCOMPARE(aclTree.findPermission(splitToVector("cat/turtle/dog/%u/bla/sdf", '/'), AclGrant::Read, "", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("fish/turtle/dog/%u/bla/sdf", '/'), AclGrant::Read, "john", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("fish/turtle/dog/john/bla/sdf", '/'), AclGrant::Read, "john", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("fish/turtle/dog/AAA/bla/sdf", '/'), AclGrant::Read, "AAA", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("fish/turtle/dog/john/bla/sdf", '/'), AclGrant::Read, "john", "clientid"), AuthResult::acl_denied);
+        for (const BenchCase &c : cases)
+        {
+            std::vector<std::string> subtopics;
+            size_t bytes = 0;
+
+            const auto start = std::chrono::steady_clock::now();
+
+            for (int i = 0; i < c.iterations; i++)
+            {
+                subtopics.clear();
+                QVERIFY(scanTopic(kernel, c.data->data(), c.data->size(), true, c.split, c.split ? &subtopics : nullptr));
+                bytes += c.data->size();
+            }
 
+            const auto duration = std::chrono::steady_clock::now() - start;
+            const double seconds = std::chrono::duration<double>(duration).count();
+
+            std::cout << "Topic scan kernel " << topicScanKernelToString(kernel) << ", " << c.name << ": "
+                      << static_cast<uint64_t>(c.iterations / seconds) << " per second, "
+                      << static_cast<uint64_t>(bytes / seconds / 1024 / 1024) << " MB/s." << std::endl;
+        }
+    }
 }
 
-void MainTests::test_acl_tree2()
+/**
+ * @brief MainTests::testConnectStorm registers clients from several threads at once, like a reconnect wave, and checks the session
+ * registry is consistent afterwards.
+ */
+void MainTests::testConnectStorm()
 {
-    AclTree aclTree;
+    const int thread_count = 4;
+    const int clients_per_thread = 1000;
 
-    aclTree.addTopic("one/two/#", AclGrant::ReadWrite, AclTopicType::Strings);
-    aclTree.addTopic("one/two/three", AclGrant::Deny, AclTopicType::Strings);
-    aclTree.addTopic("one/two/three", AclGrant::ReadWrite, AclTopicType::Strings, "Metusalem");
-    aclTree.addTopic("a/+/c", AclGrant::Read, AclTopicType::Strings);
-    aclTree.addTopic("1/+/3", AclGrant::ReadWrite, AclTopicType::Strings);
-    aclTree.addTopic("1/blocked/3", AclGrant::Deny, AclTopicType::Strings);
-    aclTree.addTopic("cat/+/dog", AclGrant::Write, AclTopicType::Strings);
-    aclTree.addTopic("cat/blocked/dog", AclGrant::Deny, AclTopicType::Strings);
-    aclTree.addTopic("cat/blocked/dog/bla/bla/#", AclGrant::Deny, AclTopicType::Strings);
+    Settings settings;
+    PluginLoader pluginLoader;
+    SubscriptionStore store;
 
-    // Test all these with a user, which should be denied.
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four/five/six", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two/four/five/six", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two/three", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("asdf", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/b/c", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/b/c", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/wildcardmatch/c", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("1/2/3", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("1/2/3", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("1/wildcardmatch/3", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("1/wildcardmatch/3", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("cat/2/dog", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("cat/2/dog", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("cat/blocked/dog", '/'), AclGrant::Write, "a", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("cat/blocked/dog", '/'), AclGrant::Read, "a", "clientid"), AuthResult::acl_denied);
+    std::vector<std::shared_ptr<ThreadData>> threadDatas;
+    for (int i = 0; i < thread_count; i++)
+    {
+        threadDatas.push_back(std::make_shared<ThreadData>(i, settings, pluginLoader));
+    }
+
+    std::atomic<int> errors = 0;
+
+    auto connectStorm = [&](int thread_nr) {
+        ThreadGlobals::assignThreadData(threadDatas.at(thread_nr).get());
+        ThreadGlobals::assignSettings(&settings);
+
+        std::shared_ptr<ThreadData> no_thread;
+
+        for (int i = 0; i < clients_per_thread; i++)
+        {
+            try
+            {
+                std::shared_ptr<Client> client = std::make_shared<Client>(0, no_thread, nullptr, false, false, nullptr, settings, false);
+                client->setClientProperties(ProtocolVersion::Mqtt5, formatString("storm_%d_%d", thread_nr, i), "user", true, 60);
+                store.registerClientAndKickExistingOne(client);
+
+                if (!store.lockSession(client->getClientId()))
+                    errors++;
+            }
+            catch (std::exception &ex)
+            {
+                errors++;
+            }
+        }
+    };
+
+    // The second pass is all reconnects, which replace the existing sessions.
+    for (int pass = 0; pass < 2; pass++)
+    {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < thread_count; i++)
+        {
+            threads.emplace_back(connectStorm, i);
+        }
+
+        for (std::thread &t : threads)
+        {
+            t.join();
+        }
+    }
+
+    FMQ_COMPARE(errors.load(), 0);
+    MYCASTCOMPARE(store.getSessionCount(), thread_count * clients_per_thread);
+    MYCASTCOMPARE(store.getAllSessions().size(), thread_count * clients_per_thread);
+
+    // The shards should be reasonably balanced.
+    for (const SessionShard &shard : store.sessionShards)
+    {
+        const size_t expected = thread_count * clients_per_thread / store.sessionShards.size();
+        QVERIFY(shard.sessionsById.size() > expected / 2 && shard.sessionsById.size() < expected * 2);
+    }
+
+    std::shared_ptr<Session> session = store.lockSession("storm_3_123");
+    QVERIFY(session);
+    store.removeSession(session);
+    QVERIFY(!store.lockSession("storm_3_123"));
+    MYCASTCOMPARE(store.getSessionCount(), thread_count * clients_per_thread - 1);
+}
+
+/**
+ * @brief MainTests::testSessionSubscriptionIndex tests that subscriptions are counted exactly, and are removed with their session without
+ * purging the tree.
+ */
+void MainTests::testSessionSubscriptionIndex()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    SubscriptionStore store;
+    std::shared_ptr<ThreadData> t = std::make_shared<ThreadData>(0, settings, pluginLoader);
+
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
+
+    std::shared_ptr<ThreadData> no_thread;
+
+    auto connect = [&](const std::string &client_id, bool clean_start) {
+        std::shared_ptr<Client> client = std::make_shared<Client>(0, no_thread, nullptr, false, false, nullptr, settings, false);
+        client->setClientProperties(ProtocolVersion::Mqtt5, client_id, "user", true, 60);
+        store.registerClientAndKickExistingOne(client, clean_start, 100, 3600);
+        return store.lockSession(client_id);
+    };
+
+    std::shared_ptr<Session> one = connect("one", false);
+    std::shared_ptr<Session> two = connect("two", false);
+
+    store.addSubscription(one, splitTopic("a/b"), 0, false, false, "", 0);
+    store.addSubscription(one, splitTopic("a/+"), 0, false, false, "", 0);
+    store.addSubscription(one, splitTopic("a/b"), 0, false, false, "group", 0);
+    store.addSubscription(two, splitTopic("a/b"), 0, false, false, "", 0);
+    MYCASTCOMPARE(store.getSubscriptionCount(), 4);
+    MYCASTCOMPARE(one->getSubscriptionNodeCount(), 3);
+
+    // Subscribing again to the same filter doesn't add anything.
+    QVERIFY(store.addSubscription(one, splitTopic("a/b"), 1, false, false, "", 0) == AddSubscriptionType::ExistingSubscription);
+    MYCASTCOMPARE(store.getSubscriptionCount(), 4);
+
+    store.removeSubscription(one, splitTopic("a/+"), "");
+    store.removeSubscription(one, splitTopic("a/+"), "");
+    store.removeSubscription(one, splitTopic("not/there"), "");
+    MYCASTCOMPARE(store.getSubscriptionCount(), 3);
+    MYCASTCOMPARE(one->getSubscriptionNodeCount(), 2);
+
+    std::shared_ptr<SubscriptionNode> node = store.getDeepestNode(splitTopic("a/b"), true);
+    QVERIFY(node);
+    MYCASTCOMPARE(node->getSubscribers().size(), 2);
+
+    // Removing a session removes its subscriptions right away, without purging the tree.
+    store.removeSession(two);
+    two.reset();
+    MYCASTCOMPARE(store.getSubscriptionCount(), 2);
+    MYCASTCOMPARE(node->getSubscribers().size(), 1);
+    QVERIFY(node->getSubscribers().find("two") == node->getSubscribers().end());
+
+    // A clean start takeover replaces the session, and with that, its subscriptions.
+    std::shared_ptr<Session> oneAgain = connect("one", true);
+    QVERIFY(oneAgain != one);
+    MYCASTCOMPARE(store.getSubscriptionCount(), 0);
+    MYCASTCOMPARE(one->getSubscriptionNodeCount(), 0);
+    QVERIFY(node->getSubscribers().empty());
+    MYCASTCOMPARE(node->getSharedSubscribers().at("group").size(), 0);
+
+    // The new session subscribing on the node doesn't get its subscription removed when the old session goes away.
+    store.addSubscription(oneAgain, splitTopic("a/b"), 0, false, false, "", 0);
+    store.removeSubscriptionsOfSession(one);
+    one.reset();
+    MYCASTCOMPARE(store.getSubscriptionCount(), 1);
+    MYCASTCOMPARE(node->getSubscribers().size(), 1);
+
+    // The tree was changed, so the purge does a full pass, but doesn't change the count.
+    QVERIFY(store.subscriptionTreeDirty);
+    QVERIFY(store.purgeSubscriptionTree());
+    MYCASTCOMPARE(store.getSubscriptionCount(), 1);
+    QVERIFY(store.getDeepestNode(splitTopic("a/b"), true));
+}
+
+void MainTests::testBatchedSubscribe()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    SubscriptionStore store;
+    std::shared_ptr<ThreadData> t = std::make_shared<ThreadData>(0, settings, pluginLoader);
+
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
+
+    std::shared_ptr<ThreadData> no_thread;
+    std::shared_ptr<Client> client = std::make_shared<Client>(0, no_thread, nullptr, false, false, nullptr, settings, false);
+    client->setClientProperties(ProtocolVersion::Mqtt5, "batcher", "user", true, 60);
+    store.registerClientAndKickExistingOne(client, false, 100, 3600);
+    client.reset();
+    std::shared_ptr<Session> session = store.lockSession("batcher");
+
+    store.addSubscription(session, splitTopic("existing/one"), 0, false, false, "", 0);
+
+    std::vector<SubscriptionTuple> tuples;
+    for (const std::string topic : {"existing/one", "a/b/c", "a/b/d", "a/+/c", "$SYS/#", "a/b/c"})
+    {
+        tuples.emplace_back(topic, splitTopic(topic), 1, false, false, "", AuthResult::success, 0, RetainHandling::SendRetainedMessagesAtSubscribe);
+    }
+
+    std::vector<const SubscriptionTuple*> subscriptions;
+    for (const SubscriptionTuple &tup : tuples)
+        subscriptions.push_back(&tup);
+
+    const std::vector<AddSubscriptionType> result = store.addSubscriptions(session, subscriptions);
+
+    MYCASTCOMPARE(result.size(), 6);
+    QVERIFY(result.at(0) == AddSubscriptionType::ExistingSubscription);
+    QVERIFY(result.at(1) == AddSubscriptionType::NewSubscription);
+    QVERIFY(result.at(2) == AddSubscriptionType::NewSubscription);
+    QVERIFY(result.at(3) == AddSubscriptionType::NewSubscription);
+    QVERIFY(result.at(4) == AddSubscriptionType::NewSubscription);
+    QVERIFY(result.at(5) == AddSubscriptionType::ExistingSubscription);
+
+    MYCASTCOMPARE(store.getSubscriptionCount(), 5);
+    MYCASTCOMPARE(session->getSubscriptionNodeCount(), 5);
+
+    for (const std::string topic : {"existing/one", "a/b/c", "a/b/d", "a/+/c", "$SYS/#"})
+    {
+        std::shared_ptr<SubscriptionNode> node = store.getDeepestNode(splitTopic(topic), true);
+        QVERIFY(node);
+        MYCASTCOMPARE(node->getSubscribers().size(), 1);
+        QCOMPARE(node->getSubscribers().at("batcher").qos, 1);
+    }
 
-    QCOMPARE(aclTree.findPermission(splitToVector("one/two/three", '/'), AclGrant::Read, "Metusalem", "clientid"), AuthResult::success);
+    QVERIFY(store.getDeepestNode(splitTopic("$SYS"), true) == store.rootDollar->children["$SYS"]);
 }
 
-void MainTests::test_acl_patterns_username()
+/**
+ * @brief MainTests::testDerivableCounter tests that counters can be read by other threads while the owner is incrementing them.
+ */
+void MainTests::testDerivableCounter()
 {
-    AclTree aclTree;
-
-    aclTree.addTopic("one/%u/three", AclGrant::ReadWrite, AclTopicType::Patterns);
-    aclTree.addTopic("a/%u/c", AclGrant::Read, AclTopicType::Patterns);
-    aclTree.addTopic("d/%u/f/#", AclGrant::Read, AclTopicType::Patterns);
-    aclTree.addTopic("one/Jheronimus/three", AclGrant::Deny, AclTopicType::Strings);
-    aclTree.addTopic("one/santaclause/three", AclGrant::Deny, AclTopicType::Strings, "santaclause");
-    aclTree.addTopic("%u/#", AclGrant::ReadWrite, AclTopicType::Patterns);
+    static_assert(alignof(DerivableCounter) == 64);
 
-    // Succeeds, because the anonymous deny should have no effect on the authenticated ACL check, so it checks the pattern based.
-    QCOMPARE(aclTree.findPermission(splitToVector("one/Jheronimus/three", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
+    const uint64_t increments = 2000000;
+    std::array<DerivableCounter, 2> counters;
+    std::atomic<bool> done = false;
 
-    // The fixed-strings deny for 'santaclause' should override the pattern based ReadWrite.
-    QCOMPARE(aclTree.findPermission(splitToVector("one/santaclause/three", '/'), AclGrant::Read, "santaclause", "clientid"), AuthResult::acl_denied);
+    auto writer = [&](DerivableCounter &counter) {
+        for (uint64_t i = 0; i < increments; i++)
+            counter.inc();
+    };
 
-    aclTree.addTopic("some/thing", AclGrant::ReadWrite, AclTopicType::Strings, "Rembrandt");
-    aclTree.addTopic("some/thing", AclGrant::ReadWrite, AclTopicType::Patterns);
+    std::thread w1(writer, std::ref(counters[0]));
+    std::thread w2(writer, std::ref(counters[1]));
 
-    QCOMPARE(aclTree.findPermission(splitToVector("one/Jheronimus/three", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/Theo/three", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::acl_denied);
+    bool monotonic = true;
+    std::thread reader([&]() {
+        uint64_t last = 0;
 
-    QCOMPARE(aclTree.findPermission(splitToVector("a/Jheronimus/c", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/NotJheronimus/c", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/Jheronimus/c", '/'), AclGrant::Write, "Jheronimus", "clientid"), AuthResult::acl_denied);
+        while (!done)
+        {
+            const uint64_t cur = counters[0].get();
+            monotonic &= cur >= last;
+            last = cur;
 
-    QCOMPARE(aclTree.findPermission(splitToVector("d/Jheronimus/f", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("d/Jheronimus/f/A", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("d/Jheronimus/f/A/B", '/'), AclGrant::Read, "Jheronimus", "clientid"), AuthResult::success);
+            counters[0].getPerSecond();
+        }
+    });
 
-    // Repeat the test, but now with a user for which there is also an unrelated user specific ACL.
+    w1.join();
+    w2.join();
+    done = true;
+    reader.join();
 
-    QCOMPARE(aclTree.findPermission(splitToVector("one/Rembrandt/three", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/Theo/three", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::acl_denied);
+    QVERIFY(monotonic);
+    QCOMPARE(counters[0].get(), increments);
+    QCOMPARE(counters[1].get(), increments);
 
-    QCOMPARE(aclTree.findPermission(splitToVector("a/Rembrandt/c", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/NotRembrandt/c", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/Rembrandt/c", '/'), AclGrant::Write, "Rembrandt", "clientid"), AuthResult::acl_denied);
+    counters[1].inc(10);
 
-    QCOMPARE(aclTree.findPermission(splitToVector("d/Rembrandt/f", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("d/Rembrandt/f/A", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("d/Rembrandt/f/A/B", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
+    DerivableCounterSum sum;
+    for (DerivableCounter &c : counters)
+        sum.add(c);
 
-    QCOMPARE(aclTree.findPermission(splitToVector("Rembrandt", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("Rembrandt", '/'), AclGrant::Write, "Rembrandt", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("Rembrandt/wer", '/'), AclGrant::Read, "Rembrandt", "clientid"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("Rembrandt/eee", '/'), AclGrant::Write, "Rembrandt", "clientid"), AuthResult::success);
+    QCOMPARE(sum.total, increments * 2 + 10);
+    QVERIFY(sum.perSecond > 0);
 
+    // Nothing happened since the last time.
+    QCOMPARE(counters[1].getPerSecond(), 0.0);
 }
 
-void MainTests::test_acl_patterns_clientid()
+void MainTests::testLatencyHistogram()
 {
-    AclTree aclTree;
+    for (uint64_t i = 0; i < 16; i++)
+    {
+        MYCASTCOMPARE(LatencyHistogram::getBucket(i), i);
+        MYCASTCOMPARE(LatencyHistogram::getBucketUpperValue(i), i);
+    }
 
-    aclTree.addTopic("one/%c/three", AclGrant::ReadWrite, AclTopicType::Patterns);
-    aclTree.addTopic("a/%c/c", AclGrant::Read, AclTopicType::Patterns);
-    aclTree.addTopic("d/%c/f/#", AclGrant::Read, AclTopicType::Patterns);
+    MYCASTCOMPARE(LatencyHistogram::getBucket(16), 16);
+    MYCASTCOMPARE(LatencyHistogram::getBucket(UINT64_MAX), LATENCY_HISTOGRAM_BUCKETS - 1);
 
-    QCOMPARE(aclTree.findPermission(splitToVector("one/clientid_one/three", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("one/clientid_two/three", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::acl_denied);
+    std::minstd_rand rnd(42);
+    for (int i = 0; i < 100000; i++)
+    {
+        const uint64_t value = rnd() >> (rnd() % 31);
+        const size_t bucket = LatencyHistogram::getBucket(value);
+        const uint64_t upper = LatencyHistogram::getBucketUpperValue(bucket);
 
-    QCOMPARE(aclTree.findPermission(splitToVector("a/clientid_one/c", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/not_clientidone/c", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::acl_denied);
-    QCOMPARE(aclTree.findPermission(splitToVector("a/clientid_one/c", '/'), AclGrant::Write, "foo", "clientid_one"), AuthResult::acl_denied);
+        QVERIFY(bucket < LATENCY_HISTOGRAM_BUCKETS);
+        QVERIFY(upper >= value);
+        QVERIFY(upper - value <= value / 16);
 
-    QCOMPARE(aclTree.findPermission(splitToVector("d/clientid_one/f", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("d/clientid_one/f/A", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
-    QCOMPARE(aclTree.findPermission(splitToVector("d/clientid_one/f/A/B", '/'), AclGrant::Read, "foo", "clientid_one"), AuthResult::success);
+        if (bucket > 0)
+            QVERIFY(LatencyHistogram::getBucketUpperValue(bucket - 1) < value);
+    }
+
+    LatencyHistogram histogram;
+
+    for (uint64_t i = 1; i <= 1000; i++)
+        histogram.record(i);
+
+    LatencyHistogramSnapshot snapshot;
+    snapshot.takeInterval(histogram);
+
+    MYCASTCOMPARE(snapshot.getCount(), 1000);
+    MYCASTCOMPARE(snapshot.getMax(), 1000);
+    QVERIFY(snapshot.getPercentile(50) >= 500 && snapshot.getPercentile(50) <= 500 + 500 / 16);
+    QVERIFY(snapshot.getPercentile(99) >= 990 && snapshot.getPercentile(99) <= 1000);
+    MYCASTCOMPARE(snapshot.getPercentile(100), 1000);
+
+    // The next interval starts empty.
+    histogram.record(20);
+    LatencyHistogramSnapshot snapshot2;
+    snapshot2.takeInterval(histogram);
+    MYCASTCOMPARE(snapshot2.getCount(), 1);
+    MYCASTCOMPARE(snapshot2.getMax(), 20);
+    MYCASTCOMPARE(snapshot2.getPercentile(99.9), 20);
 }
 
 /**
- * @brief MainTests::test_loading_acl_file was created because assertions in it failed when publishing $SYS topics were passed through the ACL
- * layer. That's why it seemingly doesn't do anything.
+ * @brief MainTests::testPublishLatencySampling tests that a sampled publish is recorded once it has been completely written, and not before.
  */
-void MainTests::test_loading_acl_file()
+void MainTests::testPublishLatencySampling()
 {
-    ConfFileTemp aclFile;
-    aclFile.writeLine("topic readwrite one/two");
-    aclFile.closeFile();
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t = std::make_shared<ThreadData>(0, settings, pluginLoader);
 
-    ConfFileTemp confFile;
-    confFile.writeLine("mosquitto_acl_file " + aclFile.getFilePath());
-    confFile.closeFile();
+    ThreadGlobals::assignThreadData(t.get());
+    ThreadGlobals::assignSettings(&settings);
 
-    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+    std::shared_ptr<ThreadData> no_thread;
+    std::shared_ptr<Client> client = std::make_shared<Client>(0, no_thread, nullptr, false, false, nullptr, settings, false);
+    client->setClientProperties(ProtocolVersion::Mqtt5, "latency", "user", true, 60);
 
-    cleanup();
-    init(args);
+    Publish pub("a/b", "payload", 1);
+    MqttPacket packet(ProtocolVersion::Mqtt5, pub);
+    packet.setPacketId(1);
+    const uint32_t packetSize = packet.getSizeIncludingNonPresentHeader();
 
-    usleep(1000000);
+    client->writeMqttPacket(packet);
 
-    QVERIFY(true);
+    t->latencySampleStart = std::chrono::steady_clock::now() - std::chrono::milliseconds(5);
+    client->writeMqttPacket(packet);
+    t->latencySampleStart.reset();
+
+    client->writeMqttPacket(packet);
+
+    auto wb = client->writebuf.lock();
+    MYCASTCOMPARE(wb->latencySamples.size(), 1);
+
+    wb->advanceBulk(packetSize * 2 - 1);
+
+    LatencyHistogramSnapshot before;
+    before.takeInterval(t->publishLatency.at(1));
+    MYCASTCOMPARE(before.getCount(), 0);
+
+    wb->advanceBulk(packetSize + 1);
+    MYCASTCOMPARE(wb->latencySamples.size(), 0);
+
+    LatencyHistogramSnapshot after;
+    after.takeInterval(t->publishLatency.at(1));
+    MYCASTCOMPARE(after.getCount(), 1);
+    QVERIFY(after.getMax() >= 5000);
+
+    LatencyHistogramSnapshot qos0;
+    qos0.takeInterval(t->publishLatency.at(0));
+    MYCASTCOMPARE(qos0.getCount(), 0);
 }
 
-#ifndef FMQ_NO_SSE
-void MainTests::test_sse_split()
+void MainTests::testOpenMetricsBuilder()
 {
-    SimdUtils data;
-
-    std::list<std::string> topics;
-    topics.push_back("one/two/threeabcasdfasdf/koe");
-    topics.push_back("/two/threeabcasdfasdf/koe"); // Test empty component.
-    topics.push_back("//two/threeabcasdfasdf/koe"); // Test two empty components.
-    topics.push_back("//1234567890abcde/bla/koe"); // Test two empty components, 15 char topic (one byte short of 16 alignment).
-    topics.push_back("//1234567890abcdef/bla/koe"); // Test two empty components, 16 char topic
-    topics.push_back("//1234567890abcdefg/bla/koe"); // Test two empty components, 17 char topic
-    topics.push_back("//1234567890abcdefg/1234567890abcdefg/koe"); // Test two empty components, two 17 char topics
-    topics.push_back("//1234567890abcdef/1234567890abcdefg/koe"); // Test two empty components, 16 and 17 char
-    topics.push_back("//1234567890abcdef/1234567890abcdefg/koe/");
-    topics.push_back("//1234567890abcdef/1234567890abcdefg/koe//");
-    topics.push_back("//1234567890abcdef/1234567890abcdef/");
-    topics.push_back("/");
-    topics.push_back("");
+    std::string name;
+    std::string labels;
+
+    QVERIFY(OpenMetricsBuilder::sysTopicToMetric("$SYS/broker/threads/3/drift/latest__ms", name, labels));
+    QCOMPARE(name, "flashmq_broker_threads_drift_latest_ms");
+    QCOMPARE(labels, "thread=\"3\"");
+
+    QVERIFY(OpenMetricsBuilder::sysTopicToMetric("$SYS/broker/retained messages/count", name, labels));
+    QCOMPARE(name, "flashmq_broker_retained_messages_count");
+    QVERIFY(labels.empty());
+
+    QVERIFY(OpenMetricsBuilder::sysTopicToMetric("$SYS/broker/bridge/my\"bridge/connected", name, labels));
+    QCOMPARE(name, "flashmq_broker_bridge_connected");
+    QCOMPARE(labels, "bridge=\"my\\\"bridge\"");
+
+    QVERIFY(!OpenMetricsBuilder::sysTopicToMetric("broker/clients/total", name, labels));
+
+    OpenMetricsBuilder builder;
+    builder.add("$SYS/broker/threads/0/loop/max_duration__us", 10);
+    builder.add("$SYS/broker/clients/total", 5);
+    builder.add("$SYS/broker/threads/1/loop/max_duration__us", 20);
+    builder.addIfNumeric("$SYS/broker/bridge/one/connected", "1");
+    builder.addIfNumeric("$SYS/broker/bridge/one/connection_status", "Connected");
+    builder.addIfNumeric("$SYS/broker/bridge/one/nan", "nan");
+    builder.addIfNumeric("$SYS/broker/bridge/one/inf", "-inf");
+    builder.addIfNumeric("$SYS/broker/bridge/one/infinity", "INFINITY");
+    builder.add("$SYS/broker/load/messages/received/total", 7, MetricType::Counter);
+    builder.add("$SYS/broker/threads/0/slow_tasks/count", 3, MetricType::Counter);
+
+    const std::string expected =
+        "# TYPE flashmq_broker_bridge_connected gauge\n"
+        "flashmq_broker_bridge_connected{bridge=\"one\"} 1\n"
+        "# TYPE flashmq_broker_clients_total gauge\n"
+        "flashmq_broker_clients_total 5\n"
+        "# TYPE flashmq_broker_load_messages_received counter\n"
+        "flashmq_broker_load_messages_received_total 7\n"
+        "# TYPE flashmq_broker_threads_loop_max_duration_us gauge\n"
+        "flashmq_broker_threads_loop_max_duration_us{thread=\"0\"} 10\n"
+        "flashmq_broker_threads_loop_max_duration_us{thread=\"1\"} 20\n"
+        "# TYPE flashmq_broker_threads_slow_tasks_count counter\n"
+        "flashmq_broker_threads_slow_tasks_count_total{thread=\"0\"} 3\n"
+        "# EOF\n";
+
+    QCOMPARE(builder.render(), expected);
+
+    builder.clear();
+    QCOMPARE(builder.render(), "# EOF\n");
+
+    std::shared_ptr<const std::string> snapshot = std::make_shared<const std::string>(expected);
+
+    const std::string ok = MetricsConnection::generateResponse("GET /metrics?x=y HTTP/1.1\r\nHost: localhost\r\n\r\n", snapshot);
+    QVERIFY(startsWith(ok, "HTTP/1.1 200 OK\r\n"));
+    QVERIFY(ok.find("Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n") != std::string::npos);
+    QVERIFY(ok.find("Content-Length: " + std::to_string(expected.length()) + "\r\n") != std::string::npos);
+    QVERIFY(endsWith(ok, "\r\n\r\n" + expected));
+
+    const std::string head = MetricsConnection::generateResponse("HEAD /metrics HTTP/1.1\r\n\r\n", snapshot);
+    QVERIFY(startsWith(head, "HTTP/1.1 200 OK\r\n"));
+    QVERIFY(endsWith(head, "\r\n\r\n"));
+
+    QVERIFY(startsWith(MetricsConnection::generateResponse("GET / HTTP/1.1\r\n\r\n", snapshot), "HTTP/1.1 404 "));
+    QVERIFY(startsWith(MetricsConnection::generateResponse("POST /metrics HTTP/1.1\r\n\r\n", snapshot), "HTTP/1.1 405 "));
+    QVERIFY(startsWith(MetricsConnection::generateResponse("GET /metrics\r\n\r\n", snapshot), "HTTP/1.1 400 "));
+    QVERIFY(startsWith(MetricsConnection::generateResponse("GET /metrics HTTP/1.1\r\n", snapshot), "HTTP/1.1 400 "));
+    QVERIFY(startsWith(MetricsConnection::generateResponse("GET /metrics HTTP/1.1\r\n\r\n", nullptr), "HTTP/1.1 503 "));
+}
 
-    for (const std::string &t : topics)
+/**
+ * @brief MainTests::testMetricsListener scrapes a 'protocol metrics' listener like Prometheus would.
+ */
+void MainTests::testMetricsListener()
+{
     {
-        std::vector<std::string> output = data.splitTopic(t);
-        QCOMPARE(output, splitToVector(t, '/'));
+        ConfFileTemp config;
+        config.writeLine("listen {");
+        config.writeLine("  protocol metrics");
+        config.writeLine("}");
+        config.closeFile();
+
+        ConfigFileParser parser(config.getFilePath());
+        try
+        {
+            parser.loadFile(false);
+            FMQ_FAIL("A metrics listener without port should not be accepted");
+        }
+        catch (ConfigFileException&)
+        {
+            /* Good! This is where we want to end up in */
+        }
     }
-}
-#endif
 
-void MainTests::test_validUtf8Generic()
-{
-    char m[16];
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("listen {");
+    confFile.writeLine("  protocol mqtt");
+    confFile.writeLine("  port 21883");
+    confFile.writeLine("}");
+    confFile.writeLine("listen {");
+    confFile.writeLine("  protocol metrics");
+    confFile.writeLine("  port 21900");
+    confFile.writeLine("  inet_protocol ip4");
+    confFile.writeLine("}");
+    confFile.closeFile();
 
-    QVERIFY(isValidUtf8Generic(""));
-    QVERIFY(isValidUtf8Generic("ƀ"));
-    QVERIFY(isValidUtf8Generic("Hello"));
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
 
-    std::memset(m, 0, 16);
-    QVERIFY(!isValidUtf8Generic(std::string(m, 16)));
+    cleanup();
+    init(args);
 
-    QVERIFY(isValidUtf8Generic("Straƀe")); // two byte chars
-    QVERIFY(isValidUtf8Generic("StraƀeHelloHelloHelloHelloHelloHello")); // two byte chars
-    QVERIFY(isValidUtf8Generic("HelloHelloHelloHelloHelloHelloHelloHelloStraƀeHelloHelloHelloHelloHelloHello")); // two byte chars
+    FlashMQTestClient client;
+    client.start();
+    client.connectClient(ProtocolVersion::Mqtt5);
 
-    std::memset(m, 0, 16);
-    m[0] = 'a';
-    m[1] = 13; // is \r
-    QVERIFY(!isValidUtf8Generic(std::string(m, 16)));
+    auto scrape = [](const std::string &request) {
+        int fd = check<std::runtime_error>(socket(AF_INET, SOCK_STREAM, 0));
+        FileCloser fd_closer(fd);
 
-    const std::string unicode_ballet_shoes("🩰");
-    QVERIFY(unicode_ballet_shoes.length() == 4);
-    QVERIFY(isValidUtf8Generic(unicode_ballet_shoes));
+        struct timeval timeout;
+        timeout.tv_sec = 5;
+        timeout.tv_usec = 0;
+        check<std::runtime_error>(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
 
-    const std::string unicode_ballot_box("☐");
-    QVERIFY(unicode_ballot_box.length() == 3);
-    QVERIFY(isValidUtf8Generic(unicode_ballot_box));
+        BindAddr bindAddr = getBindAddr(AF_INET, "127.0.0.1", 21900);
+        check<std::runtime_error>(connect(fd, bindAddr.p.get(), bindAddr.len));
+        check<std::runtime_error>(write(fd, request.data(), request.length()));
 
-    std::memset(m, 0, 16);
-    m[0] = 0b11000001; // Start 2 byte char
-    m[1] = 0b00000001; // Next byte doesn't start with 1, which is wrong
-    std::string a(m, 2);
-    QVERIFY(!isValidUtf8Generic(a));
+        std::string response;
+        char buf[4096];
+        ssize_t n = 0;
+        while ((n = check<std::runtime_error>(read(fd, buf, sizeof(buf)))) > 0)
+        {
+            response.append(buf, n);
+        }
 
-    std::memset(m, 0, 16);
-    m[0] = 0b11100001; // Start 3 byte char
-    m[1] = 0b10100001;
-    m[2] = 0b00000001; // Next byte doesn't start with 1, which is wrong
-    std::string b(m, 3);
-    QVERIFY(!isValidUtf8Generic(b));
+        return response;
+    };
 
-    std::memset(m, 0, 16);
-    m[0] = 0b11110001; // Start 4 byte char
-    m[1] = 0b10100001;
-    m[2] = 0b10100001;
-    m[3] = 0b00000001; // Next byte doesn't start with 1, which is wrong
-    std::string c(m, 4);
-    QVERIFY(!isValidUtf8Generic(c));
+    const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
 
-    std::memset(m, 0, 16);
-    m[0] = 0b11110001; // Start 4 byte char
-    m[1] = 0b10100001;
-    m[2] = 0b00100001; // Doesn't start with 1: invalid.
-    m[3] = 0b10000001;
-    std::string d(m, 4);
-    QVERIFY(!isValidUtf8Generic(d));
+    // The snapshot is made when the stats are published, which is done at startup, but in a worker thread.
+    std::string response;
+    for (int i = 0; i < 50; i++)
+    {
+        response = scrape(request);
 
-    // Upper ASCII, invalid
-    std::memset(m, 0, 16);
-    m[0] = 127;
-    std::string e(m, 1);
-    QVERIFY(!isValidUtf8Generic(e));
-}
+        if (!startsWith(response, "HTTP/1.1 503 "))
+            break;
 
-#ifndef FMQ_NO_SSE
-void MainTests::test_validUtf8Sse()
-{
-    SimdUtils data;
+        usleep(100000);
+    }
 
-    char m[16];
+    QVERIFY(startsWith(response, "HTTP/1.1 200 OK\r\n"));
+    QVERIFY(endsWith(response, "# EOF\n"));
+    QVERIFY(response.find("\nflashmq_broker_subscriptions_count ") != std::string::npos);
+    QVERIFY(response.find("\nflashmq_broker_memory_accounted_total_bytes ") != std::string::npos);
+    QVERIFY(response.find("\nflashmq_broker_latency_publish_qos1_p99_us ") != std::string::npos);
+    QVERIFY(response.find("\nflashmq_broker_threads_drift_latest_ms{thread=\"0\"} ") != std::string::npos);
+    QVERIFY(response.find("\n# TYPE flashmq_broker_load_messages_received counter\n") != std::string::npos);
+    QVERIFY(response.find("\nflashmq_broker_load_messages_received_total ") != std::string::npos);
 
-    QVERIFY(data.isValidUtf8(""));
-    QVERIFY(data.isValidUtf8("ƀ"));
-    QVERIFY(data.isValidUtf8("Hello"));
+    QVERIFY(startsWith(scrape("GET /nothing HTTP/1.1\r\n\r\n"), "HTTP/1.1 404 "));
 
-    std::memset(m, 0, 16);
-    QVERIFY(!data.isValidUtf8(std::string(m, 16)));
+    // Connections that don't send a request are kept until their timeout, but only so many.
+    {
+        auto connectIdle = [](std::vector<std::unique_ptr<FileCloser>> &fds) {
+            int fd = check<std::runtime_error>(socket(AF_INET, SOCK_STREAM, 0));
+            fds.push_back(std::make_unique<FileCloser>(fd));
+
+            struct timeval timeout;
+            timeout.tv_sec = 1;
+            timeout.tv_usec = 0;
+            check<std::runtime_error>(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+
+            BindAddr bindAddr = getBindAddr(AF_INET, "127.0.0.1", 21900);
+            check<std::runtime_error>(connect(fd, bindAddr.p.get(), bindAddr.len));
+            return fd;
+        };
 
-    QVERIFY(data.isValidUtf8("Straƀe")); // two byte chars
-    QVERIFY(data.isValidUtf8("StraƀeHelloHelloHelloHelloHelloHello")); // two byte chars
-    QVERIFY(data.isValidUtf8("HelloHelloHelloHelloHelloHelloHelloHelloStraƀeHelloHelloHelloHelloHelloHello")); // two byte chars
+        std::vector<std::unique_ptr<FileCloser>> idle;
 
-    QVERIFY(!data.isValidUtf8("Straƀe#", true));
-    QVERIFY(!data.isValidUtf8("ƀ#", true));
-    QVERIFY(!data.isValidUtf8("#ƀ", true));
-    QVERIFY(!data.isValidUtf8("+", true));
-    QVERIFY(!data.isValidUtf8("🩰+asdfasdfasdf", true));
-    QVERIFY(!data.isValidUtf8("+asdfasdfasdf", true));
+        for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++)
+        {
+            connectIdle(idle);
+        }
 
-    std::memset(m, 0, 16);
-    m[0] = 'a';
-    m[1] = 13; // is \r
-    QVERIFY(!data.isValidUtf8(std::string(m, 16)));
+        // One more is closed right away, instead of waiting for a request.
+        char buf[16];
+        const int fd = connectIdle(idle);
+        FMQ_COMPARE(read(fd, buf, sizeof(buf)), 0);
+    }
 
-    const std::string unicode_ballet_shoes("🩰");
-    QVERIFY(unicode_ballet_shoes.length() == 4);
-    QVERIFY(data.isValidUtf8(unicode_ballet_shoes));
+    // And when they're gone, there's room again.
+    response.clear();
+    for (int i = 0; i < 50 && !startsWith(response, "HTTP/1.1 200 "); i++)
+    {
+        usleep(20000);
+        response = scrape(request);
+    }
+    QVERIFY(startsWith(response, "HTTP/1.1 200 OK\r\n"));
 
-    const std::string unicode_ballot_box("☐");
-    QVERIFY(unicode_ballot_box.length() == 3);
-    QVERIFY(data.isValidUtf8(unicode_ballot_box));
+    // The MQTT listener is unaffected.
+    client.subscribe("one", 0);
+}
 
-    std::memset(m, 0, 16);
-    m[0] = 0b11000001; // Start 2 byte char
-    m[1] = 0b00000001; // Next byte doesn't start with 1, which is wrong
-    std::string a(m, 2);
-    QVERIFY(!data.isValidUtf8(a));
+void MainTests::testLoopPhaseProfiler()
+{
+    LoopPhaseProfiler profiler;
 
-    std::memset(m, 0, 16);
-    m[0] = 0b11100001; // Start 3 byte char
-    m[1] = 0b10100001;
-    m[2] = 0b00000001; // Next byte doesn't start with 1, which is wrong
-    std::string b(m, 3);
-    QVERIFY(!data.isValidUtf8(b));
+    for (uint32_t i = 0; i < LoopPhaseProfiler::sampleInterval * 4; i++)
+    {
+        profiler.startIteration();
+        profiler.mark();
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        profiler.charge(LoopPhase::Read);
+        profiler.charge(LoopPhase::Parse);
+        profiler.finishIteration();
+    }
 
-    std::memset(m, 0, 16);
-    m[0] = 0b11110001; // Start 4 byte char
-    m[1] = 0b10100001;
-    m[2] = 0b10100001;
-    m[3] = 0b00000001; // Next byte doesn't start with 1, which is wrong
-    std::string c(m, 4);
-    QVERIFY(!data.isValidUtf8(c));
+    LatencyHistogramSnapshot read;
+    read.takeInterval(profiler.histograms.at(static_cast<size_t>(LoopPhase::Read)));
+    MYCASTCOMPARE(read.getCount(), 4);
+    QVERIFY(read.getPercentile(50) >= 200);
 
-    std::memset(m, 0, 16);
-    m[0] = 0b11110001; // Start 4 byte char
-    m[1] = 0b10100001;
-    m[2] = 0b00100001; // Doesn't start with 1: invalid.
-    m[3] = 0b10000001;
-    std::string d(m, 4);
-    QVERIFY(!data.isValidUtf8(d));
+    LatencyHistogramSnapshot parse;
+    parse.takeInterval(profiler.histograms.at(static_cast<size_t>(LoopPhase::Parse)));
+    MYCASTCOMPARE(parse.getCount(), 4);
+    QVERIFY(parse.getMax() < 200);
+
+    // Phases that didn't happen are not recorded.
+    LatencyHistogramSnapshot write;
+    write.takeInterval(profiler.histograms.at(static_cast<size_t>(LoopPhase::Write)));
+    MYCASTCOMPARE(write.getCount(), 0);
+
+    QCOMPARE(loopPhaseToString(LoopPhase::RetainedMessages), "retained_messages");
+}
 
-    // Upper ASCII, invalid
-    std::memset(m, 0, 16);
-    m[0] = 127;
-    std::string e(m, 1);
-    QVERIFY(!data.isValidUtf8(e));
+void MainTests::testSlowTaskDetection()
+{
+    int runs = 0;
+    auto fast = [&runs]() { runs++; };
+    auto slow = [&runs]() { runs++; std::this_thread::sleep_for(std::chrono::milliseconds(20)); };
+    auto throwing = [&runs]() { runs++; throw std::runtime_error("test"); };
+
+    QVERIFY(!runNamedTask("queued", "fast", fast, std::chrono::milliseconds(10)));
+    QVERIFY(runNamedTask("queued", "slow", slow, std::chrono::milliseconds(10)));
+    QVERIFY(!runNamedTask("queued", "slow", slow, std::chrono::milliseconds(0)));
+    QVERIFY(!runNamedTask("queued", "throwing", throwing, std::chrono::milliseconds(10)));
+    QCOMPARE(runs, 4);
+
+    QueuedTasks tasks;
+    tasks.addTask("fast", fast, 0);
+    tasks.addTask("slow", slow, 0);
+    tasks.addTask("later", slow, 100000);
+
+    MYCASTCOMPARE(tasks.performAll(std::chrono::milliseconds(10)), 1);
+    QCOMPARE(runs, 6);
 }
 
-/**
- * @brief MainTests::test_utf8_nonchars tests the 66 non-chars in unicode, and a bit around them.
- */
-void MainTests::test_utf8_nonchars()
+void MainTests::testTaskQueue()
 {
-    SimdUtils simd_utils;
+    std::vector<int> order;
 
-    for (int i = 0x80; i < 0x90; i++)
     {
-        std::string c;
-        c.push_back(0xEF);
-        c.push_back(0xB7);
-        c.push_back(i);
-
-        QVERIFY(isValidUtf8Generic(c));
-        QVERIFY(simd_utils.isValidUtf8(c));
+        InlineTask small("small", [&order]() { order.push_back(1); });
+        QVERIFY(!small.isOnHeap());
+
+        std::array<char, 200> big_capture {};
+        big_capture[0] = 2;
+        InlineTask big("big", [&order, big_capture]() { order.push_back(big_capture[0]); });
+        QVERIFY(big.isOnHeap());
+
+        InlineTask moved(std::move(big));
+        QVERIFY(!big);
+        QVERIFY(moved);
+        QCOMPARE(std::string(moved.getName()), std::string("big"));
+
+        small();
+        moved();
+        QVERIFY(order == std::vector<int>({1, 2}));
     }
 
-    // The invalid ones
-    for (int i = 0x90; i <= 0xAF; i++)
+    // Destruction of captured state, both inline and on the heap.
     {
-        std::string c;
-        c.push_back(0xEF);
-        c.push_back(0xB7);
-        c.push_back(i);
+        auto counted = std::make_shared<int>(0);
 
-        QVERIFY(!isValidUtf8Generic(c));
-        QVERIFY(!simd_utils.isValidUtf8(c));
+        {
+            TaskQueue queue;
+            queue.push(InlineTask("inline", [counted]() {}));
+            std::array<char, 200> padding {};
+            queue.push(InlineTask("heap", [counted, padding]() {}));
+            MYCASTCOMPARE(counted.use_count(), 3);
+        }
+
+        MYCASTCOMPARE(counted.use_count(), 1);
     }
 
-    for (int i = 0xB0; i < 0xB5; i++)
+    // More than fits in the ring: the rest goes into the overflow list, and the order is kept.
     {
-        std::string c;
-        c.push_back(0xEF);
-        c.push_back(0xB7);
-        c.push_back(i);
+        TaskQueue queue;
+        std::vector<int> results;
+        const int total = 3000;
 
-        QVERIFY(isValidUtf8Generic(c));
-        QVERIFY(simd_utils.isValidUtf8(c));
-    }
+        for (int i = 0; i < total; i++)
+            queue.push(InlineTask("n", [&results, i]() { results.push_back(i); }));
 
-    // Now the last two code points of the multilingual planes
+        std::vector<InlineTask> tasks;
+        int rounds = 0;
+        bool more = true;
+        while (more)
+        {
+            more = queue.takeAll(tasks);
+            for (InlineTask &t : tasks)
+                t();
+            tasks.clear();
+            rounds++;
+        }
+
+        QVERIFY(rounds > 1);
+        MYCASTCOMPARE(results.size(), total);
+        for (int i = 0; i < total; i++)
+            QCOMPARE(results.at(i), i);
+
+        QVERIFY(!queue.takeAll(tasks));
+        QVERIFY(tasks.empty());
+    }
 
+    // Multiple producers: nothing is lost, and each producer's tasks stay in order.
     {
-        std::string s;
-        s.clear(); s.push_back(0xEF); s.push_back(0xBF); s.push_back(0xBE);
-        QVERIFY(!isValidUtf8Generic(s));
-        QVERIFY(!simd_utils.isValidUtf8(s));
+        TaskQueue queue;
+        const int producers = 4;
+        const int per_producer = 20000;
+        std::vector<int> last_seen(producers, -1);
+        bool in_order = true;
+        int received = 0;
+        std::atomic<int> done {0};
+
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++)
+        {
+            threads.emplace_back([&, p]() {
+                for (int i = 0; i < per_producer; i++)
+                {
+                    queue.push(InlineTask("n", [&, p, i]() {
+                        if (last_seen.at(p) + 1 != i)
+                            in_order = false;
+                        last_seen.at(p) = i;
+                        received++;
+                    }));
+                }
+                done++;
+            });
+        }
 
-        s.clear(); s.push_back(0xEF); s.push_back(0xBF); s.push_back(0xBF);
-        QVERIFY(!isValidUtf8Generic(s));
-        QVERIFY(!simd_utils.isValidUtf8(s));
+        std::vector<InlineTask> tasks;
+        for(;;)
+        {
+            const bool finished = done.load() == producers;
+            queue.takeAll(tasks);
+            for (InlineTask &t : tasks)
+                t();
+            if (finished && tasks.empty())
+                break;
+            tasks.clear();
+        }
 
-        // Adjacent one that is valid.
-        s.clear(); s.push_back(0xEF); s.push_back(0xBF); s.push_back(0xBD);
-        QVERIFY(isValidUtf8Generic(s));
-        QVERIFY(simd_utils.isValidUtf8(s));
+        for (std::thread &t : threads)
+            t.join();
+
+        QVERIFY(in_order);
+        QCOMPARE(received, producers * per_producer);
     }
+}
 
+void MainTests::testLoggerRepeatedMessages()
+{
+    FlashMQTempDir tmpdir;
+    const std::string path = tmpdir.getPath() / "flashmq.log";
+
+    // Start with a fresh logger, and make sure everything is written to the file at the end.
+    Logger::getInstance();
+    Logger::stopAndReset();
+
+    Logger *logger = Logger::getInstance();
+    logger->setLogPath(path);
+    logger->queueReOpen();
+    logger->noLongerLogToStd();
+
+    for (int i = 0; i < 100; i++)
+        logger->log(LOG_NOTICE) << "The same line.";
+    logger->log(LOG_NOTICE) << "A different line.";
+
+    // More than fits in a thread's ring, to also use the overflow.
+    const int nr_of_threads = 4;
+    const int lines_per_thread = 3000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nr_of_threads; t++)
     {
-        std::string s;
-        s.clear(); s.push_back(0xF0); s.push_back(0x9F); s.push_back(0xBF); s.push_back(0xBE);
-        QVERIFY(!isValidUtf8Generic(s));
-        QVERIFY(!simd_utils.isValidUtf8(s));
+        threads.emplace_back([t, logger]() {
+            for (int i = 0; i < lines_per_thread; i++)
+                logger->log(LOG_NOTICE) << "Thread " << t << " line " << i << ".";
+        });
+    }
 
-        s.clear(); s.push_back(0xF0); s.push_back(0x9F); s.push_back(0xBF); s.push_back(0xBF);
-        QVERIFY(!isValidUtf8Generic(s));
-        QVERIFY(!simd_utils.isValidUtf8(s));
+    for (std::thread &t : threads)
+        t.join();
 
-        // Adjacent one that is valid.
-        s.clear(); s.push_back(0xF0); s.push_back(0x9F); s.push_back(0xBF); s.push_back(0xBD);
-        QVERIFY(isValidUtf8Generic(s));
-        QVERIFY(simd_utils.isValidUtf8(s));
+    Logger::stopAndReset();
+
+    std::ifstream infile(path);
+    std::string line;
+    int same_count = 0;
+    bool summary_seen = false;
+    bool different_after_summary = false;
+    std::vector<int> last_seen(nr_of_threads, -1);
+    bool in_order = true;
+    int thread_lines = 0;
+
+    while (std::getline(infile, line))
+    {
+        if (strContains(line, "The same line."))
+            same_count++;
+        else if (strContains(line, "[NOTICE] ") && strContains(line, "] Last message repeated 99 times."))
+            summary_seen = true;
+        else if (strContains(line, "A different line."))
+            different_after_summary = summary_seen;
+        else if (strContains(line, "Thread "))
+        {
+            int t = -1;
+            int i = -1;
+            const std::string_view text = std::string_view(line).substr(line.find("Thread "));
+            QVERIFY(sscanf(text.data(), "Thread %d line %d.", &t, &i) == 2);
+            if (last_seen.at(t) + 1 != i)
+                in_order = false;
+            last_seen.at(t) = i;
+            thread_lines++;
+        }
     }
 
-    // TODO: there are more planes to check, but programming that out means encoding in UTF8.
+    QCOMPARE(same_count, 1);
+    QVERIFY(summary_seen);
+    QVERIFY(different_after_summary);
+    QVERIFY(in_order);
+    QCOMPARE(thread_lines, nr_of_threads * lines_per_thread);
 }
 
 /**
- * @brief MainTests::test_utf8_overlong tests multiple representations of '/' (ASCII 0xAF).
- *
- * U+002F = c0 af
- * U+002F = e0 80 af
- * U+002F = f0 80 80 af
+ * @brief MainTests::testLoggerOrderAcrossThreads has two threads take turns logging, so each line is logged after the previous one. They
+ * have to end up in the log in that order, although they're in different rings.
  */
-void MainTests::test_utf8_overlong()
+void MainTests::testLoggerOrderAcrossThreads()
 {
-    SimdUtils simd_utils;
+    FlashMQTempDir tmpdir;
+    const std::string path = tmpdir.getPath() / "flashmq.log";
+
+    Logger::getInstance();
+    Logger::stopAndReset();
+
+    Logger *logger = Logger::getInstance();
+    logger->setLogPath(path);
+    logger->queueReOpen();
+    logger->noLongerLogToStd();
 
+    const int turns = 5000;
+    std::atomic<int> turn = 0;
+
+    auto player = [&turn, logger](int me) {
+        for (int i = me; i < turns; i += 2)
+        {
+            while (turn.load(std::memory_order_acquire) != i)
+            {
+                std::this_thread::yield();
+            }
+
+            logger->log(LOG_NOTICE) << "Turn " << i << ".";
+            turn.store(i + 1, std::memory_order_release);
+        }
+    };
+
+    std::thread even(player, 0);
+    std::thread odd(player, 1);
+    even.join();
+    odd.join();
+
+    Logger::stopAndReset();
+
+    std::ifstream infile(path);
+    std::string line;
+    int expected = 0;
+    bool in_order = true;
+
+    while (std::getline(infile, line))
     {
-        std::string two;
-        two.push_back(0xc0);
-        two.push_back(0xaf);
-        QVERIFY(!isValidUtf8Generic(two));
-        QVERIFY(!simd_utils.isValidUtf8(two));
+        const size_t pos = line.find("Turn ");
+        if (pos == std::string::npos)
+            continue;
+
+        int i = -1;
+        QVERIFY(sscanf(line.c_str() + pos, "Turn %d.", &i) == 1);
+
+        if (i != expected)
+            in_order = false;
+        expected = i + 1;
     }
 
+    QVERIFY(in_order);
+    QCOMPARE(expected, turns);
+}
+
+void MainTests::testClientRebalancer()
+{
+    const uint64_t min = ClientRebalancer::minBytesPerSecond;
+
+    QVERIFY(!ClientRebalancer::decide({}));
+    QVERIFY(!ClientRebalancer::decide({min * 10}));
+    QVERIFY(!ClientRebalancer::decide({min - 1, 0, 0}));
+    QVERIFY(!ClientRebalancer::decide({min * 10, min * 9, min * 8}));
+
     {
-        std::string three;
-        three.push_back(0xe0);
-        three.push_back(0x80);
-        three.push_back(0xaf);
-        QVERIFY(!isValidUtf8Generic(three));
-        QVERIFY(!simd_utils.isValidUtf8(three));
+        auto move = ClientRebalancer::decide({min, min * 10, min * 2, min * 3});
+        QVERIFY(move);
+        MYCASTCOMPARE(move->from, 1);
+        MYCASTCOMPARE(move->to, 0);
+        QCOMPARE(move->bytesPerSecond, min * 9 / 2);
     }
 
     {
-        std::string four;
-        four.push_back(0xf0);
-        four.push_back(0x80);
-        four.push_back(0x80);
-        four.push_back(0xaf);
-        QVERIFY(!isValidUtf8Generic(four));
-        QVERIFY(!simd_utils.isValidUtf8(four));
+        ClientRebalancer rebalancer;
+        auto now = std::chrono::steady_clock::now();
+
+        QVERIFY(!rebalancer.update({1000, 1000}, now));
+
+        now += std::chrono::seconds(10);
+        auto move = rebalancer.update({1000, 1000 + min * 40}, now);
+        QVERIFY(move);
+        MYCASTCOMPARE(move->from, 1);
+        MYCASTCOMPARE(move->to, 0);
+        QCOMPARE(move->bytesPerSecond, min * 2);
+
+        // A change in thread count starts over.
+        now += std::chrono::seconds(10);
+        QVERIFY(!rebalancer.update({1000, 1000 + min * 80, 0}, now));
     }
 }
 
-void MainTests::test_utf8_compare_implementation()
+void MainTests::testClientMigration()
 {
-    SimdUtils simd_utils;
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("thread_count 2");
+    confFile.writeLine("listen {");
+    confFile.writeLine("  protocol mqtt");
+    confFile.writeLine("  port 21883");
+    confFile.writeLine("}");
+    confFile.closeFile();
 
-    // Just something to look at. It prefixes lines with a red cross when the checker returns false. Note that this means you
-    // don't see the difference between invalid UTF8 and valid but invalid for MQTT.
-    FlashMQTempDir tmpdir;
-    std::ofstream outfile(tmpdir.getPath() / "flashmq_utf8_test_result.txt", std::ios::binary);
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
 
-    int line_count = 0;
-    std::ifstream infile("UTF-8-test.txt", std::ios::binary);
-    for(std::string line; getline(infile, line ); )
-    {
-        const bool a = isValidUtf8Generic(line);
-        const bool b = simd_utils.isValidUtf8(line);
+    cleanup();
+    init(args);
 
-        QVERIFY(a == b);
+    const std::vector<std::shared_ptr<ThreadData>> threads = mainApp->getThreads();
+    MYCASTCOMPARE(threads.size(), 2);
 
-        if (a)
-            outfile << "\u2705 ";
-        else
-            outfile << "\u274C ";
+    FlashMQTestClient receiver;
+    receiver.start();
+    receiver.connectClient(ProtocolVersion::Mqtt5);
+    receiver.subscribe("migration/#", 1);
 
-        outfile << line << std::endl;
+    FlashMQTestClient sender;
+    sender.start();
+    sender.connectClient(ProtocolVersion::Mqtt5);
 
-        line_count++;
-    }
+    auto migrate = [&](const std::string &clientid) {
+        std::shared_ptr<Client> client = mainApp->getStore()->lockSession(clientid)->makeSharedClient();
+        QVERIFY(client);
 
-    QVERIFY(line_count > 40);
+        std::shared_ptr<ThreadData> from = client->lockThreadData();
+        std::shared_ptr<ThreadData> to = from == threads.at(0) ? threads.at(1) : threads.at(0);
+        const uint64_t migrated_before = from->clientsMigrated.get();
+
+        from->queueClientMigration(client, to);
+
+        int n = 0;
+        while (client->lockThreadData() != to || from->clientsMigrated.get() == migrated_before)
+        {
+            if (n++ > 500)
+                throw std::runtime_error("Waiting for client migration timed out.");
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        QCOMPARE(from->clientsMigrated.get(), migrated_before + 1);
+    };
+
+    auto publishAndCheck = [&](int count) {
+        receiver.clearReceivedLists();
+
+        for (int i = 0; i < count; i++)
+            sender.publish("migration/test", "payload " + std::to_string(i), i % 2);
+
+        receiver.waitForMessageCount(count);
+
+        auto ro = receiver.receivedObjects.lock();
+        QCOMPARE(ro->receivedPublishes.size(), static_cast<size_t>(count));
+
+        for (int i = 0; i < count; i++)
+            QCOMPARE(ro->receivedPublishes.at(i).getPayloadCopy(), "payload " + std::to_string(i));
+    };
+
+    publishAndCheck(4);
+
+    migrate(receiver.getClientId());
+    publishAndCheck(10);
+
+    migrate(sender.getClientId());
+    publishAndCheck(10);
+
+    // And back again.
+    migrate(receiver.getClientId());
+    publishAndCheck(10);
+}
+
+/**
+ * @brief MainTests::testClientMigrationWithQueuedRemoval tests that a removal that was queued on the old thread, or was about to be, isn't
+ * lost when the client is migrated.
+ */
+void MainTests::testClientMigrationWithQueuedRemoval()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("thread_count 2");
+    confFile.writeLine("listen {");
+    confFile.writeLine("  protocol mqtt");
+    confFile.writeLine("  port 21883");
+    confFile.writeLine("}");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    const std::vector<std::shared_ptr<ThreadData>> threads = mainApp->getThreads();
+    MYCASTCOMPARE(threads.size(), 2);
+
+    FlashMQTestClient queuedRemoval;
+    queuedRemoval.start();
+    queuedRemoval.connectClient(ProtocolVersion::Mqtt5);
+
+    FlashMQTestClient markedRemoval;
+    markedRemoval.start();
+    markedRemoval.connectClient(ProtocolVersion::Mqtt5);
+
+    auto test = [&](const std::string &clientid, bool queueOnOldThread) {
+        std::shared_ptr<Client> client = mainApp->getStore()->lockSession(clientid)->makeSharedClient();
+        QVERIFY(client);
+
+        const int fd = client->getFd();
+        std::shared_ptr<ThreadData> from = client->lockThreadData();
+        std::shared_ptr<ThreadData> to = from == threads.at(0) ? threads.at(1) : threads.at(0);
+
+        std::atomic<bool> done = false;
+        std::atomic<bool> could_migrate = true;
+
+        // Migrating directly, like the migration had started when another thread decided the client had to go.
+        from->addImmediateTask("test_migration", [&, client]() mutable {
+            if (queueOnOldThread)
+                from->removeClientQueued(client);
+            else
+                client->setRemovalQueued();
+
+            could_migrate = client->canMigrate();
+            from->migrateClient(client, to);
+            done = true;
+        });
+
+        int n = 0;
+        while (!done || from->getClient(fd) || to->getClient(fd))
+        {
+            if (n++ > 500)
+                throw std::runtime_error("Waiting for the client to be removed timed out.");
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        QVERIFY(!could_migrate);
+        QVERIFY(client->lockThreadData() == to);
+    };
+
+    test(queuedRemoval.getClientId(), true);
+    test(markedRemoval.getClientId(), false);
+}
+
+void MainTests::testSubscriptionFilterCovers()
+{
+    QVERIFY(subscriptionFilterCovers(splitTopic("one/two"), splitTopic("one/two")));
+    QVERIFY(subscriptionFilterCovers(splitTopic("one/#"), splitTopic("one")));
+    QVERIFY(subscriptionFilterCovers(splitTopic("one/#"), splitTopic("one/two/three")));
+    QVERIFY(subscriptionFilterCovers(splitTopic("one/#"), splitTopic("one/+/three")));
+    QVERIFY(subscriptionFilterCovers(splitTopic("one/#"), splitTopic("one/two/#")));
+    QVERIFY(subscriptionFilterCovers(splitTopic("#"), splitTopic("one/two")));
+    QVERIFY(subscriptionFilterCovers(splitTopic("one/+/three"), splitTopic("one/two/three")));
+    QVERIFY(subscriptionFilterCovers(splitTopic("one/+/three"), splitTopic("one/+/three")));
+    QVERIFY(subscriptionFilterCovers(splitTopic("$SYS/#"), splitTopic("$SYS/broker")));
+
+    QVERIFY(!subscriptionFilterCovers(splitTopic("one/two"), splitTopic("one/two/three")));
+    QVERIFY(!subscriptionFilterCovers(splitTopic("one/two/three"), splitTopic("one/two")));
+    QVERIFY(!subscriptionFilterCovers(splitTopic("one/two/three"), splitTopic("one/+/three")));
+    QVERIFY(!subscriptionFilterCovers(splitTopic("one/+/three"), splitTopic("one/#")));
+    QVERIFY(!subscriptionFilterCovers(splitTopic("one/+"), splitTopic("one/two/three")));
+    QVERIFY(!subscriptionFilterCovers(splitTopic("one/+"), splitTopic("one")));
+    QVERIFY(!subscriptionFilterCovers(splitTopic("one/#"), splitTopic("two/one")));
+    QVERIFY(!subscriptionFilterCovers(splitTopic("#"), splitTopic("$SYS/broker")));
+    QVERIFY(!subscriptionFilterCovers(splitTopic("+/broker"), splitTopic("$SYS/broker")));
 }
-#endif
 
 void MainTests::testPacketInt16Parse()
 {
@@ -1022,17 +3139,17 @@ void MainTests::testSavingSessions()
         std::shared_ptr<SubscriptionStore> store2(new SubscriptionStore());
         store2->loadSessionsAndSubscriptions(dbpath);
 
-        MYCASTCOMPARE(store->sessionsById.size(), 2);
-        MYCASTCOMPARE(store2->sessionsById.size(), 2);
+        MYCASTCOMPARE(store->getSessionCount(), 2);
+        MYCASTCOMPARE(store2->getSessionCount(), 2);
 
-        for (auto &pair : store->sessionsById)
+        for (const std::shared_ptr<Session> &ses : store->getAllSessions())
         {
-            std::shared_ptr<Session> &ses = pair.second;
-            std::shared_ptr<Session> &ses2 = store2->sessionsById[pair.first];
+            std::shared_ptr<Session> ses2 = store2->lockSession(ses->getClientId());
+            QVERIFY(ses2);
             MutexLocked<Session::QoSData> qos_locked = ses->qos.lock();
             MutexLocked<Session::QoSData> qos_locked2 = ses2->qos.lock();
 
-            QCOMPARE(pair.first, ses2->getClientId());
+            QCOMPARE(ses->getClientId(), ses2->getClientId());
 
             QCOMPARE(ses->username, ses2->username);
             QCOMPARE(ses->client_id, ses2->client_id);
@@ -1096,7 +3213,7 @@ void MainTests::testSavingSessions()
         QVERIFY(retainAsPublishedCount == 1);
         FMQ_VERIFY(withSubscriptionIdentifierCount == 1);
 
-        std::shared_ptr<Session> loadedSes = store2->sessionsById["c1"];
+        std::shared_ptr<Session> loadedSes = store2->lockSession("c1");
         MutexLocked<Session::QoSData> qos_loaded_locked = loadedSes->qos.lock();
         std::shared_ptr<QueuedPublish> queuedPublishLoaded = qos_loaded_locked->qosPacketQueue.popNext();
 
@@ -1255,6 +3372,94 @@ void MainTests::testbufferToMqttPacketsFuzz()
               << parsed_packet_count << ". Protocol errors: " << protocol_error_count << std::endl;
 }
 
+/**
+ * @brief MainTests::testPacketBytesRecycling parses a million small publishes, half of them without giving the byte arrays back to
+ * the thread, and half with. It checks that recycled arrays are really used again, by their data pointer, and reports the rate of both.
+ */
+void MainTests::testPacketBytesRecycling()
+{
+    Logger::getInstance()->setFlags(LogLevel::None, false);
+
+    Settings settings;
+    settings.logLevel = LogLevel::Info;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+    ThreadGlobals::assignThreadData(t.get());
+
+    Authentication auth(settings);
+    ThreadGlobals::assign(&auth);
+
+    std::shared_ptr<Client> dummyClient(new Client(0, t, nullptr, false, false, nullptr, settings, false));
+    dummyClient->setClientProperties(ProtocolVersion::Mqtt311, "dummy", "user1", true, 60);
+    dummyClient->setAuthenticated(true);
+
+    Publish pub("sensors/kitchen/temperature", "21.5", 0);
+    MqttPacket stagingPacket(ProtocolVersion::Mqtt311, pub);
+    CirBuf stagingBuf(1024);
+    stagingPacket.readIntoBuf(stagingBuf);
+    const std::vector<char> oneBatch = [&]() {
+        std::vector<char> one = stagingBuf.readAllToVector();
+        std::vector<char> result;
+        for (int i = 0; i < 100; i++)
+            result.insert(result.end(), one.begin(), one.end());
+        return result;
+    }();
+
+    const size_t packetsPerRun = 500000;
+    CirBuf readBuf(8192);
+    std::vector<MqttPacket> parsedPackets;
+
+    for (const bool recycle : {false, true})
+    {
+        t->packetBytesPool.clear();
+        size_t parsed = 0;
+        size_t reused = 0;
+        std::unordered_set<const char*> pooledBuffers;
+
+        const auto start = std::chrono::steady_clock::now();
+
+        while (parsed < packetsPerRun)
+        {
+            readBuf.write(oneBatch.data(), oneBatch.size());
+
+            pooledBuffers.clear();
+            for (const std::vector<char> &bites : t->packetBytesPool)
+                pooledBuffers.insert(bites.data());
+
+            MqttPacket::bufferToMqttPackets(readBuf, parsedPackets, dummyClient);
+            parsed += parsedPackets.size();
+
+            for (const MqttPacket &packet : parsedPackets)
+            {
+                if (pooledBuffers.count(packet.getBites().data()) > 0)
+                    reused++;
+            }
+
+            for (MqttPacket &packet : parsedPackets)
+            {
+                packet.parsePublishData(dummyClient);
+            }
+
+            if (recycle)
+                t->recyclePacketBytes(parsedPackets);
+
+            parsedPackets.clear();
+        }
+
+        const auto duration = std::chrono::steady_clock::now() - start;
+        const double seconds = std::chrono::duration<double>(duration).count();
+
+        std::cout << std::endl << "Parsed " << parsed << " publishes " << (recycle ? "with" : "without") << " recycling: "
+                  << static_cast<size_t>(parsed / seconds) << " packets/s." << std::endl;
+
+        // Only the first batch finds the pool empty.
+        if (recycle)
+            FMQ_COMPARE(reused, parsed - 100);
+        else
+            FMQ_COMPARE(reused, static_cast<size_t>(0));
+    }
+}
+
 void testDowngradeQoSOnSubscribeHelper(const uint8_t pub_qos, const uint8_t sub_qos)
 {
     std::vector<ProtocolVersion> protocols {ProtocolVersion::Mqtt31, ProtocolVersion::Mqtt311, ProtocolVersion::Mqtt5};
@@ -3081,7 +5286,7 @@ void MainTests::testTopicMatchingInSubscriptionTreeHelper(const std::string &sub
     store.addSubscription(client->getSession(), subscribe_subtopics, 0, false, false, "", 0);
 
     std::vector<ReceivingSubscriber> receivers;
-    store.publishRecursively(publish_subtopics.begin(), publish_subtopics.end(), store.root.get(), receivers, "fakeclientid");
+    store.publishRecursively(publish_subtopics.begin(), publish_subtopics.end(), store.root.get(), receivers, "fakeclientid", publish_topic);
 
     QVERIFY2(std::distance(receivers.begin(), receivers.end()) == match_count, publish_topic.c_str());
 }
@@ -298,6 +298,30 @@ void MainTests::testNoCopy()
     }
 }
 
+void MainTests::testUnmaskWebsocketBytes()
+{
+    const char key[4] = {0x12, 0x34, static_cast<char>(0xAB), static_cast<char>(0xF0)};
+    std::minstd_rand rnd(7);
+
+    for (size_t len = 0; len < 150; len++)
+    {
+        std::vector<char> data(len);
+        for (char &c : data)
+            c = static_cast<char>(rnd());
 
+        for (unsigned int offset = 0; offset < 6; offset++)
+        {
+            std::vector<char> expected(len);
+            for (size_t i = 0; i < len; i++)
+                expected[i] = data[i] ^ key[(offset + i) % 4];
 
+            std::vector<char> result(len);
+            unmaskWebsocketBytes(result.data(), data.data(), len, key, offset);
+            FMQ_COMPARE(result, expected);
 
+            std::vector<char> inPlace(data);
+            unmaskWebsocketBytes(inPlace.data(), inPlace.data(), len, key, offset);
+            FMQ_COMPARE(inPlace, expected);
+        }
+    }
+}
@@ -748,3 +748,126 @@ void MainTests::testWebsocketClose()
         QVERIFY2(false, ex.what());
     }
 }
+
+void MainTests::testWebsocketMaskedFramesAndWriteCoalescing()
+{
+    try
+    {
+        Settings settings;
+        PluginLoader pluginLoader;
+        std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+
+        // Kind of a hack...
+        Authentication auth(settings);
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+        FileCloser listener_closer(listen_socket);
+
+        int optval = 1;
+        check<std::runtime_error>(setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &optval, sizeof(optval)));
+
+        BindAddr bindAddr = getBindAddr(AF_INET, "127.0.0.1", 22123);
+
+        check<std::runtime_error>(bind(listen_socket, bindAddr.p.get(), bindAddr.len));
+        check<std::runtime_error>(listen(listen_socket, 64));
+
+        int client_socket = socket(AF_INET, SOCK_STREAM, 0);
+        int flags = fcntl(listen_socket, F_GETFL);
+        check<std::runtime_error>(fcntl(client_socket, F_SETFL, flags | O_NONBLOCK ));
+
+        std::shared_ptr<Client> c1(new Client(client_socket, t, nullptr, true, false, nullptr, settings, false));
+        std::shared_ptr<Client> client = c1;
+        t->giveClient(std::move(c1));
+
+        ::connect(client_socket, bindAddr.p.get(), bindAddr.len);
+
+        int socket_to_client = accept(listen_socket, nullptr, nullptr);
+        FileCloser socket_to_client_closer(socket_to_client);
+
+        if (socket_to_client < 0)
+            throw std::runtime_error("Couldn't accept socket.");
+
+        flags = fcntl(listen_socket, F_GETFL);
+        check<std::runtime_error>(fcntl(socket_to_client, F_SETFL, flags | O_NONBLOCK ));
+
+        int error = 0;
+        socklen_t optlen = sizeof(int);
+        int count = 0;
+        do
+        {
+            check<std::runtime_error>(getsockopt(client_socket, SOL_SOCKET, SO_ERROR, &error, &optlen));
+        }
+        while(error == EINPROGRESS && count++ < 1000);
+
+        if (error > 0 && error != EINPROGRESS)
+            throw std::runtime_error(strerror(error));
+
+        std::ifstream input("plainwebsocketpacket1_handshake.dat", std::ios::binary);
+        std::vector<unsigned char> websocketstart(std::istreambuf_iterator<char>(input), {});
+
+        {
+            write(socket_to_client, websocketstart.data(), websocketstart.size());
+            client->readFdIntoBuffer();
+            client->writeBufIntoFd();
+            std::vector<char> answer = readFromSocket(socket_to_client, true);
+            std::string answer_string(answer.begin(), answer.end());
+
+            QVERIFY(startsWith(answer_string, "HTTP/1.1 101 Switching Protocols"));
+
+        }
+
+        // We now have an upgraded connection.
+
+        {
+            // Two QoS 0 publishes, long enough to use the vectorized unmasking, in one masked frame.
+            const std::string payload(40, 'p');
+            Publish pub("one/two/three", payload, 0);
+            MqttPacket publishPacket(ProtocolVersion::Mqtt311, pub);
+            CirBuf stagingBuf(1024);
+            publishPacket.readIntoBuf(stagingBuf);
+            publishPacket.readIntoBuf(stagingBuf);
+            const std::vector<char> mqttBytes = stagingBuf.readAllToVector();
+            QVERIFY(mqttBytes.size() < 126);
+
+            const char maskingKey[4] = {0x37, static_cast<char>(0xFA), 0x21, 0x3D};
+
+            std::vector<char> frame;
+            frame.push_back(0x82); // Final fragment, binary
+            frame.push_back(0x80 | mqttBytes.size());
+            frame.insert(frame.end(), maskingKey, maskingKey + 4);
+            for (size_t i = 0; i < mqttBytes.size(); i++)
+                frame.push_back(mqttBytes[i] ^ maskingKey[i % 4]);
+
+            write(socket_to_client, frame.data(), frame.size());
+            pollFd(client_socket, true);
+            client->readFdIntoBuffer();
+
+            std::vector<MqttPacket> packets;
+            client->bufferToMqttPackets(packets, client);
+
+            FMQ_COMPARE(packets.size(), static_cast<size_t>(2));
+            const std::vector<char> onePacket(mqttBytes.begin(), mqttBytes.begin() + mqttBytes.size() / 2);
+            FMQ_COMPARE(packets.at(0).getBites(), onePacket);
+            FMQ_COMPARE(packets.at(1).getBites(), onePacket);
+        }
+
+        {
+            // What's pending in the write buffer goes out in one frame.
+            client->writePingResp();
+            client->writePingResp();
+            client->writePingResp();
+            client->writeBufIntoFd();
+
+            std::vector<char> answer = readFromSocket(socket_to_client, true, 8);
+            const std::vector<char> expected {static_cast<char>(0x82), 6, static_cast<char>(0xD0), 0, static_cast<char>(0xD0), 0, static_cast<char>(0xD0), 0};
+            FMQ_COMPARE(answer, expected);
+        }
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
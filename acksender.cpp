@@ -38,6 +38,14 @@ void AckSender::sendNow()
     const PacketType responseType = qos == 1 ? PacketType::PUBACK : PacketType::PUBREC;
     PubResponse pubAck(this->protocolVersion, responseType, ackCode, packetId);
     MqttPacket response(pubAck);
+
+    // Also the acks of publishes that didn't cause the pause, so they're not sent out of order.
+    if (client->isPausedForBackpressure())
+    {
+        client->holdAckForBackpressure(std::move(response));
+        return;
+    }
+
     client->writeMqttPacket(response);
 }
 
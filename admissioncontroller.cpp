@@ -0,0 +1,87 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#include "admissioncontroller.h"
+
+#include <algorithm>
+#include <cmath>
+
+void AdmissionController::refill(std::chrono::time_point<std::chrono::steady_clock> now)
+{
+    if (now <= lastRefill)
+        return;
+
+    const double seconds = std::chrono::duration<double>(now - lastRefill).count();
+    tokens = std::min(tokens + seconds * rate, std::max(rate, 1.0));
+    lastRefill = now;
+}
+
+void AdmissionController::setMaxRate(uint32_t maxRate)
+{
+    this->maxRate = maxRate;
+    this->rate = maxRate;
+    this->tokens = maxRate;
+    this->lastRefill = std::chrono::steady_clock::now();
+}
+
+/**
+ * @brief AdmissionController::tryAdmit takes a token, if there is one.
+ * @return whether the connection can be accepted now.
+ */
+bool AdmissionController::tryAdmit(std::chrono::time_point<std::chrono::steady_clock> now)
+{
+    if (!enabled())
+        return true;
+
+    refill(now);
+
+    if (tokens < 1.0)
+        return false;
+
+    tokens -= 1.0;
+    return true;
+}
+
+std::chrono::milliseconds AdmissionController::getTimeTillNextToken() const
+{
+    if (tokens >= 1.0 || rate <= 0)
+        return std::chrono::milliseconds(0);
+
+    const double ms = std::ceil((1.0 - tokens) / rate * 1000.0);
+    return std::chrono::milliseconds(static_cast<int64_t>(ms));
+}
+
+/**
+ * @brief AdmissionController::adapt is meant to be called periodically, with whether the broker is currently overloaded.
+ */
+void AdmissionController::adapt(bool overloaded)
+{
+    if (!enabled())
+        return;
+
+    refill(std::chrono::steady_clock::now());
+
+    // Never go all the way down, so clients still get in when the overload is caused by something other than connects.
+    const double minRate = std::max(maxRate / 20.0, 1.0);
+
+    if (overloaded)
+        rate = std::max(rate / 2.0, minRate);
+    else
+        rate = std::min(rate + maxRate / 10.0, maxRate);
+
+    tokens = std::min(tokens, std::max(rate, 1.0));
+}
+
+uint64_t AdmissionController::takeRejectionCount()
+{
+    const uint64_t result = rejections;
+    rejections = 0;
+    return result;
+}
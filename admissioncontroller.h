@@ -0,0 +1,48 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#ifndef ADMISSIONCONTROLLER_H
+#define ADMISSIONCONTROLLER_H
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief The AdmissionController class is a token bucket for new connections, of which the rate adapts to load. When the broker is
+ * overloaded, the rate is halved, and when it's not, it's increased by a tenth of the maximum, until it's at the maximum again. The
+ * bucket holds one second worth of connections, so a wave of reconnects is spread out over time.
+ *
+ * It's not thread safe. It's meant for the main thread that accepts connections.
+ */
+class AdmissionController
+{
+    double maxRate = 0;
+    double rate = 0;
+    double tokens = 0;
+    uint64_t rejections = 0;
+    std::chrono::time_point<std::chrono::steady_clock> lastRefill = std::chrono::steady_clock::now();
+
+    void refill(std::chrono::time_point<std::chrono::steady_clock> now);
+
+public:
+    void setMaxRate(uint32_t maxRate);
+    bool enabled() const { return maxRate > 0; }
+    double getRate() const { return rate; }
+    double getMaxRate() const { return maxRate; }
+
+    bool tryAdmit(std::chrono::time_point<std::chrono::steady_clock> now);
+    std::chrono::milliseconds getTimeTillNextToken() const;
+    void adapt(bool overloaded);
+
+    void countRejection() { rejections++; }
+    uint64_t takeRejectionCount();
+};
+
+#endif // ADMISSIONCONTROLLER_H
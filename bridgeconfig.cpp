@@ -7,6 +7,8 @@
 
 #include "utils.h"
 #include "exceptions.h"
+#include "threadglobals.h"
+#include "settings.h"
 
 bool BridgeTopicPath::isValidQos() const
 {
@@ -50,6 +52,12 @@ void BridgeState::initSSL(bool reloadCertificates)
     sslctx->setMinimumTlsVersion(c.minimumTlsVersion);
     SSL_CTX_set_mode(sslctx->get(), SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
+    if (ThreadGlobals::getSettings()->minimizeIdleConnectionMemory)
+        SSL_CTX_set_mode(sslctx->get(), SSL_MODE_RELEASE_BUFFERS);
+
+    if (c.ktls && !sslctx->enableKtls())
+        Logger::getInstance()->log(LOG_WARNING) << "Option 'ktls' is set for bridge '" << c.clientidPrefix << "', but this OpenSSL is built without kTLS support. Ignoring.";
+
     const char *privkey = c.sslPrivkey.empty() ? nullptr : c.sslPrivkey.c_str();
     const char *fullchain = c.sslFullchain.empty() ? nullptr : c.sslFullchain.c_str();
 
@@ -198,6 +206,9 @@ void BridgeConfig::isValid()
         }
     }
 
+    if (ktls && tlsMode == BridgeTLSMode::None)
+        throw ConfigFileException("Option 'ktls' requires 'tls' to be enabled.");
+
     if (address.empty())
         throw ConfigFileException("No address specified in bridge");
 
@@ -232,7 +243,7 @@ bool BridgeConfig::operator ==(const BridgeConfig &other) const
            && this->localCleanStart == other.localCleanStart && this->remoteSessionExpiryInterval == other.remoteSessionExpiryInterval
            && this->localSessionExpiryInterval == other.localSessionExpiryInterval && this->remoteRetainAvailable == other.remoteRetainAvailable
            && this->useSavedClientId == other.useSavedClientId && this->maxOutgoingTopicAliases == other.maxOutgoingTopicAliases
-           && this->maxIncomingTopicAliases == other.maxIncomingTopicAliases && this->tcpNoDelay == other.tcpNoDelay
+           && this->maxIncomingTopicAliases == other.maxIncomingTopicAliases && this->tcpNoDelay == other.tcpNoDelay && this->ktls == other.ktls
            && this->local_prefix == other.local_prefix && this->remote_prefix == other.remote_prefix;
 }
 
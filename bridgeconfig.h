@@ -61,6 +61,7 @@ public:
     std::weak_ptr<ThreadData> owner;
     bool queueForDelete = false;
     bool tcpNoDelay = false;
+    bool ktls = false;
     TLSVersion minimumTlsVersion = TLSVersion::TLSv1_1;
 
     std::optional<std::string> local_prefix;
@@ -19,6 +19,8 @@ See LICENSE for license details.
 #include "logger.h"
 #include "utils.h"
 
+std::atomic<int64_t> CirBuf::totalAllocatedBytes = 0;
+
 CirBuf::CirBuf(size_t size) :
     size(size)
 {
@@ -32,6 +34,8 @@ CirBuf::CirBuf(size_t size) :
     if (buf == NULL)
         throw std::runtime_error("Malloc error constructing buffer.");
 
+    totalAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+
 #ifndef NDEBUG
     memset(buf, 0, size);
 #endif
@@ -39,6 +43,7 @@ CirBuf::CirBuf(size_t size) :
 
 CirBuf::~CirBuf()
 {
+    totalAllocatedBytes.fetch_sub(size, std::memory_order_relaxed);
     free(buf);
     buf = nullptr;
 }
@@ -51,12 +56,18 @@ uint32_t CirBuf::usedBytes() const
 
 uint32_t CirBuf::freeSpace() const
 {
+    if (size == 0)
+        return 0;
+
     int result = (tail - (head + 1)) & (size-1);
     return result;
 }
 
 uint32_t CirBuf::maxWriteSize() const
 {
+    if (size == 0)
+        return 0;
+
     int end = size - 1 - head;
     int n = (end + tail) & (size-1);
     int result = n <= end ? n : end+1;
@@ -115,9 +126,27 @@ char CirBuf::peakAhead(uint32_t offset) const
 
 void CirBuf::ensureFreeSpace(const size_t n, const size_t max)
 {
+    // Starting at the beginning when empty means what's written next doesn't wrap, which would require two calls to read it out.
+    if (head == tail)
+    {
+        head = 0;
+        tail = 0;
+    }
+
     if (n <= freeSpace())
         return;
 
+    if (size == 0)
+    {
+        size_t newSize = CIRBUF_MIN_LAZY_SIZE;
+        while (newSize - 1 < n && newSize < max)
+        {
+            newSize = newSize << 1;
+        }
+        resetSize(newSize);
+        return;
+    }
+
     const size_t _usedBytes = usedBytes();
 
     size_t mul = 1;
@@ -151,6 +180,8 @@ void CirBuf::doubleSize(uint factor)
     memset(&newBuf[size], 68, newSize - size);
 #endif
 
+    totalAllocatedBytes.fetch_add(newSize - size, std::memory_order_relaxed);
+
     uint32_t maxRead = maxReadSize();
     buf = newBuf;
 
@@ -188,21 +219,36 @@ void CirBuf::resetSizeIfEligable(size_t size)
         return;
     }
 
-    if (usedBytes() > 0)
+    // It's meant for shrinking; buffers that were lazily allocated shouldn't grow because of it.
+    if (usedBytes() > 0 || this->size <= size)
         return;
 
     resetSize(size);
 }
 
+/**
+ * @brief CirBuf::resetSize reallocates the buffer. A size of 0 frees it.
+ * @param newSize
+ */
 void CirBuf::resetSize(size_t newSize)
 {
     assert(usedBytes() == 0);
+    assert(newSize == 0 || isPowerOfTwo(newSize));
     primedForSizeReset = false;
     if (this->size == newSize)
         return;
-    char *newBuf = (char*)malloc(newSize);
-    if (newBuf == NULL)
-        throw std::runtime_error("Malloc error resizing buffer.");
+
+    char *newBuf = nullptr;
+
+    if (newSize > 0)
+    {
+        newBuf = (char*)malloc(newSize);
+        if (newBuf == NULL)
+            throw std::runtime_error("Malloc error resizing buffer.");
+    }
+
+    totalAllocatedBytes.fetch_add(static_cast<int64_t>(newSize) - static_cast<int64_t>(this->size), std::memory_order_relaxed);
+
     free(buf);
     buf = newBuf;
     this->size = newSize;
@@ -211,7 +257,8 @@ void CirBuf::resetSize(size_t newSize)
 #ifndef NDEBUG
     Logger *logger = Logger::getInstance();
     logger->logf(LOG_DEBUG, "Reset buf size: %d", size);
-    memset(buf, 0, newSize);
+    if (buf)
+        memset(buf, 0, newSize);
 #endif
 }
 
@@ -221,10 +268,19 @@ void CirBuf::reset()
     tail = 0;
 
 #ifndef NDEBUG
-    memset(buf, 0, size);
+    if (buf)
+        memset(buf, 0, size);
 #endif
 }
 
+/**
+ * @brief CirBuf::getTotalAllocatedBytes is the memory held by all buffers, for statistics. Most of that is client buffers.
+ */
+int64_t CirBuf::getTotalAllocatedBytes()
+{
+    return totalAllocatedBytes.load(std::memory_order_relaxed);
+}
+
 void CirBuf::write(uint8_t b)
 {
     ensureFreeSpace(1);
@@ -243,7 +299,6 @@ void CirBuf::write(uint8_t b, uint8_t b2)
 
 void CirBuf::write(const void *buf, size_t count)
 {
-    assert(size > 0);
     ensureFreeSpace(count);
 
     ssize_t len_left = count;
@@ -271,11 +326,23 @@ std::vector<char> CirBuf::peekAllToVector()
 }
 
 std::vector<char> CirBuf::readToVector(const uint32_t max)
+{
+    std::vector<char> result;
+    readToVector(result, max);
+    return result;
+}
+
+/**
+ * @brief CirBuf::readToVector reads into an existing vector, so that its capacity can be reused.
+ * @param result is resized to the amount of bytes read.
+ * @param max
+ */
+void CirBuf::readToVector(std::vector<char> &result, const uint32_t max)
 {
     assert(size > 0);
 
     uint32_t bytes_left = std::min<uint32_t>(max, usedBytes());
-    std::vector<char> result(bytes_left);
+    result.resize(bytes_left);
 
     int guard = 0;
     auto pos = result.begin();
@@ -291,8 +358,6 @@ std::vector<char> CirBuf::readToVector(const uint32_t max)
     assert(guard < 3);
     assert(bytes_left == 0);
     assert(pos == result.end());
-
-    return result;
 }
 
 std::vector<char> CirBuf::readAllToVector()
@@ -18,8 +18,12 @@ See LICENSE for license details.
 #include <cassert>
 #include <algorithm>
 #include <vector>
+#include <atomic>
 
-// Optimized circular buffer, works only with sizes power of two.
+#define CIRBUF_MIN_LAZY_SIZE 64
+
+// Optimized circular buffer, works only with sizes power of two. A size of 0 means no memory is allocated, and it will
+// be allocated on the first write.
 class CirBuf
 {
 #ifdef TESTING
@@ -32,6 +36,8 @@ class CirBuf
     uint32_t size = 0;
 
     bool primedForSizeReset = false;
+
+    static std::atomic<int64_t> totalAllocatedBytes;
 public:
 
     CirBuf(const CirBuf &other) = delete;
@@ -59,11 +65,14 @@ public:
     void resetSize(size_t size);
     void reset();
 
+    static int64_t getTotalAllocatedBytes();
+
     void write(uint8_t b);
     void write(uint8_t b, uint8_t b2);
     void write(const void *buf, size_t count);
     std::vector<char> peekAllToVector();
     std::vector<char> readToVector(const uint32_t max);
+    void readToVector(std::vector<char> &result, const uint32_t max);
     std::vector<char> readAllToVector();
 
     /**
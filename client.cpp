@@ -23,6 +23,7 @@ See LICENSE for license details.
 #include "subscriptionstore.h"
 #include "mainapp.h"
 #include "exceptions.h"
+#include "memoryaccounting.h"
 
 StowedClientRegistrationData::StowedClientRegistrationData(bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval) :
     clean_start(clean_start),
@@ -40,10 +41,111 @@ AsyncAuthResult::AsyncAuthResult(AuthResult result, const std::string authMethod
 
 }
 
+Client::ConflatedPublish::ConflatedPublish(Publish &&publish, const std::optional<std::string> &topic_override) :
+    publish(std::move(publish)),
+    topic_override(topic_override)
+{
+
+}
+
+const std::string &Client::ConflatedPublish::getEffectiveTopic() const
+{
+    if (topic_override)
+        return *topic_override;
+
+    return publish.topic;
+}
+
 Client::WriteBuf::WriteBuf(size_t size) :
-    buf(size)
+    buf(size),
+    controlBuf(0)
+{
+
+}
+
+uint32_t Client::WriteBuf::usedBytes() const
 {
+    return buf.usedBytes() + controlBuf.usedBytes();
+}
+
+/**
+ * @brief Client::WriteBuf::startBulkPacket determines the length of the packet at the tail of the bulk buffer, so we know where the next
+ * boundary is. Only whole packets are put in the buffer, so the fixed header is complete.
+ */
+void Client::WriteBuf::startBulkPacket()
+{
+    assert(bulkPacketBytesLeft == 0);
+
+    if (bulkRawBytes > 0)
+    {
+        bulkPacketBytesLeft = bulkRawBytes;
+        bulkRawBytes = 0;
+        return;
+    }
+
+    uint32_t remaining_length = 0;
+    uint32_t multiplier = 1;
+    uint32_t i = 1;
+    uint8_t encodedByte = 0;
+
+    do
+    {
+        encodedByte = buf.peakAhead(i++);
+        remaining_length += (encodedByte & 127) * multiplier;
+        multiplier *= 128;
+    }
+    while ((encodedByte & 128) != 0 && i < 5);
 
+    bulkPacketBytesLeft = remaining_length + i;
+}
+
+/**
+ * @brief Client::WriteBuf::advanceLatencySamples records the latency of sampled publishes that have been completely written now.
+ */
+void Client::WriteBuf::advanceLatencySamples(uint32_t n)
+{
+    if (latencySamples.empty())
+        return;
+
+    ThreadData *td = ThreadGlobals::getThreadData();
+    const auto now = std::chrono::steady_clock::now();
+
+    auto it = latencySamples.begin();
+    while (it != latencySamples.end())
+    {
+        LatencySample &sample = *it;
+
+        if (sample.bytesLeft > n)
+        {
+            sample.bytesLeft -= n;
+            it++;
+            continue;
+        }
+
+        if (td)
+        {
+            const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(now - sample.readAt).count();
+            td->publishLatency.at(sample.qos).record(std::max<int64_t>(micros, 0));
+        }
+
+        it = latencySamples.erase(it);
+    }
+}
+
+void Client::WriteBuf::advanceBulk(uint32_t n)
+{
+    advanceLatencySamples(n);
+
+    while (n > 0)
+    {
+        if (bulkPacketBytesLeft == 0)
+            startBulkPacket();
+
+        const uint32_t m = std::min<uint32_t>(n, bulkPacketBytesLeft);
+        buf.advanceTail(m);
+        bulkPacketBytesLeft -= m;
+        n -= m;
+    }
 }
 
 /**
@@ -64,8 +166,8 @@ Client::Client(int fd, std::shared_ptr<ThreadData> threadData, SSL *ssl, bool we
     maxIncomingPacketSize(settings.maxPacketSize),
     maxIncomingTopicAliasValue(settings.maxIncomingTopicAliasValue), // Retaining snapshot of current setting, to not confuse clients when the setting changes.
     ioWrapper(ssl, websocket, settings.clientInitialBufferSize, this),
-    readbuf(settings.clientInitialBufferSize),
-    writebuf(settings.clientInitialBufferSize),
+    readbuf(0),
+    writebuf(0),
     epoll_fd(threadData ? threadData->getEpollFd() : 0),
     threadData(threadData)
 {
@@ -103,7 +205,7 @@ Client::~Client()
 
     logger->logf(LOG_NOTICE, "Removing client '%s'. Reason(s): %s", repr().c_str(), disconnectReason.c_str());
 
-    std::shared_ptr<ThreadData> td = this->threadData.lock();
+    std::shared_ptr<ThreadData> td = lockThreadData();
 
     if (td)
     {
@@ -206,6 +308,18 @@ void Client::startOrContinueSslHandshake()
     {
         ssl_version = ioWrapper.getSslVersion();
 
+        const bool ktls_send = ioWrapper.isKtlsSend();
+        const bool ktls_recv = ioWrapper.isKtlsRecv();
+
+        if (ktls_send || ktls_recv)
+        {
+            ssl_version += formatString(", kTLS%s%s", ktls_send ? " tx" : "", ktls_recv ? " rx" : "");
+
+            std::shared_ptr<ThreadData> td = lockThreadData();
+            if (td)
+                td->ktlsConnectionCounter.inc(1);
+        }
+
         if (this->outgoingConnection)
         {
             writeLoginPacket();
@@ -221,18 +335,91 @@ void Client::setDisconnectStage(DisconnectStage val)
     this->disconnectStage = val;
 }
 
+/**
+ * @brief Client::moveReadScratchBufToReadbuf copies the unparsed bytes in the thread's scratch buffer to our own buffer, allocating as needed.
+ * @param scratch
+ */
+void Client::moveReadScratchBufToReadbuf(CirBuf &scratch)
+{
+    readScratchBufFill = 0;
+
+    /*
+     * Leave room to read more, because a full buffer means we're at the maximum size and stop reading. Near the memory budget, we only
+     * make room for the bytes that were already read. If that fills the buffer, bufferToMqttPackets() pauses reading.
+     */
+    const Settings *settings = ThreadGlobals::getSettings();
+    const uint32_t maxBufferSize = std::max<uint32_t>(this->maxIncomingPacketSize, settings->clientMaxWriteBufferSize);
+    const size_t extra = MemoryAccounting::getPressure() == MemoryPressure::None ? 1 : 0;
+    readbuf.ensureFreeSpace(scratch.usedBytes() + extra, maxBufferSize);
+
+    while (scratch.usedBytes() > 0)
+    {
+        const uint32_t n = scratch.maxReadSize();
+        readbuf.write(scratch.tailPtr(), n);
+        scratch.advanceTail(n);
+    }
+
+    scratch.reset();
+}
+
+/**
+ * @brief Client::getReadBufferForReading gives the thread's scratch buffer when we have no partial packet pending, so idle clients don't
+ * need a read buffer of their own. Otherwise, it's our own buffer, because new data needs to be appended to what's there.
+ *
+ * Scratch bytes that are still there belong to a client that didn't get to parse them (like after an exception), unless the fill is ours.
+ */
+CirBuf &Client::getReadBufferForReading()
+{
+    ThreadData *td = ThreadGlobals::getThreadData();
+
+    if (td)
+    {
+        CirBuf &scratch = td->readScratchBuf;
+
+        if (scratch.usedBytes() > 0)
+        {
+            if (readScratchBufFill > 0 && readScratchBufFill == td->readScratchBufFills)
+                moveReadScratchBufToReadbuf(scratch);
+            else
+                scratch.reset();
+        }
+
+        if (readbuf.usedBytes() == 0)
+        {
+            readScratchBufFill = ++td->readScratchBufFills;
+            return scratch;
+        }
+    }
+
+    readScratchBufFill = 0;
+
+    // It may have been freed while idle, or never allocated.
+    if (readbuf.getSize() == 0)
+        readbuf.resetSize(ThreadGlobals::getSettings()->clientInitialBufferSize);
+
+    return readbuf;
+}
+
 DisconnectStage Client::readFdIntoBuffer()
 {
     if (this->disconnectStage == DisconnectStage::Now)
         return DisconnectStage::Now;
 
+    CirBuf &buf = getReadBufferForReading();
+
+    const Settings *settings = ThreadGlobals::getSettings();
+    const size_t budget = settings->clientReadBudgetBytes > 0 ? settings->clientReadBudgetBytes : std::numeric_limits<size_t>::max();
+    size_t bytesRead = 0;
+    readBudgetExhausted = false;
+
     IoWrapResult error = IoWrapResult::Success;
     int n = 0;
-    while (readbuf.freeSpace() > 0 && (n = ioWrapper.readWebsocketAndOrSsl(fd.get(), readbuf.headPtr(), readbuf.maxWriteSize(), &error)) != 0)
+    while (buf.freeSpace() > 0 && (n = ioWrapper.readWebsocketAndOrSsl(fd.get(), buf.headPtr(), buf.maxWriteSize(), &error)) != 0)
     {
         if (n > 0)
         {
-            readbuf.advanceHead(n);
+            buf.advanceHead(n);
+            bytesRead += n;
         }
 
         if (error == IoWrapResult::Interrupted)
@@ -241,16 +428,19 @@ DisconnectStage Client::readFdIntoBuffer()
             break;
 
         // Make sure we either always have enough space for a next call of this method, or stop reading the fd.
-        if (readbuf.freeSpace() == 0)
+        if (buf.freeSpace() == 0)
         {
-            const Settings *settings = ThreadGlobals::getSettings();
             // I guess I should have just made a 'max buffer size' option, and not distinguish between read/write?
             const uint32_t maxBufferSize = std::max<uint32_t>(this->maxIncomingPacketSize, settings->clientMaxWriteBufferSize);
 
-            // We always grow for another iteration when there are still decoded websocket/SSL bytes, because epoll doesn't tell us that buffer has data.
-            if (readbuf.getSize() * 2 <= maxBufferSize || error == IoWrapResult::WantRead || ioWrapper.hasProcessedBufferedBytesToRead())
+            /*
+             * We always grow for another iteration when there are still decoded websocket/SSL bytes, because epoll doesn't tell us that
+             * buffer has data. Otherwise, near the memory budget, we stop reading instead of growing. See bufferToMqttPackets().
+             */
+            const bool mayGrow = buf.getSize() * 2 <= maxBufferSize && MemoryAccounting::getPressure() == MemoryPressure::None;
+            if (mayGrow || error == IoWrapResult::WantRead || ioWrapper.hasProcessedBufferedBytesToRead())
             {
-                readbuf.doubleSize();
+                buf.doubleSize();
             }
             else
             {
@@ -258,6 +448,27 @@ DisconnectStage Client::readFdIntoBuffer()
                 break;
             }
         }
+
+        // Give the other clients of the thread a turn. The thread loop comes back to us, because epoll won't know about decoded SSL bytes.
+        if (bytesRead >= budget)
+        {
+            readBudgetExhausted = true;
+
+            ThreadData *td = ThreadGlobals::getThreadData();
+            if (td)
+                td->readByteBudgetExhausted.inc();
+
+            break;
+        }
+    }
+
+    if (bytesRead > 0)
+    {
+        trafficBytes += bytesRead;
+
+        ThreadData *td = ThreadGlobals::getThreadData();
+        if (td)
+            td->bytesReceived.inc(bytesRead);
     }
 
     if (error == IoWrapResult::Disconnected)
@@ -274,16 +485,42 @@ void Client::writeText(const std::string &text)
 
     auto write_buf_locked = writebuf.lock();
     write_buf_locked->buf.writerange(text.begin(), text.end());
+    write_buf_locked->bulkRawBytes += text.size();
     setReadyForWriting(true, write_buf_locked);
 }
 
 void Client::writePing()
 {
     auto write_buf_locked = writebuf.lock();
-    write_buf_locked->buf.write(0b11000000, 0);
+    writeToControlBuf(write_buf_locked, 0b11000000, 0);
     setReadyForWriting(true, write_buf_locked);
 }
 
+void Client::writeToControlBuf(MutexLocked<WriteBuf> &writebuf, uint8_t b, uint8_t b2)
+{
+    if (writebuf->controlBuf.usedBytes() == 0)
+        writebuf->controlQueuedAt = std::chrono::steady_clock::now();
+
+    writebuf->controlBuf.write(b, b2);
+}
+
+static bool isControlLanePacket(const PacketType packetType)
+{
+    switch (packetType)
+    {
+    case PacketType::CONNACK:
+    case PacketType::PUBACK:
+    case PacketType::PUBREC:
+    case PacketType::PUBREL:
+    case PacketType::PUBCOMP:
+    case PacketType::PINGREQ:
+    case PacketType::PINGRESP:
+        return true;
+    default:
+        return false;
+    }
+}
+
 PacketDropReason Client::writeMqttPacket(const MqttPacket &packet)
 {
     const size_t packetSize = packet.getSizeIncludingNonPresentHeader();
@@ -298,18 +535,58 @@ PacketDropReason Client::writeMqttPacket(const MqttPacket &packet)
     const Settings *settings = ThreadGlobals::getSettings();
 
     // After introducing the client_max_write_buffer_size with low default, this makes it somewhat backwards compatible with the default big packet size.
-    const uint32_t growBufMaxTo = std::max<uint32_t>(settings->clientMaxWriteBufferSize, packetSize * 2);
+    uint32_t growBufMaxTo = std::max<uint32_t>(settings->clientMaxWriteBufferSize, packetSize * 2);
 
     auto write_buf_locked = writebuf.lock();
 
+    // Control packets are never dropped, and don't count towards the bulk data limit.
+    if (isControlLanePacket(packet.packetType))
+    {
+        CirBuf &controlBuf = write_buf_locked->controlBuf;
+
+        if (controlBuf.usedBytes() == 0)
+            write_buf_locked->controlQueuedAt = std::chrono::steady_clock::now();
+
+        controlBuf.ensureFreeSpace(packetSize);
+        packet.readIntoBuf(controlBuf);
+        setReadyForWriting(true, write_buf_locked);
+        return PacketDropReason::Success;
+    }
+
+    // Near the memory budget, buffers don't grow beyond what they have (or would have had without lazy allocation).
+    const MemoryPressure memoryPressure = MemoryAccounting::getPressure();
+    const uint32_t growBufMaxToWithoutPressure = growBufMaxTo;
+    if (memoryPressure != MemoryPressure::None)
+        growBufMaxTo = std::max<uint32_t>(write_buf_locked->buf.getSize(), settings->clientInitialBufferSize);
+
     // Grow as far as we can. We have to make room for one MQTT packet.
     write_buf_locked->buf.ensureFreeSpace(packetSize, growBufMaxTo);
 
     // And drop a publish when it doesn't fit, even after resizing. This means we do allow pings. And
-    // QoS packet are queued and limited elsewhere.
-    if (packet.packetType == PacketType::PUBLISH && packet.getQos() == 0 && packetSize > write_buf_locked->buf.freeSpace())
+    // QoS packet are queued and limited elsewhere. When there are conflated publishes waiting, we also
+    // say no, so that newer publishes end up there, instead of overtaking them.
+    if (packet.packetType == PacketType::PUBLISH && packet.getQos() == 0)
     {
-        return PacketDropReason::BufferFull;
+        // Over the memory budget, we shed QoS 0 for clients that aren't keeping up.
+        const bool shed = memoryPressure == MemoryPressure::Critical && write_buf_locked->buf.usedBytes() > 0;
+
+        const bool doesNotFit = packetSize > write_buf_locked->buf.freeSpace();
+
+        if (shed || doesNotFit || !write_buf_locked->conflated.empty())
+        {
+            // Only count it when it's the memory pressure that made us drop it, not the normal buffer limit.
+            const bool droppedForPressure =
+                shed || (doesNotFit && write_buf_locked->conflated.empty() && growBufMaxTo < growBufMaxToWithoutPressure
+                         && write_buf_locked->buf.usedBytes() + packetSize < growBufMaxToWithoutPressure);
+
+            if (droppedForPressure)
+            {
+                ThreadData *td = ThreadGlobals::getThreadData();
+                td->memoryPressureDrops.inc();
+            }
+
+            return PacketDropReason::BufferFull;
+        }
     }
 
     packet.readIntoBuf(write_buf_locked->buf);
@@ -318,6 +595,15 @@ PacketDropReason Client::writeMqttPacket(const MqttPacket &packet)
     {
         ThreadData *td = ThreadGlobals::getThreadData();
         td->sentMessageCounter.inc();
+
+        // Limited, because we only count down the samples when we write, and that may not be happening.
+        if (td->latencySampleStart && write_buf_locked->latencySamples.size() < 8)
+        {
+            LatencySample &sample = write_buf_locked->latencySamples.emplace_back();
+            sample.bytesLeft = write_buf_locked->buf.usedBytes();
+            sample.qos = packet.getQos();
+            sample.readAt = *td->latencySampleStart;
+        }
     }
     else if (packet.packetType == PacketType::DISCONNECT)
         setDisconnectStage(DisconnectStage::SendPendingAppData);
@@ -387,6 +673,10 @@ PacketDropReason Client::writeMqttPacketAndBlameThisClient(
 
     PacketDropReason dropReason = writeMqttPacketAndBlameThisClient(*p);
 
+    // Conflated publishes don't use topic aliases, so we don't register the new one (if any) either.
+    if (dropReason == PacketDropReason::BufferFull && conflateWhenBacklogged && p->getQos() == 0)
+        return conflatePublish(copyFactory, retain, subscriptionIdentifier, topic_override);
+
     if (dropReason == PacketDropReason::Success && topic_alias_next > 0)
     {
         locked_aliases_extended->aliases[topic] = topic_alias_next;
@@ -405,7 +695,10 @@ PacketDropReason Client::writeMqttPacketAndBlameThisClient(const MqttPacket &pac
     }
     catch (std::exception &ex)
     {
-        std::shared_ptr<ThreadData> td = this->threadData.lock();
+        // Before looking up our thread, so that a migration that is taking place sees it. See ThreadData::migrateClient().
+        setRemovalQueued();
+
+        std::shared_ptr<ThreadData> td = lockThreadData();
         if (td)
             td->removeClientQueued(fd.get());
 
@@ -417,7 +710,7 @@ PacketDropReason Client::writeMqttPacketAndBlameThisClient(const MqttPacket &pac
 void Client::writePingResp()
 {
     auto write_buf_locked = writebuf.lock();
-    write_buf_locked->buf.write(0b11010000, 0);
+    writeToControlBuf(write_buf_locked, 0b11010000, 0);
     setReadyForWriting(true, write_buf_locked);
 }
 
@@ -441,6 +734,92 @@ void Client::writeLoginPacket()
     writeMqttPacket(pack);
 }
 
+/**
+ * @brief Client::conflatePublish holds on to a QoS 0 publish that doesn't fit in the write buffer, replacing an earlier one with the same
+ * topic. For clients that only care about the current state of topics, that's better than dropping the newest data.
+ */
+PacketDropReason Client::conflatePublish(PublishCopyFactory &copyFactory, bool retain, uint32_t subscriptionIdentifier,
+                                         const std::optional<std::string> &topic_override)
+{
+    const std::string &topic = topic_override ? *topic_override : copyFactory.getTopic();
+    const Settings *settings = ThreadGlobals::getSettings();
+
+    auto write_buf_locked = writebuf.lock();
+    WriteBuf &wb = *write_buf_locked;
+
+    auto pos = wb.conflatedByTopic.find(topic);
+
+    if (pos != wb.conflatedByTopic.end())
+    {
+        ConflatedPublish &cp = *pos->second;
+        wb.conflatedBytes -= cp.publish.topic.size() + cp.publish.payload.size();
+        cp.publish = copyFactory.getNewQos0Publish(retain, subscriptionIdentifier);
+        wb.conflatedBytes += cp.publish.topic.size() + cp.publish.payload.size();
+
+        ThreadData *td = ThreadGlobals::getThreadData();
+        if (td)
+            td->conflatedPublishes.inc();
+
+        return PacketDropReason::Success;
+    }
+
+    // New topics are subject to the same limit as the write buffer, and not accepted at all near the memory budget.
+    if (wb.conflatedBytes >= settings->clientMaxWriteBufferSize || MemoryAccounting::getPressure() != MemoryPressure::None)
+        return PacketDropReason::BufferFull;
+
+    ConflatedPublish &cp = wb.conflated.emplace_back(copyFactory.getNewQos0Publish(retain, subscriptionIdentifier), topic_override);
+    wb.conflatedByTopic[topic] = std::prev(wb.conflated.end());
+    wb.conflatedBytes += cp.publish.topic.size() + cp.publish.payload.size();
+
+    setReadyForWriting(true, write_buf_locked);
+
+    return PacketDropReason::Success;
+}
+
+/**
+ * @brief Client::moveConflatedPublishesIntoBuf is called when the bulk buffer has drained, and moves as many conflated publishes into it
+ * as will fit.
+ */
+void Client::moveConflatedPublishesIntoBuf(WriteBuf &wb)
+{
+    const Settings *settings = ThreadGlobals::getSettings();
+    ThreadData *td = ThreadGlobals::getThreadData();
+
+    while (!wb.conflated.empty())
+    {
+        ConflatedPublish &cp = wb.conflated.front();
+
+        if (!cp.publish.hasExpired())
+        {
+            MqttPacket packet(protocolVersion, cp.publish, 0, 0, false, cp.publish.subscriptionIdentifier, cp.topic_override);
+            const size_t packetSize = packet.getSizeIncludingNonPresentHeader();
+
+            if (packetSize <= this->maxOutgoingPacketSize)
+            {
+                const uint32_t growBufMaxTo = std::max<uint32_t>(settings->clientMaxWriteBufferSize, packetSize * 2);
+                wb.buf.ensureFreeSpace(packetSize, growBufMaxTo);
+
+                if (packetSize > wb.buf.freeSpace())
+                {
+                    if (wb.buf.usedBytes() > 0)
+                        break;
+                }
+                else
+                {
+                    packet.readIntoBuf(wb.buf);
+
+                    if (td)
+                        td->sentMessageCounter.inc();
+                }
+            }
+        }
+
+        wb.conflatedBytes -= cp.publish.topic.size() + cp.publish.payload.size();
+        wb.conflatedByTopic.erase(cp.getEffectiveTopic());
+        wb.conflated.pop_front();
+    }
+}
+
 void Client::writeBufIntoFd()
 {
     auto write_buf_locked = writebuf.lock(std::try_to_lock);
@@ -451,14 +830,56 @@ void Client::writeBufIntoFd()
     if (this->disconnectStage == DisconnectStage::Now)
         return;
 
+    WriteBuf &wb = *write_buf_locked;
+
     IoWrapResult error = IoWrapResult::Success;
     int n;
-    while (write_buf_locked->buf.usedBytes() > 0 || ioWrapper.hasPendingWrite())
+    uint64_t bytesWritten = 0;
+    while (wb.usedBytes() > 0 || ioWrapper.hasPendingWrite() || !wb.conflated.empty())
     {
-        n = ioWrapper.writeWebsocketAndOrSsl(fd.get(), write_buf_locked->buf.tailPtr(), write_buf_locked->buf.maxReadSize(), &error);
+        if (wb.buf.usedBytes() == 0 && !wb.conflated.empty())
+            moveConflatedPublishesIntoBuf(wb);
 
-        if (n > 0)
-            write_buf_locked->buf.advanceTail(n);
+        const bool controlPending = wb.controlBuf.usedBytes() > 0;
+
+        // Switching between control and bulk data is done at packet boundaries, and not while the transport is in the middle of something.
+        if (controlPending && !wb.writingControl && wb.bulkPacketBytesLeft == 0 && ioWrapper.canChangeWriteSource())
+            wb.writingControl = true;
+
+        if (wb.writingControl)
+        {
+            n = ioWrapper.writeWebsocketAndOrSsl(fd.get(), wb.controlBuf, &error);
+
+            if (n > 0)
+            {
+                wb.controlBuf.advanceTail(n);
+                bytesWritten += n;
+            }
+
+            if (wb.controlBuf.usedBytes() == 0)
+            {
+                wb.writingControl = false;
+
+                ThreadData *td = ThreadGlobals::getThreadData();
+                if (td)
+                    td->controlPacketWriteLatency.update(wb.controlQueuedAt);
+            }
+        }
+        else
+        {
+            if (wb.bulkPacketBytesLeft == 0 && wb.buf.usedBytes() > 0)
+                wb.startBulkPacket();
+
+            // With control packets waiting, we only finish the packet we're at.
+            const size_t max = controlPending ? wb.bulkPacketBytesLeft : std::numeric_limits<size_t>::max();
+            n = ioWrapper.writeWebsocketAndOrSsl(fd.get(), wb.buf, &error, max);
+
+            if (n > 0)
+            {
+                wb.advanceBulk(n);
+                bytesWritten += n;
+            }
+        }
 
         if (error == IoWrapResult::Interrupted)
             continue;
@@ -466,7 +887,16 @@ void Client::writeBufIntoFd()
             break;
     }
 
-    const bool data_pending = write_buf_locked->buf.usedBytes() > 0 || ioWrapper.hasPendingWrite() || error == IoWrapResult::Wouldblock;
+    if (bytesWritten > 0)
+    {
+        trafficBytes += bytesWritten;
+
+        ThreadData *td = ThreadGlobals::getThreadData();
+        if (td)
+            td->bytesSent.inc(bytesWritten);
+    }
+
+    const bool data_pending = wb.usedBytes() > 0 || ioWrapper.hasPendingWrite() || !wb.conflated.empty() || error == IoWrapResult::Wouldblock;
 
     if (this->disconnectStage == DisconnectStage::SendPendingAppData && !data_pending)
     {
@@ -539,16 +969,22 @@ std::string Client::getKeepAliveInfoString() const
     return s;
 }
 
+/**
+ * @brief Client::resetBuffersIfEligible shrinks the buffers of clients that have been idle. With 'minimize_idle_connection_memory', they
+ * are freed altogether, and allocated again when there is something to read or write.
+ */
 void Client::resetBuffersIfEligible()
 {
     const Settings *settings = ThreadGlobals::getSettings();
-    const size_t initialBufferSize = settings->clientInitialBufferSize;
+    const size_t idleBufferSize = settings->minimizeIdleConnectionMemory ? 0 : settings->clientInitialBufferSize;
 
-    readbuf.resetSizeIfEligable(initialBufferSize);
+    // Reading is done in the thread's scratch buffer, so our own is only needed for partial packets.
+    readbuf.resetSizeIfEligable(0);
     ioWrapper.resetBuffersIfEligible();
 
     auto write_buf_locked = writebuf.lock();
-    write_buf_locked->buf.resetSizeIfEligable(initialBufferSize);
+    write_buf_locked->buf.resetSizeIfEligable(idleBufferSize);
+    write_buf_locked->controlBuf.resetSizeIfEligable(0);
 }
 
 void Client::setTopicAlias(const uint16_t alias_id, const std::string &topic)
@@ -598,7 +1034,7 @@ uint16_t Client::getMaxIncomingTopicAliasValue() const
 
 void Client::sendOrQueueWill()
 {
-    if (this->threadData.expired())
+    if (!lockThreadData())
         return;
 
     if (!this->willPublish)
@@ -693,9 +1129,112 @@ const std::string &Client::getExtendedAuthenticationMethod() const
 
 std::shared_ptr<ThreadData> Client::lockThreadData()
 {
+    std::lock_guard<std::mutex> locker(threadDataMutex);
     return this->threadData.lock();
 }
 
+void Client::setHandshakeDestination(const std::shared_ptr<ThreadData> &destination)
+{
+    this->handshakeDestination = destination;
+}
+
+std::shared_ptr<ThreadData> Client::getHandshakeDestination()
+{
+    return this->handshakeDestination.lock();
+}
+
+/**
+ * @brief Client::moveToThread makes the client belong to another thread. It must already be removed from the epoll set of the current one.
+ * @param destination
+ *
+ * Only safe for clients no other thread knows about yet, like clients fresh from a handshake thread.
+ */
+void Client::moveToThread(const std::shared_ptr<ThreadData> &destination)
+{
+    assert(!this->session);
+
+    this->epoll_fd = destination->getEpollFd();
+
+    {
+        std::lock_guard<std::mutex> locker(threadDataMutex);
+        this->threadData = destination;
+    }
+
+    this->handshakeDestination.reset();
+    this->readScratchBufFill = 0;
+
+    auto write_buf_locked = writebuf.lock();
+    write_buf_locked->readyForWriting = false;
+}
+
+/**
+ * @brief Client::migrateToThread moves an established client to another thread, with its epoll registration. Call it from the current
+ * thread, between packets, and after the destination has the client in its list; see ThreadData::migrateClient().
+ *
+ * Buffers, TLS and websocket state are ours, so they come along as is.
+ */
+void Client::migrateToThread(const std::shared_ptr<ThreadData> &destination)
+{
+    {
+        std::lock_guard<std::mutex> locker(threadDataMutex);
+        this->threadData = destination;
+    }
+
+    this->readScratchBufFill = 0;
+    this->readTurn = 0;
+
+    // Other threads make us ready for writing under this lock, so they must see the old and new epoll instance consistently.
+    auto write_buf_locked = writebuf.lock();
+
+    check<std::runtime_error>(epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd.get(), NULL));
+
+    this->epoll_fd = destination->getEpollFd();
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = fd.get();
+    ev.events = readyForReading*EPOLLIN | write_buf_locked->readyForWriting*EPOLLOUT;
+    check<std::runtime_error>(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd.get(), &ev));
+}
+
+/**
+ * @brief Client::canMigrate says whether the client is in a state that can be moved to another thread. Anything that is still going on
+ * in the current thread, like a handshake, async authentication, a disconnect or a queued removal, rules it out.
+ */
+bool Client::canMigrate() const
+{
+    if (!authenticated || outgoingConnection || disconnectStage != DisconnectStage::NotInitiated)
+        return false;
+
+    if (pausedForBackpressure || pausedForMemoryPressure || readBudgetExhausted || removalQueued)
+        return false;
+
+    if (asyncAuthenticating || asyncAuthResult || packetQueueAfterAsync)
+        return false;
+
+    if (ioWrapper.isSsl() && !ioWrapper.isSslAccepted())
+        return false;
+
+    return true;
+}
+
+void Client::setRemovalQueued()
+{
+    removalQueued = true;
+}
+
+bool Client::isRemovalQueued() const
+{
+    return removalQueued;
+}
+
+uint64_t Client::takeTrafficBytes()
+{
+    const uint64_t result = trafficBytes;
+    trafficBytes = 0;
+    return result;
+}
+
 void Client::setBridgeState(std::shared_ptr<BridgeState> bridgeState)
 {
     this->bridgeState = bridgeState;
@@ -782,6 +1321,9 @@ void Client::setReadyForWriting(bool val)
 
 void Client::setReadyForWriting(bool val, MutexLocked<WriteBuf> &writebuf)
 {
+    // All changes to the write buffer end up here, so this is where we publish how full it is.
+    updateWriteBufFreeEstimate(*writebuf);
+
 #ifndef NDEBUG
     if (fuzzMode)
         return;
@@ -826,6 +1368,9 @@ void Client::setReadyForReading(bool val)
     if (this->disconnectStage == DisconnectStage::Now)
         return;
 
+    if (pausedForBackpressure)
+        val = false;
+
     // This looks a bit like a race condition, but all calls to this method are from a threads's event loop, so we should be OK.
     if (val == this->readyForReading)
         return;
@@ -880,8 +1425,189 @@ void Client::setAddr(const std::string &address)
 
 void Client::bufferToMqttPackets(std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender)
 {
-    MqttPacket::bufferToMqttPackets(readbuf, packetQueueIn, sender);
-    setReadyForReading(readbuf.freeSpace() > 0);
+    ThreadData *td = ThreadGlobals::getThreadData();
+    const Settings *settings = ThreadGlobals::getSettings();
+    const size_t budget = settings->clientReadBudgetPackets > 0 ? settings->clientReadBudgetPackets : std::numeric_limits<size_t>::max();
+    size_t parsed = 0;
+
+    if (td && readScratchBufFill > 0 && readScratchBufFill == td->readScratchBufFills)
+    {
+        CirBuf &scratch = td->readScratchBuf;
+        readScratchBufFill = 0;
+        parsed = MqttPacket::bufferToMqttPackets(scratch, packetQueueIn, sender, budget);
+        moveReadScratchBufToReadbuf(scratch);
+    }
+    else
+    {
+        parsed = MqttPacket::bufferToMqttPackets(readbuf, packetQueueIn, sender, budget);
+    }
+
+    // Packets left in the buffer are for our next turn.
+    if (parsed >= budget && readbuf.usedBytes() > 0)
+    {
+        readBudgetExhausted = true;
+
+        if (td)
+            td->readPacketBudgetExhausted.inc();
+    }
+
+    const bool readbufFull = readbuf.getSize() > 0 && readbuf.freeSpace() == 0;
+
+    // Without memory pressure, a full buffer is at its maximum size. Otherwise, it's the pressure that keeps it from growing.
+    if (td && readbufFull && readbuf.getSize() * 2 <= std::max<uint32_t>(this->maxIncomingPacketSize, settings->clientMaxWriteBufferSize))
+        td->pauseClientForMemoryPressure(sender);
+
+    setReadyForReading(!readbufFull);
+}
+
+/**
+ * @brief Client::claimReadTurn makes sure a client is read once per iteration of the thread loop, even when it's both reported by epoll and
+ * in the list of clients that exhausted their read budget.
+ */
+bool Client::claimReadTurn(uint64_t loopIteration)
+{
+    if (readTurn == loopIteration)
+        return false;
+
+    readTurn = loopIteration;
+    return true;
+}
+
+/**
+ * @brief Client::pauseReadingForBackpressure stops reading from a publisher whose messages can't be delivered, so TCP flow control slows it
+ * down, instead of us dropping its messages.
+ * @return whether the client wasn't paused already.
+ */
+bool Client::pauseReadingForBackpressure(std::vector<std::weak_ptr<Session>> &&targets)
+{
+    if (pausedForBackpressure)
+    {
+        backpressureTargets.insert(backpressureTargets.end(), targets.begin(), targets.end());
+        return false;
+    }
+
+    backpressureTargets = std::move(targets);
+    backpressurePausedAt = std::chrono::steady_clock::now();
+    setReadyForReading(false);
+    pausedForBackpressure = true;
+    return true;
+}
+
+/**
+ * @brief Client::resumeReadingIfTargetsDrained resumes reading when the subscribers we were waiting for have caught up, or when we've waited
+ * long enough. The latter keeps one stuck subscriber from stopping a publisher forever.
+ * @return whether the client is no longer paused.
+ */
+bool Client::resumeReadingIfTargetsDrained(std::chrono::time_point<std::chrono::steady_clock> now, std::chrono::milliseconds maxPause)
+{
+    if (!pausedForBackpressure)
+        return true;
+
+    if (now - backpressurePausedAt < maxPause)
+    {
+        for (std::weak_ptr<Session> &ws : backpressureTargets)
+        {
+            std::shared_ptr<Session> s = ws.lock();
+
+            if (s && s->isBacklogged())
+                return false;
+        }
+    }
+
+    pausedForBackpressure = false;
+    backpressureTargets.clear();
+
+    for (const MqttPacket &ack : acksHeldForBackpressure)
+    {
+        writeMqttPacket(ack);
+    }
+    acksHeldForBackpressure.clear();
+
+    setReadyForReading(readbuf.getSize() == 0 || readbuf.freeSpace() > 0);
+    return true;
+}
+
+/**
+ * @brief Client::holdAckForBackpressure keeps the PUBACK/PUBREC of a paused publisher until resumeReadingIfTargetsDrained(). Only pausing
+ * the reading would still let it send until the TCP buffers are full, and with the acks coming in, it has no reason to slow down.
+ */
+void Client::holdAckForBackpressure(MqttPacket &&ack)
+{
+    acksHeldForBackpressure.push_back(std::move(ack));
+}
+
+/**
+ * @brief Client::pauseReadingForMemoryPressure marks that we stopped reading because the read buffer couldn't grow near the memory budget.
+ * @return whether the client wasn't paused already.
+ */
+bool Client::pauseReadingForMemoryPressure()
+{
+    if (pausedForMemoryPressure)
+        return false;
+
+    pausedForMemoryPressure = true;
+    return true;
+}
+
+/**
+ * @brief Client::resumeReadingAfterMemoryPressure grows the read buffer we didn't grow before, and reads again.
+ */
+void Client::resumeReadingAfterMemoryPressure()
+{
+    if (!pausedForMemoryPressure)
+        return;
+
+    pausedForMemoryPressure = false;
+
+    const Settings *settings = ThreadGlobals::getSettings();
+    const uint32_t maxBufferSize = std::max<uint32_t>(this->maxIncomingPacketSize, settings->clientMaxWriteBufferSize);
+
+    if (readbuf.getSize() > 0 && readbuf.freeSpace() == 0 && readbuf.getSize() * 2 <= maxBufferSize)
+        readbuf.doubleSize();
+
+    setReadyForReading(readbuf.getSize() == 0 || readbuf.freeSpace() > 0);
+}
+
+/**
+ * @brief Client::isWriteBacklogged is for other threads too. It's not the same as the write buffer being full: we want to have drained some
+ * before saying we're no longer backlogged.
+ */
+bool Client::isWriteBacklogged()
+{
+    const Settings *settings = ThreadGlobals::getSettings();
+    auto write_buf_locked = writebuf.lock();
+    return write_buf_locked->buf.usedBytes() > settings->clientMaxWriteBufferSize / 2 || !write_buf_locked->conflated.empty();
+}
+
+/**
+ * @brief Client::getWriteBufFreeFraction is for other threads too. It doesn't lock: it's the estimate of the last change of the write
+ * buffer. See updateWriteBufFreeEstimate().
+ */
+double Client::getWriteBufFreeFraction()
+{
+    return writeBufFreeEstimate.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Client::updateWriteBufFreeEstimate is to be called under the writebuf lock. Conflated publishes mean the buffer was full, so
+ * count as no room.
+ */
+void Client::updateWriteBufFreeEstimate(const WriteBuf &wb)
+{
+    const Settings *settings = ThreadGlobals::getSettings();
+
+    if (!settings)
+        return;
+
+    float result = 0.0f;
+
+    if (wb.conflated.empty() && settings->clientMaxWriteBufferSize > 0)
+    {
+        const float used = static_cast<float>(wb.buf.usedBytes()) / static_cast<float>(settings->clientMaxWriteBufferSize);
+        result = std::max(0.0f, 1.0f - used);
+    }
+
+    writeBufFreeEstimate.store(result, std::memory_order_relaxed);
 }
 
 void Client::setClientProperties(ProtocolVersion protocolVersion, const std::string &clientId, const std::string username, bool connectPacketSeen, uint16_t keepalive)
@@ -945,7 +1671,7 @@ void Client::setDisconnectReason(const std::string &reason)
 {
 #ifndef TESTING // Because of testing trickery, we can't assert this in testing.
 #ifndef NDEBUG
-    auto td = this->threadData.lock();
+    auto td = lockThreadData();
     if (td)
     {
         assert(pthread_self() == td->thread.native_handle());
@@ -1086,6 +1812,16 @@ AllowListenerAnonymous Client::getAllowAnonymousOverride() const
     return allowAnonymousOverride;
 }
 
+void Client::setConflateWhenBacklogged(bool val)
+{
+    conflateWhenBacklogged = val;
+}
+
+bool Client::getConflateWhenBacklogged() const
+{
+    return conflateWhenBacklogged;
+}
+
 void Client::addPacketToAfterAsyncQueue(MqttPacket &&p)
 {
     if (!packetQueueAfterAsync)
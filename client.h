@@ -15,9 +15,12 @@ See LICENSE for license details.
 #include <unistd.h>
 #include <vector>
 #include <mutex>
+#include <atomic>
 #include <iostream>
 #include <time.h>
 #include <optional>
+#include <list>
+#include <unordered_map>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -69,22 +72,63 @@ public:
 
 class Client
 {
+    struct ConflatedPublish
+    {
+        Publish publish;
+        std::optional<std::string> topic_override;
+
+        ConflatedPublish(Publish &&publish, const std::optional<std::string> &topic_override);
+        const std::string &getEffectiveTopic() const;
+    };
+
+    struct LatencySample
+    {
+        uint32_t bytesLeft = 0;
+        uint8_t qos = 0;
+        std::chrono::time_point<std::chrono::steady_clock> readAt;
+    };
+
     struct OutgoingTopicAliases
     {
         uint16_t cur_alias = 0;
         std::unordered_map<std::string, uint16_t> aliases;
     };
 
+    /**
+     * Control packets like acks and ping responses have their own lane, written ahead of the bulk data at packet boundaries, so they
+     * don't wait behind a backlog of publishes.
+     */
     struct WriteBuf
     {
         CirBuf buf;
+        CirBuf controlBuf;
+        uint32_t bulkRawBytes = 0; // Bytes at the start of buf that are not MQTT packets, like the websocket upgrade response.
+        uint32_t bulkPacketBytesLeft = 0; // Of the packet at the tail of buf that we started writing. Zero means we're at a boundary.
+        bool writingControl = false;
+        std::chrono::time_point<std::chrono::steady_clock> controlQueuedAt;
         bool readyForWriting = false;
 
+        // Sampled publishes in buf, with how many bytes have to be written until they're out. See ThreadData::latencySampleStart.
+        std::vector<LatencySample> latencySamples;
+
+        // When conflating and backlogged, the last QoS 0 publish per topic, in order of first arrival.
+        std::list<ConflatedPublish> conflated;
+        std::unordered_map<std::string, std::list<ConflatedPublish>::iterator> conflatedByTopic;
+        size_t conflatedBytes = 0;
+
         WriteBuf(size_t size);
+        uint32_t usedBytes() const;
+        void startBulkPacket();
+        void advanceBulk(uint32_t n);
+        void advanceLatencySamples(uint32_t n);
     };
 
     friend class IoWrapper;
 
+#ifdef TESTING
+    friend class MainTests;
+#endif
+
     FdManaged fd;
     bool fuzzMode = false;
 
@@ -100,8 +144,14 @@ class Client
     std::string transportStr;
     std::string address;
 
-    CirBuf readbuf;
+    CirBuf readbuf; // Holds partial packets, and complete ones left over when the read budget ran out.
+    uint64_t readScratchBufFill = 0; // Which fill of the thread's scratch buffer has our unparsed bytes, if any.
+    bool readBudgetExhausted = false; // There is data we didn't get to in this turn of the event loop.
+    uint64_t readTurn = 0;
+    uint64_t trafficBytes = 0; // Read and written since the last takeTrafficBytes(), for the client rebalancer.
+    std::atomic<bool> removalQueued {false}; // Set by any thread, so a migration can see a removal may have gone to the old thread.
     MutexOwned<WriteBuf> writebuf;
+    std::atomic<float> writeBufFreeEstimate {1.0f}; // Set under the writebuf lock, for getWriteBufFreeFraction().
 
     bool authenticated = false;
     bool connectPacketSeen = false;
@@ -121,12 +171,21 @@ class Client
     bool clean_start = false;
     X509ClientVerification x509ClientVerification = X509ClientVerification::None;
     AllowListenerAnonymous allowAnonymousOverride = AllowListenerAnonymous::None;
+    bool conflateWhenBacklogged = false;
+    bool pausedForBackpressure = false;
+    std::chrono::time_point<std::chrono::steady_clock> backpressurePausedAt;
+    std::vector<std::weak_ptr<Session>> backpressureTargets; // The subscribers we're waiting for to drain.
+    std::vector<MqttPacket> acksHeldForBackpressure; // Sent when we resume, so the publisher's in-flight window runs out too.
+    bool pausedForMemoryPressure = false;
 
     std::shared_ptr<WillPublish> stagedWillPublish;
     std::shared_ptr<WillPublish> willPublish;
 
-    const int epoll_fd;
+    int epoll_fd; // Changed under the writebuf lock, because other threads use it to make us ready for writing.
+    std::mutex threadDataMutex; // Clients can be migrated, and other threads look up our thread.
     std::weak_ptr<ThreadData> threadData; // The thread (data) that this client 'lives' in.
+    std::weak_ptr<ThreadData> handshakeDestination; // When the handshake is done by a handshake thread, the thread the client moves to after.
+    const std::chrono::time_point<std::chrono::steady_clock> createdAt = std::chrono::steady_clock::now();
 
     std::shared_ptr<Session> session;
 
@@ -151,8 +210,15 @@ class Client
 
     void setReadyForWriting(bool val);
     void setReadyForWriting(bool val, MutexLocked<WriteBuf> &writebuf);
+    void updateWriteBufFreeEstimate(const WriteBuf &wb);
+    void writeToControlBuf(MutexLocked<WriteBuf> &writebuf, uint8_t b, uint8_t b2);
+    PacketDropReason conflatePublish(PublishCopyFactory &copyFactory, bool retain, uint32_t subscriptionIdentifier,
+                                     const std::optional<std::string> &topic_override);
+    void moveConflatedPublishesIntoBuf(WriteBuf &wb);
     void setReadyForReading(bool val);
     void setAddr(const std::string &address);
+    CirBuf &getReadBufferForReading();
+    void moveReadScratchBufToReadbuf(CirBuf &scratch);
 
 public:
     uint8_t preAuthPacketCounter = 0;
@@ -177,6 +243,17 @@ public:
     void setDisconnectStage(DisconnectStage val);
     DisconnectStage readFdIntoBuffer();
     void bufferToMqttPackets(std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender);
+    bool getReadBudgetExhausted() const { return readBudgetExhausted; }
+    bool claimReadTurn(uint64_t loopIteration);
+    bool pauseReadingForBackpressure(std::vector<std::weak_ptr<Session>> &&targets);
+    bool resumeReadingIfTargetsDrained(std::chrono::time_point<std::chrono::steady_clock> now, std::chrono::milliseconds maxPause);
+    bool isPausedForBackpressure() const { return pausedForBackpressure; }
+    void holdAckForBackpressure(MqttPacket &&ack);
+    bool pauseReadingForMemoryPressure();
+    void resumeReadingAfterMemoryPressure();
+    bool isPausedForMemoryPressure() const { return pausedForMemoryPressure; }
+    bool isWriteBacklogged();
+    double getWriteBufFreeFraction();
     void setClientProperties(ProtocolVersion protocolVersion, const std::string &clientId, const std::string username, bool connectPacketSeen, uint16_t keepalive);
     void setClientProperties(ProtocolVersion protocolVersion, const std::string &clientId, const std::string username, bool connectPacketSeen, uint16_t keepalive,
                              uint32_t maxOutgoingPacketSize, uint16_t maxOutgoingTopicAliasValue);
@@ -242,6 +319,16 @@ public:
     const std::string &getExtendedAuthenticationMethod() const;
 
     std::shared_ptr<ThreadData> lockThreadData();
+    void setHandshakeDestination(const std::shared_ptr<ThreadData> &destination);
+    std::shared_ptr<ThreadData> getHandshakeDestination();
+    void moveToThread(const std::shared_ptr<ThreadData> &destination);
+    void migrateToThread(const std::shared_ptr<ThreadData> &destination);
+    bool canMigrate() const;
+    void setRemovalQueued();
+    bool isRemovalQueued() const;
+    uint64_t takeTrafficBytes();
+    std::chrono::time_point<std::chrono::steady_clock> getCreatedAt() const { return createdAt; }
+    std::chrono::time_point<std::chrono::steady_clock> getLastActivity() const { return lastActivity; }
 
     void setBridgeState(std::shared_ptr<BridgeState> bridgeState);
     bool isOutgoingConnection() const;
@@ -265,6 +352,8 @@ public:
     X509ClientVerification getX509ClientVerification() const;
     void setAllowAnonymousOverride(const AllowListenerAnonymous allow);
     AllowListenerAnonymous getAllowAnonymousOverride() const;
+    void setConflateWhenBacklogged(bool val);
+    bool getConflateWhenBacklogged() const;
 
     void setAsyncAuthenticating() { this->asyncAuthenticating = true; }
     bool getAsyncAuthenticating() const { return this->asyncAuthenticating; }
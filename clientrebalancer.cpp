@@ -0,0 +1,63 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#include "clientrebalancer.h"
+
+#include <algorithm>
+
+/**
+ * @brief ClientRebalancer::update takes the traffic totals of the worker threads, and compares them to those of the previous call.
+ * @return the move to make, if any. The first call, or a call with a different number of threads, only records the totals.
+ */
+std::optional<ClientRebalanceMove> ClientRebalancer::update(const std::vector<uint64_t> &totals, std::chrono::time_point<std::chrono::steady_clock> now)
+{
+    std::optional<ClientRebalanceMove> result;
+
+    const double seconds = std::chrono::duration<double>(now - previousTime).count();
+
+    if (previousTotals.size() == totals.size() && seconds > 0)
+    {
+        std::vector<uint64_t> rates(totals.size());
+
+        for (size_t i = 0; i < totals.size(); i++)
+        {
+            const uint64_t diff = totals.at(i) >= previousTotals.at(i) ? totals.at(i) - previousTotals.at(i) : 0;
+            rates.at(i) = static_cast<uint64_t>(diff / seconds);
+        }
+
+        result = decide(rates);
+    }
+
+    previousTotals = totals;
+    previousTime = now;
+    return result;
+}
+
+std::optional<ClientRebalanceMove> ClientRebalancer::decide(const std::vector<uint64_t> &bytesPerSecond)
+{
+    if (bytesPerSecond.size() < 2)
+        return {};
+
+    const auto hottest = std::max_element(bytesPerSecond.begin(), bytesPerSecond.end());
+    const auto coldest = std::min_element(bytesPerSecond.begin(), bytesPerSecond.end());
+
+    if (*hottest < minBytesPerSecond)
+        return {};
+
+    // Hottest less than one and a half times the coldest.
+    if (*hottest * 2 < *coldest * 3)
+        return {};
+
+    ClientRebalanceMove move;
+    move.from = std::distance(bytesPerSecond.begin(), hottest);
+    move.to = std::distance(bytesPerSecond.begin(), coldest);
+    move.bytesPerSecond = (*hottest - *coldest) / 2;
+    return move;
+}
@@ -0,0 +1,45 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#ifndef CLIENTREBALANCER_H
+#define CLIENTREBALANCER_H
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+struct ClientRebalanceMove
+{
+    size_t from = 0;
+    size_t to = 0;
+    uint64_t bytesPerSecond = 0; // How much traffic to move.
+};
+
+/**
+ * @brief The ClientRebalancer class decides when clients should move from one worker thread to another. The load of a thread is the
+ * socket traffic it did since the last update. When the busiest thread does more than one and a half times the traffic of the least
+ * busy one, half the difference is moved.
+ *
+ * It's not thread safe. It's meant for the main thread.
+ */
+class ClientRebalancer
+{
+    std::vector<uint64_t> previousTotals;
+    std::chrono::time_point<std::chrono::steady_clock> previousTime;
+
+public:
+    static constexpr uint64_t minBytesPerSecond = 64 * 1024; // Below this, a thread is not busy enough to bother.
+
+    std::optional<ClientRebalanceMove> update(const std::vector<uint64_t> &totals, std::chrono::time_point<std::chrono::steady_clock> now);
+    static std::optional<ClientRebalanceMove> decide(const std::vector<uint64_t> &bytesPerSecond);
+};
+
+#endif // CLIENTREBALANCER_H
@@ -206,6 +206,8 @@ ConfigFileParser::ConfigFileParser(const std::string &path) :
     validKeys.insert("rlimit_nofile");
     validKeys.insert("expire_sessions_after_seconds");
     validKeys.insert("thread_count");
+    validKeys.insert("handshake_thread_count");
+    validKeys.insert("minimize_idle_connection_memory");
     validKeys.insert("storage_dir");
     validKeys.insert("max_qos_msg_pending_per_client");
     validKeys.insert("max_qos_bytes_pending_per_client");
@@ -220,6 +222,11 @@ ConfigFileParser::ConfigFileParser(const std::string &path) :
     validKeys.insert("max_incoming_topic_alias_value");
     validKeys.insert("max_outgoing_topic_alias_value");
     validKeys.insert("client_max_write_buffer_size");
+    validKeys.insert("client_read_budget_bytes");
+    validKeys.insert("client_read_budget_packets");
+    validKeys.insert("publisher_backpressure_threshold");
+    validKeys.insert("publisher_backpressure_max_pause_ms");
+    validKeys.insert("memory_budget");
     validKeys.insert("retained_messages_delivery_limit");
     validKeys.insert("include_dir");
     validKeys.insert("rebuild_subscription_tree_interval_seconds");
@@ -228,11 +235,13 @@ ConfigFileParser::ConfigFileParser(const std::string &path) :
     validKeys.insert("zero_byte_username_is_anonymous");
     validKeys.insert("overload_mode");
     validKeys.insert("max_event_loop_drift");
+    validKeys.insert("slow_task_threshold");
     validKeys.insert("set_retained_message_defer_timeout");
     validKeys.insert("set_retained_message_defer_timeout_spread");
     validKeys.insert("save_state_interval");
     validKeys.insert("subscription_node_lifetime");
     validKeys.insert("subscription_identifiers_enabled");
+    validKeys.insert("client_rebalance_interval");
 
     validListenKeys.insert("port");
     validListenKeys.insert("protocol");
@@ -249,6 +258,10 @@ ConfigFileParser::ConfigFileParser(const std::string &path) :
     validListenKeys.insert("tcp_nodelay");
     validListenKeys.insert("minimum_tls_version");
     validListenKeys.insert("overload_mode");
+    validListenKeys.insert("ktls");
+    validListenKeys.insert("conflate_when_backlogged");
+    validListenKeys.insert("max_connection_rate");
+    validListenKeys.insert("connection_rate_mode");
 
     validBridgeKeys.insert("local_username");
     validBridgeKeys.insert("remote_username");
@@ -279,6 +292,7 @@ ConfigFileParser::ConfigFileParser(const std::string &path) :
     validBridgeKeys.insert("local_prefix");
     validBridgeKeys.insert("remote_prefix");
     validBridgeKeys.insert("minimum_tls_version");
+    validBridgeKeys.insert("ktls");
 }
 
 std::list<std::string> ConfigFileParser::readFileRecursively(const std::string &path) const
@@ -478,9 +492,10 @@ void ConfigFileParser::loadFile(bool test)
             {
                 if (testKeyValidity(key, "protocol", validListenKeys))
                 {
-                    if (value != "mqtt" && value != "websockets")
+                    if (value != "mqtt" && value != "websockets" && value != "metrics")
                         throw ConfigFileException(formatString("Protocol '%s' is not a valid listener protocol", value.c_str()));
                     curListener->websocket = value == "websockets";
+                    curListener->metrics = value == "metrics";
                 }
                 else if (testKeyValidity(key, "port", validListenKeys))
                 {
@@ -545,6 +560,14 @@ void ConfigFileParser::loadFile(bool test)
                     bool val = stringTruthiness(value);
                     curListener->tcpNoDelay = val;
                 }
+                if (testKeyValidity(key, "ktls", validListenKeys))
+                {
+                    curListener->ktls = stringTruthiness(value);
+                }
+                if (testKeyValidity(key, "conflate_when_backlogged", validListenKeys))
+                {
+                    curListener->conflateWhenBacklogged = stringTruthiness(value);
+                }
                 if (testKeyValidity(key, "minimum_tls_version", validListenKeys))
                 {
                     if (valueTrimmed == "tlsv1.3")
@@ -564,6 +587,23 @@ void ConfigFileParser::loadFile(bool test)
                         curListener->overloadMode = OverloadMode::Log;
                     else if (_val == "close_new_clients")
                         curListener->overloadMode = OverloadMode::CloseNewClients;
+                    else if (_val == "close_new_clients_on_memory_pressure")
+                        curListener->overloadMode = OverloadMode::CloseNewClientsOnMemoryPressure;
+                    else
+                        throw ConfigFileException(formatString("Value '%s' for '%s' is invalid.", value.c_str(), key.c_str()));
+                }
+                if (testKeyValidity(key, "max_connection_rate", validListenKeys))
+                {
+                    curListener->maxConnectionRate = full_stoul(key, value);
+                }
+                if (testKeyValidity(key, "connection_rate_mode", validListenKeys))
+                {
+                    const std::string _val = str_tolower(value);
+
+                    if (_val == "defer")
+                        curListener->connectionRateMode = ConnectionRateMode::Defer;
+                    else if (_val == "close")
+                        curListener->connectionRateMode = ConnectionRateMode::Close;
                     else
                         throw ConfigFileException(formatString("Value '%s' for '%s' is invalid.", value.c_str(), key.c_str()));
                 }
@@ -786,6 +826,10 @@ void ConfigFileParser::loadFile(bool test)
                 {
                     curBridge->tcpNoDelay = true;
                 }
+                if (testKeyValidity(key, "ktls", validBridgeKeys))
+                {
+                    curBridge->ktls = stringTruthiness(value);
+                }
                 if (testKeyValidity(key, "local_prefix", validBridgeKeys))
                 {
                     if (value.empty())
@@ -998,6 +1042,22 @@ void ConfigFileParser::loadFile(bool test)
                     tmpSettings.threadCount = newVal;
                 }
 
+                if (testKeyValidity(key, "handshake_thread_count", validKeys))
+                {
+                    int newVal = full_stoi(key, value);
+                    if (newVal < 0)
+                    {
+                        throw ConfigFileException(formatString("handshake_thread_count value '%d' is invalid. Valid values are 0 or higher. 0 means disabled.", newVal));
+                    }
+                    tmpSettings.handshakeThreadCount = newVal;
+                }
+
+                if (testKeyValidity(key, "minimize_idle_connection_memory", validKeys))
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings.minimizeIdleConnectionMemory = tmp;
+                }
+
                 if (testKeyValidity(key, "max_qos_msg_pending_per_client", validKeys))
                 {
                     int newVal = full_stoi(key, value);
@@ -1105,6 +1165,12 @@ void ConfigFileParser::loadFile(bool test)
                         tmpSettings.sharedSubscriptionTargeting = SharedSubscriptionTargeting::SenderHash;
                     else if (_val == "first")
                         tmpSettings.sharedSubscriptionTargeting = SharedSubscriptionTargeting::First;
+                    else if (_val == "least_loaded")
+                        tmpSettings.sharedSubscriptionTargeting = SharedSubscriptionTargeting::LeastLoaded;
+                    else if (_val == "thread_local")
+                        tmpSettings.sharedSubscriptionTargeting = SharedSubscriptionTargeting::ThreadLocal;
+                    else if (_val == "topic_hash")
+                        tmpSettings.sharedSubscriptionTargeting = SharedSubscriptionTargeting::TopicHash;
                     else
                         throw ConfigFileException(formatString("Value '%s' for '%s' is invalid.", value.c_str(), key.c_str()));
                 }
@@ -1120,6 +1186,40 @@ void ConfigFileParser::loadFile(bool test)
                     tmpSettings.clientMaxWriteBufferSize = newVal;
                 }
 
+                if (testKeyValidity(key, "client_read_budget_bytes", validKeys))
+                {
+                    const uint32_t newVal = full_stoul(key, value);
+                    tmpSettings.clientReadBudgetBytes = newVal;
+                }
+
+                if (testKeyValidity(key, "client_read_budget_packets", validKeys))
+                {
+                    const uint32_t newVal = full_stoul(key, value);
+                    tmpSettings.clientReadBudgetPackets = newVal;
+                }
+
+                if (testKeyValidity(key, "publisher_backpressure_threshold", validKeys))
+                {
+                    const uint32_t newVal = full_stoul(key, value);
+                    tmpSettings.publisherBackpressureThreshold = newVal;
+                }
+
+                if (testKeyValidity(key, "publisher_backpressure_max_pause_ms", validKeys))
+                {
+                    const uint32_t newVal = full_stoul(key, value);
+                    if (newVal == 0)
+                    {
+                        throw ConfigFileException(formatString("Value of '%s' must be bigger than 0.", key.c_str()));
+                    }
+                    tmpSettings.publisherBackpressureMaxPauseMs = newVal;
+                }
+
+                if (testKeyValidity(key, "memory_budget", validKeys))
+                {
+                    const uint64_t newVal = full_stoul(key, value);
+                    tmpSettings.memoryBudget = newVal;
+                }
+
                 if (testKeyValidity(key, "retained_messages_delivery_limit", validKeys))
                 {
                     Logger::getInstance()->log(LOG_WARNING) << "The config option '" << key << "' is deprecated. Use 'retained_messages_node_limit' instead.";
@@ -1170,6 +1270,8 @@ void ConfigFileParser::loadFile(bool test)
                         tmpSettings.overloadMode = OverloadMode::Log;
                     else if (_val == "close_new_clients")
                         tmpSettings.overloadMode = OverloadMode::CloseNewClients;
+                    else if (_val == "close_new_clients_on_memory_pressure")
+                        tmpSettings.overloadMode = OverloadMode::CloseNewClientsOnMemoryPressure;
                     else
                         throw ConfigFileException(formatString("Value '%s' for '%s' is invalid.", value.c_str(), key.c_str()));
                 }
@@ -1186,6 +1288,26 @@ void ConfigFileParser::loadFile(bool test)
                     tmpSettings.maxEventLoopDrift = std::chrono::milliseconds(val);
                 }
 
+                if (testKeyValidity(key, "slow_task_threshold", validKeys))
+                {
+                    const int val = full_stoi(key, value);
+
+                    if (val < 0)
+                        throw ConfigFileException("Option '" + key + "' must 0 or higher.");
+
+                    tmpSettings.slowTaskThreshold = std::chrono::milliseconds(val);
+                }
+
+                if (testKeyValidity(key, "client_rebalance_interval", validKeys))
+                {
+                    const int val = full_stoi(key, value);
+
+                    if (val < 0)
+                        throw ConfigFileException("Option '" + key + "' must 0 or higher.");
+
+                    tmpSettings.clientRebalanceInterval = std::chrono::seconds(val);
+                }
+
                 if (testKeyValidity(key, "set_retained_message_defer_timeout", validKeys))
                 {
                     const int val = full_stoi(key, value);
@@ -10,32 +10,45 @@ See LICENSE for license details.
 
 #include "derivablecounter.h"
 
-void DerivableCounter::inc(uint64_t n)
+static int64_t nowNanos()
 {
-    val += n;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+DerivableCounter::DerivableCounter() :
+    timeOfPreviousNanos(nowNanos())
+{
+
 }
 
 uint64_t DerivableCounter::get() const
 {
-    return val;
+    return val.load(std::memory_order_relaxed);
 }
 
 /**
  * @brief DerivableCounter::getPerSecond returns the amount per second since last time this method was called.
  * @return
  *
- * Even though the class it not meant to be thread-safe, this method does use a mutex, because obtaining the value can be
- * scheduled in different threads.
+ * Obtaining the value can be scheduled in different threads, so the previous value and time are swapped out atomically instead of
+ * locking. Should two threads ever call it at the same time, one of them just gets a very short interval.
  */
 double DerivableCounter::getPerSecond()
 {
-    std::lock_guard<std::mutex> locker(timeMutex);
-
-    std::chrono::time_point<std::chrono::steady_clock> now = std::chrono::steady_clock::now();
-    std::chrono::milliseconds msSinceLastTime = std::chrono::duration_cast<std::chrono::milliseconds>(now - timeOfPrevious);
-    uint64_t messagesTimes1000 = (val - valPrevious) * 1000;
-    double result = messagesTimes1000 / static_cast<double>(msSinceLastTime.count() + 1); // branchless avoidance of div by 0;
-    timeOfPrevious = now;
-    valPrevious = val;
+    const int64_t now = nowNanos();
+    const uint64_t cur = val.load(std::memory_order_relaxed);
+
+    const int64_t previousTime = timeOfPreviousNanos.exchange(now, std::memory_order_relaxed);
+    const uint64_t previousVal = valPrevious.exchange(cur, std::memory_order_relaxed);
+
+    const int64_t msSinceLastTime = (now - previousTime) / 1000000;
+    const uint64_t messagesTimes1000 = (cur > previousVal ? cur - previousVal : 0) * 1000;
+    double result = messagesTimes1000 / static_cast<double>(msSinceLastTime + 1); // branchless avoidance of div by 0;
     return result;
 }
+
+void DerivableCounterSum::add(DerivableCounter &counter)
+{
+    total += counter.get();
+    perSecond += counter.getPerSecond();
+}
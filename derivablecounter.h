@@ -12,25 +12,43 @@ See LICENSE for license details.
 #define DERIVABLECOUNTER_H
 
 #include <chrono>
-#include <mutex>
+#include <atomic>
+#include <cstdint>
 
 /**
  * @brief The DerivableCounter is a counter which can derive val/dt.
  *
- * It's not thread-safe, to avoid unnecessary locking. You should have counters per thread.
+ * It has one writer: the thread that owns it. So, you should have counters per thread. Because there is only one writer, inc() can be a
+ * relaxed load and store, which is as cheap as a plain increment, but other threads can still read it without a data race. Each counter
+ * has its own cache line, so the owning thread doesn't have to fight over it with readers, or with counters of other threads.
  */
-class DerivableCounter
+class alignas(64) DerivableCounter
 {
-    uint64_t val = 0;
-    uint64_t valPrevious = 0;
-    std::chrono::time_point<std::chrono::steady_clock> timeOfPrevious = std::chrono::steady_clock::now();
-    std::mutex timeMutex;
+    std::atomic<uint64_t> val = 0;
+    std::atomic<uint64_t> valPrevious = 0;
+    std::atomic<int64_t> timeOfPreviousNanos;
 
 public:
+    DerivableCounter();
+
+    void inc(uint64_t n = 1)
+    {
+        val.store(val.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
 
-    void inc(uint64_t n = 1);
     uint64_t get() const;
     double getPerSecond();
 };
 
+/**
+ * @brief The DerivableCounterSum struct adds up the same counter of several threads, for publishing totals.
+ */
+struct DerivableCounterSum
+{
+    uint64_t total = 0;
+    double perSecond = 0;
+
+    void add(DerivableCounter &counter);
+};
+
 #endif // DERIVABLECOUNTER_H
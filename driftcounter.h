@@ -14,7 +14,7 @@ class DriftCounter
 {
     std::chrono::time_point<std::chrono::steady_clock> last_update = std::chrono::steady_clock::now();
     std::chrono::milliseconds last_drift = std::chrono::milliseconds(0);
-    std::array<std::chrono::milliseconds, 16> many_drifts;
+    std::array<std::chrono::milliseconds, 16> many_drifts {};
     unsigned int many_index = 0;
 
 public:
@@ -36,7 +36,14 @@ enum class TLSVersion
 enum class OverloadMode
 {
     Log,
-    CloseNewClients
+    CloseNewClients,
+    CloseNewClientsOnMemoryPressure
+};
+
+enum class ConnectionRateMode
+{
+    Defer,
+    Close
 };
 
 #endif // ENUMS_H
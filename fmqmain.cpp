@@ -96,6 +96,7 @@ int fmqmain(int argc, char *argv[])
 #ifdef __SSE4_2__
         sse = "with SSE4.2 support";
 #endif
+        sse += ", topic scan kernel: " + topicScanKernelToString(getTopicScanKernel());
 #ifdef NDEBUG
         logger->logf(LOG_NOTICE, "Starting FlashMQ version %s, release build %s.", FLASHMQ_VERSION, sse.c_str());
 #else
@@ -38,3 +38,20 @@ std::unordered_map<std::string, std::string> GlobalStats::getExtras()
     return r;
 }
 
+
+void GlobalStats::setMetricsSnapshot(std::shared_ptr<const std::string> snapshot)
+{
+    auto locked_data = metricsSnapshot.lock();
+    *locked_data = std::move(snapshot);
+}
+
+/**
+ * @brief GlobalStats::getMetricsSnapshot gives the OpenMetrics text rendered when the stats were last published, or nullptr when that hasn't
+ * happened yet.
+ */
+std::shared_ptr<const std::string> GlobalStats::getMetricsSnapshot()
+{
+    auto locked_data = metricsSnapshot.lock();
+    std::shared_ptr<const std::string> r = *locked_data;
+    return r;
+}
@@ -14,6 +14,7 @@ See LICENSE for license details.
 #include <stdint.h>
 #include <unordered_map>
 #include <string>
+#include <memory>
 
 #include "derivablecounter.h"
 #include "mutexowned.h"
@@ -23,6 +24,7 @@ class GlobalStats
     static GlobalStats *instance;
 
     MutexOwned<std::unordered_map<std::string, std::string>> extras;
+    MutexOwned<std::shared_ptr<const std::string>> metricsSnapshot;
 
     GlobalStats();
 public:
@@ -32,6 +34,9 @@ public:
 
     void setExtra(const std::string &topic, const std::string &payload);
     std::unordered_map<std::string, std::string> getExtras();
+
+    void setMetricsSnapshot(std::shared_ptr<const std::string> snapshot);
+    std::shared_ptr<const std::string> getMetricsSnapshot();
 };
 
 #endif // GLOBALSTATS_H
@@ -15,6 +15,7 @@ See LICENSE for license details.
 #include <openssl/x509v3.h>
 #include <openssl/sslerr.h>
 #include <signal.h>
+#include <sys/uio.h>
 
 #include "logger.h"
 #include "client.h"
@@ -59,6 +60,12 @@ char IncompleteWebsocketRead::getNextMaskingByte()
     return maskingKey[maskingKeyI++ % 4];
 }
 
+void IncompleteWebsocketRead::unmask(char *dst, const char *src, const size_t len)
+{
+    unmaskWebsocketBytes(dst, src, len, maskingKey, maskingKeyI);
+    maskingKeyI += len;
+}
+
 IncompleteWebsocketRead::IncompleteWebsocketRead()
 {
     reset();
@@ -294,6 +301,33 @@ const char *IoWrapper::getSslVersion() const
     return SSL_get_version(ssl);
 }
 
+/**
+ * @brief IoWrapper::isKtlsSend tells whether the kernel does the TLS encryption for this connection. Only meaningful after the handshake.
+ */
+bool IoWrapper::isKtlsSend() const
+{
+#ifndef OPENSSL_NO_KTLS
+    if (!ssl)
+        return false;
+
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+}
+
+bool IoWrapper::isKtlsRecv() const
+{
+#ifndef OPENSSL_NO_KTLS
+    if (!ssl)
+        return false;
+
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    return false;
+#endif
+}
+
 bool IoWrapper::needsHaProxyParsing() const
 {
     return _needsHaProxyParsing;
@@ -603,6 +637,9 @@ ssize_t IoWrapper::readWebsocketAndOrSsl(int fd, void *buf, size_t nbytes, IoWra
         return readOrSslRead(fd, buf, nbytes, error);
     }
 
+    if (websocketPendingBytes.getSize() == 0)
+        websocketPendingBytes.resetSize(ThreadGlobals::getSettings()->clientInitialBufferSize);
+
     ssize_t n = 0;
     while (websocketPendingBytes.freeSpace() > 0 && (n = readOrSslRead(fd, websocketPendingBytes.headPtr(), websocketPendingBytes.maxWriteSize(), error)) != 0)
     {
@@ -817,14 +854,18 @@ ssize_t IoWrapper::websocketBytesToReadBuffer(void *buf, const size_t nbytes, Io
             if (max_read_size + nbytesRead > nbytes)
                 raise(SIGABRT);
 
-            char *offset_in_buf = &static_cast<char*>(buf)[nbytesRead];
-            for (size_t x = 0; x < max_read_size; x++)
+            // Unmasking per contiguous part of the ring buffer, which is one or two parts.
+            size_t bytes_left = max_read_size;
+            while (bytes_left > 0)
             {
-                offset_in_buf[x] = websocketPendingBytes.peakAhead(x) ^ incompleteWebsocketRead.getNextMaskingByte();
+                char *offset_in_buf = &static_cast<char*>(buf)[nbytesRead];
+                const size_t len = std::min<size_t>(bytes_left, websocketPendingBytes.maxReadSize());
+                incompleteWebsocketRead.unmask(offset_in_buf, websocketPendingBytes.tailPtr(), len);
+                websocketPendingBytes.advanceTail(len);
+                incompleteWebsocketRead.frame_bytes_left -= len;
+                nbytesRead += len;
+                bytes_left -= len;
             }
-            websocketPendingBytes.advanceTail(max_read_size);
-            incompleteWebsocketRead.frame_bytes_left -= max_read_size;
-            nbytesRead += max_read_size;
         }
         else if (incompleteWebsocketRead.opcode == WebsocketOpcode::Ping)
         {
@@ -845,10 +886,7 @@ ssize_t IoWrapper::websocketBytesToReadBuffer(void *buf, const size_t nbytes, Io
 
             std::vector<char> masked_payload = websocketPendingBytes.readToVector(incompleteWebsocketRead.frame_bytes_left);
 
-            for (size_t i = 0; i < masked_payload.size(); i++)
-            {
-                masked_payload.at(i) = masked_payload.at(i) ^ incompleteWebsocketRead.getNextMaskingByte();
-            }
+            incompleteWebsocketRead.unmask(masked_payload.data(), masked_payload.data(), masked_payload.size());
 
             websocketWriteRemainder.ensureFreeSpace(masked_payload.size() + WEBSOCKET_MAX_SENDING_HEADER_SIZE);
             writeAsMuchOfBufAsWebsocketFrame(masked_payload.data(), masked_payload.size(), WebsocketOpcode::Pong);
@@ -926,6 +964,56 @@ ssize_t IoWrapper::websocketBytesToReadBuffer(void *buf, const size_t nbytes, Io
     return nbytesRead;
 }
 
+/**
+ * @brief makeWebsocketFrameHeader writes the header of an unmasked, final, websocket frame.
+ * @return the length of the header.
+ */
+static uint8_t makeWebsocketFrameHeader(std::array<char, WEBSOCKET_MAX_SENDING_HEADER_SIZE> &header, const uint64_t payload_length, WebsocketOpcode opcode)
+{
+    uint8_t extended_payload_length_num_bytes = 0;
+    uint8_t payload_length_field = 0;
+    if (payload_length < 126)
+        payload_length_field = payload_length;
+    else if (payload_length >= 126 && payload_length <= 0xFFFF)
+    {
+        payload_length_field = 126;
+        extended_payload_length_num_bytes = 2;
+    }
+    else if (payload_length > 0xFFFF)
+    {
+        payload_length_field = 127;
+        extended_payload_length_num_bytes = 8;
+    }
+
+    int x = 0;
+    header[x++] = (0b10000000 | static_cast<char>(opcode));
+    header[x++] = payload_length_field;
+
+    const int header_length = x + extended_payload_length_num_bytes;
+
+    // This block writes the extended payload length.
+    for (int z = extended_payload_length_num_bytes - 1; z >= 0; z--)
+    {
+        header[x++] = (payload_length >> (z*8)) & 0xFF;
+    }
+    assert(x <= WEBSOCKET_MAX_SENDING_HEADER_SIZE);
+    assert(x == header_length);
+
+    return header_length;
+}
+
+void IncompleteWebsocketWrite::start(const size_t payload_length)
+{
+    header_length = makeWebsocketFrameHeader(header, payload_length, WebsocketOpcode::Binary);
+    header_bytes_written = 0;
+    frame_bytes_left = payload_length;
+}
+
+bool IncompleteWebsocketWrite::sillWorkingOnFrame() const
+{
+    return header_bytes_written < header_length || frame_bytes_left > 0;
+}
+
 /**
  * @brief IoWrapper::writeAsMuchOfBufAsWebsocketFrame writes buf or part of buf as websocket frame to websocketWriteRemainder
  * @param buf
@@ -949,42 +1037,90 @@ ssize_t IoWrapper::writeAsMuchOfBufAsWebsocketFrame(const void *buf, const size_
     // We normally wrap each write in a frame, but if a previous one didn't fit in the system's write buffers, we're still working on it.
     if (websocketWriteRemainder.freeSpace() > WEBSOCKET_MAX_SENDING_HEADER_SIZE)
     {
-        uint8_t extended_payload_length_num_bytes = 0;
-        uint8_t payload_length = 0;
-        if (nBytesReal < 126)
-            payload_length = nBytesReal;
-        else if (nBytesReal >= 126 && nBytesReal <= 0xFFFF)
-        {
-            payload_length = 126;
-            extended_payload_length_num_bytes = 2;
-        }
-        else if (nBytesReal > 0xFFFF)
-        {
-            payload_length = 127;
-            extended_payload_length_num_bytes = 8;
-        }
-
-        int x = 0;
         std::array<char, WEBSOCKET_MAX_SENDING_HEADER_SIZE> header;
-        header[x++] = (0b10000000 | static_cast<char>(opcode));
-        header[x++] = payload_length;
+        const uint8_t header_length = makeWebsocketFrameHeader(header, nBytesReal, opcode);
+        websocketWriteRemainder.writerange(header.begin(), header.begin() + header_length);
+        websocketWriteRemainder.write(buf, nBytesReal);
+    }
 
-        const int header_length = x + extended_payload_length_num_bytes;
+    return nBytesReal;
+}
 
-        // This block writes the extended payload length.
-        const uint64_t nbytes64 = nBytesReal;
-        for (int z = extended_payload_length_num_bytes - 1; z >= 0; z--)
+/**
+ * @brief IoWrapper::writeBufAsWebsocketFrame writes all that's in buf as one websocket frame, with the header put in front of the
+ * payload by writev(), so the payload isn't copied. Only for websockets without SSL, because SSL_write() has no such thing.
+ * @param fd
+ * @param buf The client's write buffer. The caller advances its tail by what we return.
+ * @param error
+ * @param max The most bytes of buf a new frame gets.
+ * @return the number of bytes of buf written.
+ *
+ * A frame that can't be written in one go is continued on the next call, from whatever is in buf by then. Because control frames like
+ * pongs can't be put in the middle of a frame, they are written between frames.
+ */
+ssize_t IoWrapper::writeBufAsWebsocketFrame(int fd, CirBuf &buf, IoWrapResult *error, size_t max)
+{
+    assert(!ssl);
+
+    *error = IoWrapResult::Success;
+
+    if (!incompleteWebsocketWrite.sillWorkingOnFrame())
+    {
+        while (websocketWriteRemainder.usedBytes() > 0)
         {
-            header[x++] = (nbytes64 >> (z*8)) & 0xFF;
+            const ssize_t n = writeOrSslWrite(fd, websocketWriteRemainder.tailPtr(), websocketWriteRemainder.maxReadSize(), error);
+
+            if (n <= 0)
+                return 0;
+
+            websocketWriteRemainder.advanceTail(n);
         }
-        assert(x <= WEBSOCKET_MAX_SENDING_HEADER_SIZE);
-        assert(x == header_length);
 
-        websocketWriteRemainder.writerange(header.begin(), header.begin() + header_length);
-        websocketWriteRemainder.write(buf, nBytesReal);
+        if (buf.usedBytes() == 0)
+            return 0;
+
+        incompleteWebsocketWrite.start(std::min<size_t>(buf.usedBytes(), max));
     }
 
-    return nBytesReal;
+    std::array<struct iovec, 2> iov;
+    int iovcnt = 0;
+
+    const size_t header_bytes_left = incompleteWebsocketWrite.header_length - incompleteWebsocketWrite.header_bytes_written;
+    if (header_bytes_left > 0)
+    {
+        iov[iovcnt].iov_base = &incompleteWebsocketWrite.header[incompleteWebsocketWrite.header_bytes_written];
+        iov[iovcnt++].iov_len = header_bytes_left;
+    }
+
+    const size_t payload_len = std::min<size_t>(incompleteWebsocketWrite.frame_bytes_left, buf.maxReadSize());
+    if (payload_len > 0)
+    {
+        iov[iovcnt].iov_base = buf.tailPtr();
+        iov[iovcnt++].iov_len = payload_len;
+    }
+
+    assert(iovcnt > 0);
+
+    const ssize_t n = writev(fd, iov.data(), iovcnt);
+
+    if (n < 0)
+    {
+        if (errno == EINTR)
+            *error = IoWrapResult::Interrupted;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            *error = IoWrapResult::Wouldblock;
+        else
+            check<std::runtime_error>(n);
+
+        return 0;
+    }
+
+    const size_t header_part = std::min<size_t>(n, header_bytes_left);
+    const size_t payload_part = n - header_part;
+    incompleteWebsocketWrite.header_bytes_written += header_part;
+    incompleteWebsocketWrite.frame_bytes_left -= payload_part;
+
+    return payload_part;
 }
 
 /**
@@ -1032,12 +1168,35 @@ ssize_t IoWrapper::writeWebsocketAndOrSsl(int fd, const void *buf, size_t nbytes
     }
 }
 
+/**
+ * @brief IoWrapper::writeWebsocketAndOrSsl writes from the client's write buffer. Upgraded websockets without SSL get all of it in one
+ * frame, without copying. The rest writes the contiguous part at the tail.
+ * @param max The most bytes to take from buf.
+ * @return number of bytes of buf written or consumed, see the other overload.
+ */
+ssize_t IoWrapper::writeWebsocketAndOrSsl(int fd, CirBuf &buf, IoWrapResult *error, size_t max)
+{
+    if (websocketState == WebsocketState::Upgraded && !ssl)
+        return writeBufAsWebsocketFrame(fd, buf, error, max);
+
+    return writeWebsocketAndOrSsl(fd, buf.tailPtr(), std::min<size_t>(buf.maxReadSize(), max), error);
+}
+
+/**
+ * @brief IoWrapper::canChangeWriteSource says whether the next write may come from another buffer. An SSL write that has to be repeated
+ * must get the same buffer, and a websocket frame in progress must be finished from the buffer it started with.
+ */
+bool IoWrapper::canChangeWriteSource() const
+{
+    return !incompleteSslWrite.hasPendingWrite() && !incompleteWebsocketWrite.sillWorkingOnFrame();
+}
+
 void IoWrapper::resetBuffersIfEligible()
 {
     const Settings *settings = ThreadGlobals::getSettings();
     const size_t initialBufferSize = settings->clientInitialBufferSize;
 
-    const size_t sz = websocket ? initialBufferSize : 0;
+    const size_t sz = websocket && !settings->minimizeIdleConnectionMemory ? initialBufferSize : 0;
     websocketPendingBytes.resetSizeIfEligable(sz),
     websocketWriteRemainder.resetSizeIfEligable(sz);
 }
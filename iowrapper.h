@@ -15,6 +15,8 @@ See LICENSE for license details.
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <exception>
+#include <array>
+#include <limits>
 
 #include "forward_declarations.h"
 
@@ -80,9 +82,24 @@ struct IncompleteWebsocketRead
     void reset();
     bool sillWorkingOnFrame() const;
     char getNextMaskingByte();
+    void unmask(char *dst, const char *src, const size_t len);
     IncompleteWebsocketRead();
 };
 
+/**
+ * @brief Frame we are writing the payload of directly from the client's write buffer, see IoWrapper::writeBufAsWebsocketFrame().
+ */
+struct IncompleteWebsocketWrite
+{
+    std::array<char, WEBSOCKET_MAX_SENDING_HEADER_SIZE> header;
+    uint8_t header_length = 0;
+    uint8_t header_bytes_written = 0;
+    size_t frame_bytes_left = 0;
+
+    void start(const size_t payload_length);
+    bool sillWorkingOnFrame() const;
+};
+
 enum class WebsocketState
 {
     NotUpgraded,
@@ -110,6 +127,7 @@ class IoWrapper
     CirBuf websocketPendingBytes;
     IncompleteWebsocketRead incompleteWebsocketRead;
     CirBuf websocketWriteRemainder;
+    IncompleteWebsocketWrite incompleteWebsocketWrite;
 
     bool _needsHaProxyParsing = false;
 
@@ -119,6 +137,7 @@ class IoWrapper
     ssize_t readOrSslRead(int fd, void *buf, size_t nbytes, IoWrapResult *error);
     ssize_t writeOrSslWrite(int fd, const void *buf, size_t nbytes, IoWrapResult *error);
     ssize_t writeAsMuchOfBufAsWebsocketFrame(const void *buf, const size_t nbytes, WebsocketOpcode opcode = WebsocketOpcode::Binary);
+    ssize_t writeBufAsWebsocketFrame(int fd, CirBuf &buf, IoWrapResult *error, size_t max);
 
     void startOrContinueSslConnect();
     void startOrContinueSslAccept();
@@ -139,6 +158,8 @@ public:
     WebsocketState getWebsocketState() const;
     X509Manager getPeerCertificate() const;
     const char *getSslVersion() const;
+    bool isKtlsSend() const;
+    bool isKtlsRecv() const;
 
     bool needsHaProxyParsing() const;
     HaProxyConnectionType readHaProxyData(int fd, struct sockaddr *addr);
@@ -150,6 +171,8 @@ public:
 
     ssize_t readWebsocketAndOrSsl(int fd, void *buf, size_t nbytes, IoWrapResult *error);
     ssize_t writeWebsocketAndOrSsl(int fd, const void *buf, size_t nbytes, IoWrapResult *error);
+    ssize_t writeWebsocketAndOrSsl(int fd, CirBuf &buf, IoWrapResult *error, size_t max = std::numeric_limits<size_t>::max());
+    bool canChangeWriteSource() const;
 
     void resetBuffersIfEligible();
 };
@@ -0,0 +1,104 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#include "latencyhistogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+size_t LatencyHistogram::getBucket(uint64_t value)
+{
+    if (value < LATENCY_HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    const int exponent = 63 - __builtin_clzll(value);
+
+    if (exponent > LATENCY_HISTOGRAM_MAX_EXPONENT)
+        return LATENCY_HISTOGRAM_BUCKETS - 1;
+
+    const size_t sub_bucket = (value >> (exponent - LATENCY_HISTOGRAM_SUB_BUCKET_BITS)) & (LATENCY_HISTOGRAM_SUB_BUCKETS - 1);
+    return LATENCY_HISTOGRAM_SUB_BUCKETS + (exponent - LATENCY_HISTOGRAM_SUB_BUCKET_BITS) * LATENCY_HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/**
+ * @brief LatencyHistogram::getBucketUpperValue gives the highest value that ends up in the bucket, so percentiles err on the high side.
+ */
+uint64_t LatencyHistogram::getBucketUpperValue(size_t bucket)
+{
+    if (bucket < LATENCY_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    const size_t exponent = (bucket - LATENCY_HISTOGRAM_SUB_BUCKETS) / LATENCY_HISTOGRAM_SUB_BUCKETS + LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+    const uint64_t sub_bucket = (bucket - LATENCY_HISTOGRAM_SUB_BUCKETS) % LATENCY_HISTOGRAM_SUB_BUCKETS;
+    const uint64_t width = uint64_t(1) << (exponent - LATENCY_HISTOGRAM_SUB_BUCKET_BITS);
+    return (uint64_t(1) << exponent) + (sub_bucket + 1) * width - 1;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    std::atomic<uint64_t> &c = counts[getBucket(value)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if (value > maxValue.load(std::memory_order_relaxed))
+        maxValue.store(value, std::memory_order_relaxed);
+}
+
+/**
+ * @brief LatencyHistogramSnapshot::takeInterval adds what was recorded in the histogram since the last time it was taken.
+ *
+ * Like DerivableCounter::getPerSecond(), it swaps out the previous values atomically instead of locking.
+ */
+void LatencyHistogramSnapshot::takeInterval(LatencyHistogram &histogram)
+{
+    for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+        const uint64_t cur = histogram.counts[i].load(std::memory_order_relaxed);
+        const uint64_t previous = histogram.countsPrevious[i].exchange(cur, std::memory_order_relaxed);
+        const uint64_t n = cur > previous ? cur - previous : 0;
+
+        counts[i] += n;
+        count += n;
+    }
+
+    maxValue = std::max(maxValue, histogram.maxValue.exchange(0, std::memory_order_relaxed));
+}
+
+uint64_t LatencyHistogramSnapshot::getCount() const
+{
+    return count;
+}
+
+uint64_t LatencyHistogramSnapshot::getMax() const
+{
+    return maxValue;
+}
+
+/**
+ * @brief LatencyHistogramSnapshot::getPercentile gives the value below which the given percentage of values lie.
+ * @param percentile like 99.9.
+ */
+uint64_t LatencyHistogramSnapshot::getPercentile(double percentile) const
+{
+    if (count == 0)
+        return 0;
+
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(count * percentile / 100.0)));
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += counts[i];
+
+        if (seen >= rank)
+            return std::min(LatencyHistogram::getBucketUpperValue(i), maxValue > 0 ? maxValue : UINT64_MAX);
+    }
+
+    return maxValue;
+}
@@ -0,0 +1,67 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Log-linear buckets, like HDR histograms: values below 16 get a bucket each, and each power of two above that is split in 16 buckets. That
+ * makes the error at most 1/16th (6%) of the value, over the whole range.
+ */
+constexpr int LATENCY_HISTOGRAM_SUB_BUCKET_BITS = 4;
+constexpr int LATENCY_HISTOGRAM_SUB_BUCKETS = 1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+constexpr int LATENCY_HISTOGRAM_MAX_EXPONENT = 40; // In microseconds, that's almost 13 days. Anything longer is counted as that.
+constexpr size_t LATENCY_HISTOGRAM_BUCKETS =
+    LATENCY_HISTOGRAM_SUB_BUCKETS + (LATENCY_HISTOGRAM_MAX_EXPONENT - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS;
+
+class LatencyHistogramSnapshot;
+
+/**
+ * @brief The LatencyHistogram class counts durations in log-linear buckets. Like the DerivableCounter, it has one writer, the thread that
+ * owns it, and can be read from other threads.
+ */
+class alignas(64) LatencyHistogram
+{
+    friend class LatencyHistogramSnapshot;
+
+    std::array<std::atomic<uint64_t>, LATENCY_HISTOGRAM_BUCKETS> counts {};
+    std::array<std::atomic<uint64_t>, LATENCY_HISTOGRAM_BUCKETS> countsPrevious {};
+    std::atomic<uint64_t> maxValue {0}; // Since the last snapshot.
+
+public:
+    static size_t getBucket(uint64_t value);
+    static uint64_t getBucketUpperValue(size_t bucket);
+
+    void record(uint64_t value);
+};
+
+/**
+ * @brief The LatencyHistogramSnapshot class adds up the values recorded since the previous snapshot, of one or more histograms.
+ */
+class LatencyHistogramSnapshot
+{
+    std::array<uint64_t, LATENCY_HISTOGRAM_BUCKETS> counts {};
+    uint64_t count = 0;
+    uint64_t maxValue = 0;
+
+public:
+    void takeInterval(LatencyHistogram &histogram);
+
+    uint64_t getCount() const;
+    uint64_t getMax() const;
+    uint64_t getPercentile(double percentile) const;
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -18,6 +18,18 @@ See LICENSE for license details.
 
 void Listener::isValid()
 {
+    if (metrics)
+    {
+        if (isSsl())
+            throw ConfigFileException("Listeners with 'protocol metrics' can't be TLS.");
+
+        if (haproxy)
+            throw ConfigFileException("Option 'haproxy' can't be used on listeners with 'protocol metrics'.");
+
+        if (port == 0)
+            throw ConfigFileException("Listeners with 'protocol metrics' need a 'port'.");
+    }
+
     if (isSsl())
     {
         if (port == 0)
@@ -47,6 +59,11 @@ void Listener::isValid()
         throw ConfigFileException("X509 client verification can only be done on TLS listeners.");
     }
 
+    if (ktls && !isSsl())
+    {
+        throw ConfigFileException("Option 'ktls' can only be used on TLS listeners.");
+    }
+
     if (port <= 0 || port > 65534)
     {
         throw ConfigFileException(formatString("Port nr %d is not valid", port));
@@ -70,6 +87,9 @@ bool Listener::isHaProxy() const
 
 std::string Listener::getProtocolName() const
 {
+    if (metrics)
+        return "metrics HTTP";
+
     if (isSsl())
     {
         if (websocket)
@@ -88,7 +108,7 @@ std::string Listener::getProtocolName() const
     return "whoops";
 }
 
-void Listener::loadCertAndKeyFromConfig()
+void Listener::loadCertAndKeyFromConfig(bool releaseIdleBuffers)
 {
     if (!isSsl())
         return;
@@ -99,11 +119,18 @@ void Listener::loadCertAndKeyFromConfig()
         sslctx->setMinimumTlsVersion(minimumTlsVersion);
         SSL_CTX_set_mode(sslctx->get(), SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
+        // Makes OpenSSL free its read and write buffers of connections that have nothing buffered.
+        if (releaseIdleBuffers)
+            SSL_CTX_set_mode(sslctx->get(), SSL_MODE_RELEASE_BUFFERS);
+
         /*
          * Session cache requires active shutdown of SSL connections, which we don't have right now. We
          * might as well just turn the session cache off, at least until we do have session shutdown.
          */
         SSL_CTX_set_session_cache_mode(sslctx->get(), SSL_SESS_CACHE_OFF);
+
+        if (ktls && !sslctx->enableKtls())
+            Logger::getInstance()->log(LOG_WARNING) << "Option 'ktls' is set, but this OpenSSL is built without kTLS support. Ignoring.";
     }
 
     if (SSL_CTX_use_certificate_chain_file(sslctx->get(), sslFullchain.c_str()) != 1)
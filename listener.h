@@ -17,6 +17,7 @@ See LICENSE for license details.
 
 #include "sslctxmanager.h"
 #include "enums.h"
+#include "admissioncontroller.h"
 
 enum class ListenerProtocol
 {
@@ -38,6 +39,7 @@ struct Listener
     std::string inet6BindAddress;
     int port = 0;
     bool websocket = false;
+    bool metrics = false;
     bool tcpNoDelay = false;
     bool haproxy = false;
     std::string sslFullchain;
@@ -48,14 +50,19 @@ struct Listener
     std::unique_ptr<SslCtxManager> sslctx;
     AllowListenerAnonymous allowAnonymous = AllowListenerAnonymous::None;
     TLSVersion minimumTlsVersion = TLSVersion::TLSv1_1;
+    bool ktls = false;
+    bool conflateWhenBacklogged = false;
     std::optional<OverloadMode> overloadMode;
+    uint32_t maxConnectionRate = 0;
+    ConnectionRateMode connectionRateMode = ConnectionRateMode::Defer;
+    AdmissionController admission;
 
     void isValid();
     bool isSsl() const;
     bool isHaProxy() const;
     bool isTcpNoDelay() const;
     std::string getProtocolName() const;
-    void loadCertAndKeyFromConfig();
+    void loadCertAndKeyFromConfig(bool releaseIdleBuffers);
     X509ClientVerification getX509ClientVerficationMode() const;
 
     std::string getBindAddress(ListenerProtocol p);
@@ -14,23 +14,33 @@ See LICENSE for license details.
 #include <string.h>
 #include <functional>
 #include <mutex>
+#include <queue>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include "threaddata.h"
 #include "threadglobals.h"
 #include "utils.h"
 
+#define LOG_REPEAT_SUMMARY_INTERVAL std::chrono::seconds(5)
+#define LOG_STOP_GRACE_ROUNDS 1000
+
 Logger* Logger::instance = nullptr;
 std::mutex Logger::instanceMutex;
+std::atomic<uint64_t> Logger::nextId {0};
 
-LogLine::LogLine(std::string &&line, bool alsoToStdOut) :
+LogLine::LogLine(std::string &&line, size_t prefixLength, bool alsoToStdOut) :
     line(std::move(line)),
+    prefixLength(std::min(prefixLength, this->line.length())),
     alsoToStdOut(alsoToStdOut)
 {
 
 }
 
-LogLine::LogLine(const char *s, size_t len, bool alsoToStdOut) :
+LogLine::LogLine(const char *s, size_t len, size_t prefixLength, bool alsoToStdOut) :
     line(s, len),
+    prefixLength(std::min(prefixLength, len)),
     alsoToStdOut(alsoToStdOut)
 {
 
@@ -47,11 +57,129 @@ const char *LogLine::c_str() const
     return line.c_str();
 }
 
+size_t LogLine::length() const
+{
+    return line.length();
+}
+
 bool LogLine::alsoLogToStdOut() const
 {
     return alsoToStdOut;
 }
 
+void LogLine::setSequence(uint64_t sequence)
+{
+    this->sequence = sequence;
+}
+
+uint64_t LogLine::getSequence() const
+{
+    return sequence;
+}
+
+/**
+ * @brief LogLine::withoutTimestamp is what's compared to see if a line is a repeat of the previous one.
+ */
+std::string_view LogLine::withoutTimestamp() const
+{
+    std::string_view v(line);
+    const size_t pos = v.find("] ");
+
+    if (pos == std::string_view::npos || pos >= prefixLength)
+        return v;
+
+    return v.substr(pos + 2);
+}
+
+/**
+ * @brief LogLine::prefixWithoutTimestamp gives the level and thread part of the prefix, like '[WARNING] [T 2] '.
+ */
+std::string_view LogLine::prefixWithoutTimestamp() const
+{
+    std::string_view v(line);
+    v = v.substr(0, prefixLength);
+    const size_t pos = v.find("] ");
+
+    if (pos == std::string_view::npos)
+        return v;
+
+    return v.substr(pos + 2);
+}
+
+LogRing::LogRing() :
+    lines(std::make_unique<LogLine[]>(capacity))
+{
+
+}
+
+/**
+ * @brief LogRing::push is to be called by the thread owning the ring only.
+ */
+void LogRing::push(LogLine &&line)
+{
+    if (!overflowActive.load(std::memory_order_acquire))
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+
+        if (t - head.load(std::memory_order_acquire) < capacity)
+        {
+            lines[t % capacity] = std::move(line);
+            tail.store(t + 1, std::memory_order_release);
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> locker(overflowMutex);
+    overflow.push_back(std::move(line));
+    overflowActive.store(true, std::memory_order_release);
+}
+
+/**
+ * @brief LogRing::empty is to be called by the log writer thread only.
+ */
+bool LogRing::empty() const
+{
+    return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire) && !overflowActive.load(std::memory_order_acquire);
+}
+
+void LogRing::takeFromRing(std::vector<LogLine> &out)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+    const size_t t = tail.load(std::memory_order_acquire);
+
+    while (h != t)
+    {
+        out.push_back(std::move(lines[h % capacity]));
+        h++;
+    }
+
+    head.store(h, std::memory_order_release);
+}
+
+/**
+ * @brief LogRing::takeAll is to be called by the log writer thread only.
+ */
+void LogRing::takeAll(std::vector<LogLine> &out)
+{
+    takeFromRing(out);
+
+    if (!overflowActive.load(std::memory_order_acquire))
+        return;
+
+    // The ring isn't used while the overflow list is, so after emptying it once more, everything in the overflow list is newer.
+    takeFromRing(out);
+
+    std::lock_guard<std::mutex> locker(overflowMutex);
+
+    for (LogLine &line : overflow)
+    {
+        out.push_back(std::move(line));
+    }
+
+    overflow.clear();
+    overflowActive.store(false, std::memory_order_release);
+}
+
 Logger::Logger()
 {
     memset(&linesPending, 1, sizeof(sem_t));
@@ -154,9 +282,56 @@ StreamToLog Logger::log(int level)
 void Logger::queueReOpen()
 {
     reload = true;
+    wakeUpWriter();
+}
+
+/**
+ * @brief Logger::wakeUpWriter only posts the semaphore when the writer hasn't been woken up already, so a burst of lines doesn't mean
+ * a burst of sem_post calls.
+ */
+void Logger::wakeUpWriter()
+{
+    if (wakeUpPending.exchange(true))
+        return;
+
     sem_post(&linesPending);
 }
 
+/**
+ * @brief Logger::getRingOfThisThread gives the calling thread's ring, and registers one on first use. Rings are shared pointers, so
+ * the writer can still empty a ring of a thread that has exited.
+ */
+LogRing &Logger::getRingOfThisThread()
+{
+    struct ThreadRing
+    {
+        uint64_t loggerId = 0;
+        std::shared_ptr<LogRing> ring;
+    };
+
+    thread_local ThreadRing threadRing;
+
+    // The logger can be recreated (see stopAndReset()), so the ring has to be from this instance.
+    if (threadRing.loggerId != this->id || !threadRing.ring)
+    {
+        threadRing.ring = std::make_shared<LogRing>();
+        threadRing.loggerId = this->id;
+
+        std::lock_guard<std::mutex> locker(ringsMutex);
+        rings.push_back(threadRing.ring);
+    }
+
+    return *threadRing.ring;
+}
+
+void Logger::queueLine(LogLine &&line)
+{
+    LogRing &ring = getRingOfThisThread();
+    line.setSequence(nextSequence.fetch_add(1, std::memory_order_relaxed));
+    ring.push(std::move(line));
+    wakeUpWriter();
+}
+
 void Logger::reOpen()
 {
     reload = false;
@@ -259,53 +434,269 @@ void Logger::quit()
         writerThread.join();
 }
 
-void Logger::writeLog()
+/**
+ * @brief writevAll writes all of iov, dealing with partial writes and IOV_MAX. It modifies iov.
+ */
+static bool writevAll(int fd, std::vector<struct iovec> &iov)
 {
-    maskAllSignalsCurrentThread();
-
-    int graceCounter = 0;
+    size_t i = 0;
 
-    LogLine line;
-    while(running || (!lines.empty() && graceCounter++ < 1000 ))
+    while (i < iov.size())
     {
-        sem_wait(&linesPending);
+        const int count = std::min<size_t>(iov.size() - i, IOV_MAX);
+        ssize_t n = writev(fd, &iov[i], count);
 
-        if (reload)
+        if (n < 0)
         {
-            reOpen();
+            if (errno == EINTR)
+                continue;
+            return false;
         }
 
+        while (n > 0 && i < iov.size())
         {
-            std::lock_guard<std::mutex> locker(logMutex);
+            struct iovec &cur = iov[i];
 
-            if (lines.empty())
+            if (static_cast<size_t>(n) >= cur.iov_len)
+            {
+                n -= cur.iov_len;
+                i++;
                 continue;
+            }
 
-            line = std::move(lines.front());
-            lines.pop();
+            cur.iov_base = static_cast<char*>(cur.iov_base) + n;
+            cur.iov_len -= n;
+            n = 0;
         }
+    }
+
+    return true;
+}
 
-        if (this->file)
+/**
+ * @brief Logger::collectLines empties all rings into out, in the order the lines were logged in. A line that is the same as the previous
+ * line of that thread (apart from the timestamp) is not written, but counted, and then summarized with 'Last message repeated N times.'.
+ * This way, a log storm costs little more than the comparison.
+ *
+ * Each ring is in order, so merging them on the sequence numbers gives the order over all threads. A line is only written when all lines
+ * before it are there, because a thread may have taken its number, but not pushed the line yet. That thread wakes us up when it has.
+ *
+ * @param flush to write all lines and summaries, also when lines before them are missing, or the interval hasn't passed yet. For when
+ * we're stopping.
+ * @return whether there are repeats that haven't been summarized yet.
+ */
+bool Logger::collectLines(std::vector<std::shared_ptr<LogRing>> &ringsCopy, std::vector<LogLine> &scratch, std::vector<LogLine> &out,
+                          bool flush)
+{
+    {
+        std::lock_guard<std::mutex> locker(ringsMutex);
+
+        // Rings of threads that are gone (the only reference is ours) can go when they have nothing left to say.
+        auto pos = rings.begin();
+        while (pos != rings.end())
         {
-            if (fputs(line.c_str(), this->file) < 0 ||
-                fputs("\n", this->file) < 0 ||
-                fflush(this->file) != 0)
+            if (pos->use_count() == 1 && (*pos)->repeats == 0 && (*pos)->empty() && (*pos)->pending.empty())
             {
-                alsoLogToStd = true;
-                fputs("Writing to log failed. Enabling stdout logger.", stderr);
+                pos = rings.erase(pos);
+                continue;
             }
+
+            pos++;
         }
 
-        if (!this->file || line.alsoLogToStdOut())
+        ringsCopy = rings;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    bool repeatsPending = false;
+
+    auto summarize = [&out](LogRing &ring)
+    {
+        std::string summary = "[" + timestampWithMillis() + "] ";
+        summary.append(ring.lastPrefix);
+        const size_t prefix_length = summary.length();
+        summary.append("Last message repeated ").append(std::to_string(ring.repeats)).append(" times.");
+        out.emplace_back(std::move(summary), prefix_length, ring.lastAlsoToStdOut);
+        ring.repeats = 0;
+    };
+
+    // The sequence number of the first line of each ring, and the ring's index.
+    using Head = std::pair<uint64_t, size_t>;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+
+    for (size_t i = 0; i < ringsCopy.size(); i++)
+    {
+        LogRing &ring = *ringsCopy[i];
+        ring.takeAll(scratch);
+
+        for (LogLine &line : scratch)
+        {
+            ring.pending.push_back(std::move(line));
+        }
+
+        scratch.clear();
+
+        if (!ring.pending.empty())
+            heads.emplace(ring.pending.front().getSequence(), i);
+    }
+
+    while (!heads.empty())
+    {
+        const Head head = heads.top();
+
+        if (head.first != nextSequenceToWrite && !flush)
+            break;
+
+        heads.pop();
+        nextSequenceToWrite = head.first + 1;
+
+        LogRing &ring = *ringsCopy[head.second];
+        LogLine line = std::move(ring.pending.front());
+        ring.pending.pop_front();
+
+        if (!ring.pending.empty())
+            heads.emplace(ring.pending.front().getSequence(), head.second);
+
+        const std::string_view text = line.withoutTimestamp();
+
+        if (text == ring.lastLine)
+        {
+            if (ring.repeats++ == 0)
+                ring.repeatsSince = now;
+            continue;
+        }
+
+        if (ring.repeats > 0)
+            summarize(ring);
+
+        ring.lastLine = text;
+        ring.lastPrefix = line.prefixWithoutTimestamp();
+        ring.lastAlsoToStdOut = line.alsoLogToStdOut();
+        out.push_back(std::move(line));
+    }
+
+    for (std::shared_ptr<LogRing> &ringPtr : ringsCopy)
+    {
+        LogRing &ring = *ringPtr;
+
+        if (ring.repeats > 0 && (flush || now - ring.repeatsSince >= LOG_REPEAT_SUMMARY_INTERVAL))
+            summarize(ring);
+
+        repeatsPending |= ring.repeats > 0;
+    }
+
+    ringsCopy.clear();
+    return repeatsPending;
+}
+
+/**
+ * @brief Logger::allRingsEmpty is for the writer thread, to see if other threads are still logging while we stop.
+ */
+bool Logger::allRingsEmpty()
+{
+    std::lock_guard<std::mutex> locker(ringsMutex);
+
+    for (const std::shared_ptr<LogRing> &ring : rings)
+    {
+        if (!ring->empty())
+            return false;
+    }
+
+    return true;
+}
+
+void Logger::writeLines(const std::vector<LogLine> &out)
+{
+    if (out.empty())
+        return;
+
+    std::vector<struct iovec> iov;
+    iov.reserve(out.size() * 2);
+
+    auto addLine = [&iov](const LogLine &line)
+    {
+        static char newline[] = "\n";
+        iov.push_back({const_cast<char*>(line.c_str()), line.length()});
+        iov.push_back({newline, 1});
+    };
+
+    if (this->file)
+    {
+        for (const LogLine &line : out)
+            addLine(line);
+
+        if (!writevAll(fileno(this->file), iov))
         {
-            FILE *output = stdout;
+            alsoLogToStd = true;
+            fputs("Writing to log failed. Enabling stdout logger.", stderr);
+        }
+
+        iov.clear();
+    }
+
+    for (const LogLine &line : out)
+    {
+        if (!this->file || line.alsoLogToStdOut())
+            addLine(line);
+    }
+
+    if (iov.empty())
+        return;
+
+    FILE *output = stdout;
 #ifdef TESTING
-            output = stderr; // the stdout interfers with Qt test XML output, so using stderr.
+    output = stderr; // the stdout interfers with Qt test XML output, so using stderr.
 #endif
-            fputs(line.c_str(), output);
-            fputs("\n", output);
-            fflush(output);
+    fflush(output);
+    writevAll(fileno(output), iov);
+}
+
+void Logger::writeLog()
+{
+    maskAllSignalsCurrentThread();
+
+    std::vector<std::shared_ptr<LogRing>> ringsCopy;
+    std::vector<LogLine> scratch;
+    std::vector<LogLine> out;
+    bool repeatsPending = false;
+    int graceCounter = 0;
+
+    for(;;)
+    {
+        // Read before emptying the rings, so that what was logged before quit() is still written.
+        const bool stopping = !running;
+
+        if (!stopping)
+        {
+            // Only wake up periodically when there are repeat summaries that may need writing.
+            if (repeatsPending)
+            {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += 1;
+                if (sem_timedwait(&linesPending, &deadline) < 0 && errno == EINTR)
+                    continue;
+            }
+            else if (sem_wait(&linesPending) < 0 && errno == EINTR)
+                continue;
         }
+
+        // Lines logged after this get a new wake-up. The fence orders the store with our reading of the rings.
+        wakeUpPending.store(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (reload)
+        {
+            reOpen();
+        }
+
+        repeatsPending = collectLines(ringsCopy, scratch, out, stopping);
+        writeLines(out);
+        out.clear();
+
+        // Other threads may still be logging while we stop, so we keep emptying the rings for a while.
+        if (stopping && (allRingsEmpty() || graceCounter++ >= LOG_STOP_GRACE_ROUNDS))
+            break;
     }
 }
 
@@ -335,15 +726,9 @@ void Logger::logstring(int level, const std::string &str)
         return;
 
     std::string s = getPrefix(level);
+    const size_t prefix_length = s.length();
     s.append(str);
-    LogLine line(std::move(s), alsoLogToStd);
-
-    {
-        std::lock_guard<std::mutex> locker(logMutex);
-        lines.push(std::move(line));
-    }
-
-    sem_post(&linesPending);
+    queueLine(LogLine(std::move(s), prefix_length, alsoLogToStd));
 }
 
 void Logger::logf(int level, const char *str, va_list valist)
@@ -352,6 +737,7 @@ void Logger::logf(int level, const char *str, va_list valist)
         return;
 
     std::string s = getPrefix(level);
+    const size_t prefix_length = s.length();
     s.append(str);
     const char *logfmtstring = s.c_str();
 
@@ -364,15 +750,10 @@ void Logger::logf(int level, const char *str, va_list valist)
     va_copy(valist2, valist);
     vsnprintf(buf, buf_size, logfmtstring, valist2);
     size_t len = std::min<size_t>(buf_size, strlen(buf));
-    LogLine line(buf, len, alsoLogToStd);
+    LogLine line(buf, len, prefix_length, alsoLogToStd);
     va_end(valist2);
 
-    {
-        std::lock_guard<std::mutex> locker(logMutex);
-        lines.push(std::move(line));
-    }
-
-    sem_post(&linesPending);
+    queueLine(std::move(line));
 }
 
 int logSslError(const char *str, size_t len, void *u)
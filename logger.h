@@ -14,10 +14,14 @@ See LICENSE for license details.
 #include <stdio.h>
 #include <stdarg.h>
 #include <mutex>
-#include <queue>
 #include <thread>
 #include <sstream>
 #include <optional>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <chrono>
 #include "semaphore.h"
 
 #include "flashmq_plugin.h"
@@ -48,18 +52,63 @@ public:
 class LogLine
 {
     std::string line;
+    size_t prefixLength = 0;
     bool alsoToStdOut;
+    uint64_t sequence = 0;
 
 public:
-    LogLine(std::string &&line, bool alsoToStdOut);
-    LogLine(const char *s, size_t len, bool alsoToStdOut);
+    LogLine(std::string &&line, size_t prefixLength, bool alsoToStdOut);
+    LogLine(const char *s, size_t len, size_t prefixLength, bool alsoToStdOut);
     LogLine();
     LogLine(const LogLine &other) = delete;
     LogLine(LogLine &&other) = default;
     LogLine &operator=(LogLine &&other) = default;
 
     const char *c_str() const;
+    size_t length() const;
     bool alsoLogToStdOut() const;
+    void setSequence(uint64_t sequence);
+    uint64_t getSequence() const;
+    std::string_view withoutTimestamp() const;
+    std::string_view prefixWithoutTimestamp() const;
+};
+
+/**
+ * @brief The LogRing class is the lock-free queue between one logging thread and the log writer thread. Each thread that logs gets
+ * its own, so threads don't contend with each other.
+ *
+ * When the ring is full, lines go into an overflow list with a mutex, instead of being dropped or blocking on the writer. That list is
+ * then used until the writer has emptied it, to keep the lines in order.
+ */
+class LogRing
+{
+    static constexpr size_t capacity = 1024;
+
+    std::unique_ptr<LogLine[]> lines;
+    alignas(64) std::atomic<size_t> head {0}; // Written by the writer.
+    alignas(64) std::atomic<size_t> tail {0}; // Written by the logging thread.
+
+    std::atomic<bool> overflowActive {false};
+    std::mutex overflowMutex;
+    std::vector<LogLine> overflow;
+
+    void takeFromRing(std::vector<LogLine> &out);
+
+public:
+    // Only used by the writer thread: lines waiting for their turn (see Logger::collectLines()), and to detect repeated lines.
+    std::deque<LogLine> pending;
+    std::string lastLine;
+    std::string lastPrefix;
+    bool lastAlsoToStdOut = true;
+    size_t repeats = 0;
+    std::chrono::time_point<std::chrono::steady_clock> repeatsSince;
+
+    LogRing();
+    LogRing(const LogRing &other) = delete;
+
+    void push(LogLine &&line);
+    void takeAll(std::vector<LogLine> &out);
+    bool empty() const;
 };
 
 class Logger
@@ -67,22 +116,34 @@ class Logger
     static Logger *instance;
     static std::mutex instanceMutex;
 
+    static std::atomic<uint64_t> nextId;
+
+    const uint64_t id = ++nextId;
+    std::atomic<uint64_t> nextSequence {0}; // Numbers the lines of all threads, so the writer can put them in order.
+    uint64_t nextSequenceToWrite = 0; // Only used by the writer thread.
     std::string logPath;
     int curLogLevel = LOG_ERR | LOG_WARNING | LOG_NOTICE | LOG_INFO | LOG_SUBSCRIBE | LOG_UNSUBSCRIBE ;
-    std::mutex logMutex;
-    std::queue<LogLine> lines;
+    std::mutex ringsMutex;
+    std::vector<std::shared_ptr<LogRing>> rings;
     sem_t linesPending;
+    std::atomic<bool> wakeUpPending {false};
     std::thread writerThread;
-    bool running = true;
+    std::atomic<bool> running {true};
     FILE *file = nullptr;
     bool alsoLogToStd = true;
-    bool reload = false;
+    std::atomic<bool> reload {false};
 
     Logger();
     ~Logger();
     static std::string_view getLogLevelString(int level);
     void reOpen();
     void writeLog();
+    void wakeUpWriter();
+    LogRing &getRingOfThisThread();
+    void queueLine(LogLine &&line);
+    bool collectLines(std::vector<std::shared_ptr<LogRing>> &ringsCopy, std::vector<LogLine> &scratch, std::vector<LogLine> &out, bool flush);
+    bool allRingsEmpty();
+    void writeLines(const std::vector<LogLine> &out);
     static std::string getPrefix(int level);
 
 public:
@@ -0,0 +1,67 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#include "loopprofiler.h"
+
+#include <stdexcept>
+
+std::string loopPhaseToString(LoopPhase phase)
+{
+    switch (phase)
+    {
+    case LoopPhase::Read:
+        return "read";
+    case LoopPhase::Parse:
+        return "parse";
+    case LoopPhase::Handle:
+        return "handle";
+    case LoopPhase::Write:
+        return "write";
+    case LoopPhase::QueuedTasks:
+        return "queued_tasks";
+    case LoopPhase::DelayedTasks:
+        return "delayed_tasks";
+    case LoopPhase::RetainedMessages:
+        return "retained_messages";
+    default:
+        throw std::runtime_error("Unknown loop phase");
+    }
+}
+
+void LoopPhaseProfiler::startIteration()
+{
+    sampling = countdown-- == 0;
+
+    if (!sampling)
+        return;
+
+    countdown = sampleInterval - 1;
+    nanos.fill(0);
+    seen.fill(false);
+    lastMark = std::chrono::steady_clock::now();
+}
+
+/**
+ * @brief LoopPhaseProfiler::finishIteration records the phases that happened in this iteration. Phases that didn't happen are not recorded
+ * as zero, otherwise the percentiles of rare phases, like delayed tasks, would be meaningless.
+ */
+void LoopPhaseProfiler::finishIteration()
+{
+    if (!sampling)
+        return;
+
+    sampling = false;
+
+    for (size_t i = 0; i < LOOP_PHASE_COUNT; i++)
+    {
+        if (seen[i])
+            histograms[i].record(nanos[i] / 1000);
+    }
+}
@@ -0,0 +1,78 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#ifndef LOOPPROFILER_H
+#define LOOPPROFILER_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "latencyhistogram.h"
+
+enum class LoopPhase
+{
+    Read,
+    Parse,
+    Handle,
+    Write,
+    QueuedTasks,
+    DelayedTasks,
+    RetainedMessages
+};
+
+constexpr size_t LOOP_PHASE_COUNT = static_cast<size_t>(LoopPhase::RetainedMessages) + 1;
+
+std::string loopPhaseToString(LoopPhase phase);
+
+/**
+ * @brief The LoopPhaseProfiler class adds up how long each phase of an event loop iteration takes, and records that in a histogram per phase
+ * at the end of the iteration. Only one in sampleInterval iterations is timed, so the iterations that are not don't read
+ * the clock.
+ *
+ * Phases are charged with the time since the previous mark, so the gaps between phases you don't want counted need a mark().
+ */
+class LoopPhaseProfiler
+{
+    std::array<uint64_t, LOOP_PHASE_COUNT> nanos {};
+    std::array<bool, LOOP_PHASE_COUNT> seen {};
+    std::chrono::time_point<std::chrono::steady_clock> lastMark;
+    uint32_t countdown = 0;
+    bool sampling = false;
+
+public:
+    static constexpr uint32_t sampleInterval = 16;
+
+    std::array<LatencyHistogram, LOOP_PHASE_COUNT> histograms;
+
+    void startIteration();
+    void finishIteration();
+
+    void mark()
+    {
+        if (__builtin_expect(sampling, 0))
+            lastMark = std::chrono::steady_clock::now();
+    }
+
+    void charge(LoopPhase phase)
+    {
+        if (__builtin_expect(!sampling, 1))
+            return;
+
+        const auto now = std::chrono::steady_clock::now();
+        const size_t i = static_cast<size_t>(phase);
+        nanos[i] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastMark).count();
+        seen[i] = true;
+        lastMark = now;
+    }
+};
+
+#endif // LOOPPROFILER_H
@@ -33,6 +33,7 @@ See LICENSE for license details.
 #include "bridgeconfig.h"
 #include "bridgeinfodb.h"
 #include "globals.h"
+#include "memoryaccounting.h"
 
 MainApp *MainApp::instance = nullptr;
 
@@ -106,6 +107,7 @@ void MainApp::showLicense()
 #ifdef __SSE4_2__
     sse = "with SSE4.2 support";
 #endif
+    sse += ", topic scan kernel: " + topicScanKernelToString(getTopicScanKernel());
 
     printf("FlashMQ Version %s %s\n", FLASHMQ_VERSION, sse.c_str());
     puts("Copyright (C) 2021-2025 Wiebe Cazemier.");
@@ -196,6 +198,12 @@ void MainApp::queueKeepAliveCheckAtAllThreads()
     {
         thread->queueDoKeepAliveCheck();
     }
+
+    // To get rid of clients that connect and never complete the handshake.
+    for (std::shared_ptr<ThreadData> &thread : handshakeThreads)
+    {
+        thread->queueDoKeepAliveCheck();
+    }
 }
 
 void MainApp::queuePasswordFileReloadAllThreads()
@@ -226,7 +234,9 @@ void MainApp::queuePublishStatsOnDollarTopic()
 {
     if (!threads.empty())
     {
-        threads.at(0)->queuePublishStatsOnDollarTopic(threads);
+        std::vector<std::shared_ptr<ThreadData>> all_threads = threads;
+        all_threads.insert(all_threads.end(), handshakeThreads.begin(), handshakeThreads.end());
+        threads.at(0)->queuePublishStatsOnDollarTopic(all_threads);
     }
 }
 
@@ -328,7 +338,7 @@ void MainApp::queueBridgeReconnectAllThreads(bool alsoQueueNexts)
     if (alsoQueueNexts)
     {
         auto fReconnectBridges = std::bind(&MainApp::queueBridgeReconnectAllThreads, this, false);
-        timed_tasks.addTask(fReconnectBridges, 5000, true);
+        timed_tasks.addTask("queue_bridge_reconnect", fReconnectBridges, 5000, true);
     }
 }
 
@@ -351,6 +361,19 @@ void MainApp::queueInternalHeartbeat()
 
     drift.update(queue_time);
 
+    {
+        const MemoryPressure old_pressure = MemoryAccounting::getPressure();
+        const MemoryPressure new_pressure = MemoryAccounting::updatePressure(settings.memoryBudget);
+
+        if (new_pressure != old_pressure)
+        {
+            const int level = new_pressure > old_pressure ? LOG_WARNING : LOG_NOTICE;
+            Logger::getInstance()->log(level) << "Memory pressure changed from '" << memoryPressureToString(old_pressure) << "' to '"
+                                              << memoryPressureToString(new_pressure) << "'. Accounted memory is "
+                                              << MemoryAccounting::getTotalBytes() << " bytes of the 'memory_budget' of " << settings.memoryBudget << ".";
+        }
+    }
+
     std::vector<std::chrono::milliseconds> drifts(threads.size());
 
     std::transform(threads.begin(), threads.end(), drifts.begin(), [] (const std::shared_ptr<const ThreadData> &t) {
@@ -361,10 +384,215 @@ void MainApp::queueInternalHeartbeat()
     std::nth_element(drifts.begin(), drifts.begin() + n, drifts.end());
     this->medianThreadDrift = drifts.at(n);
 
+    adaptAdmissionRates();
+
     for (std::shared_ptr<ThreadData> &thread : threads)
     {
         thread->queueInternalHeartbeat();
     }
+
+    for (std::shared_ptr<ThreadData> &thread : handshakeThreads)
+    {
+        thread->queueInternalHeartbeat();
+    }
+}
+
+/**
+ * @brief MainApp::queueClientRebalance compares the traffic of the worker threads, and asks the busiest to move clients to the least busy
+ * one when they are too far apart.
+ */
+void MainApp::queueClientRebalance()
+{
+    std::vector<uint64_t> totals(threads.size());
+
+    std::transform(threads.begin(), threads.end(), totals.begin(), [] (const std::shared_ptr<const ThreadData> &t) {
+        return t->bytesReceived.get() + t->bytesSent.get();
+    });
+
+    const std::optional<ClientRebalanceMove> move = clientRebalancer.update(totals, std::chrono::steady_clock::now());
+
+    if (!move)
+        return;
+
+    std::shared_ptr<ThreadData> &from = threads.at(move->from);
+    std::shared_ptr<ThreadData> &to = threads.at(move->to);
+    from->queueClientRebalance(to, move->bytesPerSecond, settings.clientRebalanceInterval);
+}
+
+/**
+ * @brief MainApp::adaptAdmissionRates lowers the connection rate of listeners with 'max_connection_rate' when the event loops drift, or when
+ * the TLS/HAProxy handshakes can't keep up, and slowly raises it again when they recover.
+ */
+void MainApp::adaptAdmissionRates()
+{
+    const std::chrono::milliseconds worst_drift = std::max(this->medianThreadDrift, this->drift.getDrift());
+
+    size_t handshakes_pending = 0;
+    for (std::shared_ptr<ThreadData> &thread : handshakeThreads)
+    {
+        handshakes_pending += thread->getNrOfClients();
+    }
+
+    for (std::shared_ptr<Listener> &listener : this->listeners)
+    {
+        AdmissionController &admission = listener->admission;
+
+        if (!admission.enabled())
+            continue;
+
+        // We react at half the configured drift, so we throttle connects before the 'overload_mode' kicks in.
+        const bool overloaded = worst_drift > settings.maxEventLoopDrift / 2 || handshakes_pending > admission.getMaxRate();
+        const bool was_throttled = admission.getRate() < admission.getMaxRate();
+
+        admission.adapt(overloaded);
+
+        const bool is_throttled = admission.getRate() < admission.getMaxRate();
+        const uint64_t rejections = admission.takeRejectionCount();
+
+        if (rejections > 0)
+        {
+            logger->log(LOG_WARNING) << "[OVERLOAD] Closed " << rejections << " new connection(s) on " << listener->getProtocolName()
+                                     << " listener on port " << listener->port << " because 'max_connection_rate' was exceeded.";
+        }
+
+        if (is_throttled && !was_throttled)
+        {
+            logger->log(LOG_WARNING) << "[OVERLOAD] Lowering connection rate of " << listener->getProtocolName() << " listener on port "
+                                     << listener->port << " to " << admission.getRate() << "/s. Drift is " << worst_drift.count()
+                                     << " ms and " << handshakes_pending << " handshakes are pending.";
+        }
+        else if (!is_throttled && was_throttled)
+        {
+            logger->log(LOG_NOTICE) << "Connection rate of " << listener->getProtocolName() << " listener on port " << listener->port
+                                    << " is back at " << admission.getMaxRate() << "/s.";
+        }
+    }
+}
+
+/**
+ * @brief MainApp::deferAccepting stops watching a listen socket for a while. New connections wait in the kernel's listen backlog, which
+ * is better than accepting and closing them when clients are in a reconnect loop.
+ */
+void MainApp::deferAccepting(int listenFd, std::chrono::milliseconds delay)
+{
+    if (!deferredListenSockets.insert(listenFd).second)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = listenFd;
+    ev.events = 0;
+    check<std::runtime_error>(epoll_ctl(this->epollFdAccept, EPOLL_CTL_MOD, listenFd, &ev));
+
+    auto f = std::bind(&MainApp::resumeAccepting, this, listenFd);
+    const uint32_t delay_ms = std::max<uint32_t>(delay.count(), 1);
+    timed_tasks.addTask("resume_accepting", f, delay_ms);
+}
+
+void MainApp::resumeAccepting(int listenFd)
+{
+    if (deferredListenSockets.erase(listenFd) == 0)
+        return;
+
+    if (activeListenSockets.find(listenFd) == activeListenSockets.end())
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = listenFd;
+    ev.events = EPOLLIN;
+    check<std::runtime_error>(epoll_ctl(this->epollFdAccept, EPOLL_CTL_MOD, listenFd, &ev));
+}
+
+/**
+ * @brief MainApp::acceptMetricsConnection takes a connection on a metrics listener. These are not clients, and are served by the main thread.
+ */
+void MainApp::acceptMetricsConnection(int fd)
+{
+    // They're only closed after their timeout when the scraper doesn't finish, so that must not pile up.
+    if (metricsConnections.size() >= METRICS_MAX_CONNECTIONS)
+    {
+        // Logged once per purge, to avoid log spam.
+        if (!metricsConnectionLimitLogged)
+            logger->log(LOG_WARNING) << "Closing new metrics connection(s), because there are already " << metricsConnections.size() << ".";
+        metricsConnectionLimitLogged = true;
+        close(fd);
+        return;
+    }
+
+    std::unique_ptr<MetricsConnection> connection = std::make_unique<MetricsConnection>(fd);
+
+    int flags = fcntl(fd, F_GETFL);
+    check<std::runtime_error>(fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = EPOLLIN;
+    check<std::runtime_error>(epoll_ctl(this->epollFdAccept, EPOLL_CTL_ADD, fd, &ev));
+
+    metricsConnections[fd] = std::move(connection);
+}
+
+void MainApp::handleMetricsConnectionEvents(int fd, uint32_t events)
+{
+    auto pos = metricsConnections.find(fd);
+
+    if (pos == metricsConnections.end())
+        return;
+
+    const MetricsConnectionState state = pos->second->handleEvents(events);
+
+    if (state == MetricsConnectionState::Done)
+    {
+        metricsConnections.erase(pos);
+        return;
+    }
+
+    if (state == MetricsConnectionState::Writing)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof (struct epoll_event));
+        ev.data.fd = fd;
+        ev.events = EPOLLOUT;
+        check<std::runtime_error>(epoll_ctl(this->epollFdAccept, EPOLL_CTL_MOD, fd, &ev));
+    }
+}
+
+void MainApp::purgeTimedOutMetricsConnections()
+{
+    metricsConnectionLimitLogged = false;
+    const auto now = std::chrono::steady_clock::now();
+
+    auto it = metricsConnections.begin();
+    while (it != metricsConnections.end())
+    {
+        if (it->second->isTimedOut(now))
+            it = metricsConnections.erase(it);
+        else
+            it++;
+    }
+}
+
+/**
+ * @brief MainApp::quitHandshakeThreads stops the handshake threads, so no clients get handed over to the worker threads while they shut down.
+ *
+ * Clients still in their handshake are not MQTT clients yet, so there is nothing to send them.
+ */
+void MainApp::quitHandshakeThreads()
+{
+    for (std::shared_ptr<ThreadData> &thread : handshakeThreads)
+    {
+        thread->queueQuit();
+    }
+
+    for (std::shared_ptr<ThreadData> &thread : handshakeThreads)
+    {
+        logger->logf(LOG_DEBUG, "Waiting for handshake thread %d to join.", thread->threadnr);
+        thread->waitForQuit();
+    }
+
+    handshakeThreads.clear();
 }
 
 /**
@@ -674,9 +902,19 @@ void MainApp::start()
         threads.push_back(t);
     }
 
+    for (int i = 0; i < settings.handshakeThreadCount && num_threads > 0; i++)
+    {
+        std::shared_ptr<ThreadData> t = std::make_shared<ThreadData>(num_threads + i, settings, pluginLoader, true);
+        t->start(&do_thread_work);
+        handshakeThreads.push_back(t);
+    }
+
+    if (!handshakeThreads.empty())
+        logger->logf(LOG_NOTICE, "%d threads doing TLS and HAProxy handshakes, specified by 'handshake_thread_count'.", static_cast<int>(handshakeThreads.size()));
+
     // Populate the $SYS topics, otherwise you have to wait until the timer expires.
-    if (!threads.empty())
-        threads.front()->queuePublishStatsOnDollarTopic(threads);
+    queuePublishStatsOnDollarTopic();
+
 
     sendBridgesToThreads();
     queueBridgeReconnectAllThreads(true);
@@ -695,7 +933,7 @@ void MainApp::start()
         int num_fds = epoll_wait(this->epollFdAccept, events, MAX_EVENTS, epoll_wait_time);
 
         if (epoll_wait_time == 0)
-            timed_tasks.performAll();
+            timed_tasks.performAll(settings.slowTaskThreshold);
 
         if (num_fds < 0)
         {
@@ -709,15 +947,23 @@ void MainApp::start()
             int cur_fd = events[i].data.fd;
             try
             {
-                if (cur_fd != taskEventFd)
+                if (metricsConnections.find(cur_fd) != metricsConnections.end())
+                {
+                    handleMetricsConnectionEvents(cur_fd, events[i].events);
+                }
+                else if (cur_fd != taskEventFd)
                 {
                     std::shared_ptr<Listener> listener = activeListenSockets[cur_fd].getListener();
                     if (!listener)
                         continue;
 
-                    std::shared_ptr<ThreadData> thread_data = threads[listener->next_thread_index++ % num_threads];
+                    const bool admitted = listener->admission.tryAdmit(std::chrono::steady_clock::now());
 
-                    logger->logf(LOG_DEBUG, "Accepting connection on thread %d on %s", thread_data->threadnr, listener->getProtocolName().c_str());
+                    if (!admitted && listener->connectionRateMode == ConnectionRateMode::Defer)
+                    {
+                        deferAccepting(cur_fd, listener->admission.getTimeTillNextToken());
+                        continue;
+                    }
 
                     struct sockaddr_in6 addrBiggest;
                     struct sockaddr *addr = reinterpret_cast<sockaddr*>(&addrBiggest);
@@ -725,34 +971,56 @@ void MainApp::start()
                     memset(addr, 0, len);
                     int fd = check<std::runtime_error>(accept(cur_fd, addr, &len));
 
+                    if (!admitted)
+                    {
+                        // Logged once per heartbeat, to avoid log spam.
+                        listener->admission.countRejection();
+                        close(fd);
+                        continue;
+                    }
+
+                    // Scrapes are served by this thread, and also when overloaded, because that's when you want to see the metrics.
+                    if (listener->metrics)
+                    {
+                        logger->logf(LOG_DEBUG, "Accepting connection on %s", listener->getProtocolName().c_str());
+                        acceptMetricsConnection(fd);
+                        continue;
+                    }
+
+                    std::shared_ptr<ThreadData> thread_data = threads[listener->next_thread_index++ % num_threads];
+
+                    logger->logf(LOG_DEBUG, "Accepting connection on thread %d on %s", thread_data->threadnr, listener->getProtocolName().c_str());
+
                     /*
                      * I decided to not use a delayed close mechanism. It has been observed that under overload and clients in a reconnect loop,
                      * you can collect open files up to (a) million(s). By accepting and closing, the hope is we can keep clients at bay from
                      * the thread loops well enough.
                      */
-                    if (this->medianThreadDrift > settings.maxEventLoopDrift || this->drift.getDrift() > settings.maxEventLoopDrift)
+                    const bool memory_pressure = MemoryAccounting::getPressure() == MemoryPressure::Critical;
+                    if (memory_pressure || this->medianThreadDrift > settings.maxEventLoopDrift || this->drift.getDrift() > settings.maxEventLoopDrift)
                     {
                         const std::string addr_s = sockaddrToString(addr);
                         bool do_close = false;
                         const OverloadMode overload_mode = listener->overloadMode.value_or(settings.overloadMode);
+                        const char *overload_settings = memory_pressure ? "'overload_mode' and 'memory_budget'" : "'overload_mode' and 'max_event_loop_drift'";
 
-                        if (overload_mode == OverloadMode::CloseNewClients)
+                        if (overload_mode == OverloadMode::CloseNewClients || (overload_mode == OverloadMode::CloseNewClientsOnMemoryPressure && memory_pressure))
                         {
                             if (overloadLogCounter <= OVERLOAD_LOGS_MUTE_AFTER_LINES)
                             {
                                 overloadLogCounter++;
                                 logger->log(LOG_ERROR) << "[OVERLOAD] FlashMQ seems to be overloaded while accepting new connection(s) from '"
-                                                       << addr_s << ". Closing socket. See 'overload_mode' and 'max_event_loop_drift'.";
+                                                       << addr_s << ". Closing socket. See " << overload_settings << ".";
                             }
                             do_close = true;
                         }
-                        else if (overload_mode == OverloadMode::Log)
+                        else if (overload_mode == OverloadMode::Log || overload_mode == OverloadMode::CloseNewClientsOnMemoryPressure)
                         {
                             if (overloadLogCounter <= OVERLOAD_LOGS_MUTE_AFTER_LINES)
                             {
                                 overloadLogCounter++;
                                 logger->log(LOG_WARNING) << "[OVERLOAD] FlashMQ seems to be overloaded while accepting new connection(s) from '"
-                                                         << addr_s << ". See 'overload_mode' and 'max_event_loop_drift'.";
+                                                         << addr_s << ". See " << overload_settings << ".";
                             }
                         }
                         else
@@ -799,8 +1067,20 @@ void MainApp::start()
                         SSL_set_fd(clientSSL, fd);
                     }
 
+                    // The worker thread stays the final destination, so the thread selection above keeps working the same.
+                    std::shared_ptr<ThreadData> handshake_thread;
+                    if (!handshakeThreads.empty() && (listener->isSsl() || listener->isHaProxy()))
+                    {
+                        handshake_thread = handshakeThreads[nextHandshakeThreadIndex++ % handshakeThreads.size()];
+                    }
+
+                    std::shared_ptr<ThreadData> &first_thread = handshake_thread ? handshake_thread : thread_data;
+
                     // Don't use std::make_shared to avoid the weak pointers keeping the control block in memory.
-                    std::shared_ptr<Client> client = std::shared_ptr<Client>(new Client(fd, thread_data, clientSSL, listener->websocket, listener->isHaProxy(), addr, settings));
+                    std::shared_ptr<Client> client = std::shared_ptr<Client>(new Client(fd, first_thread, clientSSL, listener->websocket, listener->isHaProxy(), addr, settings));
+
+                    if (handshake_thread)
+                        client->setHandshakeDestination(thread_data);
 
                     if (listener->getX509ClientVerficationMode() != X509ClientVerification::None)
                     {
@@ -808,8 +1088,9 @@ void MainApp::start()
                     }
 
                     client->setAllowAnonymousOverride(listener->allowAnonymous);
+                    client->setConflateWhenBacklogged(listener->conflateWhenBacklogged);
 
-                    thread_data->giveClient(std::move(client));
+                    first_thread->giveClient(std::move(client));
 
                     globalStats->socketConnects.inc();
                 }
@@ -845,9 +1126,12 @@ void MainApp::start()
     }
 
     activeListenSockets.clear();
+    metricsConnections.clear();
 
     this->bgWorker.stop();
 
+    quitHandshakeThreads();
+
     if (settings.willsEnabled)
     {
         logger->logf(LOG_DEBUG, "Having all client in all threads send or queue their will.");
@@ -986,16 +1270,18 @@ void MainApp::loadConfig(bool reload)
     for (std::shared_ptr<Listener> &listener : this->listeners)
     {
         listener->isValid();
+        listener->admission.setMaxRate(listener->maxConnectionRate);
     }
 
     if (!getFuzzMode())
     {
         activeListenSockets.clear();
+        deferredListenSockets.clear();
 
         bool listenerCreateError = false;
         for(std::shared_ptr<Listener> &listener : this->listeners)
         {
-            listener->loadCertAndKeyFromConfig();
+            listener->loadCertAndKeyFromConfig(settings.minimizeIdleConnectionMemory);
             std::list<ScopedSocket> scopedSockets = createListenSocket(listener);
 
             if (scopedSockets.empty())
@@ -1080,6 +1366,11 @@ void MainApp::loadConfig(bool reload)
         thread->queueReload(settings);
     }
 
+    for (std::shared_ptr<ThreadData> &thread : handshakeThreads)
+    {
+        thread->queueReload(settings);
+    }
+
     reloadTimers(reload, oldSettings);
 }
 
@@ -1115,7 +1406,8 @@ void MainApp::reloadTimers(bool reload, const Settings &old_settings)
      *
      * TODO: better method, that is not susceptible to forgetting adding settings here when more timers can change.
      */
-    if (reload && settings.pluginTimerPeriod == old_settings.pluginTimerPeriod && settings.saveStateInterval == old_settings.saveStateInterval)
+    if (reload && settings.pluginTimerPeriod == old_settings.pluginTimerPeriod && settings.saveStateInterval == old_settings.saveStateInterval
+        && settings.clientRebalanceInterval == old_settings.clientRebalanceInterval)
     {
         logger->log(LOG_NOTICE) << "Timer config not changed. Not re-adding timers.";
         return;
@@ -1131,12 +1423,12 @@ void MainApp::reloadTimers(bool reload, const Settings &old_settings)
     if (settings.pluginTimerPeriod > 0)
     {
         auto fpluginPeriodicEvent = std::bind(&MainApp::queuepluginPeriodicEventAllThreads, this);
-        timed_tasks.addTask(fpluginPeriodicEvent, settings.pluginTimerPeriod * 1000, true);
+        timed_tasks.addTask("queue_plugin_periodic_event", fpluginPeriodicEvent, settings.pluginTimerPeriod * 1000, true);
     }
 
     {
         auto fSaveState = std::bind(&MainApp::saveStateInThread, this);
-        timed_tasks.addTask(fSaveState, settings.saveStateInterval.count() * 1000, true);
+        timed_tasks.addTask("save_state", fSaveState, settings.saveStateInterval.count() * 1000, true);
     }
 
     {
@@ -1147,13 +1439,13 @@ void MainApp::reloadTimers(bool reload, const Settings &old_settings)
 #ifdef TESTING
         interval = 1000;
 #endif
-        timed_tasks.addTask(f, interval, true);
+        timed_tasks.addTask("queue_cleanup", f, interval, true);
     }
 
     {
         uint32_t interval = 1846849; // prime
         auto f = std::bind(&MainApp::queuePurgeSubscriptionTree, this);
-        timed_tasks.addTask(f, interval, true);
+        timed_tasks.addTask("queue_purge_subscription_tree", f, interval, true);
     }
 
     {
@@ -1162,32 +1454,43 @@ void MainApp::reloadTimers(bool reload, const Settings &old_settings)
         interval = 500;
 #endif
         auto f = std::bind(&MainApp::queueRetainedMessageExpiration, this);
-        timed_tasks.addTask(f, interval, true);
+        timed_tasks.addTask("queue_retained_message_expiration", f, interval, true);
     }
 
     {
         auto fKeepAlive = std::bind(&MainApp::queueKeepAliveCheckAtAllThreads, this);
-        timed_tasks.addTask(fKeepAlive, 5000, true);
+        timed_tasks.addTask("queue_keep_alive_check", fKeepAlive, 5000, true);
     }
 
     {
         auto fPasswordFileReload = std::bind(&MainApp::queuePasswordFileReloadAllThreads, this);
-        timed_tasks.addTask(fPasswordFileReload, 2000, true);
+        timed_tasks.addTask("queue_password_file_reload", fPasswordFileReload, 2000, true);
     }
 
     {
         auto fPublishStats = std::bind(&MainApp::queuePublishStatsOnDollarTopic, this);
-        timed_tasks.addTask(fPublishStats, 10000, true);
+        timed_tasks.addTask("queue_publish_stats", fPublishStats, 10000, true);
+    }
+
+    {
+        auto fPurgeMetricsConnections = std::bind(&MainApp::purgeTimedOutMetricsConnections, this);
+        timed_tasks.addTask("purge_metrics_connections", fPurgeMetricsConnections, 5000, true);
     }
 
     {
         auto fSendPendingWills = std::bind(&MainApp::queueSendQueuedWills, this);
-        timed_tasks.addTask(fSendPendingWills, 2000, true);
+        timed_tasks.addTask("queue_send_queued_wills", fSendPendingWills, 2000, true);
     }
 
     {
         auto fInternalHeartbeat = std::bind(&MainApp::queueInternalHeartbeat, this);
-        timed_tasks.addTask(fInternalHeartbeat, HEARTBEAT_INTERVAL, true);
+        timed_tasks.addTask("queue_internal_heartbeat", fInternalHeartbeat, HEARTBEAT_INTERVAL, true);
+    }
+
+    if (settings.clientRebalanceInterval > std::chrono::seconds(0))
+    {
+        auto fClientRebalance = std::bind(&MainApp::queueClientRebalance, this);
+        timed_tasks.addTask("queue_client_rebalance", fClientRebalance, settings.clientRebalanceInterval.count() * 1000, true);
     }
 }
 
@@ -21,6 +21,7 @@ See LICENSE for license details.
 #include <functional>
 #include <forward_list>
 #include <list>
+#include <unordered_set>
 #include <sys/resource.h>
 
 #include "threaddata.h"
@@ -31,6 +32,8 @@ See LICENSE for license details.
 #include "bridgeinfodb.h"
 #include "backgroundworker.h"
 #include "driftcounter.h"
+#include "metricsexporter.h"
+#include "clientrebalancer.h"
 
 class MainApp
 {
@@ -45,6 +48,8 @@ class MainApp
     bool started = false;
     bool running = true;
     std::vector<std::shared_ptr<ThreadData>> threads;
+    std::vector<std::shared_ptr<ThreadData>> handshakeThreads;
+    size_t nextHandshakeThreadIndex = 0;
     std::shared_ptr<SubscriptionStore> subscriptionStore;
     std::unique_ptr<ConfigFileParser> confFileParser;
     int epollFdAccept = -1;
@@ -58,11 +63,15 @@ class MainApp
     uint overloadLogCounter = 0;
     DriftCounter drift;
     std::chrono::milliseconds medianThreadDrift = std::chrono::milliseconds(0);
+    ClientRebalancer clientRebalancer;
 
     Settings settings;
 
     std::list<std::shared_ptr<Listener>> listeners;
     std::unordered_map<int, ScopedSocket> activeListenSockets;
+    std::unordered_set<int> deferredListenSockets;
+    std::unordered_map<int, std::unique_ptr<MetricsConnection>> metricsConnections;
+    bool metricsConnectionLimitLogged = false;
 
     std::unordered_map<std::string, std::shared_ptr<BridgeConfig>> bridgeConfigs;
     std::mutex quitMutex;
@@ -98,6 +107,14 @@ class MainApp
     void sendBridgesToThreads();
     void queueBridgeReconnectAllThreads(bool alsoQueueNexts);
     void queueInternalHeartbeat();
+    void adaptAdmissionRates();
+    void queueClientRebalance();
+    void deferAccepting(int listenFd, std::chrono::milliseconds delay);
+    void resumeAccepting(int listenFd);
+    void acceptMetricsConnection(int fd);
+    void handleMetricsConnectionEvents(int fd, uint32_t events);
+    void purgeTimedOutMetricsConnections();
+    void quitHandshakeThreads();
 
     MainApp(const std::string &configFilePath);
 public:
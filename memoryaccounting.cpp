@@ -0,0 +1,149 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#include "memoryaccounting.h"
+
+#include <algorithm>
+#include <string>
+
+#include "cirbuf.h"
+
+// Buffers don't grow anymore above this percentage of the budget.
+#define MEMORY_PRESSURE_HIGH_PERCENTAGE 90
+
+std::atomic<MemoryPressure> MemoryAccounting::pressure = MemoryPressure::None;
+std::atomic<int64_t> MemoryAccounting::qosQueueBytes = 0;
+std::atomic<int64_t> MemoryAccounting::retainedMessageBytes = 0;
+
+AccountedMemory::AccountedMemory(std::atomic<int64_t> &counter, int64_t bytes) :
+    counter(&counter),
+    bytes(bytes)
+{
+    this->counter->fetch_add(bytes, std::memory_order_relaxed);
+}
+
+AccountedMemory::AccountedMemory(const AccountedMemory &other) :
+    counter(other.counter),
+    bytes(other.bytes)
+{
+    if (counter)
+        counter->fetch_add(bytes, std::memory_order_relaxed);
+}
+
+AccountedMemory::AccountedMemory(AccountedMemory &&other) noexcept :
+    counter(other.counter),
+    bytes(other.bytes)
+{
+    other.counter = nullptr;
+    other.bytes = 0;
+}
+
+AccountedMemory::~AccountedMemory()
+{
+    if (counter)
+        counter->fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+AccountedMemory &AccountedMemory::operator=(const AccountedMemory &other)
+{
+    if (this == &other)
+        return *this;
+
+    if (counter)
+        counter->fetch_sub(bytes, std::memory_order_relaxed);
+
+    counter = other.counter;
+    bytes = other.bytes;
+
+    if (counter)
+        counter->fetch_add(bytes, std::memory_order_relaxed);
+
+    return *this;
+}
+
+AccountedMemory &AccountedMemory::operator=(AccountedMemory &&other) noexcept
+{
+    if (this == &other)
+        return *this;
+
+    if (counter)
+        counter->fetch_sub(bytes, std::memory_order_relaxed);
+
+    counter = other.counter;
+    bytes = other.bytes;
+    other.counter = nullptr;
+    other.bytes = 0;
+
+    return *this;
+}
+
+int64_t MemoryAccounting::getBufferBytes()
+{
+    return std::max<int64_t>(CirBuf::getTotalAllocatedBytes(), 0);
+}
+
+int64_t MemoryAccounting::getQosQueueBytes()
+{
+    return std::max<int64_t>(qosQueueBytes.load(std::memory_order_relaxed), 0);
+}
+
+int64_t MemoryAccounting::getRetainedMessageBytes()
+{
+    return std::max<int64_t>(retainedMessageBytes.load(std::memory_order_relaxed), 0);
+}
+
+int64_t MemoryAccounting::getTotalBytes()
+{
+    return getBufferBytes() + getQosQueueBytes() + getRetainedMessageBytes();
+}
+
+/**
+ * @brief MemoryAccounting::determinePressure
+ * @param budget in bytes. 0 means there is no budget.
+ */
+MemoryPressure MemoryAccounting::determinePressure(uint64_t budget)
+{
+    if (budget == 0)
+        return MemoryPressure::None;
+
+    const uint64_t total = getTotalBytes();
+
+    if (total >= budget)
+        return MemoryPressure::Critical;
+
+    if (total >= budget / 100 * MEMORY_PRESSURE_HIGH_PERCENTAGE)
+        return MemoryPressure::High;
+
+    return MemoryPressure::None;
+}
+
+/**
+ * @brief MemoryAccounting::updatePressure determines and stores the pressure.
+ * @return the new pressure.
+ */
+MemoryPressure MemoryAccounting::updatePressure(uint64_t budget)
+{
+    const MemoryPressure p = determinePressure(budget);
+    pressure.store(p, std::memory_order_relaxed);
+    return p;
+}
+
+std::string memoryPressureToString(MemoryPressure p)
+{
+    switch (p)
+    {
+    case MemoryPressure::High:
+        return "high";
+    case MemoryPressure::Critical:
+        return "critical";
+    default:
+        return "none";
+    }
+}
@@ -0,0 +1,77 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#ifndef MEMORYACCOUNTING_H
+#define MEMORYACCOUNTING_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+enum class MemoryPressure
+{
+    None,
+    High, // Near the budget: buffers don't grow anymore.
+    Critical // At or over the budget: QoS 0 to backlogged clients is shed, and off-line clients don't get QoS messages queued.
+};
+
+/**
+ * @brief The AccountedMemory class adds bytes to a global counter for as long as it lives. Make it a member of the object whose memory you
+ * want to count. Copies count again, moves transfer.
+ */
+class AccountedMemory
+{
+    std::atomic<int64_t> *counter = nullptr;
+    int64_t bytes = 0;
+
+public:
+    AccountedMemory() = default;
+    AccountedMemory(std::atomic<int64_t> &counter, int64_t bytes);
+    AccountedMemory(const AccountedMemory &other);
+    AccountedMemory(AccountedMemory &&other) noexcept;
+    ~AccountedMemory();
+
+    AccountedMemory &operator=(const AccountedMemory &other);
+    AccountedMemory &operator=(AccountedMemory &&other) noexcept;
+};
+
+/**
+ * @brief The MemoryAccounting class keeps broker-wide totals of the memory that grows with load. The client buffers are counted by CirBuf
+ * itself. The pressure is determined periodically, so the hot paths only read one atomic.
+ */
+class MemoryAccounting
+{
+    static std::atomic<MemoryPressure> pressure;
+
+public:
+    static std::atomic<int64_t> qosQueueBytes;
+    static std::atomic<int64_t> retainedMessageBytes;
+
+    static int64_t getBufferBytes();
+    static int64_t getQosQueueBytes();
+    static int64_t getRetainedMessageBytes();
+    static int64_t getTotalBytes();
+
+    static MemoryPressure determinePressure(uint64_t budget);
+    static MemoryPressure updatePressure(uint64_t budget);
+
+    static MemoryPressure getPressure()
+    {
+        return pressure.load(std::memory_order_relaxed);
+    }
+
+#ifdef TESTING
+    static void setPressure(MemoryPressure p) { pressure.store(p, std::memory_order_relaxed); }
+#endif
+};
+
+std::string memoryPressureToString(MemoryPressure p);
+
+#endif // MEMORYACCOUNTING_H
@@ -0,0 +1,346 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#include "metricsexporter.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cmath>
+#include <sstream>
+
+#include "globalstats.h"
+
+#define METRICS_MAX_REQUEST_SIZE 8192
+#define METRICS_CONNECTION_TIMEOUT std::chrono::seconds(10)
+
+/**
+ * @brief appendMetricNamePart makes a topic level fit in a metric name: anything other than [a-zA-Z0-9_] becomes an underscore, and
+ * underscores are not repeated.
+ */
+static void appendMetricNamePart(std::string &name, const std::string &part)
+{
+    for (const char c : part)
+    {
+        const bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+        const char d = valid ? c : '_';
+
+        if (d == '_' && !name.empty() && name.back() == '_')
+            continue;
+
+        name.push_back(d);
+    }
+}
+
+static void appendLabel(std::string &labels, const char *label, const std::string &value)
+{
+    if (!labels.empty())
+        labels.push_back(',');
+
+    labels.append(label);
+    labels.append("=\"");
+
+    for (const char c : value)
+    {
+        if (c == '\\' || c == '"')
+        {
+            labels.push_back('\\');
+            labels.push_back(c);
+        }
+        else if (c == '\n')
+            labels.append("\\n");
+        else
+            labels.push_back(c);
+    }
+
+    labels.push_back('"');
+}
+
+/**
+ * @brief OpenMetricsBuilder::sysTopicToMetric makes a metric name out of a $SYS topic. The thread number and bridge name levels are
+ * made into labels, so that they are one metric family.
+ * @return false when it's not a $SYS topic.
+ */
+bool OpenMetricsBuilder::sysTopicToMetric(const std::string &topic, std::string &name, std::string &labels)
+{
+    const std::string prefix = "$SYS/";
+
+    if (topic.compare(0, prefix.length(), prefix) != 0)
+        return false;
+
+    name = "flashmq";
+    labels.clear();
+
+    std::vector<std::string> levels;
+    std::istringstream stream(topic.substr(prefix.length()));
+    std::string level;
+    while (std::getline(stream, level, '/'))
+        levels.push_back(level);
+
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        const std::string &cur = levels.at(i);
+
+        name.push_back('_');
+        appendMetricNamePart(name, cur);
+
+        if (i + 2 < levels.size() && i > 0 && levels.at(i - 1) == "broker")
+        {
+            if (cur == "threads")
+                appendLabel(labels, "thread", levels.at(++i));
+            else if (cur == "bridge")
+                appendLabel(labels, "bridge", levels.at(++i));
+        }
+    }
+
+    while (!name.empty() && name.back() == '_')
+        name.pop_back();
+
+    return true;
+}
+
+void OpenMetricsBuilder::add(const std::string &sysTopic, uint64_t value, MetricType type)
+{
+    std::string name;
+    std::string labels;
+
+    if (!sysTopicToMetric(sysTopic, name, labels))
+        return;
+
+    // The '_total' is added to the samples when rendering.
+    const std::string suffix = "_total";
+    if (type == MetricType::Counter && name.length() > suffix.length() && name.compare(name.length() - suffix.length(), suffix.length(), suffix) == 0)
+        name.erase(name.length() - suffix.length());
+
+    Family &family = families[name];
+    family.type = type;
+
+    Sample &sample = family.samples.emplace_back();
+    sample.labels = std::move(labels);
+    sample.value = std::to_string(value);
+}
+
+/**
+ * @brief OpenMetricsBuilder::addIfNumeric is for the $SYS values that are set as strings, like the ones in GlobalStats::getExtras(). Only
+ * numbers are metrics; something like a bridge's connection status is skipped, and so are 'nan' and 'inf', which strtod() accepts.
+ */
+void OpenMetricsBuilder::addIfNumeric(const std::string &sysTopic, const std::string &value)
+{
+    if (value.empty())
+        return;
+
+    const char *begin = value.c_str();
+    char *end = nullptr;
+    const double d = std::strtod(begin, &end);
+
+    if (end != begin + value.length() || !std::isfinite(d))
+        return;
+
+    std::string name;
+    std::string labels;
+
+    if (!sysTopicToMetric(sysTopic, name, labels))
+        return;
+
+    Sample &sample = families[name].samples.emplace_back();
+    sample.labels = std::move(labels);
+    sample.value = value;
+}
+
+std::string OpenMetricsBuilder::render() const
+{
+    std::string result;
+    result.reserve(families.size() * 96);
+
+    for (const auto &pair : families)
+    {
+        const std::string &name = pair.first;
+        const Family &family = pair.second;
+        const bool counter = family.type == MetricType::Counter;
+
+        result.append("# TYPE ").append(name).append(counter ? " counter\n" : " gauge\n");
+
+        for (const Sample &sample : family.samples)
+        {
+            result.append(name);
+
+            if (counter)
+                result.append("_total");
+
+            if (!sample.labels.empty())
+                result.append("{").append(sample.labels).append("}");
+
+            result.append(" ").append(sample.value).append("\n");
+        }
+    }
+
+    result.append("# EOF\n");
+    return result;
+}
+
+void OpenMetricsBuilder::clear()
+{
+    families.clear();
+}
+
+MetricsConnection::MetricsConnection(int fd) :
+    fd(fd)
+{
+
+}
+
+MetricsConnection::~MetricsConnection()
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+int MetricsConnection::getFd() const
+{
+    return fd;
+}
+
+void MetricsConnection::readRequest()
+{
+    char buf[4096];
+
+    while (state == MetricsConnectionState::Reading)
+    {
+        const ssize_t n = read(fd, buf, sizeof(buf));
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                state = MetricsConnectionState::Done;
+            return;
+        }
+
+        if (n == 0)
+        {
+            state = MetricsConnectionState::Done;
+            return;
+        }
+
+        request.append(buf, n);
+
+        const bool complete = request.find("\r\n\r\n") != std::string::npos;
+
+        if (complete || request.length() > METRICS_MAX_REQUEST_SIZE)
+        {
+            response = generateResponse(request, GlobalStats::getInstance()->getMetricsSnapshot());
+            request.clear();
+            request.shrink_to_fit();
+            state = MetricsConnectionState::Writing;
+        }
+    }
+}
+
+void MetricsConnection::writeResponse()
+{
+    while (responseWritten < response.length())
+    {
+        const ssize_t n = send(fd, response.data() + responseWritten, response.length() - responseWritten, MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                state = MetricsConnectionState::Done;
+            return;
+        }
+
+        responseWritten += n;
+    }
+
+    state = MetricsConnectionState::Done;
+}
+
+/**
+ * @brief MetricsConnection::handleEvents reads the request and writes as much of the response as the socket takes.
+ * @return the new state. When it's Writing, the caller has to wait for EPOLLOUT. When it's Done, the connection can be destroyed.
+ */
+MetricsConnectionState MetricsConnection::handleEvents(uint32_t events)
+{
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        state = MetricsConnectionState::Done;
+        return state;
+    }
+
+    if (state == MetricsConnectionState::Reading)
+        readRequest();
+
+    if (state == MetricsConnectionState::Writing)
+        writeResponse();
+
+    return state;
+}
+
+bool MetricsConnection::isTimedOut(std::chrono::time_point<std::chrono::steady_clock> now) const
+{
+    return now - createdAt > METRICS_CONNECTION_TIMEOUT;
+}
+
+/**
+ * @brief MetricsConnection::generateResponse answers 'GET /metrics', and nothing else. The connection is always closed afterwards.
+ */
+std::string MetricsConnection::generateResponse(const std::string &request, const std::shared_ptr<const std::string> &snapshot)
+{
+    std::string status = "200 OK";
+    std::string method;
+    std::string target;
+    std::string version;
+
+    {
+        const std::string firstLine = request.substr(0, request.find("\r\n"));
+        std::istringstream stream(firstLine);
+        stream >> method >> target >> version;
+    }
+
+    const std::string path = target.substr(0, target.find('?'));
+
+    if (request.find("\r\n\r\n") == std::string::npos || version.compare(0, 5, "HTTP/") != 0)
+        status = "400 Bad Request";
+    else if (method != "GET" && method != "HEAD")
+        status = "405 Method Not Allowed";
+    else if (path != "/metrics")
+        status = "404 Not Found";
+    else if (!snapshot)
+        status = "503 Service Unavailable";
+
+    std::ostringstream oss;
+    oss << "HTTP/1.1 " << status << "\r\n";
+    oss << "Connection: close\r\n";
+
+    if (status.compare(0, 3, "405") == 0)
+        oss << "Allow: GET, HEAD\r\n";
+
+    if (status.compare(0, 3, "200") != 0)
+    {
+        oss << "Content-Length: 0\r\n";
+        oss << "\r\n";
+        return oss.str();
+    }
+
+    oss << "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n";
+    oss << "Content-Length: " << snapshot->length() << "\r\n";
+    oss << "\r\n";
+
+    if (method == "GET")
+        oss << *snapshot;
+
+    return oss.str();
+}
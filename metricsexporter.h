@@ -0,0 +1,98 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#ifndef METRICSEXPORTER_H
+#define METRICSEXPORTER_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define METRICS_MAX_CONNECTIONS 64
+
+enum class MetricType
+{
+    Gauge,
+    Counter
+};
+
+/**
+ * @brief The OpenMetricsBuilder class turns the $SYS topics into an OpenMetrics text exposition. A topic like
+ * '$SYS/broker/threads/3/drift/latest__ms' becomes 'flashmq_broker_threads_drift_latest_ms{thread="3"}'.
+ *
+ * The $SYS topics don't say whether something can only go up, so the publisher of the stat says it's a counter. Counters get the '_total'
+ * suffix OpenMetrics wants, so '$SYS/broker/load/messages/received/total' becomes family 'flashmq_broker_load_messages_received' with
+ * sample 'flashmq_broker_load_messages_received_total'.
+ */
+class OpenMetricsBuilder
+{
+    struct Sample
+    {
+        std::string labels;
+        std::string value;
+    };
+
+    struct Family
+    {
+        MetricType type = MetricType::Gauge;
+        std::vector<Sample> samples;
+    };
+
+    // Ordered, because the samples of a family have to be together.
+    std::map<std::string, Family> families;
+
+public:
+    static bool sysTopicToMetric(const std::string &topic, std::string &name, std::string &labels);
+
+    void add(const std::string &sysTopic, uint64_t value, MetricType type=MetricType::Gauge);
+    void addIfNumeric(const std::string &sysTopic, const std::string &value);
+    std::string render() const;
+    void clear();
+};
+
+enum class MetricsConnectionState
+{
+    Reading,
+    Writing,
+    Done
+};
+
+/**
+ * @brief The MetricsConnection class is a scrape on a 'protocol metrics' listener. It's handled by the main thread, and only answers
+ * one request, from the snapshot made when the stats were last published. So, scrapes never touch the subscription tree or worker threads.
+ */
+class MetricsConnection
+{
+    int fd = -1;
+    std::chrono::time_point<std::chrono::steady_clock> createdAt = std::chrono::steady_clock::now();
+    std::string request;
+    std::string response;
+    size_t responseWritten = 0;
+    MetricsConnectionState state = MetricsConnectionState::Reading;
+
+    void readRequest();
+    void writeResponse();
+
+public:
+    MetricsConnection(int fd);
+    MetricsConnection(const MetricsConnection &other) = delete;
+    ~MetricsConnection();
+
+    int getFd() const;
+    MetricsConnectionState handleEvents(uint32_t events);
+    bool isTimedOut(std::chrono::time_point<std::chrono::steady_clock> now) const;
+
+    static std::string generateResponse(const std::string &request, const std::shared_ptr<const std::string> &snapshot);
+};
+
+#endif // METRICSEXPORTER_H
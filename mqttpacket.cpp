@@ -205,6 +205,7 @@ MqttPacket::MqttPacket(const PubResponse &pubAck) :
     bites(pubAck.getLengthIncludingFixedHeader())
 {
     this->protocolVersion = pubAck.protocol_version;
+    this->packetType = pubAck.packet_type;
 
     fixed_header_length = 2;
     const uint8_t firstByteDefaultBits = pubAck.packet_type == PacketType::PUBREL ? 0b0010 : 0;
@@ -437,9 +438,15 @@ MqttPacket::MqttPacket(const Unsubscribe &unsubscribe) :
     calculateRemainingLength();
 }
 
-void MqttPacket::bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender)
+/**
+ * @brief MqttPacket::bufferToMqttPackets parses complete packets from buf, up to maxPackets. Bytes of further packets stay in buf.
+ * @return the number of packets added to packetQueueIn.
+ */
+size_t MqttPacket::bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender, size_t maxPackets)
 {
-    while (buf.usedBytes() >= MQTT_HEADER_LENGH)
+    size_t count = 0;
+
+    while (count < maxPackets && buf.usedBytes() >= MQTT_HEADER_LENGH)
     {
         // Determine the packet length by decoding the variable length
         int remaining_length_i = 1; // index of 'remaining length' field is one after start.
@@ -456,7 +463,7 @@ void MqttPacket::bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packe
 
             // This happens when you only don't have all the bytes that specify the remaining length.
             if (fixed_header_length > buf.usedBytes())
-                return;
+                return count;
 
             encodedByte = buf.peakAhead(remaining_length_i++);
             packet_length += (encodedByte & 127) * multiplier;
@@ -482,12 +489,18 @@ void MqttPacket::bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packe
 
         if (packet_length <= buf.usedBytes())
         {
-            std::vector<char> packet_bytes = buf.readToVector(packet_length);
+            // Reusing the byte arrays of packets from previous reads of this thread avoids an allocation per packet.
+            ThreadData *td = ThreadGlobals::getThreadData();
+            std::vector<char> packet_bytes = td ? td->takePacketBytes() : std::vector<char>();
+            buf.readToVector(packet_bytes, packet_length);
             packetQueueIn.emplace_back(std::move(packet_bytes), fixed_header_length, sender);
+            count++;
         }
         else
             break;
     }
+
+    return count;
 }
 
 HandleResult MqttPacket::handle(std::shared_ptr<Client> &sender)
@@ -839,7 +852,7 @@ ConnectData MqttPacket::parseConnectData(std::shared_ptr<Client> &sender)
         uint16_t will_payload_length = readTwoBytesToUInt16();
         result.willpublish.payload = std::string(readBytes(will_payload_length), will_payload_length);
 
-        if (result.willpublish.payloadUtf8 && !isValidUtf8Generic(result.willpublish.payload))
+        if (result.willpublish.payloadUtf8 && !isValidPayloadUtf8(result.willpublish.payload))
         {
             throw ProtocolError("Will payload announced as UTF8, but it's not valid.", ReasonCodes::PayloadFormatInvalid);
         }
@@ -1697,28 +1710,40 @@ void MqttPacket::handleSubscribe(std::shared_ptr<Client> &sender)
     sender->writeMqttPacket(response);
 
     std::shared_ptr<Session> session = sender->getSession();
+    auto store = MainApp::getMainApp()->getSubscriptionStore();
+
+    std::vector<const SubscriptionTuple*> subscriptionsToAdd;
 
-    // Adding the subscription will also send publishes for retained messages, so that's why we're doing it at the end.
     for(const SubscriptionTuple &tup : deferredSubscribes)
     {
         if (tup.authResult == AuthResult::success_but_drop)
             continue;
 
-        auto store = MainApp::getMainApp()->getSubscriptionStore();
-
         logger->log(LOG_SUBSCRIBE) << "Client '" << sender->repr() << "' subscribed to '" << tup.topic << "' QoS " << static_cast<int>(tup.qos);
-        const AddSubscriptionType add_type = store->addSubscription(
-            session, tup.subtopics, tup.qos, tup.noLocal, tup.retainAsPublished, tup.shareName, tup.subscriptionIdentifier);
+        subscriptionsToAdd.push_back(&tup);
+    }
+
+    const std::vector<AddSubscriptionType> add_types = store->addSubscriptions(session, subscriptionsToAdd);
+
+    std::vector<const SubscriptionTuple*> subscriptionsWithRetained;
+
+    for (size_t i = 0; i < subscriptionsToAdd.size(); i++)
+    {
+        const SubscriptionTuple &tup = *subscriptionsToAdd[i];
+        const AddSubscriptionType add_type = add_types.at(i);
 
         if (tup.authResult == AuthResult::success && tup.shareName.empty())
         {
             if ((tup.retainHandling == RetainHandling::SendRetainedMessagesAtSubscribe) ||
                 (tup.retainHandling == RetainHandling::SendRetainedMessagesAtNewSubscribeOnly && add_type == AddSubscriptionType::NewSubscription) )
             {
-                store->giveClientRetainedMessages(session, tup.subtopics, tup.qos, tup.subscriptionIdentifier);
+                subscriptionsWithRetained.push_back(&tup);
             }
         }
     }
+
+    // Giving the retained messages sends publishes, so that's why we're doing it at the end.
+    store->giveClientRetainedMessages(session, subscriptionsWithRetained);
 }
 
 void MqttPacket::handleSubAck(std::shared_ptr<Client> &sender)
@@ -1844,7 +1869,20 @@ void MqttPacket::parsePublishData(std::shared_ptr<Client> &sender)
     publishData.username = sender->getUsername();
     publishData.client_id = sender->getClientId();
 
-    publishData.topic = readBytesToString(true, true);
+    publishData.topic = readBytesToString(false);
+
+    {
+        std::vector<std::string> subtopics;
+        if (!isValidUtf8AndSplitTopic(publishData.topic, subtopics, true))
+        {
+            logger->logf(LOG_DEBUG, "Data of invalid UTF-8 string or publish topic: %s", publishData.topic.c_str());
+            throw ProtocolError("Invalid UTF8 string detected, or invalid publish characters.", ReasonCodes::MalformedPacket);
+        }
+
+        // An empty topic means a topic alias is used, which sets the topic later.
+        if (!publishData.topic.empty())
+            publishData.setSubtopics(std::move(subtopics));
+    }
 
     if (publishData.qos)
     {
@@ -1981,8 +2019,7 @@ void MqttPacket::parsePublishData(std::shared_ptr<Client> &sender)
     payloadLen = remainingAfterPos();
     payloadStart = pos;
 
-    // Not using SIMD UTF8 checker because that requires making a copy, and requires being able to deal with large strings.
-    if (publishData.payloadUtf8 && !isValidUtf8Generic(getPayloadView()))
+    if (publishData.payloadUtf8 && !isValidPayloadUtf8(getPayloadView()))
     {
         throw ProtocolError("Payload announced as UTF8, but it's not valid.", ReasonCodes::PayloadFormatInvalid);
     }
@@ -2099,8 +2136,38 @@ void MqttPacket::handlePublish(std::shared_ptr<Client> &sender)
                 first_byte = bites[0];
 
                 PublishCopyFactory factory(this);
-                ackSender.sendNow();
-                MainApp::getMainApp()->getSubscriptionStore()->queuePacketAtSubscribers(factory, sender->getClientId());
+
+                // With publisher backpressure, the ack is sent after distributing, so it's held when it makes us pause.
+                if (settings->publisherBackpressureThreshold == 0)
+                    ackSender.sendNow();
+
+                ThreadData *td = ThreadGlobals::getThreadData();
+
+                if (td->latencySampleCountdown-- == 0)
+                {
+                    td->latencySampleCountdown = ThreadData::latencySampleInterval - 1;
+                    td->latencySampleStart = sender->getLastActivity();
+                }
+
+                // Also when distributing throws, or the next publish would be measured from this one's start.
+                OptionalResetGuard reset_latency_sample(td->latencySampleStart);
+
+                if (settings->publisherBackpressureThreshold > 0)
+                {
+                    std::vector<std::weak_ptr<Session>> backlogged;
+                    MainApp::getMainApp()->getSubscriptionStore()->queuePacketAtSubscribers(factory, sender->getClientId(), false, &backlogged);
+
+                    if (backlogged.size() >= settings->publisherBackpressureThreshold)
+                    {
+                        td->pauseClientForBackpressure(sender, std::move(backlogged));
+                    }
+
+                    ackSender.sendNow();
+                }
+                else
+                {
+                    MainApp::getMainApp()->getSubscriptionStore()->queuePacketAtSubscribers(factory, sender->getClientId());
+                }
             }
         }
         else if (authResult == AuthResult::success_but_drop_publish)
@@ -2352,6 +2419,14 @@ std::string MqttPacket::getPayloadCopy() const
     return payload;
 }
 
+/**
+ * @brief MqttPacket::releaseBites gives up the byte array, so it can be reused. The packet can't be used after this.
+ */
+std::vector<char> MqttPacket::releaseBites()
+{
+    return std::move(bites);
+}
+
 std::string_view MqttPacket::getPayloadView() const
 {
     assert(payloadStart > 0);
@@ -14,6 +14,7 @@ See LICENSE for license details.
 #include <unistd.h>
 #include <memory>
 #include <vector>
+#include <limits>
 #include <exception>
 
 #include "forward_declarations.h"
@@ -125,7 +126,8 @@ public:
     MqttPacket(const Subscribe &subscribe);
     MqttPacket(const Unsubscribe &unsubscribe);
 
-    static void bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender);
+    static size_t bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender,
+                                      size_t maxPackets = std::numeric_limits<size_t>::max());
 
     HandleResult handle(std::shared_ptr<Client> &sender);
     AuthPacketData parseAuthData();
@@ -155,6 +157,7 @@ public:
     uint8_t getFixedHeaderLength() const;
     size_t getSizeIncludingNonPresentHeader() const;
     const std::vector<char> &getBites() const { return bites; }
+    std::vector<char> releaseBites();
     uint8_t getQos() const { return publishData.qos; }
     void setQos(const uint8_t new_qos);
     ProtocolVersion getProtocolVersion() const { return protocolVersion;}
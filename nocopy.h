@@ -31,6 +31,12 @@ public:
         return *this;
     }
 
+    NoCopy<T>& operator=(T &&other)
+    {
+        data = std::move(other);
+        return *this;
+    }
+
     operator bool() const
     {
         return data.operator bool();
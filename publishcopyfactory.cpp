@@ -165,6 +165,21 @@ Publish PublishCopyFactory::getNewPublish(uint8_t new_max_qos, bool retainAsPubl
     return p;
 }
 
+/**
+ * @brief PublishCopyFactory::getNewQos0Publish is for holding on to a QoS 0 message for an on-line client that is backlogged, when
+ * conflating. The caller already decided on the retain flag.
+ */
+Publish PublishCopyFactory::getNewQos0Publish(bool retain, uint32_t subscriptionIdentifier) const
+{
+    Publish p(packet ? packet->getPublishData() : *publish);
+    p.qos = 0;
+    p.retain = retain;
+    p.topicAlias = 0;
+    p.skipTopic = false;
+    p.subscriptionIdentifier = subscriptionIdentifier;
+    return p;
+}
+
 const std::vector<std::pair<std::string, std::string> > *PublishCopyFactory::getUserProperties() const
 {
     if (packet)
@@ -52,6 +52,7 @@ public:
     std::string_view getPayload() const;
     bool getRetain() const;
     Publish getNewPublish(uint8_t new_max_qos, bool retainAsPublished, uint32_t subscriptionIdentifier) const;
+    Publish getNewQos0Publish(bool retain, uint32_t subscriptionIdentifier) const;
     const std::vector<std::pair<std::string, std::string>> *getUserProperties() const;
     const std::optional<std::string> &getCorrelationData() const;
     const std::optional<std::string> &getResponseTopic() const;
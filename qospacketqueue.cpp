@@ -17,7 +17,8 @@ See LICENSE for license details.
 QueuedPublish::QueuedPublish(Publish &&publish, uint16_t packet_id, const std::optional<std::string> &topic_override) :
     publish(std::move(publish)),
     packet_id(packet_id),
-    topic_override(topic_override)
+    topic_override(topic_override),
+    accountedMemory(MemoryAccounting::qosQueueBytes, getApproximateMemoryFootprint())
 {
 
 }
@@ -37,6 +38,14 @@ const std::optional<std::string> &QueuedPublish::getTopicOverride() const
     return topic_override;
 }
 
+const std::string &QueuedPublish::getEffectiveTopic() const
+{
+    if (topic_override)
+        return *topic_override;
+
+    return publish.topic;
+}
+
 size_t QueuedPublish::getApproximateMemoryFootprint() const
 {
     // TODO: hmm, this is possibly very inaccurate with MQTT5 packets.
@@ -87,6 +96,13 @@ void QoSPublishQueue::eraseFromMapAndRelinkList(std::unordered_map<uint16_t, std
 {
     std::shared_ptr<QueuedPublish> &qp = pos->second;
 
+    if (conflate)
+    {
+        auto index_pos = conflationIndex.find(qp->getEffectiveTopic());
+        if (index_pos != conflationIndex.end() && index_pos->second == qp->getPacketId())
+            conflationIndex.erase(index_pos);
+    }
+
     if (qp->prev)
         qp->prev->next = qp->next;
 
@@ -117,6 +133,52 @@ std::shared_ptr<QueuedPublish> QoSPublishQueue::popNext()
     return result;
 }
 
+/**
+ * @brief QoSPublishQueue::setConflate makes the queue track publishes per topic, so that eraseByTopic() can be used to only keep the
+ * last value of a topic.
+ */
+void QoSPublishQueue::setConflate(bool val)
+{
+    if (this->conflate == val)
+        return;
+
+    this->conflate = val;
+    this->conflationIndex.clear();
+
+    if (!val)
+        return;
+
+    std::shared_ptr<QueuedPublish> qp = this->tail;
+    while (qp)
+    {
+        addToConflationIndex(qp);
+        qp = qp->next;
+    }
+}
+
+bool QoSPublishQueue::getConflate() const
+{
+    return conflate;
+}
+
+/**
+ * @brief QoSPublishQueue::eraseByTopic removes the queued publish for a topic, if any. Only works when conflating.
+ * @return whether a publish was removed.
+ */
+bool QoSPublishQueue::eraseByTopic(const std::string &topic)
+{
+    if (!conflate)
+        return false;
+
+    auto pos = conflationIndex.find(topic);
+
+    if (pos == conflationIndex.end())
+        return false;
+
+    const uint16_t packet_id = pos->second;
+    return erase(packet_id);
+}
+
 size_t QoSPublishQueue::size() const
 {
     return queue.size();
@@ -138,6 +200,14 @@ void QoSPublishQueue::addToHeadOfLinkedList(std::shared_ptr<QueuedPublish> &qp)
         this->tail = qp;
 }
 
+void QoSPublishQueue::addToConflationIndex(const std::shared_ptr<QueuedPublish> &qp)
+{
+    if (!conflate)
+        return;
+
+    this->conflationIndex[qp->getEffectiveTopic()] = qp->getPacketId();
+}
+
 /**
  * @brief QoSPublishQueue::queuePublish
  *
@@ -157,6 +227,7 @@ void QoSPublishQueue::queuePublish(
     addToHeadOfLinkedList(qp);
     qosQueueBytes += qp->getApproximateMemoryFootprint();
     addToExpirationQueue(qp);
+    addToConflationIndex(qp);
     queue[id] = std::move(qp);
 }
 
@@ -176,6 +247,7 @@ void QoSPublishQueue::queuePublish(Publish &&pub, uint16_t id, const std::option
     addToHeadOfLinkedList(qp);
     qosQueueBytes += qp->getApproximateMemoryFootprint();
     addToExpirationQueue(qp);
+    addToConflationIndex(qp);
     queue[id] = std::move(qp);
 }
 
@@ -16,6 +16,7 @@ See LICENSE for license details.
 
 #include "types.h"
 #include "publishcopyfactory.h"
+#include "memoryaccounting.h"
 
 /**
  * @brief The QueuedPublish class wraps the publish with a packet id.
@@ -29,6 +30,8 @@ class QueuedPublish
 
     // We store this separately because because we need to retain the original publish path for ACL checking upon resending.
     std::optional<std::string> topic_override;
+
+    AccountedMemory accountedMemory;
 public:
     QueuedPublish(Publish &&publish, uint16_t packet_id, const std::optional<std::string> &topic_override);
     QueuedPublish(const QueuedPublish &other) = delete;
@@ -40,6 +43,7 @@ public:
     uint16_t getPacketId() const;
     Publish &getPublish();
     const std::optional<std::string> &getTopicOverride() const;
+    const std::string &getEffectiveTopic() const;
 };
 
 class QoSPublishQueue
@@ -52,9 +56,14 @@ class QoSPublishQueue
 
     ssize_t qosQueueBytes = 0;
 
+    // Only maintained when conflating: the packet id of the queued publish per (effective) topic.
+    bool conflate = false;
+    std::unordered_map<std::string, uint16_t> conflationIndex;
+
     void addToExpirationQueue(std::shared_ptr<QueuedPublish> &qp);
     void eraseFromMapAndRelinkList(std::unordered_map<uint16_t, std::shared_ptr<QueuedPublish>>::iterator pos);
     void addToHeadOfLinkedList(std::shared_ptr<QueuedPublish> &qp);
+    void addToConflationIndex(const std::shared_ptr<QueuedPublish> &qp);
 
 public:
     QoSPublishQueue() = default;
@@ -76,6 +85,9 @@ public:
     int clearExpiredMessages();
     const std::shared_ptr<QueuedPublish> &getTail() const;
     std::shared_ptr<QueuedPublish> popNext();
+    void setConflate(bool val);
+    bool getConflate() const;
+    bool eraseByTopic(const std::string &topic);
 
 };
 
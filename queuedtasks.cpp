@@ -13,6 +13,28 @@ See LICENSE for license details.
 #include "queuedtasks.h"
 #include "logger.h"
 
+void logTaskError(const char *kind, const char *name, const std::exception &ex)
+{
+    Logger *logger = Logger::getInstance();
+    logger->logf(LOG_ERR, "Error in %s task '%s': %s", kind, name, ex.what());
+}
+
+bool checkSlowTask(const char *kind, const char *name, std::chrono::time_point<std::chrono::steady_clock> start,
+                   std::chrono::milliseconds slowTaskThreshold)
+{
+    if (slowTaskThreshold <= std::chrono::milliseconds(0))
+        return false;
+
+    const auto duration = std::chrono::steady_clock::now() - start;
+
+    if (duration <= slowTaskThreshold)
+        return false;
+
+    Logger *logger = Logger::getInstance();
+    logger->log(LOG_WARNING) << "Slow " << kind << " task '" << name << "' took "
+                             << std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() << " ms.";
+    return true;
+}
 
 bool QueuedTask::operator<(const QueuedTask &rhs) const
 {
@@ -24,7 +46,7 @@ QueuedTasks::QueuedTasks()
 
 }
 
-uint32_t QueuedTasks::addTask(std::function<void ()> f, uint32_t delayInMs, bool repeat)
+uint32_t QueuedTasks::addTask(const char *name, std::function<void ()> f, uint32_t delayInMs, bool repeat)
 {
     std::chrono::time_point<std::chrono::steady_clock> when = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayInMs);
 
@@ -40,6 +62,7 @@ uint32_t QueuedTasks::addTask(std::function<void ()> f, uint32_t delayInMs, bool
     t.when = when;
     t.interval = std::chrono::milliseconds(delayInMs);
     t.repeat = repeat;
+    t.name = name;
 
     queuedTasks.insert(t);
 
@@ -62,11 +85,15 @@ uint32_t QueuedTasks::getTimeTillNext() const
     return y.count();
 }
 
-void QueuedTasks::performAll()
+/**
+ * @brief QueuedTasks::performAll runs the tasks that are due.
+ * @return the number of tasks that took longer than slowTaskThreshold.
+ */
+size_t QueuedTasks::performAll(std::chrono::milliseconds slowTaskThreshold)
 {
     const auto now = std::chrono::steady_clock::now();
 
-    std::vector<std::shared_ptr<std::function<void()>>> functions;
+    std::vector<std::pair<const char*, std::shared_ptr<std::function<void()>>>> functions;
 
     for (auto pos = queuedTasks.begin(); pos != queuedTasks.end(); )
     {
@@ -80,7 +107,7 @@ void QueuedTasks::performAll()
         const auto tpos = tasks.find(cur->id);
         if (tpos != tasks.end() && cur->f.lock() == tpos->second)
         {
-            functions.push_back(tpos->second);
+            functions.emplace_back(cur->name, tpos->second);
 
             if (cur->repeat)
             {
@@ -97,21 +124,20 @@ void QueuedTasks::performAll()
         queuedTasks.erase(cur);
     }
 
-    for(const std::shared_ptr<std::function<void()>> &f : functions)
+    size_t slow_count = 0;
+
+    for(const auto &pair : functions)
     {
-        try
-        {
-            if (!f || !*f)
-                continue;
+        const std::shared_ptr<std::function<void()>> &f = pair.second;
 
-            f->operator()();
-        }
-        catch (std::exception &ex)
-        {
-            Logger *logger = Logger::getInstance();
-            logger->logf(LOG_ERR, "Error in delayed task: %s", ex.what());
-        }
+        if (!f || !*f)
+            continue;
+
+        if (runNamedTask("delayed", pair.first, *f, slowTaskThreshold))
+            slow_count++;
     }
+
+    return slow_count;
 }
 
 void QueuedTasks::clear()
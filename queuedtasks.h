@@ -16,6 +16,35 @@ See LICENSE for license details.
 #include <unordered_map>
 #include <memory>
 #include <chrono>
+#include <exception>
+
+void logTaskError(const char *kind, const char *name, const std::exception &ex);
+bool checkSlowTask(const char *kind, const char *name, std::chrono::time_point<std::chrono::steady_clock> start,
+                   std::chrono::milliseconds slowTaskThreshold);
+
+/**
+ * @brief runNamedTask runs a task, and logs it when it throws or takes longer than the threshold, so you can see what's holding up the
+ * event loop.
+ * @param kind is for the log lines, like 'queued' or 'delayed'.
+ * @param slowTaskThreshold 0 means never log it as slow.
+ * @return whether the task was slow.
+ */
+template<typename F>
+bool runNamedTask(const char *kind, const char *name, F &f, std::chrono::milliseconds slowTaskThreshold)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    try
+    {
+        f();
+    }
+    catch (std::exception &ex)
+    {
+        logTaskError(kind, name, ex);
+    }
+
+    return checkSlowTask(kind, name, start, slowTaskThreshold);
+}
 
 struct QueuedTask
 {
@@ -23,6 +52,7 @@ struct QueuedTask
     std::chrono::milliseconds interval;
     uint32_t id = 0;
     bool repeat = false;
+    const char *name = "unnamed";
     std::weak_ptr<std::function<void()>> f;
 
     bool operator<(const QueuedTask &rhs) const;
@@ -41,10 +71,10 @@ class QueuedTasks
 
 public:
     QueuedTasks();
-    uint32_t addTask(std::function<void()> f, uint32_t delayInMs, bool repeat=false);
+    uint32_t addTask(const char *name, std::function<void()> f, uint32_t delayInMs, bool repeat=false);
     void eraseTask(uint32_t id);
     uint32_t getTimeTillNext() const;
-    void performAll();
+    size_t performAll(std::chrono::milliseconds slowTaskThreshold);
     void clear();
 };
 
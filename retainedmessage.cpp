@@ -18,6 +18,7 @@ RetainedMessage::RetainedMessage(const Publish &publish) :
     this->publish.retain = true;
     const Settings *settings = ThreadGlobals::getSettings();
     this->publish.setExpireAfterToCeiling(settings->expireRetainedMessagesAfterSeconds);
+    this->accountedMemory = AccountedMemory(MemoryAccounting::retainedMessageBytes, getSize());
 }
 
 bool RetainedMessage::operator==(const RetainedMessage &rhs) const
@@ -13,10 +13,12 @@ See LICENSE for license details.
 
 #include <string>
 #include "types.h"
+#include "memoryaccounting.h"
 
 struct RetainedMessage
 {
     Publish publish;
+    AccountedMemory accountedMemory;
 
     RetainedMessage(const Publish &publish);
 
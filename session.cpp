@@ -17,6 +17,8 @@ See LICENSE for license details.
 #include "exceptions.h"
 #include "plugin.h"
 #include "settings.h"
+#include "memoryaccounting.h"
+#include "threaddata.h"
 
 
 Session::Session(const std::string &clientid, const std::string &username) :
@@ -24,7 +26,7 @@ Session::Session(const std::string &clientid, const std::string &username) :
     username(username),
 
     // Sessions also get defaults from the handleConnect() method, but when you create sessions elsewhere, we do need some sensible defaults.
-    qos(ThreadGlobals::getSettings()->maxQosMsgPendingPerClient)
+    qos(ThreadGlobals::getSettings()->maxQosMsgPendingPerClient, &qosFreeCapacityEstimate)
 {
     this->sessionExpiryInterval = ThreadGlobals::getSettings()->expireSessionsAfterSeconds;
 }
@@ -33,12 +35,14 @@ void Session::QoSData::increaseFlowControlQuota()
 {
     flowControlQuota++;
     flowControlQuota = std::min<int>(flowControlQuota, flowControlCealing);
+    updateFreeCapacityEstimate();
 }
 
 void Session::QoSData::increaseFlowControlQuota(int n)
 {
     flowControlQuota += n;
     flowControlQuota = std::min<int>(flowControlQuota, flowControlCealing);
+    updateFreeCapacityEstimate();
 }
 
 void Session::QoSData::clearExpiredMessagesFromQueue()
@@ -65,9 +69,30 @@ uint16_t Session::QoSData::getNextPacketId()
     nextPacketId = std::max<uint16_t>(nextPacketId, 1);
     assert(flowControlQuota > 0);
     flowControlQuota--;
+    updateFreeCapacityEstimate();
     return nextPacketId;
 }
 
+/**
+ * @brief Session::QoSData::updateFreeCapacityEstimate publishes the free fraction of the flow control quota, or 0 when the queue is
+ * over its byte limit. It's relaxed and can lag a bit, which is fine for picking a shared subscriber, and saves taking our lock there.
+ */
+void Session::QoSData::updateFreeCapacityEstimate()
+{
+    if (!freeCapacityEstimate)
+        return;
+
+    const Settings *settings = ThreadGlobals::getSettings();
+    const bool over_byte_limit = settings && qosPacketQueue.getByteSize() >= settings->maxQosBytesPendingPerClient && qosPacketQueue.size() > 0;
+
+    float result = 0.0f;
+
+    if (flowControlQuota > 0 && flowControlCealing > 0 && !over_byte_limit)
+        result = static_cast<float>(flowControlQuota) / static_cast<float>(flowControlCealing);
+
+    freeCapacityEstimate->store(result, std::memory_order_relaxed);
+}
+
 Session::~Session()
 {
     logger->log(LOG_DEBUG) << "Session destructor of session with client ID '" << this->client_id << "'.";
@@ -106,6 +131,7 @@ void Session::assignActiveConnection(const std::shared_ptr<Session> &thisSession
     thisSession->assignActiveConnection(client);
     client->assignSession(thisSession);
     thisSession->setSessionProperties(clientReceiveMax, sessionExpiryInterval, clean_start, client->getProtocolVersion());
+    thisSession->qos.lock()->qosPacketQueue.setConflate(client->getConflateWhenBacklogged());
 }
 
 /**
@@ -172,6 +198,21 @@ PacketDropReason Session::writePacket(PublishCopyFactory &copyFactory, const uin
         if (!c)
         {
             qos_locked->clearExpiredMessagesFromQueue();
+
+            // Over the memory budget, off-line clients don't get more queued. This is checked before conflating, so that they keep the
+            // value they have.
+            if (MemoryAccounting::getPressure() == MemoryPressure::Critical)
+            {
+                ThreadData *td = ThreadGlobals::getThreadData();
+                if (td)
+                    td->memoryPressureDrops.inc();
+                return PacketDropReason::QoSTODOSomethingSomething;
+            }
+
+            // When conflating, an off-line client only gets the last value of each topic.
+            const std::string &effective_topic = topic_override ? *topic_override : copyFactory.getTopic();
+            if (qos_locked->qosPacketQueue.eraseByTopic(effective_topic))
+                qos_locked->increaseFlowControlQuota();
         }
 
         if (qos_locked->flowControlQuota <= 0 || (qos_locked->qosPacketQueue.getByteSize() >= settings->maxQosBytesPendingPerClient && qos_locked->qosPacketQueue.size() > 0))
@@ -200,7 +241,10 @@ PacketDropReason Session::writePacket(PublishCopyFactory &copyFactory, const uin
         pack_id = qos_locked->getNextPacketId();
 
         if (!destroyOnDisconnect)
+        {
             qos_locked->qosPacketQueue.queuePublish(copyFactory, pack_id, effectiveQos, effectiveRetain, subscriptionIdentifier, topic_override);
+            qos_locked->updateFreeCapacityEstimate();
+        }
     }
 
     PacketDropReason return_value = PacketDropReason::ClientOffline;
@@ -216,6 +260,96 @@ PacketDropReason Session::writePacket(PublishCopyFactory &copyFactory, const uin
     return return_value;
 }
 
+/**
+ * @brief Session::isBacklogged says whether deliveries to this session are likely to fail, because the client's write buffer or the QoS
+ * queue is (nearly) full.
+ */
+bool Session::isBacklogged()
+{
+    const std::shared_ptr<Client> c = makeSharedClient();
+
+    if (c && c->isWriteBacklogged())
+        return true;
+
+    const Settings *settings = ThreadGlobals::getSettings();
+    MutexLocked<QoSData> qos_locked = qos.lock();
+    return qos_locked->flowControlQuota <= 0 || (qos_locked->qosPacketQueue.getByteSize() >= settings->maxQosBytesPendingPerClient && qos_locked->qosPacketQueue.size() > 0);
+}
+
+/**
+ * @brief Session::getFreeCapacity says how much this session can take right now, from 0 (off-line or saturated) to 1 (idle). It's the
+ * lowest of the free fractions of the client's write buffer and the flow control quota.
+ *
+ * It's called for every member of a share on each publish, so it uses the estimates that the client and the QoS data publish, instead
+ * of taking their locks.
+ */
+double Session::getFreeCapacity()
+{
+    const double quota_free = qosFreeCapacityEstimate.load(std::memory_order_relaxed);
+
+    if (quota_free <= 0.0)
+        return 0.0;
+
+    const std::shared_ptr<Client> c = makeSharedClient();
+
+    if (!c)
+        return 0.0;
+
+    const double write_buf_free = c->getWriteBufFreeFraction();
+    return std::min(write_buf_free, quota_free);
+}
+
+bool Session::isOnThread(const ThreadData *threadData)
+{
+    const std::shared_ptr<Client> c = makeSharedClient();
+    return c && c->lockThreadData().get() == threadData;
+}
+
+void Session::addSubscriptionNode(const std::shared_ptr<SubscriptionNode> &node, const std::string &shareName)
+{
+    auto nodes_locked = subscriptionNodes.lock();
+    (*nodes_locked)[std::make_pair(node.get(), shareName)] = node;
+}
+
+void Session::removeSubscriptionNode(const SubscriptionNode *node, const std::string &shareName)
+{
+    auto nodes_locked = subscriptionNodes.lock();
+    nodes_locked->erase(std::make_pair(node, shareName));
+}
+
+/**
+ * @brief Session::takeSubscriptionNodes empties the reverse index, and returns the nodes that still exist, for removing the subscriptions.
+ */
+std::vector<std::pair<std::shared_ptr<SubscriptionNode>, std::string>> Session::takeSubscriptionNodes()
+{
+    SubscriptionNodeIndex nodes;
+
+    {
+        auto nodes_locked = subscriptionNodes.lock();
+        nodes = std::move(*nodes_locked);
+        nodes_locked->clear();
+    }
+
+    std::vector<std::pair<std::shared_ptr<SubscriptionNode>, std::string>> result;
+    result.reserve(nodes.size());
+
+    for (auto &pair : nodes)
+    {
+        std::shared_ptr<SubscriptionNode> node = pair.second.lock();
+
+        if (node)
+            result.emplace_back(std::move(node), pair.first.second);
+    }
+
+    return result;
+}
+
+size_t Session::getSubscriptionNodeCount()
+{
+    auto nodes_locked = subscriptionNodes.lock();
+    return nodes_locked->size();
+}
+
 /**
  * @brief Session::clearQosMessage clears a QOS message from the queue. Note that in QoS 2, that doesn't complete the handshake.
  * @param packet_id
@@ -243,6 +377,10 @@ bool Session::clearQosMessage(uint16_t packet_id, bool qosHandshakeEnds)
     {
         qos_locked->increaseFlowControlQuota();
     }
+    else
+    {
+        qos_locked->updateFreeCapacityEstimate();
+    }
 
     return result;
 }
@@ -300,6 +438,8 @@ void Session::sendAllPendingQosData()
                 copiedPublishes.emplace_back(pub, qp->getTopicOverride(), qp->getPacketId());
             }
 
+            qos_locked->updateFreeCapacityEstimate();
+
             for (const uint16_t packet_id : qos_locked->outgoingQoS2MessageIds)
             {
                 copiedQoS2Ids.push_back(packet_id);
@@ -426,8 +566,9 @@ void Session::resetQoSData()
 {
     MutexLocked<QoSData> qos_locked = qos.lock();
     QoSData &q = *qos_locked;
-    QoSData new_q(ThreadGlobals::getSettings()->maxQosMsgPendingPerClient);
+    QoSData new_q(ThreadGlobals::getSettings()->maxQosMsgPendingPerClient, &qosFreeCapacityEstimate);
     q = std::move(new_q);
+    q.updateFreeCapacityEstimate();
 }
 
 /**
@@ -448,6 +589,7 @@ void Session::setSessionProperties(uint16_t clientReceiveMax, uint32_t sessionEx
     // Flow control is not part of the session state, so/but/and because we call this function every time a client connects, we reset it properly.
     qos_locked->flowControlQuota = clientReceiveMax;
     qos_locked->flowControlCealing = clientReceiveMax;
+    qos_locked->updateFreeCapacityEstimate();
 
     this->sessionExpiryInterval = sessionExpiryInterval;
 
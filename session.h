@@ -12,10 +12,13 @@ See LICENSE for license details.
 #define SESSION_H
 
 #include <memory>
+#include <atomic>
 #include <list>
 #include <mutex>
 #include <shared_mutex>
 #include <set>
+#include <map>
+#include <vector>
 
 #include "forward_declarations.h"
 #include "logger.h"
@@ -48,8 +51,12 @@ class Session
         int flowControlCealing = 0xFFFF;
         int flowControlQuota = 0xFFFF;
 
-        QoSData(const uint16_t maxQosMsgPendingPerClient) :
-            flowControlQuota(maxQosMsgPendingPerClient)
+        // Where updateFreeCapacityEstimate() publishes to, so it can be read without this lock.
+        std::atomic<float> *freeCapacityEstimate = nullptr;
+
+        QoSData(const uint16_t maxQosMsgPendingPerClient, std::atomic<float> *freeCapacityEstimate) :
+            flowControlQuota(maxQosMsgPendingPerClient),
+            freeCapacityEstimate(freeCapacityEstimate)
         {
 
         }
@@ -58,6 +65,7 @@ class Session
         void increaseFlowControlQuota();
         void increaseFlowControlQuota(int n);
         uint16_t getNextPacketId();
+        void updateFreeCapacityEstimate();
     };
 
     friend class SessionsAndSubscriptionsDB;
@@ -72,8 +80,16 @@ class Session
     LockedWeakPtr<Client> client;
     const std::string client_id;
     const std::string username;
+    std::atomic<float> qosFreeCapacityEstimate {1.0f}; // See QoSData::updateFreeCapacityEstimate().
     MutexOwned<QoSData> qos;
 
+    /*
+     * Reverse index of the subscription tree nodes this session is subscribed on, per share name (empty for normal subscriptions), so
+     * they can be removed without walking the tree.
+     */
+    typedef std::map<std::pair<const SubscriptionNode*, std::string>, std::weak_ptr<SubscriptionNode>> SubscriptionNodeIndex;
+    MutexOwned<SubscriptionNodeIndex> subscriptionNodes;
+
     // Note, we set these write-once to avoid threading issues. As a work-around to avoid mutexing in a hot path.
     std::optional<std::string> local_prefix;
     std::optional<std::string> remote_prefix;
@@ -105,6 +121,15 @@ public:
     bool clearQosMessage(uint16_t packet_id, bool qosHandshakeEnds);
     void sendAllPendingQosData();
     bool hasActiveClient();
+    bool isBacklogged();
+    double getFreeCapacity();
+    bool isOnThread(const ThreadData *threadData);
+
+    void addSubscriptionNode(const std::shared_ptr<SubscriptionNode> &node, const std::string &shareName);
+    void removeSubscriptionNode(const SubscriptionNode *node, const std::string &shareName);
+    std::vector<std::pair<std::shared_ptr<SubscriptionNode>, std::string>> takeSubscriptionNodes();
+    size_t getSubscriptionNodeCount();
+
     void clearWill();
     std::shared_ptr<WillPublish> getWill();
     void setWill(WillPublish &&pub);
@@ -40,7 +40,10 @@ enum class SharedSubscriptionTargeting
 {
     RoundRobin,
     SenderHash,
-    First
+    First,
+    LeastLoaded,
+    ThreadLocal,
+    TopicHash
 };
 
 enum class WildcardSubscriptionDenyMode
@@ -74,6 +77,11 @@ public:
     int clientInitialBufferSize = 1024; // Must be power of 2
     uint32_t maxPacketSize = ABSOLUTE_MAX_PACKET_SIZE;
     uint32_t clientMaxWriteBufferSize = 1048576;
+    uint32_t clientReadBudgetBytes = 0;
+    uint32_t clientReadBudgetPackets = 0;
+    uint32_t publisherBackpressureThreshold = 0;
+    uint32_t publisherBackpressureMaxPauseMs = 1000;
+    uint64_t memoryBudget = 0;
     uint16_t maxIncomingTopicAliasValue = 65535;
     uint16_t maxOutgoingTopicAliasValue = 65535;
 #ifdef TESTING
@@ -92,6 +100,8 @@ public:
     int pluginTimerPeriod = 60;
     std::string storageDir;
     int threadCount = 0;
+    int handshakeThreadCount = 0;
+    bool minimizeIdleConnectionMemory = false;
     uint16_t maxQosMsgPendingPerClient = 512;
     uint maxQosBytesPendingPerClient = 65536;
     bool willsEnabled = true;
@@ -105,6 +115,8 @@ public:
     WildcardSubscriptionDenyMode wildcardSubscriptionDenyMode = WildcardSubscriptionDenyMode::DenyAll;
     bool zeroByteUsernameIsAnonymous = false;
     std::chrono::milliseconds maxEventLoopDrift = std::chrono::milliseconds(2000);
+    std::chrono::milliseconds slowTaskThreshold = std::chrono::milliseconds(100);
+    std::chrono::seconds clientRebalanceInterval = std::chrono::seconds(0);
     OverloadMode overloadMode = OverloadMode::Log;
     std::chrono::milliseconds setRetainedMessageDeferTimeout = std::chrono::milliseconds(0);
     std::chrono::milliseconds setRetainedMessageDeferTimeoutSpread = std::chrono::milliseconds(1000);
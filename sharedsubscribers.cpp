@@ -10,6 +10,10 @@ See LICENSE for license details.
 
 #include "sharedsubscribers.h"
 #include <cassert>
+#include <algorithm>
+
+#include "threadglobals.h"
+#include "settings.h"
 
 SharedSubscribers::SharedSubscribers() noexcept
 {
@@ -44,10 +48,67 @@ Subscription &SharedSubscribers::operator[](const std::string &clientid)
     const int newIndex = members.size();
     index[clientid] = newIndex;
     members.emplace_back();
+
+    if (hashRingWanted())
+        addToHashRing(clientid, newIndex);
+
     Subscription &r = members.back();
     return r;
 }
 
+/**
+ * @brief SharedSubscribers::hashRingWanted says whether to maintain the hash ring. Only topic hash targeting uses it, and it's not free.
+ */
+bool SharedSubscribers::hashRingWanted()
+{
+    const Settings *settings = ThreadGlobals::getSettings();
+    return !settings || settings->sharedSubscriptionTargeting == SharedSubscriptionTargeting::TopicHash;
+}
+
+void SharedSubscribers::appendHashRingPoints(const std::string &clientid, int index)
+{
+    std::hash<std::string> hasher;
+
+    for (int i = 0; i < hashRingVirtualNodes; i++)
+    {
+        const size_t point = hasher(clientid + "#" + std::to_string(i));
+        hashRing.emplace_back(point, index);
+    }
+}
+
+/**
+ * @brief SharedSubscribers::addToHashRing adds the points of one member. Only the new points are sorted, and then merged in.
+ */
+void SharedSubscribers::addToHashRing(const std::string &clientid, int index)
+{
+    const size_t oldSize = hashRing.size();
+    appendHashRingPoints(clientid, index);
+
+    const auto middle = hashRing.begin() + oldSize;
+    std::sort(middle, hashRing.end());
+    std::inplace_merge(hashRing.begin(), middle, hashRing.end());
+}
+
+void SharedSubscribers::rebuildHashRing()
+{
+    hashRing.clear();
+
+    if (!hashRingWanted())
+    {
+        hashRing.shrink_to_fit();
+        return;
+    }
+
+    hashRing.reserve(index.size() * hashRingVirtualNodes);
+
+    for (auto &pair : this->index)
+    {
+        appendHashRingPoints(pair.first, pair.second);
+    }
+
+    std::sort(hashRing.begin(), hashRing.end());
+}
+
 const Subscription *SharedSubscribers::getFirst() const
 {
     const Subscription *result = nullptr;
@@ -103,19 +164,159 @@ const Subscription *SharedSubscribers::getNext(size_t hash) const
     return result;
 }
 
-void SharedSubscribers::erase(const std::string &clientid)
+/**
+ * @brief SharedSubscribers::getLeastLoaded picks the member with the most free write buffer and flow control quota. The search starts
+ * at the round robin position, so idle members, which end the search, are still spread evenly.
+ *
+ * When all members are saturated, it falls back to round robin, so the dropped or queued messages are spread.
+ */
+const Subscription *SharedSubscribers::getLeastLoaded()
+{
+    if (members.empty())
+        return nullptr;
+
+    const Subscription *result = nullptr;
+    double best_capacity = 0.0;
+
+    // This counter use is not thread safe / atomic, but it doesn't matter much.
+    const size_t start = roundRobinCounter++;
+
+    for (size_t i = 0; i < members.size(); i++)
+    {
+        const Subscription &s = members[(start + i) % members.size()];
+
+        const std::shared_ptr<Session> session = s.session.lock();
+
+        if (!session)
+            continue;
+
+        const double capacity = session->getFreeCapacity();
+
+        if (capacity >= 1.0)
+            return &s;
+
+        if (capacity > best_capacity)
+        {
+            best_capacity = capacity;
+            result = &s;
+        }
+    }
+
+    if (result)
+        return result;
+
+    return getNext();
+}
+
+/**
+ * @brief SharedSubscribers::getThreadLocal picks the next member in round robin order whose client lives on the given thread, so the
+ * delivery doesn't need cross-thread locking and wake-ups. If there are none, it's plain round robin.
+ */
+const Subscription *SharedSubscribers::getThreadLocal(const ThreadData *threadData)
+{
+    if (members.empty())
+        return nullptr;
+
+    const size_t start = roundRobinCounter;
+
+    for (size_t i = 0; i < members.size(); i++)
+    {
+        const size_t pos = (start + i) % members.size();
+        const Subscription &s = members[pos];
+
+        const std::shared_ptr<Session> session = s.session.lock();
+
+        if (session && session->isOnThread(threadData))
+        {
+            roundRobinCounter = pos + 1;
+            return &s;
+        }
+    }
+
+    return getNext();
+}
+
+/**
+ * @brief SharedSubscribers::getByTopicHash selects the member that owns the hash on the consistent hash ring, so a topic keeps going
+ * to the same member, and members coming and going only move about 1/N of the topics. Departed members are skipped by walking the ring
+ * further, which gives their topics to the members next to their points.
+ */
+const Subscription *SharedSubscribers::getByTopicHash(size_t hash) const
+{
+    if (members.empty())
+        return nullptr;
+
+    // The ring is only maintained with topic hash targeting, so after switching to it on a reload, it may not be there yet.
+    if (hashRing.empty())
+        return getNext(hash);
+
+    auto pos = std::lower_bound(hashRing.begin(), hashRing.end(), std::make_pair(hash, 0));
+
+    for (size_t i = 0; i < hashRing.size(); i++)
+    {
+        if (pos == hashRing.end())
+            pos = hashRing.begin();
+
+        const Subscription &s = members[pos->second];
+
+        if (!s.session.expired())
+            return &s;
+
+        pos++;
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief SharedSubscribers::erase removes the member, leaving an empty spot for purgeAndReIndex() to clean up.
+ * @param onlyOfSession when given, the member is only removed if it belongs to that session (or to no session anymore), so that a new
+ * session with the same client ID keeps its subscription.
+ * @return whether a member was removed.
+ */
+bool SharedSubscribers::erase(const std::string &clientid, const Session *onlyOfSession)
 {
     auto index_pos = index.find(clientid);
-    if (index_pos != index.end())
+    if (index_pos == index.end())
+        return false;
+
+    const int index = index_pos->second;
+    assert(index < static_cast<int>(members.size()));
+    Subscription &sub = members[index];
+
+    if (onlyOfSession)
     {
-        const int index = index_pos->second;
-        assert(index < static_cast<int>(members.size()));
-        members[index].reset();
+        std::shared_ptr<Session> ses = sub.session.lock();
+
+        if (ses && ses.get() != onlyOfSession)
+            return false;
     }
+
+    sub.reset();
+    this->index.erase(index_pos);
+    return true;
 }
 
-void SharedSubscribers::purgeAndReIndex()
+/**
+ * @brief SharedSubscribers::purgeAndReIndex removes the empty spots.
+ * @return the amount of members that were dropped because their session no longer exists, without them being erased first.
+ */
+size_t SharedSubscribers::purgeAndReIndex()
 {
+    const bool nothingToPurge = members.size() == index.size() &&
+                                std::none_of(members.begin(), members.end(), [](const Subscription &sub) { return sub.session.expired(); });
+
+    if (nothingToPurge)
+    {
+        // The targeting may have been changed on a reload.
+        const bool ringComplete = hashRing.size() == members.size() * hashRingVirtualNodes;
+        if (hashRingWanted() ? !ringComplete : !hashRing.empty())
+            rebuildHashRing();
+
+        return 0;
+    }
+
+    size_t orphans = 0;
     int i = 0;
     std::vector<Subscription> newMembers;
     std::unordered_map<std::string, int> newIndex;
@@ -126,7 +327,10 @@ void SharedSubscribers::purgeAndReIndex()
         Subscription &sub = members[index];
 
         if (sub.session.expired())
+        {
+            orphans++;
             continue;
+        }
 
         newMembers.push_back(sub);
         newIndex[pair.first] = i;
@@ -135,6 +339,15 @@ void SharedSubscribers::purgeAndReIndex()
 
     this->members = std::move(newMembers);
     this->index = std::move(newIndex);
+
+    rebuildHashRing();
+
+    return orphans;
+}
+
+size_t SharedSubscribers::size() const
+{
+    return index.size();
 }
 
 bool SharedSubscribers::empty() const
@@ -29,6 +29,18 @@ class SharedSubscribers
     int roundRobinCounter = 0;
     std::string shareName;
 
+    /*
+     * Consistent hash ring: points (hashes of the client ID and a virtual node number) and the member index they belong to, sorted
+     * by point. Because the points only depend on the client ID, members coming and going only move their own part of the keys.
+     */
+    static constexpr int hashRingVirtualNodes = 64;
+    std::vector<std::pair<size_t, int>> hashRing;
+
+    static bool hashRingWanted();
+    void appendHashRingPoints(const std::string &clientid, int index);
+    void addToHashRing(const std::string &clientid, int index);
+    void rebuildHashRing();
+
 public:
     SharedSubscribers() noexcept;
 
@@ -37,8 +49,12 @@ public:
     const Subscription *getFirst() const;
     const Subscription *getNext();
     const Subscription *getNext(size_t hash) const;
-    void erase(const std::string &clientid);
-    void purgeAndReIndex();
+    const Subscription *getLeastLoaded();
+    const Subscription *getThreadLocal(const ThreadData *threadData);
+    const Subscription *getByTopicHash(size_t hash) const;
+    bool erase(const std::string &clientid, const Session *onlyOfSession = nullptr);
+    size_t purgeAndReIndex();
+    size_t size() const;
     bool empty() const;
     void getForSerializing(const std::string &topic, std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &outputList) const;
 };
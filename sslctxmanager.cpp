@@ -63,3 +63,23 @@ void SslCtxManager::setMinimumTlsVersion(TLSVersion min_version)
 
     SSL_CTX_set_min_proto_version(ssl_ctx, tlsEnumToInt(min_version));
 }
+
+/**
+ * @brief SslCtxManager::enableKtls makes OpenSSL hand the symmetric crypto to the kernel after the handshake, when the kernel and cipher support it.
+ * @return false when this OpenSSL doesn't have kTLS at all.
+ *
+ * When the kernel refuses (no 'tls' module, unsupported cipher), OpenSSL silently keeps doing the crypto itself, so
+ * SSL_read() and SSL_write() keep working either way. With kTLS active, they just become plain read() and write()s.
+ */
+bool SslCtxManager::enableKtls()
+{
+    if (!ssl_ctx)
+        return false;
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+    return true;
+#else
+    return false;
+#endif
+}
@@ -29,6 +29,7 @@ public:
 
     static int tlsEnumToInt(TLSVersion v);
     void setMinimumTlsVersion(TLSVersion min_version);
+    bool enableKtls();
 };
 
 #endif // SSLCTXMANAGER_H
@@ -58,7 +58,7 @@ std::unordered_map<std::string, SharedSubscribers> &SubscriptionNode::getSharedS
 
 AddSubscriptionType SubscriptionNode::addSubscriber(
     const std::shared_ptr<Session> &subscriber, uint8_t qos, bool noLocal, bool retainAsPublished,
-    const std::string &shareName, const uint32_t subscriptionIdentifier)
+    const std::string &shareName, const uint32_t subscriptionIdentifier, bool *entryCreated)
 {
     if (!subscriber)
         return AddSubscriptionType::Invalid;
@@ -79,29 +79,33 @@ AddSubscriptionType SubscriptionNode::addSubscriber(
 
     if (shareName.empty())
     {
+        const size_t size_before = subscribers.size();
         Subscription &s = subscribers[client_id];
         result = s.session.expired() ? AddSubscriptionType::NewSubscription : AddSubscriptionType::ExistingSubscription;
         s = sub;
+
+        if (entryCreated)
+            *entryCreated = subscribers.size() > size_before;
     }
     else
     {
         SharedSubscribers &subscribers = sharedSubscribers[shareName];
         subscribers.setName(shareName); // c++14 doesn't have try-emplace yet, in which case this separate step wouldn't be needed.
 
+        const size_t size_before = subscribers.size();
         Subscription &s = subscribers[client_id];
         result = s.session.expired() ? AddSubscriptionType::NewSubscription : AddSubscriptionType::ExistingSubscription;
         s = sub;
+
+        if (entryCreated)
+            *entryCreated = subscribers.size() > size_before;
     }
 
     return result;
 }
 
-void SubscriptionNode::removeSubscriber(const std::shared_ptr<Session> &subscriber, const std::string &shareName)
+bool SubscriptionNode::removeSubscriber(const std::shared_ptr<Session> &subscriber, const std::string &shareName)
 {
-    Subscription sub;
-    sub.session = subscriber;
-    sub.qos = 0;
-
     const std::string &clientId = subscriber->getClientId();
 
     std::unique_lock locker(lock);
@@ -115,6 +119,7 @@ void SubscriptionNode::removeSubscriber(const std::shared_ptr<Session> &subscrib
         if (it != subscribers.end())
         {
             subscribers.erase(it);
+            return true;
         }
     }
     else
@@ -123,133 +128,194 @@ void SubscriptionNode::removeSubscriber(const std::shared_ptr<Session> &subscrib
         if (pos != sharedSubscribers.end())
         {
             SharedSubscribers &subscribers = pos->second;
-            subscribers.erase(clientId);
+            return subscribers.erase(clientId);
         }
     }
+
+    return false;
+}
+
+/**
+ * @brief SubscriptionNode::removeSubscriberOfSession is like removeSubscriber(), but leaves the subscription alone when it's of another
+ * session with the same client ID, like a session that took over.
+ */
+bool SubscriptionNode::removeSubscriberOfSession(const Session *subscriber, const std::string &shareName)
+{
+    const std::string &clientId = subscriber->getClientId();
+
+    std::unique_lock locker(lock);
+
+    lastUpdate = std::chrono::steady_clock::now();
+
+    if (shareName.empty())
+    {
+        auto it = subscribers.find(clientId);
+
+        if (it == subscribers.end())
+            return false;
+
+        std::shared_ptr<Session> ses = it->second.session.lock();
+
+        if (ses && ses.get() != subscriber)
+            return false;
+
+        subscribers.erase(it);
+        return true;
+    }
+
+    auto pos = sharedSubscribers.find(shareName);
+    if (pos != sharedSubscribers.end())
+    {
+        SharedSubscribers &subscribers = pos->second;
+        return subscribers.erase(clientId, subscriber);
+    }
+
+    return false;
+}
+
+SubscriptionStore::SubscriptionStore()
+{
+
 }
 
-SubscriptionStore::SubscriptionStore() :
-    sessionsByIdConst(sessionsById)
+SessionShard &SubscriptionStore::getSessionShard(const std::string &client_id)
 {
+    static_assert((sessionShardCount & (sessionShardCount - 1)) == 0, "The shard count must be a power of two.");
 
+    const size_t hash = std::hash<std::string>()(client_id);
+    return sessionShards[hash & (sessionShardCount - 1)];
 }
 
 /**
- * @brief SubscriptionStore::getDeepestNode gets the node in the tree walking the path of 'the/subscription/topic/path', making new nodes as required.
- * @param topic
- * @param subtopics
- * @return
+ * @brief SubscriptionStore::getAllSessions copies the session pointers, one shard at a time, so there is no moment all CONNECTs are blocked.
  */
-std::shared_ptr<SubscriptionNode> SubscriptionStore::getDeepestNode(const std::vector<std::string> &subtopics, bool abort_on_dead_end)
+std::vector<std::shared_ptr<Session>> SubscriptionStore::getAllSessions() const
 {
-    const std::shared_ptr<SubscriptionNode> *start = &root;
+    std::vector<std::shared_ptr<Session>> result;
+
+    for (const SessionShard &shard : sessionShards)
+    {
+        std::shared_lock locker(shard.lock);
+
+        result.reserve(result.size() + shard.sessionsById.size());
+
+        for (const auto &pair : shard.sessionsById)
+        {
+            result.push_back(pair.second);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief SubscriptionStore::getDeepestNodeLocked walks the path of 'the/subscription/topic/path'. The caller must hold subscriptions_lock, and
+ * hold it exclusively when create is true.
+ * @param create whether to make new nodes as required. If false, a missing node results in a nullptr.
+ */
+std::shared_ptr<SubscriptionNode> SubscriptionStore::getDeepestNodeLocked(const std::vector<std::string> &subtopics, bool create)
+{
+    const std::shared_ptr<SubscriptionNode> *deepestNode = &root;
     if (!subtopics.empty())
     {
         const std::string &first = subtopics.front();
         if (first.length() > 0 && first[0] == '$')
-            start = &rootDollar;
+            deepestNode = &rootDollar;
     }
 
-    std::shared_ptr<SubscriptionNode> result;
-    bool retry_mode = false;
-
-    for(int i = 0; i < 2; i++)
+    for (const std::string &subtopic : subtopics)
     {
-        assert(i < 1 || retry_mode);
+        std::shared_ptr<SubscriptionNode> *selectedChildren = nullptr;
 
-        std::shared_lock rlock(subscriptions_lock, std::defer_lock);
-        std::unique_lock wlock(subscriptions_lock, std::defer_lock);
-
-        if (retry_mode)
+        if (subtopic == "#")
+            selectedChildren = &(*deepestNode)->childrenPound;
+        else if (subtopic == "+")
+            selectedChildren = &(*deepestNode)->childrenPlus;
+        else
         {
-            assert(!abort_on_dead_end);
-            wlock.lock();
+            auto &children = (*deepestNode)->children;
+
+            if (create)
+            {
+                selectedChildren = &children[subtopic];
+            }
+            else // read-only path
+            {
+                auto child_pos = children.find(subtopic);
+
+                if (child_pos == children.end())
+                    return std::shared_ptr<SubscriptionNode>();
+
+                selectedChildren = &child_pos->second;
+            }
         }
-        else
-            rlock.lock();
 
-        auto subtopic_pos = subtopics.begin();
-        const std::shared_ptr<SubscriptionNode> *deepestNode = start;
+        std::shared_ptr<SubscriptionNode> &node = *selectedChildren;
 
-        while(subtopic_pos != subtopics.end())
+        if (!node)
         {
-            const std::string &subtopic = *subtopic_pos;
-            std::shared_ptr<SubscriptionNode> *selectedChildren = nullptr;
-
-            if (subtopic == "#")
-                selectedChildren = &(*deepestNode)->childrenPound;
-            else if (subtopic == "+")
-                selectedChildren = &(*deepestNode)->childrenPlus;
-            else
-            {
-                auto &children = (*deepestNode)->children;
+            if (!create)
+                return std::shared_ptr<SubscriptionNode>();
 
-                if (retry_mode)
-                {
-                    assert(wlock.owns_lock());
-                    selectedChildren = &children[subtopic];
-                }
-                else // read-only path
-                {
-                    assert(rlock.owns_lock());
-                    auto child_pos = children.find(subtopic);
+            node = std::make_shared<SubscriptionNode>();
+        }
 
-                    if (child_pos == children.end())
-                    {
-                        if (abort_on_dead_end)
-                            return result;
+        deepestNode = &node;
+    }
 
-                        retry_mode = true;
-                        break;
-                    }
-                    else
-                    {
-                        selectedChildren = &child_pos->second;
-                    }
-                }
-            }
+    assert(deepestNode);
+    assert(*deepestNode);
+    return *deepestNode;
+}
 
-            std::shared_ptr<SubscriptionNode> &node = *selectedChildren;
+/**
+ * @brief SubscriptionStore::getDeepestNode gets the node in the tree walking the path of 'the/subscription/topic/path', making new nodes as required.
+ * @param topic
+ * @param subtopics
+ * @return
+ */
+std::shared_ptr<SubscriptionNode> SubscriptionStore::getDeepestNode(const std::vector<std::string> &subtopics, bool abort_on_dead_end)
+{
+    {
+        std::shared_lock rlock(subscriptions_lock);
+        std::shared_ptr<SubscriptionNode> result = getDeepestNodeLocked(subtopics, false);
 
-            if (!node)
-            {
-                if (!retry_mode)
-                {
-                    assert(rlock.owns_lock());
+        if (result || abort_on_dead_end)
+            return result;
+    }
 
-                    if (abort_on_dead_end)
-                        return result;
+    std::unique_lock wlock(subscriptions_lock);
+    return getDeepestNodeLocked(subtopics, true);
+}
 
-                    retry_mode = true;
-                    break;
-                }
+/**
+ * @brief SubscriptionStore::getDeepestNodes is getDeepestNode() for many paths at once, taking the read lock once, and the write lock
+ * at most once, for the paths that need new nodes.
+ */
+std::vector<std::shared_ptr<SubscriptionNode>> SubscriptionStore::getDeepestNodes(const std::vector<const std::vector<std::string>*> &subtopicsList)
+{
+    std::vector<std::shared_ptr<SubscriptionNode>> result(subtopicsList.size());
+    bool missing = false;
 
-                assert(retry_mode);
-                assert(wlock.owns_lock());
-                node = std::make_shared<SubscriptionNode>();
-
-                /*
-                 * This is not technically correct, because we haven't made a subscription yet, but it:
-                 *
-                 * 1) Only happens when we're about to make a subscription, and not when we remove one.
-                 * 2) Allows continuous subscription and unsubcription on a node without needing to update this atomic counter.
-                 */
-                subscriptionCount++;
-            }
+    {
+        std::shared_lock rlock(subscriptions_lock);
 
-            deepestNode = &node;
-            subtopic_pos++;
+        for (size_t i = 0; i < subtopicsList.size(); i++)
+        {
+            result[i] = getDeepestNodeLocked(*subtopicsList[i], false);
+            missing |= !result[i];
         }
+    }
 
-        assert(deepestNode);
-        assert(*deepestNode);
-
-        if (retry_mode && subtopic_pos != subtopics.end())
-            continue;
+    if (missing)
+    {
+        std::unique_lock wlock(subscriptions_lock);
 
-        result = *deepestNode;
-        assert(result);
-        return result;
+        for (size_t i = 0; i < subtopicsList.size(); i++)
+        {
+            if (!result[i])
+                result[i] = getDeepestNodeLocked(*subtopicsList[i], true);
+        }
     }
 
     return result;
@@ -263,10 +329,59 @@ AddSubscriptionType SubscriptionStore::addSubscription(
 
     const std::shared_ptr<SubscriptionNode> deepestNode = getDeepestNode(subtopics);
 
-    if (!deepestNode)
+    return addSubscriptionToNode(deepestNode, session, qos, noLocal, retainAsPublished, shareName, subscriptionIdentifier);
+}
+
+/**
+ * @brief SubscriptionStore::addSubscriptions adds all subscriptions of a SUBSCRIBE packet, looking up (or making) the nodes for all of them
+ * with one acquisition of the tree lock.
+ * @return the result per subscription, in the same order.
+ */
+std::vector<AddSubscriptionType> SubscriptionStore::addSubscriptions(
+    const std::shared_ptr<Session> &session, const std::vector<const SubscriptionTuple*> &subscriptions)
+{
+    std::vector<AddSubscriptionType> result(subscriptions.size(), AddSubscriptionType::Invalid);
+
+    if (!session)
+        return result;
+
+    std::vector<const std::vector<std::string>*> subtopicsList;
+    subtopicsList.reserve(subscriptions.size());
+
+    for (const SubscriptionTuple *tup : subscriptions)
+    {
+        subtopicsList.push_back(&tup->subtopics);
+    }
+
+    const std::vector<std::shared_ptr<SubscriptionNode>> nodes = getDeepestNodes(subtopicsList);
+
+    for (size_t i = 0; i < subscriptions.size(); i++)
+    {
+        const SubscriptionTuple &tup = *subscriptions[i];
+        result[i] = addSubscriptionToNode(nodes[i], session, tup.qos, tup.noLocal, tup.retainAsPublished, tup.shareName, tup.subscriptionIdentifier);
+    }
+
+    return result;
+}
+
+AddSubscriptionType SubscriptionStore::addSubscriptionToNode(
+    const std::shared_ptr<SubscriptionNode> &node, const std::shared_ptr<Session> &session, uint8_t qos, bool noLocal, bool retainAsPublished,
+    const std::string &shareName, const uint32_t subscriptionIdentifier)
+{
+    if (!node)
         return AddSubscriptionType::Invalid;
 
-    return deepestNode->addSubscriber(session, qos, noLocal, retainAsPublished, shareName, subscriptionIdentifier);
+    bool entryCreated = false;
+    const AddSubscriptionType result = node->addSubscriber(session, qos, noLocal, retainAsPublished, shareName, subscriptionIdentifier, &entryCreated);
+
+    if (entryCreated)
+        subscriptionCount++;
+
+    // Also done for existing entries, because the entry may have been of an earlier session with the same client ID.
+    if (result != AddSubscriptionType::Invalid)
+        session->addSubscriptionNode(node, shareName);
+
+    return result;
 }
 
 void SubscriptionStore::removeSubscription(
@@ -280,16 +395,55 @@ void SubscriptionStore::removeSubscription(
     if (!node)
         return;
 
-    node->removeSubscriber(session, shareName);
+    if (node->removeSubscriber(session, shareName))
+    {
+        subscriptionCount--;
+        subscriptionTreeDirty = true;
+    }
+
+    session->removeSubscriptionNode(node.get(), shareName);
+}
+
+/**
+ * @brief SubscriptionStore::removeSubscriptionsOfSession removes the subscriptions of a session that is removed or replaced. Thanks to the
+ * session's index of subscription nodes, this doesn't involve walking the tree.
+ */
+void SubscriptionStore::removeSubscriptionsOfSession(const std::shared_ptr<Session> &session)
+{
+    if (!session)
+        return;
+
+    const std::vector<std::pair<std::shared_ptr<SubscriptionNode>, std::string>> nodes = session->takeSubscriptionNodes();
+
+    if (nodes.empty())
+        return;
+
+    // Tree maintenance doesn't take the node locks, so keep it out while we're modifying them.
+    std::shared_lock locker(subscriptions_lock);
+
+    size_t removed = 0;
+
+    for (const std::pair<std::shared_ptr<SubscriptionNode>, std::string> &pair : nodes)
+    {
+        if (pair.first->removeSubscriberOfSession(session.get(), pair.second))
+            removed++;
+    }
+
+    if (removed > 0)
+    {
+        subscriptionCount -= removed;
+        subscriptionTreeDirty = true;
+    }
 }
 
 std::shared_ptr<Session> SubscriptionStore::getBridgeSession(std::shared_ptr<Client> &client)
 {
     const std::string &client_id = client->getClientId();
 
-    std::unique_lock locker(sessions_lock);
+    SessionShard &shard = getSessionShard(client_id);
+    std::unique_lock locker(shard.lock);
 
-    std::shared_ptr<Session> &session = sessionsById[client_id];
+    std::shared_ptr<Session> &session = shard.sessionsById[client_id];
 
     if (!session)
         session = std::make_shared<Session>(client_id, client->getUsername());
@@ -329,15 +483,17 @@ void SubscriptionStore::registerClientAndKickExistingOne(std::shared_ptr<Client>
 
     // These destructors need to be called outside the sessions lock, so placing here.
     std::shared_ptr<Session> session;
+    std::shared_ptr<Session> replacedSession;
 
     if (client->getClientId().empty())
         throw ProtocolError("Trying to store client without an ID.", ReasonCodes::ProtocolError);
 
     {
-        std::unique_lock ses_locker(sessions_lock);
+        SessionShard &shard = getSessionShard(client->getClientId());
+        std::unique_lock ses_locker(shard.lock);
 
-        auto session_it = sessionsById.find(client->getClientId());
-        if (session_it != sessionsById.end())
+        auto session_it = shard.sessionsById.find(client->getClientId());
+        if (session_it != shard.sessionsById.end())
         {
             session = session_it->second;
 
@@ -360,13 +516,17 @@ void SubscriptionStore::registerClientAndKickExistingOne(std::shared_ptr<Client>
 
         if (!session || session->getDestroyOnDisconnect() || clean_start)
         {
+            replacedSession = std::move(session);
+
             // Don't use sdt::make_shared to avoid the weak pointers from retaining the size of session in the control block.
             session = std::shared_ptr<Session>(new Session(client->getClientId(), client->getUsername()));
 
-            sessionsById[client->getClientId()] = session;
+            shard.sessionsById[client->getClientId()] = session;
         }
     }
 
+    removeSubscriptionsOfSession(replacedSession);
+
     session->assignActiveConnection(session, client, clientReceiveMax, sessionExpiryInterval, clean_start);
 }
 
@@ -378,10 +538,11 @@ void SubscriptionStore::registerClientAndKickExistingOne(std::shared_ptr<Client>
  */
 std::shared_ptr<Session> SubscriptionStore::lockSession(const std::string &clientid)
 {
-    std::shared_lock ses_locker(sessions_lock);
+    const SessionShard &shard = getSessionShard(clientid);
+    std::shared_lock ses_locker(shard.lock);
 
-    auto it = sessionsByIdConst.find(clientid);
-    if (it != sessionsByIdConst.end())
+    auto it = shard.sessionsById.find(clientid);
+    if (it != shard.sessionsById.end())
     {
         return it->second;
     }
@@ -500,7 +661,8 @@ void SubscriptionStore::queueWillMessage(const std::shared_ptr<WillPublish> &wil
 }
 
 void SubscriptionStore::publishNonRecursively(
-    SubscriptionNode *this_node, std::vector<ReceivingSubscriber> &targetSessions, const std::string &senderClientId) noexcept
+    SubscriptionNode *this_node, std::vector<ReceivingSubscriber> &targetSessions, const std::string &senderClientId,
+    const std::string &topic) noexcept
 {
     std::shared_lock locker(this_node->lock);
 
@@ -548,6 +710,15 @@ void SubscriptionStore::publishNonRecursively(
             sub = subscribers.getNext();
         else if (settings->sharedSubscriptionTargeting == SharedSubscriptionTargeting::First)
             sub = subscribers.getFirst();
+        else if (settings->sharedSubscriptionTargeting == SharedSubscriptionTargeting::LeastLoaded)
+            sub = subscribers.getLeastLoaded();
+        else if (settings->sharedSubscriptionTargeting == SharedSubscriptionTargeting::ThreadLocal)
+            sub = subscribers.getThreadLocal(ThreadGlobals::getThreadData());
+        else if (settings->sharedSubscriptionTargeting == SharedSubscriptionTargeting::TopicHash)
+        {
+            const size_t hash = std::hash<std::string>()(topic);
+            sub = subscribers.getByTopicHash(hash);
+        }
 
         if (sub == nullptr)
             continue;
@@ -582,18 +753,18 @@ void SubscriptionStore::publishNonRecursively(
 void SubscriptionStore::publishRecursively(
     std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
     SubscriptionNode *this_node, std::vector<ReceivingSubscriber> &targetSessions,
-    const std::string &senderClientId) noexcept
+    const std::string &senderClientId, const std::string &topic) noexcept
 {
     if (cur_subtopic_it == end) // This is the end of the topic path, so look for subscribers here.
     {
         if (this_node)
         {
-            publishNonRecursively(this_node, targetSessions, senderClientId);
+            publishNonRecursively(this_node, targetSessions, senderClientId, topic);
 
             // Subscribing to 'one/two/three/#' also gives you 'one/two/three'.
             if (this_node->childrenPound)
             {
-                publishNonRecursively(this_node->childrenPound.get(), targetSessions, senderClientId);
+                publishNonRecursively(this_node->childrenPound.get(), targetSessions, senderClientId, topic);
             }
         }
         return;
@@ -612,23 +783,28 @@ void SubscriptionStore::publishRecursively(
 
     if (this_node->childrenPound)
     {
-        publishNonRecursively(this_node->childrenPound.get(), targetSessions, senderClientId);
+        publishNonRecursively(this_node->childrenPound.get(), targetSessions, senderClientId, topic);
     }
 
     const auto &sub_node = this_node->children.find(cur_subtop);
 
     if (this_node->childrenPlus)
     {
-        publishRecursively(next_subtopic, end, this_node->childrenPlus.get(), targetSessions, senderClientId);
+        publishRecursively(next_subtopic, end, this_node->childrenPlus.get(), targetSessions, senderClientId, topic);
     }
 
     if (sub_node != this_node->children.end())
     {
-        publishRecursively(next_subtopic, end, sub_node->second.get(), targetSessions, senderClientId);
+        publishRecursively(next_subtopic, end, sub_node->second.get(), targetSessions, senderClientId, topic);
     }
 }
 
-void SubscriptionStore::queuePacketAtSubscribers(PublishCopyFactory &copyFactory, const std::string &senderClientId, bool dollar)
+/**
+ * @brief SubscriptionStore::queuePacketAtSubscribers
+ * @param backloggedTargets optional; is given the sessions that the publish couldn't be delivered to because they're backlogged.
+ */
+void SubscriptionStore::queuePacketAtSubscribers(PublishCopyFactory &copyFactory, const std::string &senderClientId, bool dollar,
+                                                 std::vector<std::weak_ptr<Session>> *backloggedTargets)
 {
     /*
      * Sometimes people publish or set as will topics with dollar. Node-to-Node communication for bridges for instance.
@@ -649,15 +825,23 @@ void SubscriptionStore::queuePacketAtSubscribers(PublishCopyFactory &copyFactory
     {
         const std::vector<std::string> &subtopics = copyFactory.getSubtopics();
         std::shared_lock locker(subscriptions_lock);
-        publishRecursively(subtopics.begin(), subtopics.end(), startNode, subscriberSessions, senderClientId);
+        publishRecursively(subtopics.begin(), subtopics.end(), startNode, subscriberSessions, senderClientId, copyFactory.getTopic());
     }
 
     if (subscriberSessions.size() > reserve && subscriberSessions.size() <= 1048576)
         this->subscriber_reserve.store(reserve, std::memory_order_relaxed);
 
+    ThreadData *td = ThreadGlobals::getThreadData();
+
     for(const ReceivingSubscriber &x : subscriberSessions)
     {
-        x.session->writePacket(copyFactory, x.qos, x.retainAsPublished, x.subscriptionIdentifier);
+        const PacketDropReason drop_reason = x.session->writePacket(copyFactory, x.qos, x.retainAsPublished, x.subscriptionIdentifier);
+
+        if (drop_reason != PacketDropReason::Success && td)
+            td->deliveryDrops[static_cast<size_t>(drop_reason)].inc();
+
+        if (backloggedTargets && (drop_reason == PacketDropReason::BufferFull || drop_reason == PacketDropReason::QoSTODOSomethingSomething))
+            backloggedTargets->emplace_back(x.session);
     }
 }
 
@@ -854,9 +1038,9 @@ void SubscriptionStore::giveClientRetainedMessagesInitiateDeferred(const std::we
          * allows some depriorirzation.
          */
         if (drop_count > 0)
-            t->addDelayedTask(again, 50);
+            t->addDelayedTask("give_retained_messages", again, 50);
         else
-            t->addImmediateTask(again);
+            t->addImmediateTask("give_retained_messages", again);
     }
 }
 
@@ -899,6 +1083,47 @@ void SubscriptionStore::giveClientRetainedMessages(const std::shared_ptr<Session
     giveClientRetainedMessagesInitiateDeferred(ses, subscribeSubtopicsCopy, deferred, requeue_count, total_node_count, max_qos, subscriptionIdentifier);
 }
 
+/**
+ * @brief SubscriptionStore::giveClientRetainedMessages gives the retained messages for several subscriptions of one SUBSCRIBE packet.
+ *
+ * Subscriptions that are covered by another one in the list, with at least the same QoS, are skipped, because walking the retained
+ * message tree for them would only give the client the same messages twice. So, 'one/#' and 'one/two' visit the nodes under 'one' once.
+ */
+void SubscriptionStore::giveClientRetainedMessages(const std::shared_ptr<Session> &ses, const std::vector<const SubscriptionTuple*> &subscriptions)
+{
+    for (size_t i = 0; i < subscriptions.size(); i++)
+    {
+        const SubscriptionTuple &tup = *subscriptions[i];
+        bool covered = false;
+
+        for (size_t j = 0; j < subscriptions.size() && !covered; j++)
+        {
+            if (i == j)
+                continue;
+
+            const SubscriptionTuple &other = *subscriptions[j];
+
+            if (other.qos < tup.qos || other.subscriptionIdentifier != tup.subscriptionIdentifier)
+                continue;
+
+            if (!subscriptionFilterCovers(other.subtopics, tup.subtopics))
+                continue;
+
+            // Of two identical ones, keep the first.
+            const bool identical = other.qos == tup.qos && subscriptionFilterCovers(tup.subtopics, other.subtopics);
+            covered = !identical || j < i;
+        }
+
+        if (covered)
+        {
+            logger->log(LOG_DEBUG) << "Skipping retained messages for '" << tup.topic << "', because another subscription in the same packet covers it.";
+            continue;
+        }
+
+        giveClientRetainedMessages(ses, tup.subtopics, tup.qos, tup.subscriptionIdentifier);
+    }
+}
+
 /**
  * @brief SubscriptionStore::trySetRetainedMessages queues setting of retained messages if not able to set directly.
  * @param publish
@@ -1030,7 +1255,11 @@ bool SubscriptionStore::setRetainedMessage(const Publish &publish, const std::ve
 }
 
 // Clean up the weak pointers to sessions and remove nodes that are empty.
-int SubscriptionNode::cleanSubscriptions(std::deque<std::weak_ptr<SubscriptionNode>> &defferedLeafs, size_t &real_subscriber_count)
+/*
+ * With subscriptions being removed together with their sessions, expired ones are not expected. They are counted in orphan_count, so the
+ * subscription count can be corrected if it does happen.
+ */
+int SubscriptionNode::cleanSubscriptions(std::deque<std::weak_ptr<SubscriptionNode>> &defferedLeafs, size_t &orphan_count, bool &kept_for_grace_period)
 {
     const size_t children_amount = children.size();
     const bool split = children_amount > 15;
@@ -1052,7 +1281,7 @@ int SubscriptionNode::cleanSubscriptions(std::deque<std::weak_ptr<SubscriptionNo
             continue;
         }
 
-        int n = node->cleanSubscriptions(defferedLeafs, real_subscriber_count);
+        int n = node->cleanSubscriptions(defferedLeafs, orphan_count, kept_for_grace_period);
         subscribersLeftInChildren += n;
 
         if (n > 0)
@@ -1071,7 +1300,7 @@ int SubscriptionNode::cleanSubscriptions(std::deque<std::weak_ptr<SubscriptionNo
 
         if (!node_)
             continue;
-        int n = node_->cleanSubscriptions(defferedLeafs, real_subscriber_count);
+        int n = node_->cleanSubscriptions(defferedLeafs, orphan_count, kept_for_grace_period);
         subscribersLeftInChildren += n;
 
         if (n == 0)
@@ -1093,6 +1322,7 @@ int SubscriptionNode::cleanSubscriptions(std::deque<std::weak_ptr<SubscriptionNo
             {
                 Logger::getInstance()->logf(LOG_DEBUG, "Removing empty spot in subscribers map");
                 subscribers.erase(cur_it);
+                orphan_count++;
             }
         }
     }
@@ -1105,7 +1335,7 @@ int SubscriptionNode::cleanSubscriptions(std::deque<std::weak_ptr<SubscriptionNo
             shared_it++;
 
             SharedSubscribers &subscribers_of_share = cur_shared->second;
-            subscribers_of_share.purgeAndReIndex();
+            orphan_count += subscribers_of_share.purgeAndReIndex();
 
             if (subscribers_of_share.empty())
                 sharedSubscribers.erase(cur_shared);
@@ -1116,7 +1346,10 @@ int SubscriptionNode::cleanSubscriptions(std::deque<std::weak_ptr<SubscriptionNo
     const bool grace_period_expired = lastUpdate + settings->subscriptionNodeLifetime < std::chrono::steady_clock::now();
     const int grace_period_fake = static_cast<int>(!grace_period_expired);
     const size_t node_subscriber_count = subscribers.size() + sharedSubscribers.size();
-    real_subscriber_count += node_subscriber_count;
+
+    if (node_subscriber_count + subscribersLeftInChildren == 0 && !grace_period_expired)
+        kept_for_grace_period = true;
+
     return node_subscriber_count + subscribersLeftInChildren + grace_period_fake;
 }
 
@@ -1136,13 +1369,14 @@ void SubscriptionStore::removeSession(const std::shared_ptr<Session> &session)
     std::list<std::shared_ptr<Session>> sessionsToRemove;
 
     {
-        std::unique_lock session_locker(sessions_lock);
+        SessionShard &shard = getSessionShard(clientid);
+        std::unique_lock session_locker(shard.lock);
 
-        auto session_it = sessionsById.find(clientid);
-        if (session_it != sessionsById.end() && session_it->second == session)
+        auto session_it = shard.sessionsById.find(clientid);
+        if (session_it != shard.sessionsById.end() && session_it->second == session)
         {
             sessionsToRemove.push_back(session_it->second);
-            sessionsById.erase(session_it);
+            shard.sessionsById.erase(session_it);
         }
     }
 
@@ -1151,6 +1385,8 @@ void SubscriptionStore::removeSession(const std::shared_ptr<Session> &session)
         if (!s)
             continue;
 
+        removeSubscriptionsOfSession(s);
+
         std::shared_ptr<WillPublish> will = s->getWill();
         if (will)
         {
@@ -1252,26 +1488,45 @@ bool SubscriptionStore::purgeSubscriptionTree()
             if (node)
             {
                 counter++;
-                node->cleanSubscriptions(deferredSubscriptionLeafsForPurging, subscriptionDeferredCounter);
+                node->cleanSubscriptions(deferredSubscriptionLeafsForPurging, subscriptionDeferredOrphanCounter, subscriptionDeferredKeptForGracePeriod);
             }
         }
 
         logger->log(LOG_INFO) << "Rebuilding subscription tree: processed " << counter << " deferred leafs. Deferred leafs left: " << deferredSubscriptionLeafsForPurging.size();
     }
+    else if (!subscriptionTreeDirty.exchange(false))
+    {
+        logger->logf(LOG_DEBUG, "Not rebuilding subscription tree: no subscriptions were removed since the last time");
+        return true;
+    }
     else
     {
         std::unique_lock locker(subscriptions_lock);
 
         logger->logf(LOG_INFO, "Rebuilding subscription tree");
-        subscriptionDeferredCounter = 0;
-        root->cleanSubscriptions(deferredSubscriptionLeafsForPurging, subscriptionDeferredCounter);
+        subscriptionDeferredOrphanCounter = 0;
+        subscriptionDeferredKeptForGracePeriod = false;
+        root->cleanSubscriptions(deferredSubscriptionLeafsForPurging, subscriptionDeferredOrphanCounter, subscriptionDeferredKeptForGracePeriod);
         logger->log(LOG_INFO) << "Rebuilding subscription tree done, with " << deferredSubscriptionLeafsForPurging.size() << " deferred direct leafs to check";
     }
 
     const bool done = !hasDeferredSubscriptionTreeNodesForPurging();
 
     if (done)
-        subscriptionCount = subscriptionDeferredCounter;
+    {
+        if (subscriptionDeferredOrphanCounter > 0)
+        {
+            logger->log(LOG_WARNING) << "Subscription tree contained " << subscriptionDeferredOrphanCounter << " subscriptions of sessions that no longer exist.";
+            subscriptionCount -= std::min<size_t>(subscriptionDeferredOrphanCounter, subscriptionCount);
+        }
+
+        // Nodes still in their grace period need another pass later. And if there were orphans, there may be more to come.
+        if (subscriptionDeferredKeptForGracePeriod || subscriptionDeferredOrphanCounter > 0)
+            subscriptionTreeDirty = true;
+
+        subscriptionDeferredOrphanCounter = 0;
+        subscriptionDeferredKeptForGracePeriod = false;
+    }
 
     return done;
 }
@@ -1356,7 +1611,15 @@ size_t SubscriptionStore::getRetainedMessageCount() const
 
 uint64_t SubscriptionStore::getSessionCount() const
 {
-    return sessionsByIdConst.size();
+    uint64_t result = 0;
+
+    for (const SessionShard &shard : sessionShards)
+    {
+        std::shared_lock locker(shard.lock);
+        result += shard.sessionsById.size();
+    }
+
+    return result;
 }
 
 size_t SubscriptionStore::getSubscriptionCount()
@@ -1632,21 +1895,8 @@ void SubscriptionStore::saveSessionsAndSubscriptions(const std::string &filePath
 
     const std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
 
-    std::vector<std::shared_ptr<Session>> sessionPointers;
-    std::unordered_map<std::string, std::list<SubscriptionForSerializing>> subscriptionCopies;
-
-    {
-        std::shared_lock session_locker(sessions_lock);
-
-        sessionPointers.reserve(sessionsByIdConst.size());
-
-        for (const auto &pair : sessionsByIdConst)
-        {
-            sessionPointers.push_back(pair.second);
-        }
-    }
-
-    subscriptionCopies = getSubscriptions();
+    const std::vector<std::shared_ptr<Session>> sessionPointers = getAllSessions();
+    const std::unordered_map<std::string, std::list<SubscriptionForSerializing>> subscriptionCopies = getSubscriptions();
 
     const std::chrono::time_point<std::chrono::steady_clock> doneCopying = std::chrono::steady_clock::now();
 
@@ -1675,11 +1925,20 @@ void SubscriptionStore::loadSessionsAndSubscriptions(const std::string &filePath
         db.openRead();
         SessionsAndSubscriptionsResult loadedData = db.readData();
 
-        std::unique_lock session_locker(sessions_lock);
-
         for (std::shared_ptr<Session> &session : loadedData.sessions)
         {
-            sessionsById[session->getClientId()] = session;
+            std::shared_ptr<Session> replacedSession;
+
+            {
+                SessionShard &shard = getSessionShard(session->getClientId());
+                std::unique_lock session_locker(shard.lock);
+                std::shared_ptr<Session> &slot = shard.sessionsById[session->getClientId()];
+                replacedSession = std::move(slot);
+                slot = session;
+            }
+
+            removeSubscriptionsOfSession(replacedSession);
+
             queueSessionRemoval(session);
             queueWillMessage(session->getWill(), session);
         }
@@ -1689,15 +1948,14 @@ void SubscriptionStore::loadSessionsAndSubscriptions(const std::string &filePath
             const std::string &topic = pair.first;
             const std::list<SubscriptionForSerializing> &subs = pair.second;
 
+            const std::vector<std::string> subtopics = splitTopic(topic);
+
             for (const SubscriptionForSerializing &sub : subs)
             {
-                std::shared_ptr<SubscriptionNode> subscriptionNode = getDeepestNode(splitTopic(topic));
-
-                auto session_it = sessionsByIdConst.find(sub.clientId);
-                if (session_it != sessionsByIdConst.end())
+                const std::shared_ptr<Session> ses = lockSession(sub.clientId);
+                if (ses)
                 {
-                    const std::shared_ptr<Session> &ses = session_it->second;
-                    subscriptionNode->addSubscriber(ses, sub.qos, sub.noLocal, sub.retainAsPublished, sub.shareName, sub.subscriptionidentifier);
+                    addSubscription(ses, subtopics, sub.qos, sub.noLocal, sub.retainAsPublished, sub.shareName, sub.subscriptionidentifier);
                 }
 
             }
@@ -20,6 +20,9 @@ See LICENSE for license details.
 #include <pthread.h>
 #include <optional>
 #include <atomic>
+#include <array>
+#include <shared_mutex>
+#include <deque>
 
 #include "client.h"
 #include "session.h"
@@ -65,13 +68,14 @@ public:
     const std::unordered_map<std::string, Subscription> &getSubscribers() const;
     std::unordered_map<std::string, SharedSubscribers> &getSharedSubscribers();
     AddSubscriptionType addSubscriber(const std::shared_ptr<Session> &subscriber, uint8_t qos, bool noLocal, bool retainAsPublished,
-                       const std::string &shareName, const uint32_t subscriptionIdentifier);
-    void removeSubscriber(const std::shared_ptr<Session> &subscriber, const std::string &shareName);
+                       const std::string &shareName, const uint32_t subscriptionIdentifier, bool *entryCreated = nullptr);
+    bool removeSubscriber(const std::shared_ptr<Session> &subscriber, const std::string &shareName);
+    bool removeSubscriberOfSession(const Session *subscriber, const std::string &shareName);
     std::unordered_map<std::string, std::shared_ptr<SubscriptionNode>> children;
     std::shared_ptr<SubscriptionNode> childrenPlus;
     std::shared_ptr<SubscriptionNode> childrenPound;
 
-    int cleanSubscriptions(std::deque<std::weak_ptr<SubscriptionNode>> &defferedLeafs, size_t &real_subscriber_count);
+    int cleanSubscriptions(std::deque<std::weak_ptr<SubscriptionNode>> &defferedLeafs, size_t &orphan_count, bool &kept_for_grace_period);
     bool empty() const;
 };
 
@@ -119,19 +123,29 @@ struct DeferredGetSubscription
     DeferredGetSubscription(const std::shared_ptr<SubscriptionNode> &node, const std::string &composedTopic, const bool root);
 };
 
+/**
+ * @brief The SessionShard struct is one part of the session registry. Sessions are spread over the shards by client ID hash, so CONNECTs
+ * of different clients don't serialize on one lock, and rehashing a growing map only blocks the clients of one shard.
+ */
+struct SessionShard
+{
+    mutable std::shared_mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<Session>> sessionsById;
+};
+
 class SubscriptionStore
 {
 #ifdef TESTING
     friend class MainTests;
 #endif
 
+    static constexpr size_t sessionShardCount = 64;
+
     const std::shared_ptr<SubscriptionNode> root = std::make_shared<SubscriptionNode>();
     const std::shared_ptr<SubscriptionNode> rootDollar = std::make_shared<SubscriptionNode>();
     std::atomic<size_t> subscriber_reserve = 1024;
     std::shared_mutex subscriptions_lock;
-    std::shared_mutex sessions_lock;
-    std::unordered_map<std::string, std::shared_ptr<Session>> sessionsById;
-    const std::unordered_map<std::string, std::shared_ptr<Session>> &sessionsByIdConst;
+    std::array<SessionShard, sessionShardCount> sessionShards;
 
     std::mutex queuedSessionRemovalsMutex;
     std::map<std::chrono::seconds, std::vector<std::weak_ptr<Session>>> queuedSessionRemovals;
@@ -150,24 +164,35 @@ class SubscriptionStore
     std::atomic<size_t> retainedMessageCount = 0;
 
     /*
-     * Subscription events and expiring sessions are hard to track so this counter is not 100% correct, but it
-     * gives a good idea and it's corrected by the periodic tree maintenance.
+     * The amount of entries in the subscription tree. Subscriptions are removed together with their session, using the session's
+     * index of subscription nodes, so this is exact.
      */
     std::atomic<size_t> subscriptionCount = 0;
 
+    /*
+     * Set when subscriptions are removed, which may leave empty nodes. Without it, there is nothing for the periodic purge to do.
+     */
+    std::atomic<bool> subscriptionTreeDirty = false;
+
     std::mutex pendingWillsMutex;
     std::map<std::chrono::seconds, std::vector<QueuedWill>> pendingWillMessages;
 
     std::deque<std::weak_ptr<SubscriptionNode>> deferredSubscriptionLeafsForPurging;
-    size_t subscriptionDeferredCounter = 0;
+    size_t subscriptionDeferredOrphanCounter = 0;
+    bool subscriptionDeferredKeptForGracePeriod = false;
 
     Logger *logger = Logger::getInstance();
 
+    SessionShard &getSessionShard(const std::string &client_id);
+    std::vector<std::shared_ptr<Session>> getAllSessions() const;
+
     static void publishNonRecursively(
-        SubscriptionNode *this_node, std::vector<ReceivingSubscriber> &targetSessions, const std::string &senderClientId) noexcept;
+        SubscriptionNode *this_node, std::vector<ReceivingSubscriber> &targetSessions, const std::string &senderClientId,
+        const std::string &topic) noexcept;
     static void publishRecursively(
         std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
-        SubscriptionNode *this_node, std::vector<ReceivingSubscriber> &targetSessions, const std::string &senderClientId) noexcept;
+        SubscriptionNode *this_node, std::vector<ReceivingSubscriber> &targetSessions, const std::string &senderClientId,
+        const std::string &topic) noexcept;
     static void giveClientRetainedMessagesRecursively(std::vector<std::string>::const_iterator cur_subtopic_it,
                                                       std::vector<std::string>::const_iterator end, const std::shared_ptr<RetainedMessageNode> &this_node, bool poundMode,
                                                       const std::shared_ptr<Session> &session, const uint8_t max_qos,
@@ -189,7 +214,14 @@ class SubscriptionStore
         RetainedMessageNode *this_node, const std::chrono::time_point<std::chrono::steady_clock> &limit,
         std::deque<std::weak_ptr<RetainedMessageNode>> &deferred, size_t &real_message_counter);
 
+    std::shared_ptr<SubscriptionNode> getDeepestNodeLocked(const std::vector<std::string> &subtopics, bool create);
     std::shared_ptr<SubscriptionNode> getDeepestNode(const std::vector<std::string> &subtopics, bool abort_on_dead_end=false);
+    std::vector<std::shared_ptr<SubscriptionNode>> getDeepestNodes(const std::vector<const std::vector<std::string>*> &subtopicsList);
+    AddSubscriptionType addSubscriptionToNode(
+        const std::shared_ptr<SubscriptionNode> &node, const std::shared_ptr<Session> &session, uint8_t qos, bool noLocal, bool retainAsPublished,
+        const std::string &shareName, const uint32_t subscriptionIdentifier);
+
+    void removeSubscriptionsOfSession(const std::shared_ptr<Session> &session);
 
     void sendWill(const std::shared_ptr<WillPublish> will, const std::shared_ptr<Session> session, const std::string &log);
 public:
@@ -198,6 +230,7 @@ public:
     AddSubscriptionType addSubscription(
         const std::shared_ptr<Session> &session, const std::vector<std::string> &subtopics, uint8_t qos, bool noLocal, bool retainAsPublished,
         const std::string &shareName, const uint32_t subscriptionIdentifier);
+    std::vector<AddSubscriptionType> addSubscriptions(const std::shared_ptr<Session> &session, const std::vector<const SubscriptionTuple*> &subscriptions);
     void removeSubscription(const std::shared_ptr<Session> &session, const std::vector<std::string> &subtopics, const std::string &shareName);
     std::shared_ptr<Session> getBridgeSession(std::shared_ptr<Client> &client);
     void registerClientAndKickExistingOne(std::shared_ptr<Client> &client);
@@ -208,9 +241,11 @@ public:
     void queueOrSendWillMessage(
         const std::shared_ptr<WillPublish> &willMessage, const std::shared_ptr<Session> &session, bool forceNow = false);
     void queueWillMessage(const std::shared_ptr<WillPublish> &willMessage, const std::shared_ptr<Session> &session);
-    void queuePacketAtSubscribers(PublishCopyFactory &copyFactory, const std::string &senderClientId, bool dollar = false);
+    void queuePacketAtSubscribers(PublishCopyFactory &copyFactory, const std::string &senderClientId, bool dollar = false,
+                                  std::vector<std::weak_ptr<Session>> *backloggedTargets = nullptr);
     void giveClientRetainedMessages(const std::shared_ptr<Session> &ses,
                                     const std::vector<std::string> &subscribeSubtopics, uint8_t max_qos, const uint32_t subscriptionIdentifier);
+    void giveClientRetainedMessages(const std::shared_ptr<Session> &ses, const std::vector<const SubscriptionTuple*> &subscriptions);
     void giveClientRetainedMessagesInitiateDeferred(const std::weak_ptr<Session> ses,
                                                     const std::shared_ptr<const std::vector<std::string>> subscribeSubtopicsCopy,
                                                     std::shared_ptr<std::deque<DeferredRetainedMessageNodeDelivery>> deferred,
@@ -0,0 +1,115 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#include "taskqueue.h"
+
+TaskQueue::TaskQueue() :
+    cells(std::make_unique<Cell[]>(capacity))
+{
+    for (size_t i = 0; i < capacity; i++)
+    {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief TaskQueue::push can be called from any thread. It doesn't wake up the consumer; that's up to the caller.
+ */
+void TaskQueue::push(InlineTask &&task)
+{
+    if (!overflowActive.load(std::memory_order_acquire))
+    {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+
+        for(;;)
+        {
+            Cell &cell = cells[pos & (capacity - 1)];
+            const size_t seq = cell.sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+            if (diff == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.task = std::move(task);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return;
+                }
+            }
+            else if (diff < 0)
+            {
+                break; // Full
+            }
+            else
+            {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    auto overflow_locked = overflow.lock();
+    overflow_locked->push_back(std::move(task));
+    overflowActive.store(true, std::memory_order_release);
+}
+
+size_t TaskQueue::takeFromRing(std::vector<InlineTask> &out, size_t max)
+{
+    size_t taken = 0;
+
+    for (; taken < max; taken++)
+    {
+        Cell &cell = cells[dequeuePos & (capacity - 1)];
+        const size_t seq = cell.sequence.load(std::memory_order_acquire);
+
+        // Also when a producer claimed the cell but is not done writing it yet; it will wake us up again.
+        if (seq != dequeuePos + 1)
+            break;
+
+        out.push_back(std::move(cell.task));
+        cell.sequence.store(dequeuePos + capacity, std::memory_order_release);
+        dequeuePos++;
+    }
+
+    return taken;
+}
+
+/**
+ * @brief TaskQueue::takeAll is for the consumer thread only. It moves at most one ring's worth of tasks into out, so that producers
+ * that keep adding tasks can't keep the thread busy forever.
+ * @return whether there may be more tasks, in which case the caller should come back later.
+ */
+bool TaskQueue::takeAll(std::vector<InlineTask> &out)
+{
+    size_t taken = takeFromRing(out, capacity);
+
+    if (taken == capacity)
+        return true;
+
+    if (!overflowActive.load(std::memory_order_acquire))
+        return false;
+
+    // Producers don't use the ring while the overflow list is in use, but what they put in it before has to go first.
+    taken += takeFromRing(out, capacity - taken);
+
+    // A producer claimed a cell but hasn't written it yet.
+    if (enqueuePos.load(std::memory_order_acquire) != dequeuePos)
+        return true;
+
+    auto overflow_locked = overflow.lock();
+
+    for (InlineTask &task : *overflow_locked)
+    {
+        out.push_back(std::move(task));
+    }
+
+    overflow_locked->clear();
+    overflowActive.store(false, std::memory_order_release);
+    return false;
+}
@@ -0,0 +1,192 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#ifndef TASKQUEUE_H
+#define TASKQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "mutexowned.h"
+
+/**
+ * @brief The InlineTask class is a move-only callable with a name. Callables that fit in inlineSize bytes are stored inline, so queueing
+ * them doesn't allocate. Bigger ones are put on the heap, like std::function does.
+ *
+ * The name is for logging slow tasks and errors, and must be a string literal, or otherwise outlive the task.
+ */
+class InlineTask
+{
+public:
+    static constexpr size_t inlineSize = 64;
+
+private:
+    struct Ops
+    {
+        void (*invoke)(void *storage);
+        void (*moveTo)(void *from, void *to); // Move constructs 'to' and destroys 'from'.
+        void (*destroy)(void *storage);
+    };
+
+    template<typename F>
+    struct InlineOps
+    {
+        static void invoke(void *storage) { (*static_cast<F*>(storage))(); }
+        static void moveTo(void *from, void *to)
+        {
+            F *f = static_cast<F*>(from);
+            new (to) F(std::move(*f));
+            f->~F();
+        }
+        static void destroy(void *storage) { static_cast<F*>(storage)->~F(); }
+        static constexpr Ops ops { &invoke, &moveTo, &destroy };
+    };
+
+    template<typename F>
+    struct HeapOps
+    {
+        static F *&ptr(void *storage) { return *static_cast<F**>(storage); }
+        static void invoke(void *storage) { (*ptr(storage))(); }
+        static void moveTo(void *from, void *to) { new (to) F*(ptr(from)); }
+        static void destroy(void *storage) { delete ptr(storage); }
+        static constexpr Ops ops { &invoke, &moveTo, &destroy };
+    };
+
+    template<typename F>
+    static constexpr bool fitsInline = sizeof(F) <= inlineSize && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<F>::value;
+
+    alignas(std::max_align_t) unsigned char storage[inlineSize];
+    const Ops *ops = nullptr;
+    const char *name = "unnamed";
+    bool onHeap = false;
+
+public:
+    InlineTask() = default;
+
+    template<typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, InlineTask>::value>>
+    InlineTask(const char *name, F &&f) :
+        name(name)
+    {
+        typedef std::decay_t<F> T;
+
+        if constexpr (fitsInline<T>)
+        {
+            new (storage) T(std::forward<F>(f));
+            ops = &InlineOps<T>::ops;
+        }
+        else
+        {
+            new (storage) T*(new T(std::forward<F>(f)));
+            ops = &HeapOps<T>::ops;
+            onHeap = true;
+        }
+    }
+
+    InlineTask(InlineTask &&other) noexcept :
+        ops(other.ops),
+        name(other.name),
+        onHeap(other.onHeap)
+    {
+        if (ops)
+        {
+            ops->moveTo(other.storage, storage);
+            other.ops = nullptr;
+        }
+    }
+
+    InlineTask &operator=(InlineTask &&other) noexcept
+    {
+        if (this == &other)
+            return *this;
+
+        reset();
+
+        ops = other.ops;
+        name = other.name;
+        onHeap = other.onHeap;
+
+        if (ops)
+        {
+            ops->moveTo(other.storage, storage);
+            other.ops = nullptr;
+        }
+
+        return *this;
+    }
+
+    InlineTask(const InlineTask &other) = delete;
+    InlineTask &operator=(const InlineTask &other) = delete;
+
+    ~InlineTask()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        if (ops)
+            ops->destroy(storage);
+        ops = nullptr;
+    }
+
+    void operator()()
+    {
+        if (ops)
+            ops->invoke(storage);
+    }
+
+    const char *getName() const { return name; }
+    bool isOnHeap() const { return onHeap; }
+    explicit operator bool() const { return ops != nullptr; }
+};
+
+/**
+ * @brief The TaskQueue class is how other threads give a thread work. It's a bounded lock-free ring, for multiple producers and one
+ * consumer, after Dmitry Vyukov's bounded MPMC queue.
+ *
+ * When the ring is full, tasks go into an overflow list with a mutex, instead of being dropped. Once something is in there, all producers
+ * use the overflow list until the consumer has emptied it, so that tasks of one producer stay in order.
+ */
+class TaskQueue
+{
+    struct alignas(64) Cell
+    {
+        std::atomic<size_t> sequence;
+        InlineTask task;
+    };
+
+    static constexpr size_t capacity = 1024;
+    static_assert((capacity & (capacity - 1)) == 0, "Capacity must be a power of two");
+
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<size_t> enqueuePos {0};
+    alignas(64) size_t dequeuePos = 0;
+
+    std::atomic<bool> overflowActive {false};
+    MutexOwned<std::list<InlineTask>> overflow;
+
+    size_t takeFromRing(std::vector<InlineTask> &out, size_t max);
+
+public:
+    TaskQueue();
+    TaskQueue(const TaskQueue &other) = delete;
+
+    void push(InlineTask &&task);
+    bool takeAll(std::vector<InlineTask> &out);
+};
+
+#endif // TASKQUEUE_H
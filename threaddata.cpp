@@ -12,11 +12,13 @@ See LICENSE for license details.
 #include <string>
 #include <sstream>
 #include <cassert>
+#include <algorithm>
 
 #include "globalstats.h"
 #include "subscriptionstore.h"
 #include "mainapp.h"
 #include "utils.h"
+#include "memoryaccounting.h"
 
 KeepAliveCheck::KeepAliveCheck(const std::shared_ptr<Client> client) :
     client(client)
@@ -32,12 +34,14 @@ QueuedRetainedMessage::QueuedRetainedMessage(const Publish &p, const std::vector
 
 }
 
-ThreadData::ThreadData(int threadnr, const Settings &settings, const PluginLoader &pluginLoader) :
+ThreadData::ThreadData(int threadnr, const Settings &settings, const PluginLoader &pluginLoader, bool handshakeThread) :
     epollfd(check<std::runtime_error>(epoll_create(999))),
     pluginLoader(pluginLoader),
+    handshakeThread(handshakeThread),
     settingsLocalCopy(settings),
     authentication(settingsLocalCopy),
-    threadnr(threadnr)
+    threadnr(threadnr),
+    readScratchBuf(settings.clientInitialBufferSize)
 {
     logger = Logger::getInstance();
 
@@ -81,7 +85,7 @@ void ThreadData::start(thread_f f)
 
     pthread_t native = this->thread.native_handle();
     std::ostringstream threadName;
-    threadName << "FlashMQ T " << threadnr;
+    threadName << (handshakeThread ? "FlashMQ HS " : "FlashMQ T ") << threadnr;
     threadName.flush();
     std::string name = threadName.str();
     const char *c_str = name.c_str();
@@ -117,32 +121,20 @@ void ThreadData::quit()
  */
 void ThreadData::queuePublishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadData>> &threads)
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::publishStatsOnDollarTopic, this, threads);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("publish_stats", std::move(f));
 }
 
 void ThreadData::queueSendingQueuedWills()
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::sendQueuedWills, this);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("send_queued_wills", std::move(f));
 }
 
 void ThreadData::queueRemoveExpiredSessions()
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::removeExpiredSessions, this);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("remove_expired_sessions", std::move(f));
 }
 
 void ThreadData::queuePurgeSubscriptionTree()
@@ -151,12 +143,8 @@ void ThreadData::queuePurgeSubscriptionTree()
     if (subscriptionStore->hasDeferredSubscriptionTreeNodesForPurging())
         return;
 
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::purgeSubscriptionTree, this);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("purge_subscription_tree", std::move(f));
 }
 
 void ThreadData::queueRemoveExpiredRetainedMessages()
@@ -165,12 +153,8 @@ void ThreadData::queueRemoveExpiredRetainedMessages()
     if (subscriptionStore->hasDeferredRetainedMessageNodesForPurging())
         return;
 
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::removeExpiredRetainedMessages, this);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("remove_expired_retained_messages", std::move(f));
 }
 
 void ThreadData::queueClientNextKeepAliveCheck(
@@ -399,27 +383,26 @@ void ThreadData::bridgeReconnect()
     if (requeue)
     {
         auto f = std::bind(&ThreadData::bridgeReconnect, this);
-        delayedTasks.addTask(f, 500);
+        delayedTasks.addTask("bridge_reconnect", f, 500);
     }
 }
 
 void ThreadData::queueContinuationOfAuthentication(const std::shared_ptr<Client> &client, AuthResult authResult, const std::string &authMethod, const std::string &returnData)
 {
-    auto f = [client, authResult, authMethod, returnData]
+    auto f = [client, authResult, authMethod, returnData, this]
     {
+        // The client may have been migrated to another thread since this was queued.
+        std::shared_ptr<ThreadData> td = client->lockThreadData();
+        if (td && td.get() != this)
+        {
+            td->queueContinuationOfAuthentication(client, authResult, authMethod, returnData);
+            return;
+        }
+
         client->setAsyncAuthResult({authResult, authMethod, returnData});
     };
 
-    bool wake_up_needed = false;
-
-    {
-        auto task_queue_locked = taskQueue.lock();
-        wake_up_needed = task_queue_locked->empty();
-        task_queue_locked->push_back(std::move(f));
-    }
-
-    if (wake_up_needed)
-        wakeUpThread();
+    addImmediateTask("continue_authentication", std::move(f));
 }
 
 void ThreadData::clientDisconnectActions(
@@ -459,22 +442,13 @@ void ThreadData::queueClientDisconnectActions(
                 std::move(session), std::move(bridgeState), disconnect_reason);
     assert(!willPublish);
     assert(!session);
-    auto task_queue_locked = taskQueue.lock();
-    task_queue_locked->push_back(std::move(f));
-
-    wakeUpThread();
+    addImmediateTask("client_disconnect_actions", std::move(f));
 }
 
 void ThreadData::queueBridgeReconnect()
 {
     auto f = std::bind(&ThreadData::bridgeReconnect, this);
-
-    {
-        auto task_queue_locked = taskQueue.lock();
-        task_queue_locked->push_back(f);
-    }
-
-    wakeUpThread();
+    addImmediateTask("bridge_reconnect", std::move(f));
 }
 
 void ThreadData::publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadData>> &threads)
@@ -503,6 +477,19 @@ void ThreadData::publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadDat
     double retainedMessagesSetPerSecond = 0;
     uint64_t retainedMessagesSetCount = 0;
 
+    bool handshakeThreadsPresent = false;
+    uint handshakesPending = 0;
+    double handshakesCompletedPerSecond = 0;
+    uint64_t handshakesCompletedCount = 0;
+    std::chrono::milliseconds handshakeDurationAvgMax(0);
+
+    double ktlsConnectionsPerSecond = 0;
+    uint64_t ktlsConnectionCount = 0;
+
+    DerivableCounterSum bytesReceived;
+    DerivableCounterSum bytesSent;
+    std::array<DerivableCounterSum, PACKET_DROP_REASON_COUNT> deliveryDrops;
+
     for (const std::shared_ptr<ThreadData> &thread : threads)
     {
         nrOfClients += thread->getNrOfClients();
@@ -531,44 +518,147 @@ void ThreadData::publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadDat
         retainedMessagesSetPerSecond += thread->retainedMessageSet.getPerSecond();
         retainedMessagesSetCount += thread->retainedMessageSet.get();
 
+        ktlsConnectionsPerSecond += thread->ktlsConnectionCounter.getPerSecond();
+        ktlsConnectionCount += thread->ktlsConnectionCounter.get();
+
+        if (thread->isHandshakeThread())
+        {
+            handshakeThreadsPresent = true;
+            handshakesPending += thread->getNrOfClients();
+            handshakesCompletedPerSecond += thread->handshakesCompleted.getPerSecond();
+            handshakesCompletedCount += thread->handshakesCompleted.get();
+            handshakeDurationAvgMax = std::max(handshakeDurationAvgMax, thread->handshakeDuration.getAvgDrift());
+        }
+
         publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/drift/latest__ms", thread->driftCounter.getDrift().count());
         publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/drift/moving_avg__ms", thread->driftCounter.getAvgDrift().count());
 
-        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/retained_deferrals/count", thread->deferredRetainedMessagesSet.get());
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/retained_deferrals/count", thread->deferredRetainedMessagesSet.get(), MetricType::Counter);
         publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/retained_deferrals/persecond", thread->deferredRetainedMessagesSet.getPerSecond());
-        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/retained_deferrals/timeout/count", thread->deferredRetainedMessagesSetTimeout.get());
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/retained_deferrals/timeout/count", thread->deferredRetainedMessagesSetTimeout.get(), MetricType::Counter);
         publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/retained_deferrals/timeout/persecond", thread->deferredRetainedMessagesSetTimeout.getPerSecond());
+
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/loop/max_duration__us", thread->maxLoopDurationMicros.exchange(0));
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/read_budget_exhausted/bytes/count", thread->readByteBudgetExhausted.get(), MetricType::Counter);
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/read_budget_exhausted/bytes/persecond", thread->readByteBudgetExhausted.getPerSecond());
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/read_budget_exhausted/packets/count", thread->readPacketBudgetExhausted.get(), MetricType::Counter);
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/read_budget_exhausted/packets/persecond", thread->readPacketBudgetExhausted.getPerSecond());
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/control_packet_write_latency/moving_avg__ms", thread->controlPacketWriteLatency.getAvgDrift().count());
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/conflated_publishes/count", thread->conflatedPublishes.get(), MetricType::Counter);
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/conflated_publishes/persecond", thread->conflatedPublishes.getPerSecond());
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/publisher_backpressure_pauses/count", thread->publisherBackpressurePauses.get(), MetricType::Counter);
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/publisher_backpressure_pauses/persecond", thread->publisherBackpressurePauses.getPerSecond());
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/memory_pressure_drops/count", thread->memoryPressureDrops.get(), MetricType::Counter);
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/memory_pressure_drops/persecond", thread->memoryPressureDrops.getPerSecond());
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/slow_tasks/count", thread->slowTasks.get(), MetricType::Counter);
+        publishStat("$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/migrated_clients/count", thread->clientsMigrated.get(), MetricType::Counter);
+
+        for (size_t i = 0; i < LOOP_PHASE_COUNT; i++)
+        {
+            LatencyHistogramSnapshot phase;
+            phase.takeInterval(thread->loopProfiler.histograms.at(i));
+
+            const std::string prefix = "$SYS/broker/threads/" + std::to_string(thread->threadnr) + "/loop/phases/" + loopPhaseToString(static_cast<LoopPhase>(i));
+            publishStat(prefix + "/p99__us", phase.getPercentile(99.0));
+            publishStat(prefix + "/max__us", phase.getMax());
+        }
+
+        bytesReceived.add(thread->bytesReceived);
+        bytesSent.add(thread->bytesSent);
+
+        for (size_t i = 0; i < deliveryDrops.size(); i++)
+        {
+            deliveryDrops[i].add(thread->deliveryDrops[i]);
+        }
     }
 
     GlobalStats *globalStats = GlobalStats::getInstance();
 
-    publishStat("$SYS/broker/network/socketconnects/total", globalStats->socketConnects.get());
+    publishStat("$SYS/broker/network/socketconnects/total", globalStats->socketConnects.get(), MetricType::Counter);
     publishStat("$SYS/broker/network/socketconnects/persecond", globalStats->socketConnects.getPerSecond());
 
-    publishStat("$SYS/broker/clients/mqttconnects/total", mqttConnectCount);
+    publishStat("$SYS/broker/network/ktlsconnects/total", ktlsConnectionCount, MetricType::Counter);
+    publishStat("$SYS/broker/network/ktlsconnects/persecond", ktlsConnectionsPerSecond);
+
+    publishStat("$SYS/broker/clients/mqttconnects/total", mqttConnectCount, MetricType::Counter);
     publishStat("$SYS/broker/clients/mqttconnects/persecond", mqttConnectCountPerSecond);
 
     publishStat("$SYS/broker/clients/total", nrOfClients);
 
-    publishStat("$SYS/broker/load/messages/received/total", receivedMessageCount);
+    {
+        // This is the memory of our own buffers. OpenSSL's buffers are not included.
+        const uint64_t bufferBytes = MemoryAccounting::getBufferBytes();
+        publishStat("$SYS/broker/memory/buffers/total__bytes", bufferBytes);
+        publishStat("$SYS/broker/memory/buffers/perclient__bytes", nrOfClients > 0 ? bufferBytes / nrOfClients : 0);
+        publishStat("$SYS/broker/memory/qos_queues/total__bytes", MemoryAccounting::getQosQueueBytes());
+        publishStat("$SYS/broker/memory/retained_messages/total__bytes", MemoryAccounting::getRetainedMessageBytes());
+        publishStat("$SYS/broker/memory/accounted/total__bytes", MemoryAccounting::getTotalBytes());
+        publishStat("$SYS/broker/memory/budget__bytes", settingsLocalCopy.memoryBudget);
+        publishStat("$SYS/broker/memory/pressure", static_cast<uint64_t>(MemoryAccounting::getPressure()));
+    }
+
+    if (handshakeThreadsPresent)
+    {
+        publishStat("$SYS/broker/handshakes/pending", handshakesPending);
+        publishStat("$SYS/broker/handshakes/total", handshakesCompletedCount, MetricType::Counter);
+        publishStat("$SYS/broker/handshakes/persecond", handshakesCompletedPerSecond);
+        publishStat("$SYS/broker/handshakes/duration/moving_avg__ms", handshakeDurationAvgMax.count());
+    }
+
+    publishStat("$SYS/broker/load/messages/received/total", receivedMessageCount, MetricType::Counter);
     publishStat("$SYS/broker/load/messages/received/persecond", receivedMessageCountPerSecond);
 
-    publishStat("$SYS/broker/load/messages/sent/total", sentMessageCount);
+    publishStat("$SYS/broker/load/messages/sent/total", sentMessageCount, MetricType::Counter);
     publishStat("$SYS/broker/load/messages/sent/persecond", sentMessageCountPerSecond);
 
-    publishStat("$SYS/broker/load/messages/set_retained/total", retainedMessagesSetCount);
+    for (size_t qos = 0; qos < 3; qos++)
+    {
+        LatencyHistogramSnapshot latency;
+
+        for (const std::shared_ptr<ThreadData> &thread : threads)
+        {
+            latency.takeInterval(thread->publishLatency.at(qos));
+        }
+
+        const std::string prefix = "$SYS/broker/latency/publish/qos" + std::to_string(qos);
+        publishStat(prefix + "/samples", latency.getCount());
+        publishStat(prefix + "/p50__us", latency.getPercentile(50.0));
+        publishStat(prefix + "/p99__us", latency.getPercentile(99.0));
+        publishStat(prefix + "/p999__us", latency.getPercentile(99.9));
+        publishStat(prefix + "/max__us", latency.getMax());
+    }
+
+    publishStat("$SYS/broker/load/bytes/received/total", bytesReceived.total, MetricType::Counter);
+    publishStat("$SYS/broker/load/bytes/received/persecond", bytesReceived.perSecond);
+
+    publishStat("$SYS/broker/load/bytes/sent/total", bytesSent.total, MetricType::Counter);
+    publishStat("$SYS/broker/load/bytes/sent/persecond", bytesSent.perSecond);
+
+    for (size_t i = 0; i < deliveryDrops.size(); i++)
+    {
+        const PacketDropReason reason = static_cast<PacketDropReason>(i);
+
+        if (reason == PacketDropReason::Success)
+            continue;
+
+        const std::string name = packetDropReasonToString(reason);
+        publishStat("$SYS/broker/load/messages/undelivered/" + name + "/total", deliveryDrops[i].total, MetricType::Counter);
+        publishStat("$SYS/broker/load/messages/undelivered/" + name + "/persecond", deliveryDrops[i].perSecond);
+    }
+
+    publishStat("$SYS/broker/load/messages/set_retained/total", retainedMessagesSetCount, MetricType::Counter);
     publishStat("$SYS/broker/load/messages/set_retained/persecond", retainedMessagesSetPerSecond);
 
-    publishStat("$SYS/broker/load/aclchecks/read/total", aclReadCheckCount);
+    publishStat("$SYS/broker/load/aclchecks/read/total", aclReadCheckCount, MetricType::Counter);
     publishStat("$SYS/broker/load/aclchecks/read/persecond", aclReadChecksPerSecond);
 
-    publishStat("$SYS/broker/load/aclchecks/write/total", aclWriteCheckCount);
+    publishStat("$SYS/broker/load/aclchecks/write/total", aclWriteCheckCount, MetricType::Counter);
     publishStat("$SYS/broker/load/aclchecks/write/persecond", aclWriteChecksPerSecond);
 
-    publishStat("$SYS/broker/load/aclchecks/subscribe/total", aclSubscribeCheckCount);
+    publishStat("$SYS/broker/load/aclchecks/subscribe/total", aclSubscribeCheckCount, MetricType::Counter);
     publishStat("$SYS/broker/load/aclchecks/subscribe/persecond", aclSubscribeChecksPerSecond);
 
-    publishStat("$SYS/broker/load/aclchecks/registerwill/total", aclRegisterWillCheckCount);
+    publishStat("$SYS/broker/load/aclchecks/registerwill/total", aclRegisterWillCheckCount, MetricType::Counter);
     publishStat("$SYS/broker/load/aclchecks/registerwill/persecond", aclRegisterWillChecksPerSecond);
 
     std::shared_ptr<SubscriptionStore> subscriptionStore = MainApp::getMainApp()->getSubscriptionStore();
@@ -583,14 +673,21 @@ void ThreadData::publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadDat
     {
         Publish p(pair.first, pair.second, 0);
         publishWithAcl(p);
+
+        statsMetrics.addIfNumeric(pair.first, pair.second);
     }
+
+    globalStats->setMetricsSnapshot(std::make_shared<const std::string>(statsMetrics.render()));
+    statsMetrics.clear();
 }
 
-void ThreadData::publishStat(const std::string &topic, uint64_t n)
+void ThreadData::publishStat(const std::string &topic, uint64_t n, MetricType type)
 {
     const std::string payload = std::to_string(n);
     Publish p(topic, payload, 0);
     publishWithAcl(p, true);
+
+    statsMetrics.add(topic, n, type);
 }
 
 void ThreadData::publishBridgeState(std::shared_ptr<BridgeState> bridge, bool connected, const std::optional<std::string> &error)
@@ -675,7 +772,7 @@ void ThreadData::purgeSubscriptionTree()
     if (!done)
     {
         auto f = std::bind(&ThreadData::purgeSubscriptionTree, this);
-        addDelayedTask(f, 100);
+        addDelayedTask("purge_subscription_tree", f, 100);
     }
 }
 
@@ -693,9 +790,9 @@ void ThreadData::removeExpiredRetainedMessages()
         auto f = std::bind(&ThreadData::removeExpiredRetainedMessages, this);
 
 #ifdef TESTING
-        addImmediateTask(f);
+        addImmediateTask("remove_expired_retained_messages", f);
 #else
-        addDelayedTask(f, 100);
+        addDelayedTask("remove_expired_retained_messages", f, 100);
 #endif
     }
 }
@@ -741,7 +838,7 @@ void ThreadData::sendAllDisconnects()
         uint64_t one = 1;
         check<std::runtime_error>(write(disconnectingAllEventFd, &one, sizeof(uint64_t)));
     };
-    addImmediateTask(queued_collect_disconnecting_clients);
+    addImmediateTask("collect_disconnecting_clients", queued_collect_disconnecting_clients);
 }
 
 void ThreadData::removeQueuedClients()
@@ -764,6 +861,20 @@ void ThreadData::removeQueuedClients()
         locked_clients_to_remove->clear();
     }
 
+    // Clients that were migrated after their removal was queued here, are removed by their new thread.
+    auto moved = std::partition(clients.begin(), clients.end(), [this](const std::shared_ptr<Client> &client) {
+        return client->lockThreadData().get() == this;
+    });
+
+    for (auto it = moved; it != clients.end(); it++)
+    {
+        std::shared_ptr<ThreadData> td = (*it)->lockThreadData();
+        if (td)
+            td->queueRemovingClient(*it);
+    }
+
+    clients.erase(moved, clients.end());
+
     {
         auto clients_locked = this->clients.lock();
         for(const std::shared_ptr<Client> &client : clients)
@@ -778,6 +889,125 @@ void ThreadData::removeQueuedClients()
     }
 }
 
+std::vector<char> ThreadData::takePacketBytes()
+{
+    if (packetBytesPool.empty())
+        return std::vector<char>();
+
+    std::vector<char> result = std::move(packetBytesPool.back());
+    packetBytesPool.pop_back();
+    return result;
+}
+
+/**
+ * @brief ThreadData::recyclePacketBytes keeps the byte arrays of handled packets for parsing the next ones. Packets that were moved
+ * elsewhere, like the ones deferred for async auth, are left alone, as are big arrays.
+ * @param packets are unusable after.
+ */
+void ThreadData::recyclePacketBytes(std::vector<MqttPacket> &packets)
+{
+    for (MqttPacket &packet : packets)
+    {
+        if (packetBytesPool.size() >= PACKET_BYTES_POOL_MAX_SIZE)
+            return;
+
+        std::vector<char> bites = packet.releaseBites();
+
+        if (bites.capacity() == 0 || bites.capacity() > PACKET_BYTES_POOL_MAX_CAPACITY)
+            continue;
+
+        packetBytesPool.push_back(std::move(bites));
+    }
+}
+
+void ThreadData::pauseClientForBackpressure(const std::shared_ptr<Client> &client, std::vector<std::weak_ptr<Session>> &&targets)
+{
+    if (!client->pauseReadingForBackpressure(std::move(targets)))
+        return;
+
+    publisherBackpressurePauses.inc();
+
+    if (clientsPausedForBackpressure.empty())
+    {
+        auto f = std::bind(&ThreadData::resumeClientsAfterBackpressure, this);
+        addDelayedTask("resume_after_backpressure", f, 10);
+    }
+
+    clientsPausedForBackpressure.emplace_back(client);
+}
+
+/**
+ * @brief ThreadData::resumeClientsAfterBackpressure polls the publishers we paused. The subscribers they wait for can be on other threads,
+ * so there is no event to wait for.
+ */
+void ThreadData::resumeClientsAfterBackpressure()
+{
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::milliseconds maxPause(settingsLocalCopy.publisherBackpressureMaxPauseMs);
+
+    auto pos = clientsPausedForBackpressure.begin();
+    while (pos != clientsPausedForBackpressure.end())
+    {
+        std::shared_ptr<Client> c = pos->lock();
+
+        if (c && !c->resumeReadingIfTargetsDrained(now, maxPause))
+        {
+            pos++;
+            continue;
+        }
+
+        // Epoll won't tell us about data that was already read, so give those clients their turn again.
+        if (c && c->getReadBudgetExhausted())
+            clientsWithReadBudgetExhausted.emplace_back(c);
+
+        pos = clientsPausedForBackpressure.erase(pos);
+    }
+
+    if (!clientsPausedForBackpressure.empty())
+    {
+        auto f = std::bind(&ThreadData::resumeClientsAfterBackpressure, this);
+        addDelayedTask("resume_after_backpressure", f, 10);
+    }
+}
+
+void ThreadData::pauseClientForMemoryPressure(const std::shared_ptr<Client> &client)
+{
+    if (!client->pauseReadingForMemoryPressure())
+        return;
+
+    if (clientsPausedForMemoryPressure.empty())
+    {
+        auto f = std::bind(&ThreadData::resumeClientsAfterMemoryPressure, this);
+        addDelayedTask("resume_after_memory_pressure", f, 100);
+    }
+
+    clientsPausedForMemoryPressure.emplace_back(client);
+}
+
+/**
+ * @brief ThreadData::resumeClientsAfterMemoryPressure polls the memory pressure, which is determined by the main thread, and lets the clients
+ * whose read buffer couldn't grow continue when it's gone.
+ */
+void ThreadData::resumeClientsAfterMemoryPressure()
+{
+    if (MemoryAccounting::getPressure() != MemoryPressure::None)
+    {
+        auto f = std::bind(&ThreadData::resumeClientsAfterMemoryPressure, this);
+        addDelayedTask("resume_after_memory_pressure", f, 100);
+        return;
+    }
+
+    for (std::weak_ptr<Client> &wc : clientsPausedForMemoryPressure)
+    {
+        std::shared_ptr<Client> c = wc.lock();
+
+        if (c)
+            c->resumeReadingAfterMemoryPressure();
+    }
+
+    clientsPausedForMemoryPressure.clear();
+}
+
 void ThreadData::giveClient(std::shared_ptr<Client> &&client)
 {
     const int fd = client->getFd();
@@ -797,6 +1027,222 @@ void ThreadData::giveClient(std::shared_ptr<Client> &&client)
     check<std::runtime_error>(epoll_ctl(epollfd.get(), EPOLL_CTL_ADD, fd, &ev));
 }
 
+/**
+ * @brief ThreadData::handOverClient moves a client that is done with its TLS or HAProxy handshake from this handshake thread to its worker thread.
+ * @param client
+ *
+ * Because OpenSSL doesn't read ahead by default, any data the client sent after the handshake is still in the socket, so
+ * the level-triggered epoll of the destination thread will report it.
+ */
+void ThreadData::handOverClient(std::shared_ptr<Client> &client)
+{
+    assert(pthread_self() == thread.native_handle());
+    assert(handshakeThread);
+
+    const int fd = client->getFd();
+    std::shared_ptr<ThreadData> destination = client->getHandshakeDestination();
+
+    if (!destination)
+    {
+        client->setDisconnectReason("No thread to hand over to after handshake");
+        removeClient(client);
+        return;
+    }
+
+    check<std::runtime_error>(epoll_ctl(epollfd.get(), EPOLL_CTL_DEL, fd, NULL));
+
+    {
+        auto clients_locked = clients.lock();
+        auto pos = clients_locked->by_fd.find(fd);
+        if (pos != clients_locked->by_fd.end() && pos->second == client)
+            clients_locked->by_fd.erase(pos);
+    }
+
+    handshakesCompleted.inc(1);
+    handshakeDuration.update(client->getCreatedAt());
+
+    client->moveToThread(destination);
+    destination->giveClient(std::shared_ptr<Client>(client));
+}
+
+/**
+ * @brief ThreadData::queueClientMigration makes this thread move a client to another thread, at the end of its next loop iteration.
+ * @param client must be a client of this thread.
+ *
+ * Can be called from any thread.
+ */
+void ThreadData::queueClientMigration(const std::shared_ptr<Client> &client, const std::shared_ptr<ThreadData> &destination)
+{
+    std::weak_ptr<Client> c = client;
+    std::weak_ptr<ThreadData> d = destination;
+
+    auto f = [this, c, d]() {
+        clientsToMigrate.emplace_back(c, d);
+    };
+
+    addImmediateTask("queue_client_migration", std::move(f));
+}
+
+/**
+ * @brief ThreadData::queueClientRebalance makes this thread pick busy clients to move to the destination, with the given amount of traffic
+ * together.
+ * @param interval is the rebalance interval. When our last look at the clients' traffic is older than two intervals, this time we only
+ * look, so the decision is based on recent traffic.
+ */
+void ThreadData::queueClientRebalance(const std::shared_ptr<ThreadData> &destination, uint64_t bytesPerSecond, std::chrono::milliseconds interval)
+{
+    std::weak_ptr<ThreadData> d = destination;
+    auto f = std::bind(&ThreadData::selectClientsForMigration, this, d, bytesPerSecond, interval);
+    addImmediateTask("rebalance_clients", std::move(f));
+}
+
+void ThreadData::selectClientsForMigration(std::weak_ptr<ThreadData> destination, uint64_t bytesPerSecond, std::chrono::milliseconds interval)
+{
+    assert(pthread_self() == thread.native_handle());
+
+    std::shared_ptr<ThreadData> dest = destination.lock();
+
+    if (!dest || dest.get() == this || !running)
+        return;
+
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> elapsed = now - lastClientTrafficSample;
+    const bool sample_recent = now - lastClientTrafficSample <= interval * 2;
+    lastClientTrafficSample = now;
+
+    std::vector<std::pair<uint64_t, std::shared_ptr<Client>>> candidates;
+
+    {
+        auto clients_locked = clients.lock();
+
+        for (auto &pair : clients_locked->by_fd)
+        {
+            const std::shared_ptr<Client> &c = pair.second;
+
+            if (!c)
+                continue;
+
+            const uint64_t bytes = c->takeTrafficBytes();
+
+            if (sample_recent && bytes > 0 && c->canMigrate())
+                candidates.emplace_back(static_cast<uint64_t>(bytes / elapsed.count()), c);
+        }
+    }
+
+    if (!sample_recent)
+        return;
+
+    std::sort(candidates.begin(), candidates.end(), [](const auto &a, const auto &b) {
+        return a.first > b.first;
+    });
+
+    uint64_t budget = bytesPerSecond;
+    uint64_t moved = 0;
+    size_t count = 0;
+
+    for (auto &candidate : candidates)
+    {
+        if (count >= CLIENT_REBALANCE_MAX_MOVES)
+            break;
+
+        // Moving it would just make the other thread the busy one.
+        if (candidate.first > budget)
+            continue;
+
+        budget -= candidate.first;
+        moved += candidate.first;
+        count++;
+        clientsToMigrate.emplace_back(candidate.second, dest);
+    }
+
+    if (count == 0)
+        return;
+
+    logger->log(LOG_NOTICE) << "Moving " << count << " client(s) with " << moved << " bytes/s of traffic from thread " << threadnr
+                            << " to thread " << dest->threadnr << ", to balance the load.";
+}
+
+/**
+ * @brief ThreadData::migrateQueuedClients moves the clients in clientsToMigrate to their new thread. It's done at the end of the thread
+ * loop, so the clients are between packets.
+ */
+void ThreadData::migrateQueuedClients()
+{
+    std::vector<std::pair<std::weak_ptr<Client>, std::weak_ptr<ThreadData>>> migrations;
+    migrations.swap(clientsToMigrate);
+
+    for (auto &migration : migrations)
+    {
+        std::shared_ptr<Client> client = migration.first.lock();
+        std::shared_ptr<ThreadData> destination = migration.second.lock();
+
+        if (!client || !destination || destination.get() == this || destination->isHandshakeThread())
+            continue;
+
+        // It may have been removed, or started disconnecting, since it was chosen.
+        if (!client->canMigrate() || getClient(client->getFd()) != client)
+            continue;
+
+        try
+        {
+            migrateClient(client, destination);
+        }
+        catch (std::exception &ex)
+        {
+            logger->log(LOG_ERR) << "Error migrating client '" << client->repr() << "' to thread " << destination->threadnr << ": " << ex.what();
+
+            // It can be in both threads at this point.
+            client->setRemovalQueued();
+
+            {
+                auto clients_locked = clients.lock();
+                auto pos = clients_locked->by_fd.find(client->getFd());
+                if (pos != clients_locked->by_fd.end() && pos->second == client)
+                    clients_locked->by_fd.erase(pos);
+            }
+
+            destination->removeClientQueued(client->getFd());
+        }
+    }
+}
+
+void ThreadData::migrateClient(std::shared_ptr<Client> &client, const std::shared_ptr<ThreadData> &destination)
+{
+    assert(pthread_self() == thread.native_handle());
+
+    const int fd = client->getFd();
+
+    /*
+     * The destination must know the client before its epoll can report it, and we only let go of it after its thread is switched. That
+     * way, a removal queued by another thread always finds the client in the thread it looked up, and removeQueuedClients() passes it on
+     * if that's us.
+     */
+    {
+        auto clients_locked = destination->clients.lock();
+        clients_locked->by_fd[fd] = client;
+    }
+
+    client->migrateToThread(destination);
+
+    {
+        auto clients_locked = clients.lock();
+        auto pos = clients_locked->by_fd.find(fd);
+        if (pos != clients_locked->by_fd.end() && pos->second == client)
+            clients_locked->by_fd.erase(pos);
+    }
+
+    destination->queueClientNextKeepAliveCheck(client, true);
+
+    /*
+     * Another thread may have looked up our thread for a removal before the switch, but only asked us after we let go of the client.
+     * It marks the client first, so we see that here.
+     */
+    if (client->isRemovalQueued())
+        destination->queueRemovingClient(client);
+
+    clientsMigrated.inc();
+}
+
 void ThreadData::giveBridge(std::shared_ptr<BridgeState> &bridgeState)
 {
     if (!bridgeState)
@@ -830,9 +1276,7 @@ void ThreadData::giveBridge(std::shared_ptr<BridgeState> &bridgeState)
 void ThreadData::removeBridgeQueued(std::shared_ptr<BridgeConfig> bridgeConfig, const std::string &reason)
 {
     auto f = std::bind(&ThreadData::removeBridge, this, bridgeConfig, reason);
-    auto task_queue_locked = taskQueue.lock();
-    task_queue_locked->push_back(f);
-    wakeUpThread();
+    addImmediateTask("remove_bridge", std::move(f));
 }
 
 void ThreadData::removeBridge(std::shared_ptr<BridgeConfig> bridgeConfig, const std::string &reason)
@@ -925,13 +1369,8 @@ void ThreadData::queueInternalHeartbeat()
             Logger::getInstance()->log(LOG_WARNING) << "Thread " << threadnr << " drift is: " << this->driftCounter.getDrift().count() << " ms";
     };
 
-    {
-        auto bound = std::bind(f, std::chrono::steady_clock::now());
-        auto task_queue_locked = taskQueue.lock();
-        task_queue_locked->push_back(bound);
-    }
-
-    wakeUpThread();
+    auto bound = std::bind(f, std::chrono::steady_clock::now());
+    addImmediateTask("internal_heartbeat", std::move(bound));
 }
 
 std::shared_ptr<Client> ThreadData::getClient(int fd)
@@ -952,27 +1391,12 @@ void ThreadData::removeClientQueued(const std::shared_ptr<Client> &client)
     // the last reference on the shared pointer to client.
     assert(pthread_self() == thread.native_handle());
 
-    bool wakeUpNeeded = true;
-
-    {
-        auto locked_clients_to_remove = clientsQueuedForRemoving.lock();
-        wakeUpNeeded = locked_clients_to_remove->empty();
-        locked_clients_to_remove->push_front(client);
-    }
-
-    if (wakeUpNeeded)
-    {
-        auto f = std::bind(&ThreadData::removeQueuedClients, this);
-        auto task_queue_locked = taskQueue.lock();
-        task_queue_locked->push_back(f);
-
-        wakeUpThread();
-    }
+    client->setRemovalQueued();
+    queueRemovingClient(client);
 }
 
 void ThreadData::removeClientQueued(int fd)
 {
-    bool wakeUpNeeded = true;
     std::shared_ptr<Client> clientFound;
 
     {
@@ -986,20 +1410,29 @@ void ThreadData::removeClientQueued(int fd)
 
     if (clientFound)
     {
-        {
-            auto locked_clients_to_remove = clientsQueuedForRemoving.lock();
-            wakeUpNeeded = locked_clients_to_remove->empty();
-            locked_clients_to_remove->push_front(std::move(clientFound));
-        }
+        clientFound->setRemovalQueued();
+        queueRemovingClient(clientFound);
+    }
+}
 
-        if (wakeUpNeeded)
-        {
-            auto f = std::bind(&ThreadData::removeQueuedClients, this);
-            auto task_queue_locked = taskQueue.lock();
-            task_queue_locked->push_back(f);
+/**
+ * @brief ThreadData::queueRemovingClient can be called from any thread. When the client has been migrated to another thread in the
+ * meantime, removeQueuedClients() passes it on.
+ */
+void ThreadData::queueRemovingClient(const std::shared_ptr<Client> &client)
+{
+    bool wakeUpNeeded = true;
 
-            wakeUpThread();
-        }
+    {
+        auto locked_clients_to_remove = clientsQueuedForRemoving.lock();
+        wakeUpNeeded = locked_clients_to_remove->empty();
+        locked_clients_to_remove->push_front(client);
+    }
+
+    if (wakeUpNeeded)
+    {
+        auto f = std::bind(&ThreadData::removeQueuedClients, this);
+        addImmediateTask("remove_queued_clients", std::move(f));
     }
 }
 
@@ -1042,6 +1475,14 @@ void ThreadData::serverInitiatedDisconnect(const std::shared_ptr<Client> &client
         return;
 
     auto f = [client, reason, reason_text, this]() {
+        // The client may have been migrated to another thread since this was queued.
+        std::shared_ptr<ThreadData> td = client->lockThreadData();
+        if (td && td.get() != this)
+        {
+            td->serverInitiatedDisconnect(client, reason, reason_text);
+            return;
+        }
+
         if (!reason_text.empty())
             client->setDisconnectReason(reason_text);
         client->setDisconnectReason("Server initiating disconnect with reason: " + reasonCodeToString(reason));
@@ -1059,29 +1500,21 @@ void ThreadData::serverInitiatedDisconnect(const std::shared_ptr<Client> &client
         }
     };
 
-    addImmediateTask(f);
+    addImmediateTask("server_initiated_disconnect", f);
 }
 
 void ThreadData::queueDoKeepAliveCheck()
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::doKeepAliveCheck, this);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("keep_alive_check", std::move(f));
 }
 
 void ThreadData::queueQuit()
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::quit, this);
-    task_queue_locked->push_back(f);
+    addImmediateTask("quit", std::move(f));
 
     authentication.setQuitting();
-
-    wakeUpThread();
 }
 
 void ThreadData::waitForQuit()
@@ -1091,15 +1524,11 @@ void ThreadData::waitForQuit()
 
 void ThreadData::queuePasswdFileReload()
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&Authentication::loadMosquittoPasswordFile, &authentication);
-    task_queue_locked->push_back(f);
+    addImmediateTask("password_file_reload", std::move(f));
 
     auto f2 = std::bind(&Authentication::loadMosquittoAclFile, &authentication);
-    task_queue_locked->push_back(f2);
-
-    wakeUpThread();
+    addImmediateTask("acl_file_reload", std::move(f2));
 }
 
 int ThreadData::getNrOfClients()
@@ -1110,12 +1539,8 @@ int ThreadData::getNrOfClients()
 
 void ThreadData::queuepluginPeriodicEvent()
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::pluginPeriodicEvent, this);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("plugin_periodic_event", std::move(f));
 }
 
 void ThreadData::pluginPeriodicEvent()
@@ -1125,22 +1550,14 @@ void ThreadData::pluginPeriodicEvent()
 
 void ThreadData::queueSendWills()
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::sendAllWills, this);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("send_all_wills", std::move(f));
 }
 
 void ThreadData::queueSendDisconnects()
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::sendAllDisconnects, this);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("send_all_disconnects", std::move(f));
 }
 
 void ThreadData::pollExternalFd(int fd, uint32_t events, const std::weak_ptr<void> &p)
@@ -1172,9 +1589,9 @@ void ThreadData::pollExternalRemove(int fd)
     }
 }
 
-uint32_t ThreadData::addDelayedTask(std::function<void ()> f, uint32_t delayMs)
+uint32_t ThreadData::addDelayedTask(const char *name, std::function<void ()> f, uint32_t delayMs)
 {
-    return delayedTasks.addTask(f, delayMs);
+    return delayedTasks.addTask(name, f, delayMs);
 }
 
 void ThreadData::removeDelayedTask(uint32_t id)
@@ -1182,22 +1599,6 @@ void ThreadData::removeDelayedTask(uint32_t id)
     delayedTasks.eraseTask(id);
 }
 
-void ThreadData::addImmediateTask(std::function<void ()> f)
-{
-    bool wakeupNeeded = true;
-
-    {
-        auto task_queue_locked = taskQueue.lock();
-        wakeupNeeded = task_queue_locked->empty();
-        task_queue_locked->push_back(f);
-    }
-
-    if (wakeupNeeded)
-    {
-        wakeUpThread();
-    }
-}
-
 void ThreadData::doKeepAliveCheck()
 {
     logger->logf(LOG_DEBUG, "doKeepAliveCheck in thread %d", threadnr);
@@ -1237,6 +1638,11 @@ void ThreadData::doKeepAliveCheck()
                 for (KeepAliveCheck const &k : checks)
                 {
                     std::shared_ptr<Client> client = k.client.lock();
+
+                    // Clients handed over by a handshake thread, or migrated, are checked by their new thread.
+                    if (client && client->lockThreadData().get() != this)
+                        continue;
+
                     if (client)
                     {
                         clientsChecked++;
@@ -1333,16 +1739,19 @@ void ThreadData::reload(const Settings &settings)
 
 void ThreadData::queueReload(const Settings &settings)
 {
-    auto task_queue_locked = taskQueue.lock();
-
     auto f = std::bind(&ThreadData::reload, this, settings);
-    task_queue_locked->push_back(f);
-
-    wakeUpThread();
+    addImmediateTask("reload_settings", std::move(f));
 }
 
+/**
+ * @brief ThreadData::wakeUpThread makes the thread look at its task queue. The eventfd is only written when a wake-up isn't already
+ * pending, so a burst of tasks from other threads costs one syscall, not one per task.
+ */
 void ThreadData::wakeUpThread()
 {
+    if (taskEventPending.exchange(true))
+        return;
+
     uint64_t one = 1;
     check<std::runtime_error>(write(taskEventFd, &one, sizeof(uint64_t)));
 }
@@ -23,18 +23,29 @@ See LICENSE for license details.
 #include <chrono>
 #include <forward_list>
 #include <random>
+#include <atomic>
+#include <array>
+#include <optional>
 
 #include "client.h"
 #include "plugin.h"
 #include "logger.h"
 #include "derivablecounter.h"
+#include "latencyhistogram.h"
+#include "loopprofiler.h"
+#include "metricsexporter.h"
 #include "queuedtasks.h"
+#include "taskqueue.h"
 #include "settings.h"
 #include "bridgeconfig.h"
 #include "driftcounter.h"
 #include "fdmanaged.h"
 #include "mutexowned.h"
 
+#define PACKET_BYTES_POOL_MAX_SIZE 256
+#define PACKET_BYTES_POOL_MAX_CAPACITY 4096
+#define CLIENT_REBALANCE_MAX_MOVES 16
+
 typedef void (*thread_f)(ThreadData *);
 
 struct KeepAliveCheck
@@ -62,6 +73,10 @@ struct Clients
 
 class ThreadData
 {
+#ifdef TESTING
+    friend class MainTests;
+#endif
+
     FdManaged epollfd;
     MutexOwned<Clients> clients;
     Logger *logger;
@@ -71,14 +86,17 @@ class ThreadData
 
     std::list<QueuedRetainedMessage> queuedRetainedMessages;
 
+    // Collects what publishStat() publishes, to render the snapshot for metrics listeners from.
+    OpenMetricsBuilder statsMetrics;
+
     const PluginLoader &pluginLoader;
+    const bool handshakeThread = false;
 
     void reload(const Settings &settings);
-    void wakeUpThread();
     void doKeepAliveCheck();
     void quit();
     void publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadData>> &threads);
-    void publishStat(const std::string &topic, uint64_t n);
+    void publishStat(const std::string &topic, uint64_t n, MetricType type=MetricType::Gauge);
     void sendQueuedWills();
     void removeExpiredSessions();
     void purgeSubscriptionTree();
@@ -94,6 +112,9 @@ class ThreadData
     void bridgeReconnect();
 
     void removeQueuedClients();
+    void queueRemovingClient(const std::shared_ptr<Client> &client);
+    void selectClientsForMigration(std::weak_ptr<ThreadData> destination, uint64_t bytesPerSecond, std::chrono::milliseconds interval);
+    void migrateClient(std::shared_ptr<Client> &client, const std::shared_ptr<ThreadData> &destination);
     void publishWithAcl(Publish &pub, bool setRetain=false);
     void removeBridge(std::shared_ptr<BridgeConfig> bridgeConfig, const std::string &reason);
 
@@ -107,11 +128,23 @@ public:
     int threadnr = 0;
     int taskEventFd = -1;
     int disconnectingAllEventFd = -1;
-    MutexOwned<std::list<std::function<void()>>> taskQueue;
+    TaskQueue taskQueue;
+    std::atomic<bool> taskEventPending {false}; // Set when taskEventFd has been written and the thread hasn't looked yet.
     QueuedTasks delayedTasks;
     DriftCounter driftCounter;
     std::unordered_map<int, std::weak_ptr<void>> externalFds;
     std::vector<std::weak_ptr<Client>> disconnectingClients;
+    std::vector<std::weak_ptr<Client>> clientsWithReadBudgetExhausted; // Revisited round-robin, before the next epoll_wait.
+    std::vector<std::weak_ptr<Client>> clientsPausedForBackpressure;
+    std::vector<std::weak_ptr<Client>> clientsPausedForMemoryPressure;
+    std::vector<std::pair<std::weak_ptr<Client>, std::weak_ptr<ThreadData>>> clientsToMigrate; // Done at the end of the loop iteration.
+    std::chrono::time_point<std::chrono::steady_clock> lastClientTrafficSample;
+    uint64_t loopIterations = 0;
+    std::atomic<uint64_t> maxLoopDurationMicros {0}; // Reset when published on $SYS.
+
+    CirBuf readScratchBuf; // Clients read into this, so only partial packets need their own buffer. See Client::readFdIntoBuffer().
+    uint64_t readScratchBufFills = 0;
+    std::vector<std::vector<char>> packetBytesPool; // Byte arrays of handled packets, reused by the next ones.
 
     DerivableCounter receivedMessageCounter;
     DerivableCounter sentMessageCounter;
@@ -123,19 +156,58 @@ public:
     DerivableCounter deferredRetainedMessagesSet;
     DerivableCounter deferredRetainedMessagesSetTimeout;
     DerivableCounter retainedMessageSet;
+    DerivableCounter handshakesCompleted;
+    DerivableCounter ktlsConnectionCounter;
+    DerivableCounter readByteBudgetExhausted;
+    DerivableCounter readPacketBudgetExhausted;
+    DerivableCounter conflatedPublishes;
+    DerivableCounter publisherBackpressurePauses;
+    DerivableCounter memoryPressureDrops;
+    DerivableCounter bytesReceived;
+    DerivableCounter bytesSent;
+    DerivableCounter slowTasks;
+    DerivableCounter clientsMigrated;
+    std::array<DerivableCounter, PACKET_DROP_REASON_COUNT> deliveryDrops; // Publishes not written to subscribers, by PacketDropReason.
+    std::array<LatencyHistogram, 3> publishLatency; // From reading the publish to writing it to the subscriber, by QoS of the subscriber.
+
+    /*
+     * One in so many incoming publishes is followed to its subscribers, to measure latency. While it's being distributed, this is set to
+     * the time it was read, and Client::writeMqttPacket() marks its place in the write buffers.
+     */
+    static constexpr uint32_t latencySampleInterval = 64;
+    uint32_t latencySampleCountdown = 0;
+    std::optional<std::chrono::time_point<std::chrono::steady_clock>> latencySampleStart;
+
+    LoopPhaseProfiler loopProfiler;
+
+    DriftCounter handshakeDuration;
+    DriftCounter controlPacketWriteLatency;
 
     std::minstd_rand randomish;
 
-    ThreadData(int threadnr, const Settings &settings, const PluginLoader &pluginLoader);
+    ThreadData(int threadnr, const Settings &settings, const PluginLoader &pluginLoader, bool handshakeThread=false);
     ThreadData(const ThreadData &other) = delete;
     ThreadData(ThreadData &&other) = delete;
     ~ThreadData();
 
     int getEpollFd() const { return epollfd.get(); }
+    bool isHandshakeThread() const { return handshakeThread; }
 
     void start(thread_f f);
 
+    std::vector<char> takePacketBytes();
+    void recyclePacketBytes(std::vector<MqttPacket> &packets);
+
+    void pauseClientForBackpressure(const std::shared_ptr<Client> &client, std::vector<std::weak_ptr<Session>> &&targets);
+    void resumeClientsAfterBackpressure();
+    void pauseClientForMemoryPressure(const std::shared_ptr<Client> &client);
+    void resumeClientsAfterMemoryPressure();
+
     void giveClient(std::shared_ptr<Client> &&client);
+    void handOverClient(std::shared_ptr<Client> &client);
+    void queueClientMigration(const std::shared_ptr<Client> &client, const std::shared_ptr<ThreadData> &destination);
+    void queueClientRebalance(const std::shared_ptr<ThreadData> &destination, uint64_t bytesPerSecond, std::chrono::milliseconds interval);
+    void migrateQueuedClients();
     void giveBridge(std::shared_ptr<BridgeState> &bridgeState);
     void removeBridgeQueued(std::shared_ptr<BridgeConfig> bridgeConfig, const std::string &reason);
     std::shared_ptr<Client> getClient(int fd);
@@ -179,12 +251,21 @@ public:
     void queueSendDisconnects();
     void queueInternalHeartbeat();
 
+    void wakeUpThread();
     void pollExternalFd(int fd, uint32_t events, const std::weak_ptr<void> &p);
     void pollExternalRemove(int fd);
-    uint32_t addDelayedTask(std::function<void()> f, uint32_t delayMs);
+    uint32_t addDelayedTask(const char *name, std::function<void()> f, uint32_t delayMs);
     void removeDelayedTask(uint32_t id);
 
-    void addImmediateTask(std::function<void()> f);
+    /**
+     * A template, so that the callable is stored in the task queue as is, without the allocation of wrapping it in std::function first.
+     */
+    template<typename F>
+    void addImmediateTask(const char *name, F &&f)
+    {
+        taskQueue.push(InlineTask(name, std::forward<F>(f)));
+        wakeUpThread();
+    }
 };
 
 #endif // THREADDATA_H
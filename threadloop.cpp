@@ -28,6 +28,7 @@ void do_thread_work(ThreadData *threadData)
     memset(&events, 0, sizeof (struct epoll_event)*MAX_EVENTS);
 
     std::vector<MqttPacket> packetQueueIn;
+    std::vector<InlineTask> queuedTasks;
 
     Logger *logger = Logger::getInstance();
 
@@ -35,8 +36,12 @@ void do_thread_work(ThreadData *threadData)
 
     try
     {
-        logger->logf(LOG_NOTICE, "Thread %d doing auth init.", threadData->threadnr);
-        threadData->initplugin();
+        // Handshake threads never handle MQTT packets, so they don't need the auth back-end.
+        if (!threadData->isHandshakeThread())
+        {
+            logger->logf(LOG_NOTICE, "Thread %d doing auth init.", threadData->threadnr);
+            threadData->initplugin();
+        }
         threadData->running = true;
     }
     catch(std::exception &ex)
@@ -47,6 +52,7 @@ void do_thread_work(ThreadData *threadData)
     }
 
     std::vector<ReadyClient> ready_clients;
+    std::vector<std::weak_ptr<Client>> budget_exhausted_clients;
 
     while (threadData->running)
     {
@@ -55,11 +61,24 @@ void do_thread_work(ThreadData *threadData)
         const uint32_t next_task_delay = threadData->delayedTasks.getTimeTillNext();
         const uint32_t epoll_wait_time = std::min<uint32_t>(next_task_delay, 100);
 
-        int fdcount = epoll_wait(epoll_fd, events, MAX_EVENTS, epoll_wait_time);
+        // Clients that had data left when their read budget ran out don't wait for new events.
+        const uint32_t epoll_timeout = threadData->clientsWithReadBudgetExhausted.empty() ? epoll_wait_time : 0;
+
+        int fdcount = epoll_wait(epoll_fd, events, MAX_EVENTS, epoll_timeout);
+
+        const auto loop_start = std::chrono::steady_clock::now();
+        const uint64_t loop_iteration = ++threadData->loopIterations;
+
+        LoopPhaseProfiler &profiler = threadData->loopProfiler;
+        profiler.startIteration();
 
         if (__builtin_expect(epoll_wait_time == 0, 0))
         {
-            threadData->delayedTasks.performAll();
+            profiler.mark();
+            const size_t slow_count = threadData->delayedTasks.performAll(threadData->settingsLocalCopy.slowTaskThreshold);
+            if (slow_count > 0)
+                threadData->slowTasks.inc(slow_count);
+            profiler.charge(LoopPhase::DelayedTasks);
         }
 
         if (fdcount < 0)
@@ -79,27 +98,27 @@ void do_thread_work(ThreadData *threadData)
                 if (read(fd, &eventfd_value, sizeof(uint64_t)) < 0)
                     logger->log(LOG_ERROR) << "Error reading taskEventFd: " << strerror(errno);
 
-                std::list<std::function<void()>> copiedTasks;
+                profiler.mark();
 
-                {
-                    auto task_queue_locked = threadData->taskQueue.lock();
-                    copiedTasks = std::move(*task_queue_locked);
-                    task_queue_locked->clear();
-                }
+                // Tasks queued after this get a new wake-up. The fence orders the store with our reading of the queue.
+                threadData->taskEventPending.store(false);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                const bool more_tasks = threadData->taskQueue.takeAll(queuedTasks);
 
-                for(auto &f : copiedTasks)
+                for(InlineTask &task : queuedTasks)
                 {
-                    try
-                    {
-                        f();
-                    }
-                    catch (std::exception &ex)
-                    {
-                        Logger *logger = Logger::getInstance();
-                        logger->logf(LOG_ERR, "Error in queued task: %s", ex.what());
-                    }
+                    if (runNamedTask("queued", task.getName(), task, threadData->settingsLocalCopy.slowTaskThreshold))
+                        threadData->slowTasks.inc();
                 }
 
+                queuedTasks.clear();
+
+                if (more_tasks)
+                    threadData->wakeUpThread();
+
+                profiler.charge(LoopPhase::QueuedTasks);
+
                 try
                 {
                     threadData->setQueuedRetainedMessages();
@@ -111,6 +130,8 @@ void do_thread_work(ThreadData *threadData)
                                          << "happen and is likely a bug. Clearing the queue for safety.";
                     threadData->clearQueuedRetainedMessages();
                 }
+
+                profiler.charge(LoopPhase::RetainedMessages);
             }
             else if (fd == threadData->disconnectingAllEventFd)
             {
@@ -140,7 +161,11 @@ void do_thread_work(ThreadData *threadData)
             {
                 ready_clients.emplace_back(static_cast<uint32_t>(cur_ev.events), threadData->getClient(fd));
 
-                if (__builtin_expect(!ready_clients.back().client, 0))
+                if (__builtin_expect(ready_clients.back().client && (cur_ev.events & EPOLLIN), 1))
+                {
+                    ready_clients.back().client->claimReadTurn(loop_iteration);
+                }
+                else if (!ready_clients.back().client)
                 {
                     ready_clients.pop_back();
 
@@ -155,6 +180,26 @@ void do_thread_work(ThreadData *threadData)
             }
         }
 
+        if (!threadData->clientsWithReadBudgetExhausted.empty())
+        {
+            VectorClearGuard clear_budget_exhausted_clients(budget_exhausted_clients);
+            budget_exhausted_clients.swap(threadData->clientsWithReadBudgetExhausted);
+
+            for (std::weak_ptr<Client> &wc : budget_exhausted_clients)
+            {
+                std::shared_ptr<Client> c = wc.lock();
+
+                if (!c || c->isPausedForBackpressure() || !c->claimReadTurn(loop_iteration))
+                    continue;
+
+                // It may have been removed, or moved to another thread.
+                if (threadData->getClient(c->getFd()) != c)
+                    continue;
+
+                ready_clients.emplace_back(EPOLLIN, std::move(c));
+            }
+        }
+
         for (ReadyClient &ready_client : ready_clients)
         {
             std::shared_ptr<Client> &client = ready_client.client;
@@ -169,6 +214,13 @@ void do_thread_work(ThreadData *threadData)
                     if (client->readHaProxyData() == HaProxyConnectionType::Local)
                     {
                         client->setDisconnectReason("HAProxy health check");
+
+                        // Nothing follows on a health check, so there's no point in handing it over to a worker thread.
+                        if (__builtin_expect(threadData->isHandshakeThread(), 0))
+                        {
+                            threadData->removeClient(client);
+                            continue;
+                        }
                     }
                 }
                 if (client->isOutgoingConnection() && !client->getOutgoingConnectionEstablished())
@@ -206,6 +258,14 @@ void do_thread_work(ThreadData *threadData)
                 if (client->isSsl() && !client->isSslAccepted())
                 {
                     client->startOrContinueSslHandshake();
+
+                    if (!threadData->isHandshakeThread() || !client->isSslAccepted())
+                        continue;
+                }
+                if (__builtin_expect(threadData->isHandshakeThread(), 0))
+                {
+                    if (!client->needsHaProxyParsing())
+                        threadData->handOverClient(client);
                     continue;
                 }
                 if (__builtin_expect((ready_client.events & EPOLLOUT) && client->hasAsyncAuthResult(), 0))
@@ -218,8 +278,11 @@ void do_thread_work(ThreadData *threadData)
                 if ((ready_client.events & EPOLLIN) || ((ready_client.events & EPOLLOUT) && client->getSslReadWantsWrite()))
                 {
                     VectorClearGuard vectorClear(packetQueueIn);
+                    profiler.mark();
                     const DisconnectStage disconnect = client->readFdIntoBuffer();
+                    profiler.charge(LoopPhase::Read);
                     client->bufferToMqttPackets(packetQueueIn, client);
+                    profiler.charge(LoopPhase::Parse);
 
                     for (MqttPacket &packet : packetQueueIn)
                     {
@@ -234,16 +297,24 @@ void do_thread_work(ThreadData *threadData)
                         }
                     }
 
+                    threadData->recyclePacketBytes(packetQueueIn);
+                    profiler.charge(LoopPhase::Handle);
+
                     if (disconnect == DisconnectStage::Now)
                     {
                         client->setDisconnectReason("socket disconnect detected");
                         threadData->removeClient(client);
                         continue;
                     }
+
+                    if (client->getReadBudgetExhausted() && !client->isPausedForBackpressure())
+                        threadData->clientsWithReadBudgetExhausted.emplace_back(client);
                 }
                 if ((ready_client.events & EPOLLOUT) || ((ready_client.events & EPOLLIN) && client->getSslWriteWantsRead()))
                 {
+                    profiler.mark();
                     client->writeBufIntoFd();
+                    profiler.charge(LoopPhase::Write);
 
                     if (client->getDisconnectStage() == DisconnectStage::Now)
                     {
@@ -314,12 +385,25 @@ void do_thread_work(ThreadData *threadData)
                 threadData->removeClient(client);
             }
         }
+
+        // Clients chosen for migration have had their turn in this iteration now, so they are between packets.
+        if (__builtin_expect(!threadData->clientsToMigrate.empty(), 0))
+            threadData->migrateQueuedClients();
+
+        profiler.finishIteration();
+
+        const uint64_t loop_duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - loop_start).count();
+        if (loop_duration > threadData->maxLoopDurationMicros.load(std::memory_order_relaxed))
+            threadData->maxLoopDurationMicros.store(loop_duration, std::memory_order_relaxed);
     }
 
     try
     {
-        logger->logf(LOG_NOTICE, "Thread %d doing auth cleanup.", threadData->threadnr);
-        threadData->cleanupplugin();
+        if (!threadData->isHandshakeThread())
+        {
+            logger->logf(LOG_NOTICE, "Thread %d doing auth cleanup.", threadData->threadnr);
+            threadData->cleanupplugin();
+        }
     }
     catch(std::exception &ex)
     {
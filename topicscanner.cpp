@@ -0,0 +1,361 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#include "topicscanner.h"
+
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FMQ_TOPIC_SCAN_X86
+#include <immintrin.h>
+#endif
+
+class TopicSplitter
+{
+    const char *data;
+    std::vector<std::string> *subtopics;
+    size_t start = 0;
+
+public:
+    TopicSplitter(const char *data, std::vector<std::string> *subtopics) :
+        data(data),
+        subtopics(subtopics)
+    {
+
+    }
+
+    void slashAt(const size_t pos)
+    {
+        if (subtopics)
+            subtopics->emplace_back(data + start, pos - start);
+        start = pos + 1;
+    }
+
+    void finish(const size_t len)
+    {
+        if (subtopics)
+            subtopics->emplace_back(data + start, len - start);
+    }
+};
+
+/**
+ * @brief scanCharScalar checks one (possibly multi-byte) character at n and advances n past it. The rules are the same as in
+ * isValidUtf8Generic().
+ */
+static inline bool scanCharScalar(const uint8_t *s, const size_t len, size_t &n, const bool validateUtf8, const bool alsoCheckInvalidPublishChars,
+                                  TopicSplitter &splitter)
+{
+    const uint8_t x = s[n];
+
+    if (x == '/')
+    {
+        splitter.slashAt(n++);
+        return true;
+    }
+
+    if (alsoCheckInvalidPublishChars && (x == '#' || x == '+'))
+        return false;
+
+    if (!validateUtf8 || (x & 0b10000000) == 0)
+    {
+        n++;
+        return !validateUtf8 || (x > 0x1F && x != 0x7F);
+    }
+
+    int multibyte_remain = 0;
+    uint32_t cur_code_point = 0;
+
+    if((x & 0b11100000) == 0b11000000) // 2 byte char
+    {
+        multibyte_remain = 1;
+        cur_code_point = ((x & 0b00011111) << 6);
+    }
+    else if((x & 0b11110000) == 0b11100000) // 3 byte char
+    {
+        multibyte_remain = 2;
+        cur_code_point = ((x & 0b00001111) << 12);
+    }
+    else if((x & 0b11111000) == 0b11110000) // 4 byte char
+    {
+        multibyte_remain = 3;
+        cur_code_point = ((x & 0b00000111) << 18);
+    }
+    else
+        return false;
+
+    const int total_char_len = multibyte_remain + 1;
+    n++;
+
+    while (multibyte_remain > 0)
+    {
+        if (n >= len)
+            return false;
+
+        const uint8_t y = s[n++];
+
+        if((y & 0b11000000) != 0b10000000)
+            return false;
+        multibyte_remain--;
+        cur_code_point += ((y & 0b00111111) << (6*multibyte_remain));
+    }
+
+    // Overlong values.
+    if (total_char_len == 2 && cur_code_point < 0x80)
+        return false;
+    else if (total_char_len == 3 && cur_code_point < 0x800)
+        return false;
+    else if (total_char_len == 4 && cur_code_point < 0x10000)
+        return false;
+
+    if (cur_code_point >= 0x007F && cur_code_point <= 0x009F)
+        return false;
+
+    // Invalid range for MQTT. [MQTT-1.5.3-1]
+    if (cur_code_point >= 0xD800 && cur_code_point <= 0xDFFF)
+        return false;
+
+    // Unicode noncharacters.
+    if (cur_code_point >= 0xFDD0 && cur_code_point <= 0xFDEF)
+        return false;
+    const uint32_t plane = (cur_code_point & 0x1F0000) >> 16;
+    const uint32_t last_16_bit = cur_code_point & 0xFFFF;
+    if (plane <= 16 && (last_16_bit == 0xFFFE || last_16_bit == 0xFFFF))
+        return false;
+
+    return true;
+}
+
+static bool scanTopicScalar(const char *data, size_t len, bool validateUtf8, bool alsoCheckInvalidPublishChars, std::vector<std::string> *subtopics)
+{
+    const uint8_t *s = reinterpret_cast<const uint8_t*>(data);
+    TopicSplitter splitter(data, subtopics);
+
+    size_t n = 0;
+    while (n < len)
+    {
+        if (!scanCharScalar(s, len, n, validateUtf8, alsoCheckInvalidPublishChars, splitter))
+            return false;
+    }
+
+    splitter.finish(len);
+    return true;
+}
+
+#ifdef FMQ_TOPIC_SCAN_X86
+
+/*
+ * The vector kernels have the same structure: a block that is all ASCII is validated and split with vector compares, and a block that
+ * contains multi-byte characters is done by scanCharScalar(), which may take us a few bytes into the next block. Topics and payloads
+ * are mostly ASCII, so that's the path that matters.
+ */
+
+__attribute__((target("avx2")))
+static bool scanTopicAvx2(const char *data, size_t len, bool validateUtf8, bool alsoCheckInvalidPublishChars, std::vector<std::string> *subtopics)
+{
+    const uint8_t *s = reinterpret_cast<const uint8_t*>(data);
+    TopicSplitter splitter(data, subtopics);
+
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i lowerBound = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    const __m256i pound = _mm256_set1_epi8('#');
+    const __m256i plus = _mm256_set1_epi8('+');
+
+    alignas(32) uint8_t tail[32];
+
+    size_t n = 0;
+    while (n < len)
+    {
+        const size_t block_len = std::min<size_t>(len - n, 32);
+        __m256i block;
+
+        if (block_len == 32)
+        {
+            block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + n));
+        }
+        else
+        {
+            // Padding with spaces makes the padding pass all checks.
+            std::memset(tail, ' ', sizeof(tail));
+            std::memcpy(tail, s + n, block_len);
+            block = _mm256_load_si256(reinterpret_cast<const __m256i*>(tail));
+        }
+
+        if (validateUtf8 && _mm256_movemask_epi8(block) != 0)
+        {
+            const size_t block_end = n + block_len;
+            while (n < block_end)
+            {
+                if (!scanCharScalar(s, len, n, validateUtf8, alsoCheckInvalidPublishChars, splitter))
+                    return false;
+            }
+            continue;
+        }
+
+        __m256i invalid = _mm256_setzero_si256();
+
+        if (validateUtf8)
+        {
+            // Signed compare, but we know there are no bytes >= 0x80 here.
+            invalid = _mm256_or_si256(_mm256_cmpgt_epi8(lowerBound, block), _mm256_cmpeq_epi8(block, del));
+        }
+
+        if (alsoCheckInvalidPublishChars)
+        {
+            invalid = _mm256_or_si256(invalid, _mm256_cmpeq_epi8(block, pound));
+            invalid = _mm256_or_si256(invalid, _mm256_cmpeq_epi8(block, plus));
+        }
+
+        if (_mm256_movemask_epi8(invalid) != 0)
+            return false;
+
+        uint32_t slashes = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, slash)));
+
+        while (slashes)
+        {
+            splitter.slashAt(n + __builtin_ctz(slashes));
+            slashes &= slashes - 1;
+        }
+
+        n += block_len;
+    }
+
+    splitter.finish(len);
+    return true;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static bool scanTopicAvx512bw(const char *data, size_t len, bool validateUtf8, bool alsoCheckInvalidPublishChars, std::vector<std::string> *subtopics)
+{
+    const uint8_t *s = reinterpret_cast<const uint8_t*>(data);
+    TopicSplitter splitter(data, subtopics);
+
+    const __m512i slash = _mm512_set1_epi8('/');
+    const __m512i lowerBound = _mm512_set1_epi8(0x20);
+    const __m512i del = _mm512_set1_epi8(0x7F);
+    const __m512i pound = _mm512_set1_epi8('#');
+    const __m512i plus = _mm512_set1_epi8('+');
+
+    size_t n = 0;
+    while (n < len)
+    {
+        const size_t block_len = std::min<size_t>(len - n, 64);
+        const __mmask64 in_range = block_len == 64 ? ~__mmask64(0) : (__mmask64(1) << block_len) - 1;
+
+        // The masked load doesn't touch bytes past the end, so there is no need for a padded copy.
+        const __m512i block = _mm512_maskz_loadu_epi8(in_range, s + n);
+
+        if (validateUtf8 && _mm512_movepi8_mask(block) != 0)
+        {
+            const size_t block_end = n + block_len;
+            while (n < block_end)
+            {
+                if (!scanCharScalar(s, len, n, validateUtf8, alsoCheckInvalidPublishChars, splitter))
+                    return false;
+            }
+            continue;
+        }
+
+        __mmask64 invalid = 0;
+
+        if (validateUtf8)
+            invalid = _mm512_cmplt_epu8_mask(block, lowerBound) | _mm512_cmpeq_epi8_mask(block, del);
+
+        if (alsoCheckInvalidPublishChars)
+            invalid |= _mm512_cmpeq_epi8_mask(block, pound) | _mm512_cmpeq_epi8_mask(block, plus);
+
+        if ((invalid & in_range) != 0)
+            return false;
+
+        uint64_t slashes = _mm512_mask_cmpeq_epi8_mask(in_range, block, slash);
+
+        while (slashes)
+        {
+            splitter.slashAt(n + __builtin_ctzll(slashes));
+            slashes &= slashes - 1;
+        }
+
+        n += block_len;
+    }
+
+    splitter.finish(len);
+    return true;
+}
+
+#endif
+
+static TopicScanKernel detectTopicScanKernel()
+{
+#ifdef FMQ_TOPIC_SCAN_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512bw"))
+        return TopicScanKernel::Avx512bw;
+
+    if (__builtin_cpu_supports("avx2"))
+        return TopicScanKernel::Avx2;
+#endif
+
+    return TopicScanKernel::None;
+}
+
+TopicScanKernel getTopicScanKernel()
+{
+    static const TopicScanKernel kernel = detectTopicScanKernel();
+    return kernel;
+}
+
+std::string topicScanKernelToString(TopicScanKernel kernel)
+{
+    switch (kernel)
+    {
+    case TopicScanKernel::Avx2:
+        return "AVX2";
+    case TopicScanKernel::Avx512bw:
+        return "AVX-512BW";
+    default:
+        return "none";
+    }
+}
+
+bool topicScanKernelSupported(TopicScanKernel kernel)
+{
+    const TopicScanKernel best = getTopicScanKernel();
+
+    switch (kernel)
+    {
+    case TopicScanKernel::None:
+        return true;
+    case TopicScanKernel::Avx2:
+        return best == TopicScanKernel::Avx2 || best == TopicScanKernel::Avx512bw;
+    case TopicScanKernel::Avx512bw:
+        return best == TopicScanKernel::Avx512bw;
+    default:
+        return false;
+    }
+}
+
+bool scanTopic(TopicScanKernel kernel, const char *data, size_t len, bool validateUtf8, bool alsoCheckInvalidPublishChars,
+               std::vector<std::string> *subtopics)
+{
+    switch (kernel)
+    {
+#ifdef FMQ_TOPIC_SCAN_X86
+    case TopicScanKernel::Avx512bw:
+        return scanTopicAvx512bw(data, len, validateUtf8, alsoCheckInvalidPublishChars, subtopics);
+    case TopicScanKernel::Avx2:
+        return scanTopicAvx2(data, len, validateUtf8, alsoCheckInvalidPublishChars, subtopics);
+#endif
+    default:
+        return scanTopicScalar(data, len, validateUtf8, alsoCheckInvalidPublishChars, subtopics);
+    }
+}
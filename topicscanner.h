@@ -0,0 +1,47 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021-2025 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of The Open Software License 3.0 (OSL-3.0).
+
+See LICENSE for license details.
+*/
+
+#ifndef TOPICSCANNER_H
+#define TOPICSCANNER_H
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+/**
+ * @brief The TopicScanKernel enum lists the wide vector implementations of scanTopic(). Which one is used is decided at runtime, based
+ * on what the CPU supports, so the binary doesn't need to be compiled for a specific machine.
+ */
+enum class TopicScanKernel
+{
+    None,
+    Avx2,
+    Avx512bw
+};
+
+TopicScanKernel getTopicScanKernel();
+std::string topicScanKernelToString(TopicScanKernel kernel);
+bool topicScanKernelSupported(TopicScanKernel kernel);
+
+/**
+ * @brief scanTopic does UTF-8 validation (with the MQTT restrictions of isValidUtf8Generic()), optionally rejects '+' and '#', and
+ * splits on '/', in one pass.
+ * @param subtopics can be nullptr when you only want to validate. It's appended to, so give it an empty vector.
+ * @return whether the data is valid. When false, subtopics is in an undefined state.
+ */
+bool scanTopic(TopicScanKernel kernel, const char *data, size_t len, bool validateUtf8, bool alsoCheckInvalidPublishChars,
+               std::vector<std::string> *subtopics);
+
+inline bool scanTopic(const char *data, size_t len, bool validateUtf8, bool alsoCheckInvalidPublishChars, std::vector<std::string> *subtopics)
+{
+    return scanTopic(getTopicScanKernel(), data, len, validateUtf8, alsoCheckInvalidPublishChars, subtopics);
+}
+
+#endif // TOPICSCANNER_H
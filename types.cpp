@@ -265,6 +265,11 @@ void Publish::resplitTopic()
     subtopics = splitTopic(this->topic);
 }
 
+void Publish::setSubtopics(std::vector<std::string> &&subtopics)
+{
+    this->subtopics = std::move(subtopics);
+}
+
 WillPublish::WillPublish(const Publish &other) :
     Publish(other)
 {
@@ -274,6 +274,7 @@ public:
 
     const std::vector<std::string> &getSubtopics();
     void resplitTopic();
+    void setSubtopics(std::vector<std::string> &&subtopics);
 };
 
 class WillPublish : public Publish
@@ -388,4 +389,6 @@ enum class PacketDropReason
     QoSTODOSomethingSomething
 };
 
+constexpr size_t PACKET_DROP_REASON_COUNT = static_cast<size_t>(PacketDropReason::QoSTODOSomethingSomething) + 1;
+
 #endif // TYPES_H
@@ -20,6 +20,11 @@ See LICENSE for license details.
 #include <signal.h>
 #include <iomanip>
 #include <time.h>
+#include <array>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -134,6 +139,15 @@ bool containsDangerousCharacters(const std::string &s)
 
 std::vector<std::string> splitTopic(const std::string &topic)
 {
+    const TopicScanKernel kernel = getTopicScanKernel();
+    if (kernel != TopicScanKernel::None)
+    {
+        std::vector<std::string> output;
+        output.reserve(16);
+        scanTopic(kernel, topic.data(), topic.size(), false, false, &output);
+        return output;
+    }
+
 #ifdef __SSE4_2__
     thread_local static SimdUtils simdUtils;
     return simdUtils.splitTopic(topic);
@@ -153,6 +167,26 @@ std::vector<std::string> splitTopic(const std::string &topic)
 #endif
 }
 
+/**
+ * @brief isValidUtf8AndSplitTopic does isValidUtf8() and splitTopic() in one pass when the CPU has a topic scan kernel.
+ */
+bool isValidUtf8AndSplitTopic(const std::string &topic, std::vector<std::string> &subtopics, bool alsoCheckInvalidPublishChars)
+{
+    const TopicScanKernel kernel = getTopicScanKernel();
+    if (kernel != TopicScanKernel::None)
+    {
+        subtopics.clear();
+        subtopics.reserve(16);
+        return scanTopic(kernel, topic.data(), topic.size(), true, alsoCheckInvalidPublishChars, &subtopics);
+    }
+
+    if (!isValidUtf8(topic, alsoCheckInvalidPublishChars))
+        return false;
+
+    subtopics = splitTopic(topic);
+    return true;
+}
+
 std::vector<std::string> splitToVector(const std::string &input, const char sep, size_t max, bool keep_empty_parts)
 {
     std::vector<std::string> output;
@@ -634,6 +668,61 @@ std::string websocketCloseCodeToString(uint16_t code)
     }
 }
 
+/**
+ * @brief unmaskWebsocketBytes XORs websocket payload with the masking key, a vector at a time where possible.
+ * @param dst can be the same as src.
+ * @param src
+ * @param len
+ * @param maskingKey the four bytes from the frame header.
+ * @param maskingKeyOffset the position in the key of the first byte, for when a frame's payload is unmasked in parts.
+ */
+void unmaskWebsocketBytes(char *dst, const char *src, const size_t len, const char *maskingKey, const unsigned int maskingKeyOffset)
+{
+    std::array<char, 4> key;
+    for (int i = 0; i < 4; i++)
+    {
+        key[i] = maskingKey[(maskingKeyOffset + i) % 4];
+    }
+
+    uint32_t key32;
+    std::memcpy(&key32, key.data(), key.size());
+
+    size_t i = 0;
+
+#ifdef __AVX2__
+    const __m256i key256 = _mm256_set1_epi32(key32);
+    for (; i + 32 <= len; i += 32)
+    {
+        const __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src[i]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i]), _mm256_xor_si256(data, key256));
+    }
+#endif
+
+#ifdef __SSE2__
+    const __m128i key128 = _mm_set1_epi32(key32);
+    for (; i + 16 <= len; i += 16)
+    {
+        const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i]), _mm_xor_si128(data, key128));
+    }
+#endif
+
+    const uint64_t key64 = (static_cast<uint64_t>(key32) << 32) | key32;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t data;
+        std::memcpy(&data, &src[i], 8);
+        data ^= key64;
+        std::memcpy(&dst[i], &data, 8);
+    }
+
+    // Every step above is a multiple of four, so the key still lines up.
+    for (; i < len; i++)
+    {
+        dst[i] = src[i] ^ key[i % 4];
+    }
+}
+
 std::string protocolVersionString(ProtocolVersion p)
 {
     switch (p)
@@ -891,6 +980,48 @@ uint16_t getFirstWildcardDepth(const std::vector<std::string> &subtopics)
     return result;
 }
 
+/**
+ * @brief subscriptionFilterCovers says whether every topic that matches 'other' also matches 'filter'.
+ *
+ * one/#         covers one, one/two and one/+/three
+ * one/+/three   covers one/two/three, but not one/#
+ * +/two         doesn't cover $SYS/two, because wildcards at the start don't match '$' topics.
+ */
+bool subscriptionFilterCovers(const std::vector<std::string> &filter, const std::vector<std::string> &other)
+{
+    if (!filter.empty() && !other.empty() && (filter[0] == "+" || filter[0] == "#") && !other[0].empty() && other[0][0] == '$')
+        return false;
+
+    auto other_it = other.begin();
+
+    for (const std::string &s : filter)
+    {
+        if (s == "#")
+            return true;
+
+        if (other_it == other.end())
+            return false;
+
+        const std::string &o = *other_it;
+
+        if (o == "#")
+            return false;
+
+        if (s == "+")
+        {
+            other_it++;
+            continue;
+        }
+
+        if (o == "+" || o != s)
+            return false;
+
+        other_it++;
+    }
+
+    return other_it == other.end();
+}
+
 std::string reasonCodeToString(ReasonCodes code)
 {
     switch (code)
@@ -1037,6 +1168,32 @@ std::string packetTypeToString(PacketType ptype)
     return oss.str();
 }
 
+/**
+ * @brief packetDropReasonToString gives names that can be used in $SYS topics.
+ */
+std::string packetDropReasonToString(PacketDropReason reason)
+{
+    switch (reason)
+    {
+    case PacketDropReason::Success:
+        return "success";
+    case PacketDropReason::ClientError:
+        return "client_error";
+    case PacketDropReason::ClientOffline:
+        return "client_offline";
+    case PacketDropReason::AuthDenied:
+        return "auth_denied";
+    case PacketDropReason::BiggerThanPacketLimit:
+        return "bigger_than_packet_limit";
+    case PacketDropReason::BufferFull:
+        return "buffer_full";
+    case PacketDropReason::QoSTODOSomethingSomething:
+        return "qos_queue_full";
+    default:
+        return std::to_string(static_cast<int>(reason));
+    }
+}
+
 
 std::string propertyToString(Mqtt5Properties p)
 {
@@ -28,6 +28,7 @@ See LICENSE for license details.
 #include <cassert>
 
 #include "cirbuf.h"
+#include "topicscanner.h"
 #include "bindaddr.h"
 #include "types.h"
 #include "flashmq_plugin.h"
@@ -50,6 +51,7 @@ template<typename T> int check(int rc)
 std::list<std::string> split(const std::string &input, const char sep, size_t max = std::numeric_limits<int>::max(), bool keep_empty_parts = true);
 std::vector<std::string> splitToVector(const std::string &input, const char sep, size_t max = std::numeric_limits<int>::max(), bool keep_empty_parts = true);
 std::vector<std::string> splitTopic(const std::string &topic);
+bool isValidUtf8AndSplitTopic(const std::string &topic, std::vector<std::string> &subtopics, bool alsoCheckInvalidPublishChars);
 
 bool isValidUtf8Generic(const char *s, bool alsoCheckInvalidPublishChars = false);
 
@@ -146,6 +148,10 @@ bool isValidUtf8Generic(const T &s, bool alsoCheckInvalidPublishChars = false)
 template<typename T>
 bool isValidUtf8(const T &s, bool alsoCheckInvalidPublishChars = false)
 {
+    const TopicScanKernel kernel = getTopicScanKernel();
+    if (kernel != TopicScanKernel::None)
+        return scanTopic(kernel, s.data(), s.size(), true, alsoCheckInvalidPublishChars, nullptr);
+
 #ifdef __SSE4_2__
     thread_local static SimdUtils simdUtils;
     return simdUtils.isValidUtf8(s, alsoCheckInvalidPublishChars);
@@ -154,6 +160,19 @@ bool isValidUtf8(const T &s, bool alsoCheckInvalidPublishChars = false)
 #endif
 }
 
+/**
+ * @brief isValidPayloadUtf8 is for data of any length. The SSE4.2 checker of isValidUtf8() is limited to topic lengths and needs a copy.
+ */
+template<typename T>
+bool isValidPayloadUtf8(const T &s)
+{
+    const TopicScanKernel kernel = getTopicScanKernel();
+    if (kernel != TopicScanKernel::None)
+        return scanTopic(kernel, s.data(), s.size(), true, false, nullptr);
+
+    return isValidUtf8Generic(s);
+}
+
 bool strContains(const std::string &s, const std::string &needle);
 
 bool isValidShareName(const std::string &s);
@@ -225,6 +244,7 @@ template<typename ex> void checkWritableDir(const std::string &path)
 }
 
 std::string websocketCloseCodeToString(uint16_t code);
+void unmaskWebsocketBytes(char *dst, const char *src, const size_t len, const char *maskingKey, const unsigned int maskingKeyOffset);
 
 std::string protocolVersionString(ProtocolVersion p);
 
@@ -281,8 +301,10 @@ T get_random_int()
 void exceptionOnNonMqtt(const std::vector<char> &data);
 
 uint16_t getFirstWildcardDepth(const std::vector<std::string> &subtopics);
+bool subscriptionFilterCovers(const std::vector<std::string> &filter, const std::vector<std::string> &other);
 std::string reasonCodeToString(ReasonCodes code);
 std::string packetTypeToString(PacketType ptype);
+std::string packetDropReasonToString(PacketDropReason reason);
 std::string propertyToString(Mqtt5Properties p);
 
 
@@ -384,6 +406,23 @@ public:
     }
 };
 
+template<typename T>
+class OptionalResetGuard
+{
+    std::optional<T> &o;
+public:
+    OptionalResetGuard(std::optional<T> &o) :
+        o(o)
+    {
+
+    }
+
+    ~OptionalResetGuard()
+    {
+        o.reset();
+    }
+};
+
 template<typename T>
 std::optional<T> &non_optional(std::optional<T> &o)
 {